@@ -0,0 +1,251 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file admin.c
+    @brief admin commands on a unix socket
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    one command per line, answered with one line, e.g.
+    echo "profile 30" | socat - UNIX-CONNECT:/var/run/xfrpc.sock
+    the socket is served by loop 0 and only its owner can connect.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "debug.h"
+#include "upgrade.h"
+#include "cpuprof.h"
+#include "alloc.h"
+#include "admin.h"
+#include "xfrpc.h"
+#include "commandline.h"
+
+#define ADMIN_LINE_MAX 		256
+#define PROFILE_MAX_SECONDS	120
+
+struct admin_cmd {
+	const char 	*name;
+	void 		(*handler)(struct bufferevent *bev, const char *arg);
+	const char 	*usage;
+};
+
+static struct evconnlistener *admin_listener = NULL;
+static struct event_base *admin_base = NULL;
+static char *admin_path = NULL;
+static struct bufferevent *profile_waiter = NULL;	// connection waiting for cpu profile
+
+static void admin_event_cb(struct bufferevent *bev, short what, void *ctx);
+
+static void
+admin_close_cb(struct bufferevent *bev, void *ctx)
+{
+	bufferevent_free(bev);
+}
+
+// answer and close once it is sent
+static void
+admin_reply(struct bufferevent *bev, const char *msg)
+{
+	evbuffer_add_printf(bufferevent_get_output(bev), "%s\n", msg);
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, admin_close_cb, admin_event_cb, NULL);
+}
+
+static void
+profile_done(const char *result, void *arg)
+{
+	if (profile_waiter)
+		admin_reply(profile_waiter, result);
+	profile_waiter = NULL;
+}
+
+static void
+cmd_profile(struct bufferevent *bev, const char *arg)
+{
+	int seconds = arg ? atoi(arg) : 0;
+	if (seconds <= 0 || seconds > PROFILE_MAX_SECONDS) {
+		admin_reply(bev, "error: seconds must be 1 to 120");
+		return;
+	}
+	if (start_cpu_profile(admin_base, seconds, profile_done, NULL) < 0) {
+		admin_reply(bev, "error: a cpu profile is running");
+		return;
+	}
+	// answered when the profile is written
+	profile_waiter = bev;
+	bufferevent_disable(bev, EV_READ);
+}
+
+static void
+cmd_heap(struct bufferevent *bev, const char *arg)
+{
+	dump_alloc_stats();
+	admin_reply(bev, "allocation stats logged, heap profile written if -P is set");
+}
+
+static void
+cmd_flight(struct bufferevent *bev, const char *arg)
+{
+	dump_flight_recorders();
+	char msg[300];
+	snprintf(msg, sizeof(msg), "flight recorders of all instances dumping to %s, see log for files", 
+		get_dump_dir());
+	admin_reply(bev, msg);
+}
+
+static void cmd_help(struct bufferevent *bev, const char *arg);
+
+static const struct admin_cmd admin_cmds[] = {
+	{"profile", cmd_profile, "profile <seconds>: sample cpu and write pprof and folded stacks"},
+	{"heap", 	cmd_heap, 	"heap: log allocations by subsystem"},
+	{"flight", 	cmd_flight, "flight: dump flight recorders of all instances"},
+	{"help", 	cmd_help, 	"help: list commands"},
+};
+
+static void
+cmd_help(struct bufferevent *bev, const char *arg)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+	int i;
+	for (i = 0; i < sizeof(admin_cmds) / sizeof(admin_cmds[0]); i++)
+		evbuffer_add_printf(out, "%s\n", admin_cmds[i].usage);
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, admin_close_cb, admin_event_cb, NULL);
+}
+
+static void
+admin_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t eol_len = 0;
+	struct evbuffer_ptr eol = evbuffer_search_eol(in, NULL, &eol_len, EVBUFFER_EOL_ANY);
+	if (eol.pos < 0) {
+		if (evbuffer_get_length(in) >= ADMIN_LINE_MAX)
+			admin_reply(bev, "error: line too long");
+		return;
+	}
+	if (eol.pos >= ADMIN_LINE_MAX) {
+		admin_reply(bev, "error: line too long");
+		return;
+	}
+
+	char line[ADMIN_LINE_MAX];
+	evbuffer_remove(in, line, eol.pos);
+	line[eol.pos] = '\0';
+	evbuffer_drain(in, eol_len);
+
+	char *arg = strchr(line, ' ');
+	if (arg) {
+		*arg++ = '\0';
+		while (*arg == ' ')
+			arg++;
+	}
+
+	int i;
+	for (i = 0; i < sizeof(admin_cmds) / sizeof(admin_cmds[0]); i++) {
+		if (strcmp(line, admin_cmds[i].name) == 0) {
+			debug(LOG_INFO, "admin command: %s %s", line, arg ? arg : "");
+			admin_cmds[i].handler(bev, arg);
+			return;
+		}
+	}
+	admin_reply(bev, "error: unknown command, try help");
+}
+
+static void
+admin_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		if (bev == profile_waiter)
+			profile_waiter = NULL;
+		bufferevent_free(bev);
+	}
+}
+
+static void
+admin_accept_cb(struct evconnlistener *listener, evutil_socket_t fd, 
+				struct sockaddr *addr, int socklen, void *ctx)
+{
+	struct bufferevent *bev = bufferevent_socket_new(admin_base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		evutil_closesocket(fd);
+		return;
+	}
+	bufferevent_setcb(bev, admin_read_cb, NULL, admin_event_cb, NULL);
+	bufferevent_enable(bev, EV_READ);
+}
+
+void
+start_admin_socket(struct event_base *base, const char *path)
+{
+	struct sockaddr_un sun;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		debug(LOG_ERR, "error: admin socket path %s too long", path);
+		return;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	// left by a process killed before, or by the process upgraded from
+	unlink(path);
+	mode_t mask = umask(0077);
+	admin_listener = evconnlistener_new_bind(base, admin_accept_cb, NULL, 
+			LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, -1, 
+			(struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	if (!admin_listener) {
+		debug(LOG_ERR, "error: listen on admin socket %s failed: %s", path, strerror(errno));
+		return;
+	}
+	admin_base = base;
+	admin_path = strdup(path);
+	debug(LOG_INFO, "admin socket listens on %s", path);
+}
+
+void
+close_admin_socket()
+{
+	if (!admin_listener)
+		return;
+
+	evconnlistener_free(admin_listener);
+	admin_listener = NULL;
+	// the upgraded process listens on the same path already
+	if (!is_upgrading())
+		unlink(admin_path);
+	free(admin_path);
+	admin_path = NULL;
+}
@@ -0,0 +1,741 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file alloc.c
+    @brief size class allocator and allocation accounting by subsystem
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    evbuffer chains, bufferevents and openssl buffers are taken from size
+    classes instead of malloc of libc, so blocks of one size share slabs and
+    long uptime does not leave the heap full of holes. every thread keeps a
+    few free blocks of each class and gives half of them back to the shared
+    lists when it has too many. blocks of several pages given back have their
+    pages returned to the kernel. requests above the largest class go to
+    malloc of libc. json-c has no allocation hook and keeps using libc.
+
+    every block carries its owner, so live bytes, allocations and peak of
+    each subsystem are known whichever allocator backs it. with heap_sample
+    set, about one allocation in heap_sample bytes records its call stack,
+    SIGUSR1 writes sampled stacks still in use as a pprof heap profile.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#include <event2/event.h>
+#include <openssl/crypto.h>
+
+#include "debug.h"
+#include "uthash.h"
+#include "alloc.h"
+#include "utils.h"
+
+#define ALLOC_HDR		16
+#define ALLOC_MAGIC		0xa11c
+#define LARGE_CLASS		0xff
+#define MAX_SMALL		32768
+#define SLAB_SIZE		(128 * 1024)
+#define HUGE_CHUNK		(2 * 1024 * 1024)
+#define CACHE_BYTES		(64 * 1024)		// free blocks a thread keeps for each class
+#define SITE_DEPTH		24
+#define SITE_SKIP		2				// frames of the allocator itself
+
+// usable bytes, half steps between powers of two keep waste under a third
+static const uint32_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+	1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, MAX_SMALL,
+};
+#define NCLASS 	(sizeof(class_size) / sizeof(class_size[0]))
+
+struct heap_site;
+
+// in front of every block, keeps it 16 bytes aligned
+struct alloc_hdr {
+	uint32_t 	size;		// bytes asked for
+	uint8_t 	cls;
+	uint8_t 	owner;
+	uint16_t 	magic;
+	union {
+		struct heap_site 	*site;	// set when the allocation is sampled
+		uint64_t 			pad;
+	} sample;
+};
+
+// call stack of sampled allocations
+struct heap_site {
+	void 		*pc[SITE_DEPTH];
+	size_t 		inuse_count;
+	size_t 		inuse_bytes;
+	size_t 		alloc_count;
+	size_t 		alloc_bytes;
+	UT_hash_handle 	hh;
+};
+
+struct free_block {
+	struct free_block 	*next;
+};
+
+struct size_class {
+	pthread_mutex_t 	lock;
+	struct free_block 	*free;
+	uint32_t 			nfree;
+};
+
+struct thread_cache {
+	struct free_block 	*free[NCLASS];
+	uint32_t 			nfree[NCLASS];
+};
+
+struct alloc_stat {
+	size_t 	live;		// bytes asked for and not freed yet
+	size_t 	peak;
+	size_t 	nalloc;
+	size_t 	nfree;
+};
+
+static int alloc_mode = ALLOC_LIBC;
+static const char *mode_name[] = {"libc", "slab", "huge"};
+static const char *owner_name[ALLOC_OWNERS] = {
+	"libevent", "openssl", "tcpmux", "client", "control", "crypto", "msg", "config", 
+	"http", "static_file", "kcp",
+};
+
+static struct size_class central[NCLASS];
+static uint8_t class_of[MAX_SMALL / 16 + 1];
+static size_t page_size;
+
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *chunk_cur, *chunk_end;
+
+static __thread struct thread_cache *tcache;
+static pthread_key_t tcache_key;
+
+static struct alloc_stat stats[ALLOC_OWNERS];
+static size_t slab_bytes;
+static size_t large_bytes;
+
+static long heap_sample;
+static __thread long sample_left;
+static __thread int in_sample;
+static struct heap_site *all_sites;
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STAT_ADD(v, n) 	__atomic_fetch_add(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(v, n) 	__atomic_fetch_sub(&(v), (n), __ATOMIC_RELAXED)
+#define STAT_GET(v) 	__atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+static inline void
+stat_alloc(int owner, size_t size)
+{
+	struct alloc_stat *st = &stats[owner];
+	size_t live = STAT_ADD(st->live, size) + size;
+	size_t peak = STAT_GET(st->peak);
+	while (live > peak && 
+		!__atomic_compare_exchange_n(&st->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// below MAX_SMALL blocks come from size classes unless libc backs everything
+static inline int
+from_libc(size_t size)
+{
+	return alloc_mode == ALLOC_LIBC || size > MAX_SMALL;
+}
+
+static inline size_t
+class_stride(int cls)
+{
+	return class_size[cls] + ALLOC_HDR;
+}
+
+static inline uint32_t
+cache_limit(int cls)
+{
+	uint32_t n = CACHE_BYTES / class_stride(cls);
+	return n < 4 ? 4 : n;
+}
+
+// hugepage chunk of HUGE_CHUNK bytes, aligned so thp can back it
+static uint8_t *
+map_huge_chunk()
+{
+#ifdef MAP_HUGETLB
+	void *p = mmap(NULL, HUGE_CHUNK, PROT_READ|PROT_WRITE, 
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+
+	// no reserved hugepages, ask for transparent ones
+	uint8_t *raw = mmap(NULL, 2 * HUGE_CHUNK, PROT_READ|PROT_WRITE, 
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	uint8_t *start = (uint8_t *)(((uintptr_t)raw + HUGE_CHUNK - 1) & ~(uintptr_t)(HUGE_CHUNK - 1));
+	if (start > raw)
+		munmap(raw, start - raw);
+	if (start + HUGE_CHUNK < raw + 2 * HUGE_CHUNK)
+		munmap(start + HUGE_CHUNK, raw + 2 * HUGE_CHUNK - (start + HUGE_CHUNK));
+#ifdef MADV_HUGEPAGE
+	madvise(start, HUGE_CHUNK, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+static uint8_t *
+map_slab()
+{
+	pthread_mutex_lock(&chunk_lock);
+	if (chunk_cur + SLAB_SIZE > chunk_end) {
+		size_t size = SLAB_SIZE;
+		uint8_t *p = NULL;
+		if (alloc_mode == ALLOC_HUGE) {
+			p = map_huge_chunk();
+			size = HUGE_CHUNK;
+		} else {
+			p = mmap(NULL, SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				p = NULL;
+		}
+		if (!p) {
+			pthread_mutex_unlock(&chunk_lock);
+			return NULL;
+		}
+		chunk_cur = p;
+		chunk_end = p + size;
+		slab_bytes += size;
+	}
+
+	uint8_t *slab = chunk_cur;
+	chunk_cur += SLAB_SIZE;
+	pthread_mutex_unlock(&chunk_lock);
+	return slab;
+}
+
+// takes up to n blocks of shared list, carves a new slab when it is empty
+static struct free_block *
+central_get(int cls, uint32_t n, uint32_t *got)
+{
+	struct size_class *sc = &central[cls];
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->free) {
+		uint8_t *slab = map_slab();
+		if (!slab) {
+			pthread_mutex_unlock(&sc->lock);
+			*got = 0;
+			return NULL;
+		}
+		size_t stride = class_stride(cls);
+		uint8_t *p;
+		for (p = slab + (SLAB_SIZE / stride - 1) * stride; p >= slab; p -= stride) {
+			struct free_block *blk = (struct free_block *)p;
+			blk->next = sc->free;
+			sc->free = blk;
+			sc->nfree++;
+		}
+	}
+
+	struct free_block *head = sc->free, *last = head;
+	uint32_t i = 1;
+	while (i < n && last->next) {
+		last = last->next;
+		i++;
+	}
+	sc->free = last->next;
+	sc->nfree -= i;
+	last->next = NULL;
+	pthread_mutex_unlock(&sc->lock);
+	*got = i;
+	return head;
+}
+
+// pages a free block covers entirely go back to the kernel,
+// they come back zeroed when the block is used again
+static void
+release_pages(int cls, struct free_block *blk)
+{
+	size_t stride = class_stride(cls);
+	if (alloc_mode == ALLOC_HUGE || stride < 2 * page_size)
+		return;
+
+	uintptr_t start = ((uintptr_t)(blk + 1) + page_size - 1) & ~(uintptr_t)(page_size - 1);
+	uintptr_t end = ((uintptr_t)blk + stride) & ~(uintptr_t)(page_size - 1);
+	if (end > start)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+static void
+central_put(int cls, struct free_block *head, struct free_block *last, uint32_t n)
+{
+	struct free_block *blk;
+	for (blk = head; blk; blk = blk->next)
+		release_pages(cls, blk);
+
+	struct size_class *sc = &central[cls];
+	pthread_mutex_lock(&sc->lock);
+	last->next = sc->free;
+	sc->free = head;
+	sc->nfree += n;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+// gives n blocks of the thread cache back
+static void
+cache_spill(struct thread_cache *tc, int cls, uint32_t n)
+{
+	struct free_block *head = tc->free[cls], *last = head;
+	uint32_t i;
+	for (i = 1; i < n; i++)
+		last = last->next;
+	tc->free[cls] = last->next;
+	tc->nfree[cls] -= n;
+	last->next = NULL;
+	central_put(cls, head, last, n);
+}
+
+static void
+free_thread_cache(void *arg)
+{
+	struct thread_cache *tc = arg;
+	int cls;
+	for (cls = 0; cls < NCLASS; cls++) {
+		if (tc->nfree[cls])
+			cache_spill(tc, cls, tc->nfree[cls]);
+	}
+	free(tc);
+	tcache = NULL;
+}
+
+static struct thread_cache *
+get_thread_cache()
+{
+	if (!tcache) {
+		tcache = calloc(1, sizeof(struct thread_cache));
+		if (tcache)
+			pthread_setspecific(tcache_key, tcache);
+	}
+	return tcache;
+}
+
+static struct alloc_hdr *
+alloc_small(int cls)
+{
+	struct thread_cache *tc = get_thread_cache();
+	uint32_t got;
+	if (!tc)
+		return (struct alloc_hdr *)central_get(cls, 1, &got);
+
+	if (!tc->free[cls]) {
+		tc->free[cls] = central_get(cls, cache_limit(cls) / 2, &got);
+		tc->nfree[cls] = got;
+		if (!got)
+			return NULL;
+	}
+
+	struct free_block *blk = tc->free[cls];
+	tc->free[cls] = blk->next;
+	tc->nfree[cls]--;
+	return (struct alloc_hdr *)blk;
+}
+
+static void
+free_small(int cls, struct alloc_hdr *hdr)
+{
+	struct free_block *blk = (struct free_block *)hdr;
+	struct thread_cache *tc = get_thread_cache();
+	if (!tc) {
+		blk->next = NULL;
+		central_put(cls, blk, blk, 1);
+		return;
+	}
+
+	blk->next = tc->free[cls];
+	tc->free[cls] = blk;
+	if (++tc->nfree[cls] > cache_limit(cls))
+		cache_spill(tc, cls, tc->nfree[cls] / 2);
+}
+
+// pc of the sampled allocation, keyed by whole stack
+static __attribute__((noinline)) struct heap_site *
+sample_site(size_t size, void *caller)
+{
+	void *pc[SITE_DEPTH + SITE_SKIP] = {0};
+#ifdef HAVE_EXECINFO_H
+	int depth = backtrace(pc, SITE_DEPTH + SITE_SKIP);
+	if (depth <= SITE_SKIP)
+		return NULL;
+#else
+	// no unwinder, caller of xfrpc_malloc only
+	pc[SITE_SKIP] = caller;
+#endif
+
+	struct heap_site *site = NULL;
+	pthread_mutex_lock(&site_lock);
+	HASH_FIND(hh, all_sites, pc + SITE_SKIP, sizeof(site->pc), site);
+	if (!site) {
+		site = calloc(1, sizeof(struct heap_site));
+		if (!site) {
+			pthread_mutex_unlock(&site_lock);
+			return NULL;
+		}
+		memcpy(site->pc, pc + SITE_SKIP, sizeof(site->pc));
+		HASH_ADD(hh, all_sites, pc, sizeof(site->pc), site);
+	}
+	site->inuse_count++;
+	site->inuse_bytes += size;
+	site->alloc_count++;
+	site->alloc_bytes += size;
+	pthread_mutex_unlock(&site_lock);
+	return site;
+}
+
+static void
+resize_sample(struct heap_site *site, size_t old, size_t size, int freed)
+{
+	pthread_mutex_lock(&site_lock);
+	site->inuse_bytes += size - old;
+	if (freed)
+		site->inuse_count--;
+	pthread_mutex_unlock(&site_lock);
+}
+
+// next sample after about heap_sample bytes, jittered so periodic sizes are caught
+static inline int
+should_sample(size_t size)
+{
+	if (!heap_sample || in_sample)
+		return 0;
+	sample_left -= size;
+	if (sample_left > 0)
+		return 0;
+	sample_left = heap_sample / 2 + random() % heap_sample;
+	return 1;
+}
+
+void *
+xfrpc_malloc(int owner, size_t size)
+{
+	struct alloc_hdr *hdr;
+	uint8_t cls;
+	if (from_libc(size)) {
+		hdr = malloc(size + ALLOC_HDR);
+		cls = LARGE_CLASS;
+		if (hdr)
+			STAT_ADD(large_bytes, size);
+	} else {
+		cls = class_of[(size + 15) >> 4];
+		hdr = alloc_small(cls);
+	}
+	if (!hdr)
+		return NULL;
+
+	hdr->size = size;
+	hdr->cls = cls;
+	hdr->owner = owner;
+	hdr->magic = ALLOC_MAGIC;
+	hdr->sample.pad = 0;
+	if (should_sample(size)) {
+		in_sample = 1;
+		hdr->sample.site = sample_site(size, __builtin_return_address(0));
+		in_sample = 0;
+	}
+	stat_alloc(owner, size);
+	STAT_ADD(stats[owner].nalloc, 1);
+	return hdr + 1;
+}
+
+void *
+xfrpc_calloc(int owner, size_t size)
+{
+	void *p = xfrpc_malloc(owner, size);
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+char *
+xfrpc_strdup(int owner, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = xfrpc_malloc(owner, len);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+void
+alloc_move(int from, int to, size_t bytes)
+{
+	STAT_SUB(stats[from].live, bytes);
+	stat_alloc(to, bytes);
+}
+
+void
+xfrpc_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	struct alloc_hdr *hdr = (struct alloc_hdr *)ptr - 1;
+	if (hdr->magic != ALLOC_MAGIC) {
+		debug(LOG_ERR, "error: free of %p not allocated by xfrpc allocator", ptr);
+		abort();
+	}
+	hdr->magic = 0;
+	if (hdr->sample.site)
+		resize_sample(hdr->sample.site, hdr->size, 0, 1);
+	STAT_SUB(stats[hdr->owner].live, hdr->size);
+	STAT_ADD(stats[hdr->owner].nfree, 1);
+	if (hdr->cls == LARGE_CLASS) {
+		STAT_SUB(large_bytes, hdr->size);
+		free(hdr);
+	} else
+		free_small(hdr->cls, hdr);
+}
+
+void *
+xfrpc_realloc(int owner, void *ptr, size_t size)
+{
+	if (!ptr)
+		return xfrpc_malloc(owner, size);
+	if (!size) {
+		xfrpc_free(ptr);
+		return NULL;
+	}
+
+	struct alloc_hdr *hdr = (struct alloc_hdr *)ptr - 1;
+	owner = hdr->owner;
+	if (hdr->cls != LARGE_CLASS && size <= class_size[hdr->cls]) {
+		// still fits its block
+		if (hdr->sample.site)
+			resize_sample(hdr->sample.site, hdr->size, size, 0);
+		stat_alloc(owner, size - hdr->size);
+		hdr->size = size;
+		return ptr;
+	}
+
+	if (hdr->cls == LARGE_CLASS && from_libc(size)) {
+		size_t old = hdr->size;
+		hdr = realloc(hdr, size + ALLOC_HDR);
+		if (!hdr)
+			return NULL;
+		if (hdr->sample.site)
+			resize_sample(hdr->sample.site, old, size, 0);
+		stat_alloc(owner, size - old);
+		STAT_ADD(large_bytes, size - old);
+		hdr->size = size;
+		return hdr + 1;
+	}
+
+	void *p = xfrpc_malloc(owner, size);
+	if (!p)
+		return NULL;
+	memcpy(p, ptr, size < hdr->size ? size : hdr->size);
+	xfrpc_free(ptr);
+	return p;
+}
+
+static void *
+event_malloc(size_t size)
+{
+	return xfrpc_malloc(ALLOC_EVENT, size);
+}
+
+static void *
+event_realloc(void *ptr, size_t size)
+{
+	return xfrpc_realloc(ALLOC_EVENT, ptr, size);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *
+ssl_malloc(size_t size, const char *file, int line)
+{
+	return xfrpc_malloc(ALLOC_SSL, size);
+}
+
+static void *
+ssl_realloc(void *ptr, size_t size, const char *file, int line)
+{
+	return xfrpc_realloc(ALLOC_SSL, ptr, size);
+}
+
+static void
+ssl_free(void *ptr, const char *file, int line)
+{
+	xfrpc_free(ptr);
+}
+#endif
+
+int
+parse_alloc_mode(const char *name)
+{
+	int i;
+	for (i = 0; i < sizeof(mode_name) / sizeof(mode_name[0]); i++) {
+		if (strcmp(name, mode_name[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void
+init_allocator(int mode, long sample)
+{
+	alloc_mode = mode;
+	heap_sample = sample > 0 ? sample : 0;
+	sample_left = heap_sample;
+
+	if (mode != ALLOC_LIBC) {
+		page_size = sysconf(_SC_PAGESIZE);
+		pthread_key_create(&tcache_key, free_thread_cache);
+
+		int cls, i;
+		for (cls = 0, i = 0; i < sizeof(class_of); i++) {
+			if ((size_t)i * 16 > class_size[cls])
+				cls++;
+			class_of[i] = cls;
+		}
+		for (cls = 0; cls < NCLASS; cls++)
+			pthread_mutex_init(&central[cls].lock, NULL);
+	}
+
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+	event_set_mem_functions(event_malloc, event_realloc, xfrpc_free);
+#else
+	debug(LOG_WARNING, "libevent built without mm replacement, it keeps malloc of libc");
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (!CRYPTO_set_mem_functions(ssl_malloc, ssl_realloc, ssl_free))
+		debug(LOG_WARNING, "openssl allocated already, it keeps malloc of libc");
+#endif
+
+	if (mode != ALLOC_LIBC)
+		debug(LOG_INFO, "allocator %s, %d size classes up to %d bytes", 
+			mode_name[mode], (int)NCLASS, MAX_SMALL);
+	if (heap_sample)
+		debug(LOG_INFO, "sample an allocation every %ld bytes for heap profile", heap_sample);
+}
+
+// legacy heap profile of pprof, mapped libraries let it resolve symbols
+static void
+dump_heap_profile()
+{
+	char name[64], path[PATH_MAX];
+	snprintf(name, sizeof(name), "xfrpc_heap.%d.%ld.heap", (int)getpid(), (long)time(NULL));
+	FILE *fp = open_dump_file(name, path, sizeof(path));
+	if (!fp) {
+		debug(LOG_ERR, "error: open %s failed: %s", path, strerror(errno));
+		return;
+	}
+
+	size_t inuse_count = 0, inuse_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+	struct heap_site *site, *tmp;
+	pthread_mutex_lock(&site_lock);
+	HASH_ITER(hh, all_sites, site, tmp) {
+		inuse_count += site->inuse_count;
+		inuse_bytes += site->inuse_bytes;
+		alloc_count += site->alloc_count;
+		alloc_bytes += site->alloc_bytes;
+	}
+	fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%ld\n", 
+		inuse_count, inuse_bytes, alloc_count, alloc_bytes, heap_sample);
+	HASH_ITER(hh, all_sites, site, tmp) {
+		fprintf(fp, "%zu: %zu [%zu: %zu] @", site->inuse_count, site->inuse_bytes, 
+			site->alloc_count, site->alloc_bytes);
+		int i;
+		for (i = 0; i < SITE_DEPTH && site->pc[i]; i++)
+			fprintf(fp, " %p", site->pc[i]);
+		fprintf(fp, "\n");
+	}
+	pthread_mutex_unlock(&site_lock);
+
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd >= 0) {
+		char buf[4096];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			fwrite(buf, 1, n, fp);
+		close(fd);
+	}
+	fclose(fp);
+	debug(LOG_INFO, "heap profile of %zu sampled bytes in use written to %s", inuse_bytes, path);
+}
+
+void
+trim_allocator()
+{
+	struct thread_cache *tc = tcache;
+	int cls;
+	for (cls = 0; tc && cls < NCLASS; cls++) {
+		if (tc->nfree[cls])
+			cache_spill(tc, cls, tc->nfree[cls]);
+	}
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
+
+void
+dump_alloc_stats()
+{
+	size_t cached = 0;
+	int cls;
+	for (cls = 0; alloc_mode != ALLOC_LIBC && cls < NCLASS; cls++) {
+		pthread_mutex_lock(&central[cls].lock);
+		cached += (size_t)central[cls].nfree * class_stride(cls);
+		pthread_mutex_unlock(&central[cls].lock);
+	}
+
+	pthread_mutex_lock(&chunk_lock);
+	size_t mapped = slab_bytes;
+	pthread_mutex_unlock(&chunk_lock);
+
+	debug(LOG_INFO, "allocator %s: slabs %zu KB, %zu KB free in shared lists, libc %zu KB", 
+		mode_name[alloc_mode], mapped >> 10, cached >> 10, STAT_GET(large_bytes) >> 10);
+	int i;
+	for (i = 0; i < ALLOC_OWNERS; i++) {
+		debug(LOG_INFO, "allocator %s: %zu bytes live, peak %zu, %zu allocs, %zu frees", 
+			owner_name[i], STAT_GET(stats[i].live), STAT_GET(stats[i].peak), 
+			STAT_GET(stats[i].nalloc), STAT_GET(stats[i].nfree));
+	}
+
+	if (heap_sample)
+		dump_heap_profile();
+}
@@ -0,0 +1,81 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file alloc.h
+    @brief size class allocator and allocation accounting by subsystem
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <stddef.h>
+
+enum alloc_mode {
+	ALLOC_LIBC = 0,		// malloc of libc, nothing installed
+	ALLOC_SLAB,			// size classes in slabs with thread caches
+	ALLOC_HUGE,			// slabs carved from hugepages
+};
+
+// subsystems accounted apart, memory of one must be freed by xfrpc_free
+enum alloc_owner {
+	ALLOC_EVENT = 0,
+	ALLOC_SSL,
+	ALLOC_TCPMUX,
+	ALLOC_CLIENT,
+	ALLOC_CONTROL,
+	ALLOC_CRYPTO,
+	ALLOC_MSG,
+	ALLOC_CONFIG,
+	ALLOC_HTTP,			// http cache entries and parsed requests
+	ALLOC_STATIC_FILE,	// file cache, lookup and read jobs of static_file
+	ALLOC_KCP,			// kcp segments and buffers
+	ALLOC_OWNERS,
+};
+
+// returns -1 if name is not libc, slab or huge
+int parse_alloc_mode(const char *name);
+
+// must run before any libevent or openssl call,
+// heap_sample is mean bytes between sampled allocations, 0 disables it
+void init_allocator(int mode, long heap_sample);
+
+void *xfrpc_malloc(int owner, size_t size);
+
+void *xfrpc_calloc(int owner, size_t size);
+
+char *xfrpc_strdup(int owner, const char *s);
+
+void *xfrpc_realloc(int owner, void *ptr, size_t size);
+
+void xfrpc_free(void *ptr);
+
+// bytes embedded in an object of one owner accounted to another
+void alloc_move(int from, int to, size_t bytes);
+
+// logs live bytes of every owner, writes heap profile if sampling
+void dump_alloc_stats();
+
+// give cached memory of calling thread back to the system
+void trim_allocator();
+
+#endif //_ALLOC_H_
@@ -47,80 +47,178 @@
 #include "proxy.h"
 #include "utils.h"
 #include "tcpmux.h"
+#include "instance.h"
+#include "crypto_pool.h"
+#include "ratelimit.h"
+#include "sockmap.h"
+#include "alloc.h"
 
-static struct proxy_client 	*all_pc = NULL;
+// per instance state
+#define all_pc 	(cur_instance->all_pc)
+
+// a side of a pair relayed in kernel is at EOF: the other side gets FIN and
+// the pair is closed once it reads EOF too, or at once on error
+static void
+sockmap_client_event(struct proxy_client *client, struct bufferevent *bev, 
+					struct bufferevent *peer, short what)
+{
+	if (!(what & BEV_EVENT_ERROR) && sockmap_bev_eof(bev, peer))
+		return;
+
+	debug(LOG_DEBUG, "proxy client %d relayed in kernel closed", client->stream_id);
+	if (client->ctl_bev) {
+		unlimit_bev(client->ctl_bev);
+		bufferevent_free(client->ctl_bev);
+		client->ctl_bev = NULL;
+	}
+	del_proxy_client_by_stream_id(client->stream_id);
+}
 
 static void
 xfrp_worker_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
+	struct proxy_client *client = ctx;
+	set_cur_instance(client->inst);
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		if (client->sockmap == SOCKMAP_RELAYED) {
+			sockmap_client_event(client, bev, client->local_proxy_bev, what);
+			return;
+		}
 		debug(LOG_DEBUG, "working connection closed!");
+		unlimit_bev(bev);
 		bufferevent_free(bev);
 	}
 }
 
+// frps <---> local service is a pure pass-through: no tcp_mux, tls, encryption,
+// compression or bandwidth_limit, and a proxy type which forwards data as it is
+static int
+is_pass_through_client(struct proxy_client *client)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct proxy_service *ps = client->ps;
+	if (!c_conf->sockmap || c_conf->tcp_mux || c_conf->tls_enable || 
+		c_conf->protocol != PROTOCOL_TCP || c_conf->bandwidth_limit || !ps)
+		return 0;
+
+	const struct proxy_type_ops *ops = get_proxy_type_ops(ps->type);
+	return !client->crypto && !ps->use_compression && !ps->bandwidth_limit && 
+		ops->on_local_data == tcp_proxy_c2s_cb && ops->on_remote_data == tcp_proxy_s2c_cb;
+}
+
+// hand the pair over to kernel once data buffered before is written
+static void
+try_sockmap_client(struct proxy_client *client)
+{
+	if (client->sockmap || !client->connected || !client->ctl_bev || !client->local_proxy_bev)
+		return;
+
+	if (!is_pass_through_client(client)) {
+		client->sockmap = SOCKMAP_FAILED;
+		return;
+	}
+
+	struct bufferevent *bevs[] = {client->ctl_bev, client->local_proxy_bev};
+	for (int i = 0; i < 2; i++) {
+		if (evbuffer_get_length(bufferevent_get_input(bevs[i])) || 
+			evbuffer_get_length(bufferevent_get_output(bevs[i])))
+			return;
+	}
+
+	if (sockmap_bev_pair(client->ctl_bev, client->local_proxy_bev)) {
+		client->sockmap = SOCKMAP_RELAYED;
+		debug(LOG_DEBUG, "proxy [%s] client %d relayed in kernel", client->ps->proxy_name, client->stream_id);
+	} else {
+		client->sockmap = SOCKMAP_FAILED;
+	}
+}
+
+// output to local service is written
+static void
+xfrp_proxy_write_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = ctx;
+	set_cur_instance(client->inst);
+	try_sockmap_client(client);
+}
+
 void 
 xfrp_proxy_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
 	struct proxy_client *client = ctx;
 	assert(client);
+	set_cur_instance(client->inst);
 
+	const struct proxy_type_ops *ops = get_proxy_type_ops(client->ps->type);
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
-		if (0 == strcmp(client->ps->proxy_type, "tcp"))
-			debug(LOG_DEBUG, "xfrpc tcp proxy close connect server [%s:%d] stream_id %d: %s", 
-							client->ps->local_ip, client->ps->local_port, 
-							client->stream_id, strerror(errno));
-		else if (0 == strcmp(client->ps->proxy_type, "socks5"))
-			debug(LOG_DEBUG, "xfrpc socks5 proxy close connect [%d:%d]  stream_id %d: %s", 
-							client->remote_addr.type, client->remote_addr.port,
-							client->stream_id, strerror(errno));
-		else
-			debug(LOG_DEBUG, "xfrpc proxy close connect server [%s:%d] stream_id %d: %s", 
-							client->ps->local_ip, client->ps->local_port, 
-							client->stream_id, strerror(errno));
+		if (client->sockmap == SOCKMAP_RELAYED) {
+			sockmap_client_event(client, bev, client->ctl_bev, what);
+			return;
+		}
+		// data of local service still in crypto pool is sent first
+		if (client->crypto && work_crypto_defer_close(client->crypto, what))
+			return;
+		if (ops->on_close)
+			ops->on_close(client);
 		if (tmux_stream_close(client->ctl_bev, &client->stream)) {
+			unlimit_bev(bev);
 			bufferevent_free(bev);
 			client->local_proxy_bev = NULL;
 		}
 	} else if (what & BEV_EVENT_CONNECTED) {
 		debug(LOG_DEBUG, "what [%d] client [%d] connected : %s", what, client->stream_id, strerror(errno));
+		client->connected = 1;
+		trace_setup_phase(client, SETUP_LOCAL_CONNECTED);
 		if (client->data_tail_size > 0) {
 			debug(LOG_DEBUG, "send client data ...");
 			send_client_data_tail(client);		
-		} else if (is_socks5_proxy(client->ps)) {
-		    // if rb is not empty, send data
-			// rb is client->stream.rx_ring
-			struct ring_buffer *rb = &client->stream.rx_ring;
-			if (rb->sz > 0)
-				tx_ring_buffer_write(client->local_proxy_bev, rb, rb->sz);
-
-			client->state = SOCKS5_ESTABLISHED;
+		} else if (ops->on_connected) {
+			ops->on_connected(client);
 		}
+		try_sockmap_client(client);
 	}
 }
 
+// local service ---> xfrpc, switch to instance of client before handling data
+void
+xfrp_proxy_local_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = ctx;
+	set_cur_instance(client->inst);
+	trace_setup_phase(client, SETUP_FIRST_UP);
+	get_proxy_type_ops(client->ps->type)->on_local_data(bev, ctx);
+}
+
+// frps ---> xfrpc
+static void
+xfrp_worker_remote_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = ctx;
+	set_cur_instance(client->inst);
+	trace_setup_phase(client, SETUP_FIRST_DOWN);
+	const struct proxy_type_ops *ops = get_proxy_type_ops(client->ps->type);
+	if (client->crypto)
+		work_crypto_recv(client->crypto, bev, ops);
+	else
+		ops->on_remote_data(bev, ctx);
+}
+
 int 
 is_ftp_proxy(const struct proxy_service *ps)
 {
-	if (! ps || ! ps->proxy_type)
+	if (! ps)
 		return 0;
 
-	if (0 == strcmp(ps->proxy_type, "ftp") && ps->remote_data_port > 0)
-		return 1;
-
-	return 0;
+	return ps->type == PROXY_TYPE_FTP && ps->remote_data_port > 0;
 }
 
 int
 is_socks5_proxy(const struct proxy_service *ps)
 {
-	if (! ps || ! ps->proxy_type)
+	if (! ps)
 		return 0;
 
-	if (0 == strcmp(ps->proxy_type, "socks5"))
-		return 1;
-
-	return 0;
+	return ps->type == PROXY_TYPE_SOCKS5;
 }
 
 // create frp tunnel for service
@@ -146,20 +244,11 @@ start_xfrp_tunnel(struct proxy_client *client)
 		return;
 	}
 
-	if ( !ps->local_port ) {
-		debug(LOG_ERR, "service tunnel started failed, proxy service resource unvalid.");
+	const struct proxy_type_ops *ops = get_proxy_type_ops(ps->type);
+	if (ops->connect && !ops->connect(client)) {
+		del_proxy_client_by_stream_id(client->stream_id);
 		return;
 	}
-
-	//  if client's proxy type is not socks5, then connect to local proxy server
-	if ( !is_socks5_proxy(client->ps) ) {
-		client->local_proxy_bev = connect_server(base, ps->local_ip, ps->local_port);
-		if ( !client->local_proxy_bev ) {
-			debug(LOG_ERR, "frpc tunnel connect local proxy port [%d] failed!", ps->local_port);
-			del_proxy_client_by_stream_id(client->stream_id);
-			return;
-		}
-	}
 	
 	debug(LOG_DEBUG, "proxy server [%s:%d] <---> client [%s:%d]", 
 		  c_conf->server_addr, 
@@ -167,37 +256,29 @@ start_xfrp_tunnel(struct proxy_client *client)
 		  ps->local_ip ? ps->local_ip:"127.0.0.1",
 		  ps->local_port);
 
-#define PREDICT_FALSE(x) 0
-	bufferevent_data_cb proxy_s2c_recv, proxy_c2s_recv;
-	if (PREDICT_FALSE(is_ftp_proxy(client->ps))) {
-		proxy_c2s_recv = ftp_proxy_c2s_cb;
-		proxy_s2c_recv = ftp_proxy_s2c_cb;
-	} else {
-		proxy_c2s_recv = tcp_proxy_c2s_cb; // local service ---> xfrpc
-		proxy_s2c_recv = tcp_proxy_s2c_cb; // frps ---> xfrpc
-	}
-	
 	if (!c_conf->tcp_mux) {
 		bufferevent_setcb(client->ctl_bev, 
-						proxy_s2c_recv, 
+						xfrp_worker_remote_cb, // frps ---> xfrpc
 						NULL, 
 						xfrp_worker_event_cb, 
 						client);
 		bufferevent_enable(client->ctl_bev, EV_READ|EV_WRITE);
+		limit_work_bev(client->ctl_bev);
 	}
 
-	if (is_socks5_proxy(client->ps)) {
-		debug(LOG_DEBUG, "socks5 proxy client can't connect to remote server here ...");
+	if (!ops->connect) {
+		debug(LOG_DEBUG, "%s proxy client can't connect to remote server here ...", ps->proxy_type);
 		return;
 	}
 
 	bufferevent_setcb(client->local_proxy_bev, 
-						proxy_c2s_recv, 
-						NULL, 
+						xfrp_proxy_local_cb, // local service ---> xfrpc
+						xfrp_proxy_write_cb, 
 						xfrp_proxy_event_cb, 
 						client);
 						
 	bufferevent_enable(client->local_proxy_bev, EV_READ|EV_WRITE);
+	limit_local_bev(client);
 }
 
 int 
@@ -205,6 +286,7 @@ send_client_data_tail(struct proxy_client *client)
 {
 	int send_l = 0;
 	if (client->data_tail && client->data_tail_size && client->local_proxy_bev) {
+		trace_setup_phase(client, SETUP_FIRST_DOWN);
 		send_l = bufferevent_write(client->local_proxy_bev, client->data_tail, client->data_tail_size);
 		client->data_tail = NULL;
 		client->data_tail_size = 0;
@@ -217,8 +299,17 @@ static void
 free_proxy_client(struct proxy_client *client)
 {
 	debug(LOG_DEBUG, "free client %d", client->stream_id);
+	end_setup_trace(client);
+	if (client->ps) {
+		const struct proxy_type_ops *ops = get_proxy_type_ops(client->ps->type);
+		if (ops->on_free)
+			ops->on_free(client);
+	}
+	unlimit_bev(client->local_proxy_bev);
 	if (client->local_proxy_bev) bufferevent_free(client->local_proxy_bev);
-	free(client);
+	if (client->crypto) free_work_crypto(client->crypto);
+	alloc_move(ALLOC_TCPMUX, ALLOC_CLIENT, sizeof(client->stream));
+	xfrpc_free(client);
 }
 
 static void 
@@ -254,8 +345,11 @@ get_proxy_client(uint32_t sid)
 struct proxy_client *
 new_proxy_client()
 {
-	struct proxy_client *client = calloc(1, sizeof(struct proxy_client));
+	struct proxy_client *client = xfrpc_calloc(ALLOC_CLIENT, sizeof(struct proxy_client));
 	assert(client);
+	// rings of its stream are tcp_mux buffers
+	alloc_move(ALLOC_CLIENT, ALLOC_TCPMUX, sizeof(client->stream));
+	client->inst 		= cur_instance;
 	client->stream_id   = get_next_session_id();
 	init_tmux_stream(&client->stream, client->stream_id, INIT);
 	HASH_ADD_INT(all_pc, stream_id, client);
@@ -263,6 +357,53 @@ new_proxy_client()
 	return client;
 }
 
+// client of a stream handed over by the process upgraded from, its local
+// service is connected already
+struct proxy_client *
+adopt_proxy_client(uint32_t stream_id, struct proxy_service *ps, struct bufferevent *local_bev)
+{
+	struct proxy_client *client = xfrpc_calloc(ALLOC_CLIENT, sizeof(struct proxy_client));
+	assert(client);
+	alloc_move(ALLOC_CLIENT, ALLOC_TCPMUX, sizeof(client->stream));
+	client->inst 		= cur_instance;
+	client->stream_id 	= stream_id;
+	client->base 		= get_main_control()->connect_base;
+	client->ctl_bev 	= get_main_control()->connect_bev;
+	client->ps 			= ps;
+	client->work_started = 1;
+	client->connected 	= 1;
+	init_tmux_stream(&client->stream, stream_id, ESTABLISHED);
+	HASH_ADD_INT(all_pc, stream_id, client);
+
+	client->local_proxy_bev = local_bev;
+	bufferevent_setcb(local_bev, xfrp_proxy_local_cb, NULL, xfrp_proxy_event_cb, client);
+	bufferevent_enable(local_bev, EV_READ|EV_WRITE);
+	limit_local_bev(client);
+	return client;
+}
+
+// close all working clients of proxy service ps before it is unregistered
+void
+close_proxy_clients(struct proxy_service *ps)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, all_pc, client, tmp) {
+		if (client->ps != ps)
+			continue;
+
+		debug(LOG_DEBUG, "close proxy [%s] client %d", ps->proxy_name, client->stream_id);
+		if (c_conf->tcp_mux) {
+			tcp_mux_send_win_update_rst(client->ctl_bev, client->stream_id);
+			flight_record(&client->stream, client->stream_id, FL_CLOSE, RST, FL_CLOSE_PROXY);
+		} else if (client->ctl_bev) {
+			unlimit_bev(client->ctl_bev);
+			bufferevent_free(client->ctl_bev);
+		}
+		del_proxy_client_by_stream_id(client->stream_id);
+	}
+}
+
 void
 clear_all_proxy_client()
 {
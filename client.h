@@ -32,14 +32,23 @@
 #include "uthash.h"
 #include "common.h"
 #include "tcpmux.h"
+#include "latency.h"
+#include "tcpinfo.h"
 
 struct event_base;
 struct base_conf;
 struct bufferevent;
 struct event;
 struct proxy_service;
-
-#define SOCKS5_ADDRES_LEN 20
+struct socks5_connector;
+struct http_conn;
+struct static_file_conn;
+struct xfrpc_instance;
+struct work_crypto;
+struct ftp_data_endpoint;
+struct bufferevent_rate_limit_group;
+
+#define SOCKS5_ADDRES_LEN 256 // domain is up to 255 bytes, zero terminated
 struct socks5_addr {
 	uint8_t 	addr[SOCKS5_ADDRES_LEN];
 	uint16_t	port;
@@ -52,13 +61,30 @@ enum socks5_state {
 	SOCKS5_HANDSHAKE,
 	SOCKS5_CONNECT,
 	SOCKS5_ESTABLISHED,
+	SOCKS5_CLOSED,
+};
+
+enum proxy_type {
+	PROXY_TYPE_TCP,
+	PROXY_TYPE_MSTSC,
+	PROXY_TYPE_SOCKS5,
+	PROXY_TYPE_HTTP,
+	PROXY_TYPE_HTTPS,
+	PROXY_TYPE_FTP,
+	PROXY_TYPE_FTP_DATA,	// created for each ftp proxy, not configurable
+	PROXY_TYPE_STATIC_FILE,
+	PROXY_TYPE_MAX,
 };
 
+#define SOCKMAP_RELAYED	1
+#define SOCKMAP_FAILED	2
+
 struct proxy_client {
 	struct event_base 	*base;
 	struct bufferevent	*ctl_bev; // xfrpc proxy <---> frps
 	struct bufferevent 	*local_proxy_bev; // xfrpc proxy <---> local service
 	struct base_conf	*bconf;
+	struct xfrpc_instance *inst; // instance the client belongs to
 	struct tmux_stream 	stream;
 	
 	uint32_t				stream_id;
@@ -71,6 +97,34 @@ struct proxy_client {
 	// socks5 only
 	struct 	socks5_addr remote_addr;
 	enum 	socks5_state state;
+	struct 	socks5_connector *connector; // target connecting in progress
+	uint8_t 	socks5_reply; // full rfc1928 handshake, replies go back to client
+
+	// ftp only
+	int 	ftp_in_line; // reply line start has been inspected
+	char 	src_addr[64]; // user address of StartWorkConn, empty if unknown
+	struct 	ftp_data_endpoint *ftp_data_eps; // passive endpoints announced, oldest first
+
+	// http only
+	struct 	http_conn *http; // NULL when http cache disabled
+
+	// work connection encryption, NULL if use_encryption is not set
+	struct 	work_crypto *crypto;
+
+	// static_file only
+	struct 	static_file_conn *static_file; // NULL until first request
+
+	// monotonic ns each setup phase was reached, 0 if not yet
+	uint64_t 	setup_ts[SETUP_PHASE_MAX];
+	uint8_t 	setup_counted;	// phases added to stats of proxy
+	uint8_t 	setup_logged;
+
+	// TCP_INFO of sockets to local service and, without tcp_mux, to frps
+	struct tcp_path_state 	local_path;
+	struct tcp_path_state 	frps_path;
+
+	uint8_t 	sockmap;	// SOCKMAP_RELAYED or SOCKMAP_FAILED once tried
+	uint8_t 	mem_paused;	// reading stopped under memory pressure
 
 	// private arguments
 	UT_hash_handle hh;
@@ -79,6 +133,7 @@ struct proxy_client {
 struct proxy_service {
 	char 	*proxy_name;
 	char 	*proxy_type;
+	enum proxy_type type;	// resolved from proxy_type when config loaded
 	char 	*ftp_cfg_proxy_name;
 	int 	use_encryption;
 	int		use_compression;
@@ -89,6 +144,9 @@ struct proxy_service {
 	int 	remote_data_port;
 	int 	local_port;
 
+	// unix domain socket of local service, directory to serve for static_file
+	char 	*local_path;
+
 	// http and https only
 	char 	*custom_domains;
 	char 	*subdomain;
@@ -100,6 +158,12 @@ struct proxy_service {
 	// load balance
 	char	*group;
 	char	*group_key;
+
+	// bytes per second read from local service, 0 unlimited
+	size_t 	bandwidth_limit;
+	struct bufferevent_rate_limit_group *rate_group;	// local connections of the proxy
+
+	struct setup_stats *setup_stats;	// NULL until first work connection started
 	
 	// private arguments
 	UT_hash_handle hh;
@@ -124,8 +188,15 @@ int is_socks5_proxy(const struct proxy_service *ps);
 
 struct proxy_client *new_proxy_client();
 
+struct proxy_client *adopt_proxy_client(uint32_t stream_id, struct proxy_service *ps, 
+				struct bufferevent *local_bev);
+
 void clear_all_proxy_client();
 
+void close_proxy_clients(struct proxy_service *ps);
+
 void xfrp_proxy_event_cb(struct bufferevent *bev, short what, void *ctx);
 
+void xfrp_proxy_local_cb(struct bufferevent *bev, void *ctx);
+
 #endif //_CLIENT_H_
@@ -38,8 +38,12 @@
 #include "config.h"
 #include "commandline.h"
 #include "debug.h"
+#include "alloc.h"
+#include "mempressure.h"
 #include "version.h"
 #include "utils.h"
+#include "instance.h"
+#include "upgrade.h"
 
 typedef void signal_func (int);
 
@@ -48,7 +52,17 @@ static void usage(const char *appname);
 
 static int is_daemon = 1;
 
-static char *confile = NULL;
+#define MAX_CONFILES	64
+
+static char *confiles[MAX_CONFILES]; 	// one instance for each config file
+static int 	confile_count = 0;
+static int 	loop_threads = 1;
+static int 	alloc_mode = ALLOC_LIBC;
+static int 	mem_soft = 0;
+static int 	mem_hard = 0;	// 0 disables memory pressure
+static long 	heap_sample = 0;
+static char 	*admin_socket = NULL;
+static char 	*dump_dir = "/tmp";
 
 /*
  * Fork a child process and then kill the parent so make the calling
@@ -101,6 +115,24 @@ set_signal_handler (int signo, signal_func * func)
         return oact.sa_handler;
 }
 
+int
+get_loop_threads()
+{
+	return loop_threads;
+}
+
+const char *
+get_admin_socket()
+{
+	return admin_socket;
+}
+
+const char *
+get_dump_dir()
+{
+	return dump_dir;
+}
+
 int 
 get_daemon_status()
 {
@@ -118,7 +150,13 @@ usage(const char *appname)
     fprintf(stdout, "Usage: %s [options]\n", appname);
     fprintf(stdout, "\n");
     fprintf(stdout, "options:\n");
-    fprintf(stdout, "  -c [filename] Use this config file\n");
+    fprintf(stdout, "  -c [filename] Use this config file, repeat it to run more instances\n");
+    fprintf(stdout, "  -t <threads>  Event loop threads shared by instances\n");
+    fprintf(stdout, "  -m <alloc>    Allocator of libevent and openssl: libc, slab or huge\n");
+    fprintf(stdout, "  -A <path>     Serve admin commands on this unix socket\n");
+    fprintf(stdout, "  -D <dir>      Write flight recorder and profiles here, default /tmp\n");
+    fprintf(stdout, "  -P <bytes>    Sample an allocation every that many bytes for heap profile\n");
+    fprintf(stdout, "  -M <soft:hard> Degrade at these percents of memory limit\n");
     fprintf(stdout, "  -f            Run in foreground\n");
     fprintf(stdout, "  -d <level>    Debug level\n");
     fprintf(stdout, "  -h            Print usage\n");
@@ -135,8 +173,10 @@ parse_commandline(int argc, char **argv)
 {
     int c;
 	int flag = 0;
+
+	set_upgrade_argv(argv);
 	
-    while (-1 != (c = getopt(argc, argv, "c:hfd:sw:vrx:i:a:"))) {
+    while (-1 != (c = getopt(argc, argv, "c:hfd:sw:vrx:i:a:t:m:P:A:M:D:"))) {
 
 
         switch (c) {
@@ -148,12 +188,61 @@ parse_commandline(int argc, char **argv)
 
         case 'c':
             if (optarg) {
-				confile = strdup(optarg); //never free it
-                assert(confile);
+				if (confile_count >= MAX_CONFILES) {
+					fprintf(stderr, "too many config files, at most %d\n", MAX_CONFILES);
+					exit(1);
+				}
+				confiles[confile_count] = strdup(optarg); //never free it
+                assert(confiles[confile_count]);
+				confile_count++;
 				flag = 1;
             }
             break;
 
+        case 't':
+            if (optarg) {
+                loop_threads = atoi(optarg);
+                if (loop_threads < 1)
+                    loop_threads = 1;
+            }
+            break;
+
+        case 'm':
+            if (optarg) {
+                alloc_mode = parse_alloc_mode(optarg);
+                if (alloc_mode < 0) {
+                    fprintf(stderr, "unknown allocator %s\n", optarg);
+                    exit(1);
+                }
+            }
+            break;
+
+        case 'A':
+            if (optarg) {
+                admin_socket = strdup(optarg); //never free it
+                assert(admin_socket);
+            }
+            break;
+
+        case 'D':
+            if (optarg) {
+                dump_dir = strdup(optarg); //never free it
+                assert(dump_dir);
+            }
+            break;
+
+        case 'P':
+            if (optarg)
+                heap_sample = atol(optarg);
+            break;
+
+        case 'M':
+            if (optarg && sscanf(optarg, "%d:%d", &mem_soft, &mem_hard) != 2) {
+                fprintf(stderr, "memory pressure wants soft:hard percents, got %s\n", optarg);
+                exit(1);
+            }
+            break;
+
         case 'f':
             is_daemon = 0;
             debugconf.log_stderr = 1;
@@ -201,7 +290,13 @@ parse_commandline(int argc, char **argv)
 		exit(0);
 	}
 	
-	load_config(confile);
+	// before config loading allocates anything of openssl
+	init_allocator(alloc_mode, heap_sample);
+	init_mem_pressure(mem_soft, mem_hard);
+
+	int i;
+	for (i = 0; i < confile_count; i++)
+		new_xfrpc_instance(confiles[i]);
 	
 	if (is_daemon) {
 		makedaemon();
@@ -33,4 +33,10 @@ void parse_commandline(int, char **);
 
 int get_daemon_status();
 
+int get_loop_threads();
+
+const char *get_admin_socket();
+
+const char *get_dump_dir();
+
 #endif                          /* _COMMANDLINE_H_ */
@@ -26,36 +26,62 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <time.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <syslog.h>
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <event2/bufferevent.h>
 
 #include "ini.h"
 #include "uthash.h"
 #include "config.h"
 #include "client.h"
+#include "proxy.h"
 #include "debug.h"
 #include "msg.h"
 #include "utils.h"
 #include "version.h"
+#include "instance.h"
+#include "alloc.h"
+
+// per instance state
+#define c_conf 		(cur_instance->c_conf)
+#define all_ps 		(cur_instance->all_ps)
+#define config_file (cur_instance->config_file)
+
+// config parsing context, passed to ini parser as user data
+struct config_parse_ctx {
+	struct common_conf		*common;	// NULL when [common] is not parsed
+	struct proxy_service 	*ps_hash;
+	struct proxy_service 	*cur_ps;	// proxy service of the last parsed section
+	int 					error;
+};
 
+enum proxy_option_type {
+	OPT_STRING,
+	OPT_INT,
+	OPT_BOOL,
+	OPT_TYPE,
+	OPT_BANDWIDTH,
+};
 
-// define a list of type in array
-static const char *valid_types[] = {
-	"tcp",
-	"mstsc",
-	"socks5",
-	"http",
-	"https",
-	NULL
+struct proxy_option {
+	const char 				*name;
+	enum proxy_option_type 	type;
+	size_t 					offset;
 };
 
-static struct common_conf 	*c_conf;
-static struct proxy_service *all_ps;
+#define PROXY_OPTION(n, t, field) { n, t, offsetof(struct proxy_service, field) }
 
-static void new_ftp_data_proxy_service(struct proxy_service *ftp_ps);
+static void new_ftp_data_proxy_service(struct proxy_service **ps_hash, struct proxy_service *ftp_ps);
 
 struct common_conf *
 get_common_config()
@@ -66,10 +92,14 @@ get_common_config()
 void 
 free_common_config()
 {
-	struct common_conf *c_conf = get_common_config();
-
-	if (c_conf->server_addr) free(c_conf->server_addr);
-	if (c_conf->auth_token) free(c_conf->auth_token);
+	xfrpc_free(c_conf->server_addr);
+	xfrpc_free(c_conf->auth_token);
+	xfrpc_free(c_conf->tls_cert_file);
+	xfrpc_free(c_conf->tls_key_file);
+	xfrpc_free(c_conf->tls_trusted_ca_file);
+	xfrpc_free(c_conf->tls_server_name);
+	xfrpc_free(c_conf->capture_file);
+	xfrpc_free(c_conf->replay_file);
 };
 
 static int 
@@ -81,23 +111,6 @@ is_true(const char *val)
 	return 0;
 }
 
-static const char *
-get_valid_type(const char *val)
-{
-	if (!val)
-		return NULL;
-	
-	#define MATCH_VALUE(s) strcmp(val, s) == 0
-	// iterate the valid_types array
-	for (int i = 0; valid_types[i]; i++) {
-		if (MATCH_VALUE(valid_types[i])) {
-			return valid_types[i];
-		}
-	}
-	
-	return NULL;
-}
-
 static void 
 dump_common_conf()
 {
@@ -111,22 +124,34 @@ dump_common_conf()
 			 c_conf->heartbeat_interval, c_conf->heartbeat_timeout);
 }
 
-static void 
-dump_proxy_service(const int index, struct proxy_service *ps)
+static int 
+init_proxy_service(const int index, struct proxy_service **ps_hash, struct proxy_service *ps)
 {
 	if (!ps)
-		return;
+		return 0;
 	
 	if (NULL == ps->proxy_type) {
-		ps->proxy_type = strdup("tcp");
+		ps->proxy_type = xfrpc_strdup(ALLOC_CONFIG, "tcp");
 		assert(ps->proxy_type);
-	} else if (strcmp(ps->proxy_type, "ftp") == 0) {
-		new_ftp_data_proxy_service(ps);
+		ps->type = PROXY_TYPE_TCP;
+	} else if (ps->type == PROXY_TYPE_FTP) {
+		new_ftp_data_proxy_service(ps_hash, ps);
+	} else if (ps->type == PROXY_TYPE_SOCKS5) {
+		// if ps->proxy_type is socks5, and ps->remote_port is not set, set it to 1980
+		if (ps->remote_port == 0)
+			ps->remote_port = DEFAULT_SOCKS5_PORT;
+		if (ps->group == NULL)
+			ps->group = xfrpc_strdup(ALLOC_CONFIG, "chatgptd");
+	} else if (ps->type == PROXY_TYPE_MSTSC) {
+		// if ps->proxy_type is mstsc, and ps->local_port is not set, set it to 3389
+		// start a thread to listen on local_port, and forward data to remote_port
+		if (ps->local_port == 0)
+			ps->local_port = DEFAULT_MSTSC_PORT;
 	}
 
 	if (!validate_proxy(ps)) {
 		debug(LOG_ERR, "Error: validate_proxy failed");
-		exit(-1);
+		return 0;
 	}
 
 	debug(LOG_DEBUG, 
@@ -143,17 +168,23 @@ dump_proxy_service(const int index, struct proxy_service *ps)
 		ps->host_header_rewrite,
 		ps->http_user,
 		ps->http_pwd);
+
+	return 1;
 }
 
-static void 
-dump_all_ps()
+// return 0 if any proxy service is invalid
+static int 
+init_all_ps(struct proxy_service **ps_hash)
 {
 	struct proxy_service *ps = NULL, *tmp = NULL;
 	
 	int index = 0;
-	HASH_ITER(hh, all_ps, ps, tmp) {
-		dump_proxy_service(index++, ps);
+	HASH_ITER(hh, *ps_hash, ps, tmp) {
+		if (!init_proxy_service(index++, ps_hash, ps))
+			return 0;
 	}
+
+	return 1;
 }
 
 static struct proxy_service *
@@ -162,15 +193,16 @@ new_proxy_service(const char *name)
 	if (! name)
 		return NULL;
 
-	struct proxy_service *ps = (struct proxy_service *)calloc(sizeof(struct proxy_service), 1);
+	struct proxy_service *ps = (struct proxy_service *)xfrpc_calloc(ALLOC_CONFIG, sizeof(struct proxy_service));
 	assert(ps);
 	assert(c_conf);
 
-	ps->proxy_name 			= strdup(name);
+	ps->proxy_name 			= xfrpc_strdup(ALLOC_CONFIG, name);
 	ps->ftp_cfg_proxy_name	= NULL;
 	assert(ps->proxy_name);
 
 	ps->proxy_type 			= NULL;
+	ps->type 				= PROXY_TYPE_TCP;
 	ps->use_encryption 		= 0;
 	ps->local_port			= -1;
 	ps->remote_port			= -1;
@@ -184,18 +216,58 @@ new_proxy_service(const char *name)
 	ps->host_header_rewrite	= NULL;
 	ps->http_user			= NULL;
 	ps->http_pwd			= NULL;
+	ps->local_path			= NULL;
+	ps->bandwidth_limit		= 0;
+	ps->rate_group			= NULL;
+	ps->setup_stats			= NULL;
 
 	return ps;
 }
 
+void
+free_proxy_service(struct proxy_service *ps)
+{
+	if (!ps)
+		return;
+
+	xfrpc_free(ps->proxy_name);
+	xfrpc_free(ps->proxy_type);
+	xfrpc_free(ps->ftp_cfg_proxy_name);
+	xfrpc_free(ps->local_ip);
+	xfrpc_free(ps->local_path);
+	xfrpc_free(ps->custom_domains);
+	xfrpc_free(ps->subdomain);
+	xfrpc_free(ps->locations);
+	xfrpc_free(ps->host_header_rewrite);
+	xfrpc_free(ps->http_user);
+	xfrpc_free(ps->http_pwd);
+	xfrpc_free(ps->group);
+	xfrpc_free(ps->group_key);
+	SAFE_FREE(ps->setup_stats);
+	// its local connections are out of the group, see free_proxy_client
+	if (ps->rate_group) bufferevent_rate_limit_group_free(ps->rate_group);
+	xfrpc_free(ps);
+}
+
+static void
+free_all_ps(struct proxy_service **ps_hash)
+{
+	struct proxy_service *ps = NULL, *tmp = NULL;
+	HASH_ITER(hh, *ps_hash, ps, tmp) {
+		HASH_DEL(*ps_hash, ps);
+		free_proxy_service(ps);
+	}
+	*ps_hash = NULL;
+}
+
 // create a new proxy service with suffix "_ftp_data_proxy"
 static void 
-new_ftp_data_proxy_service(struct proxy_service *ftp_ps)
+new_ftp_data_proxy_service(struct proxy_service **ps_hash, struct proxy_service *ftp_ps)
 {
 	struct proxy_service *ps = NULL;
 	char *ftp_data_proxy_name = get_ftp_data_proxy_name((const char *)ftp_ps->proxy_name);
 
-	HASH_FIND_STR(all_ps, ftp_data_proxy_name, ps);
+	HASH_FIND_STR(*ps_hash, ftp_data_proxy_name, ps);
 	if (!ps) {
 		ps = new_proxy_service(ftp_data_proxy_name);
 		if (! ps) {
@@ -204,18 +276,20 @@ new_ftp_data_proxy_service(struct proxy_service *ftp_ps)
 			exit(0);
 		}
 		
-		ps->ftp_cfg_proxy_name = strdup(ftp_ps->proxy_name);
+		ps->ftp_cfg_proxy_name = xfrpc_strdup(ALLOC_CONFIG, ftp_ps->proxy_name);
 		assert(ps->ftp_cfg_proxy_name);
 
-		ps->proxy_type = strdup("tcp");
+		ps->proxy_type = xfrpc_strdup(ALLOC_CONFIG, "ftp_data");
+		ps->type = PROXY_TYPE_FTP_DATA;
 		ps->remote_port = ftp_ps->remote_data_port;
-		ps->local_ip = ftp_ps->local_ip;
-		ps->local_port = 0; //will be init in working tunnel connectting
+		ps->local_ip = ftp_ps->local_ip ? xfrpc_strdup(ALLOC_CONFIG, ftp_ps->local_ip) : NULL;
+		ps->local_port = 0; // passive endpoint of ftp server is connected in working tunnel
+		ps->bandwidth_limit = ftp_ps->bandwidth_limit;
 
-		HASH_ADD_KEYPTR(hh, all_ps, ps->proxy_name, strlen(ps->proxy_name), ps);
+		HASH_ADD_KEYPTR(hh, *ps_hash, ps->proxy_name, strlen(ps->proxy_name), ps);
 	}
 
-	free(ftp_data_proxy_name);
+	xfrpc_free(ftp_data_proxy_name);
 }
 
 int
@@ -224,24 +298,48 @@ validate_proxy(struct proxy_service *ps)
 	if (!ps || !ps->proxy_name || !ps->proxy_type)
 		return 0;
 
-	if (strcmp(ps->proxy_type, "socks5") == 0) {
+	switch(ps->type) {
+	case PROXY_TYPE_SOCKS5:
 		if (ps->remote_port == 0) {
 			debug(LOG_ERR, "Proxy [%s] error: remote_port not found", ps->proxy_name);
 			return 0;
 		}
-	} else if (strcmp(ps->proxy_type, "mstsc") == 0) {
+		break;
+	case PROXY_TYPE_MSTSC:
 		if (ps->remote_port == 0 || ps->local_port == 0) {
 			debug(LOG_ERR, "Proxy [%s] error: remote_port or local_port not found", ps->proxy_name);
 			return 0;
 		}
-	} else if (strcmp(ps->proxy_type, "tcp") == 0) {
-		if (ps->remote_port == 0 || ps->local_port == 0 || ps->local_ip == NULL) {
-			debug(LOG_ERR, "Proxy [%s] error: remote_port or local_port or local_ip not found", ps->proxy_name);
+		break;
+	case PROXY_TYPE_TCP:
+		// local service is reached by local_path or by local_ip and local_port
+		if (ps->remote_port == 0 || (!ps->local_path && (ps->local_port == 0 || ps->local_ip == NULL))) {
+			debug(LOG_ERR, "Proxy [%s] error: remote_port or local_path or local_port or local_ip not found", ps->proxy_name);
+			return 0;
+		}
+		break;
+	case PROXY_TYPE_FTP:
+		if (ps->remote_port <= 0 || ps->remote_data_port <= 0 || ps->local_port <= 0 || ps->local_ip == NULL) {
+			debug(LOG_ERR, "Proxy [%s] error: remote_port or remote_data_port or local_port or local_ip not found", ps->proxy_name);
 			return 0;
 		}
-	} else if (strcmp(ps->proxy_type, "http") == 0 || strcmp(ps->proxy_type, "https") == 0) {
-		if (ps->local_port == 0 || ps->local_ip == NULL) {
-			debug(LOG_ERR, "Proxy [%s] error: local_port or local_ip not found", ps->proxy_name);
+		break;
+	case PROXY_TYPE_FTP_DATA:
+		if (ps->remote_port <= 0 || ps->ftp_cfg_proxy_name == NULL) {
+			debug(LOG_ERR, "Proxy [%s] error: ftp data proxy invalid", ps->proxy_name);
+			return 0;
+		}
+		break;
+	case PROXY_TYPE_STATIC_FILE:
+		if (ps->remote_port <= 0 || ps->local_path == NULL) {
+			debug(LOG_ERR, "Proxy [%s] error: remote_port or local_path not found", ps->proxy_name);
+			return 0;
+		}
+		break;
+	case PROXY_TYPE_HTTP:
+	case PROXY_TYPE_HTTPS:
+		if (!ps->local_path && (ps->local_port == 0 || ps->local_ip == NULL)) {
+			debug(LOG_ERR, "Proxy [%s] error: local_path or local_port or local_ip not found", ps->proxy_name);
 			return 0;
 		}
 		// custom_domains and subdomain can not be set at the same time
@@ -253,7 +351,8 @@ validate_proxy(struct proxy_service *ps)
 			debug(LOG_ERR, "Proxy [%s] error: custom_domains or subdomain must be set", ps->proxy_name);
 			return 0;
 		}
-	} else {
+		break;
+	default:
 		debug(LOG_ERR, "Proxy [%s] error: proxy_type not found", ps->proxy_name);
 		return 0;
 	}
@@ -262,93 +361,156 @@ validate_proxy(struct proxy_service *ps)
 }
 
 static int 
-proxy_service_handler(void *user, const char *sect, const char *nm, const char *value)
+str_equal(const char *a, const char *b)
 {
- 	struct proxy_service *ps = NULL;
+	if (a == NULL || b == NULL)
+		return a == b;
 
-	char *section = NULL;
-	section = strdup(sect);
-	assert(section);
+	return strcmp(a, b) == 0;
+}
+
+int
+proxy_service_equal(const struct proxy_service *a, const struct proxy_service *b)
+{
+	return str_equal(a->proxy_name, b->proxy_name) &&
+		str_equal(a->proxy_type, b->proxy_type) &&
+		str_equal(a->ftp_cfg_proxy_name, b->ftp_cfg_proxy_name) &&
+		a->use_encryption == b->use_encryption &&
+		a->use_compression == b->use_compression &&
+		str_equal(a->local_ip, b->local_ip) &&
+		a->local_port == b->local_port &&
+		str_equal(a->local_path, b->local_path) &&
+		a->remote_port == b->remote_port &&
+		a->remote_data_port == b->remote_data_port &&
+		str_equal(a->custom_domains, b->custom_domains) &&
+		str_equal(a->subdomain, b->subdomain) &&
+		str_equal(a->locations, b->locations) &&
+		str_equal(a->host_header_rewrite, b->host_header_rewrite) &&
+		str_equal(a->http_user, b->http_user) &&
+		str_equal(a->http_pwd, b->http_pwd) &&
+		str_equal(a->group, b->group) &&
+		str_equal(a->group_key, b->group_key);
+}
 
-	if (strcmp(section, "common") == 0) {
-		SAFE_FREE(section);
+// proxy section options, sorted by name for bsearch
+static const struct proxy_option proxy_options[] = {
+	PROXY_OPTION("bandwidth_limit",		OPT_BANDWIDTH,	bandwidth_limit),
+	PROXY_OPTION("custom_domains",		OPT_STRING,	custom_domains),
+	PROXY_OPTION("group",				OPT_STRING,	group),
+	PROXY_OPTION("group_key",			OPT_STRING,	group_key),
+	PROXY_OPTION("host_header_rewrite",	OPT_STRING,	host_header_rewrite),
+	PROXY_OPTION("http_pwd",			OPT_STRING,	http_pwd),
+	PROXY_OPTION("http_user",			OPT_STRING,	http_user),
+	PROXY_OPTION("local_ip",			OPT_STRING,	local_ip),
+	PROXY_OPTION("local_path",			OPT_STRING,	local_path),
+	PROXY_OPTION("local_port",			OPT_INT,	local_port),
+	PROXY_OPTION("locations",			OPT_STRING,	locations),
+	PROXY_OPTION("remote_data_port",	OPT_INT,	remote_data_port),
+	PROXY_OPTION("remote_port",			OPT_INT,	remote_port),
+	PROXY_OPTION("subdomain",			OPT_STRING,	subdomain),
+	PROXY_OPTION("type",				OPT_TYPE,	proxy_type),
+	PROXY_OPTION("use_compression",		OPT_BOOL,	use_compression),
+	PROXY_OPTION("use_encryption",		OPT_BOOL,	use_encryption),
+};
+
+static int
+proxy_option_cmp(const void *key, const void *elem)
+{
+	return strcmp((const char *)key, ((const struct proxy_option *)elem)->name);
+}
+
+static const struct proxy_option *
+find_proxy_option(const char *name)
+{
+	return bsearch(name, proxy_options, 
+				sizeof(proxy_options) / sizeof(proxy_options[0]), 
+				sizeof(proxy_options[0]), 
+				proxy_option_cmp);
+}
+
+// bandwidth as frpc writes it: 512KB, 1MB, or bytes without unit
+static size_t
+parse_bandwidth(const char *value)
+{
+	char *unit = NULL;
+	double n = strtod(value, &unit);
+	if (n < 0)
 		return 0;
-	}
+	while (*unit == ' ')
+		unit++;
+	if (strncasecmp(unit, "MB", 2) == 0)
+		n *= 1024 * 1024;
+	else if (strncasecmp(unit, "KB", 2) == 0)
+		n *= 1024;
+	return (size_t)n;
+}
 
-	HASH_FIND_STR(all_ps, section, ps);
-	if (!ps) {
-		ps = new_proxy_service(section);
-		if (! ps) {
-			debug(LOG_ERR, "cannot create proxy service, it should not happenned!");
-			exit(0);
+static int
+set_proxy_option(struct proxy_service *ps, const struct proxy_option *opt, const char *value)
+{
+	void *field = (char *)ps + opt->offset;
+
+	switch(opt->type) {
+	case OPT_TYPE: {
+		int type = get_proxy_type_by_name(value);
+		if (type < 0) {
+			debug(LOG_ERR, "proxy service type %s is not supportted", value);
+			return 0;
 		}
+		ps->type = type;
+	}
+		// fall through
+	case OPT_STRING:
+		xfrpc_free(*(char **)field);
+		*(char **)field = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(*(char **)field);
+		break;
+	case OPT_INT:
+		*(int *)field = atoi(value);
+		break;
+	case OPT_BOOL:
+		*(int *)field = is_true(value);
+		break;
+	case OPT_BANDWIDTH:
+		*(size_t *)field = parse_bandwidth(value);
+		break;
+	}
 
-		HASH_ADD_KEYPTR(hh, all_ps, ps->proxy_name, strlen(ps->proxy_name), ps);
-	} 
-	
-	#define MATCH_NAME(s) strcmp(nm, s) == 0
-	#define TO_BOOL(v) strcmp(value, "true") ? 0:1
+	return 1;
+}
 
-	if (MATCH_NAME("type")) {
-		if (! get_valid_type(value)) {
-			debug(LOG_ERR, "proxy service type %s is not supportted", value);
-			SAFE_FREE(section);
-			exit(0);
+static int 
+proxy_service_handler(void *user, const char *section, const char *nm, const char *value)
+{
+	struct config_parse_ctx *ctx = (struct config_parse_ctx *)user;
+ 	struct proxy_service *ps = ctx->cur_ps;
+
+	// options of one section are consecutive, only look up the hash when section changes
+	if (!ps || strcmp(ps->proxy_name, section) != 0) {
+		HASH_FIND_STR(ctx->ps_hash, section, ps);
+		if (!ps) {
+			ps = new_proxy_service(section);
+			if (! ps) {
+				debug(LOG_ERR, "cannot create proxy service, it should not happenned!");
+				exit(0);
+			}
+
+			HASH_ADD_KEYPTR(hh, ctx->ps_hash, ps->proxy_name, strlen(ps->proxy_name), ps);
 		}
-		ps->proxy_type = strdup(value);
-		assert(ps->proxy_type);
-	} else if (MATCH_NAME("local_ip")) {
-		ps->local_ip = strdup(value);
-		assert(ps->local_ip);
-	} else if (MATCH_NAME("local_port")) {
-		ps->local_port = atoi(value);
-	} else if (MATCH_NAME("use_encryption")) {
-		ps->use_encryption = is_true(value);
-	} else if (MATCH_NAME("remote_port")) {
-		ps->remote_port = atoi(value);
-	} else if (MATCH_NAME("remote_data_port")) {
-		ps->remote_data_port = atoi(value);
-	} else if (MATCH_NAME("http_user")) {
-		ps->http_user = strdup(value);
-	} else if (MATCH_NAME("http_pwd")) {
-		ps->http_pwd = strdup(value);
-	} else if (MATCH_NAME("subdomain")) {
-		ps->subdomain = strdup(value);
-	} else if (MATCH_NAME("custom_domains")) {
-		ps->custom_domains = strdup(value);
-		assert(ps->custom_domains);
-	} else if (MATCH_NAME("locations")) {
-		ps->locations = strdup(value);
-	} else if (MATCH_NAME("host_header_rewrite")) {
-		ps->host_header_rewrite = strdup(value);
-	} else if (MATCH_NAME("use_encryption")) {
-		ps->use_encryption = TO_BOOL(value);
-	} else if (MATCH_NAME("use_compression")) {
-		ps->use_compression = TO_BOOL(value);
-	} else if (MATCH_NAME("group")) {
-		ps->group = strdup(value);
-	} else if (MATCH_NAME("group_key")) {
-		ps->group_key = strdup(value);
-	} else {
+		ctx->cur_ps = ps;
+	}
+
+	const struct proxy_option *opt = find_proxy_option(nm);
+	if (!opt) {
 		debug(LOG_ERR, "unknown option %s in section %s", nm, section);
-		SAFE_FREE(section);
 		return 0;
 	}
-	
-	// if ps->proxy_type is socks5, and ps->remote_port is not set, set it to 1980
-	if (ps->proxy_type && strcmp(ps->proxy_type, "socks5") == 0) {
-		if (ps->remote_port == 0)
-			ps->remote_port = DEFAULT_SOCKS5_PORT;
-		if (ps->group == NULL)
-			ps->group = strdup("chatgptd");
-	} else if (ps->proxy_type && strcmp(ps->proxy_type, "mstsc") == 0) {
-		// if ps->proxy_type is mstsc, and ps->local_port is not set, set it to 3389
-		// start a thread to listen on local_port, and forward data to remote_port
-		if (ps->local_port == 0)
-			ps->local_port = DEFAULT_MSTSC_PORT;
+
+	if (!set_proxy_option(ps, opt, value)) {
+		ctx->error = 1;
+		return 0;
 	}
-	
-	SAFE_FREE(section);
+
 	return 1;
 }
 
@@ -359,8 +521,8 @@ common_handler(void *user, const char *section, const char *name, const char *va
 	
 	#define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
 	if (MATCH("common", "server_addr")) {
-		SAFE_FREE(config->server_addr);
-		config->server_addr = strdup(value);
+		xfrpc_free(config->server_addr);
+		config->server_addr = xfrpc_strdup(ALLOC_CONFIG, value);
 		assert(config->server_addr);
 	} else if (MATCH("common", "server_port")) {
 		config->server_port = atoi(value);
@@ -369,12 +531,89 @@ common_handler(void *user, const char *section, const char *name, const char *va
 	} else if (MATCH("common", "heartbeat_timeout")) {
 		config->heartbeat_timeout = atoi(value);
 	} else if (MATCH("common", "token")) {
-		SAFE_FREE(config->auth_token);
-		config->auth_token = strdup(value);
+		xfrpc_free(config->auth_token);
+		config->auth_token = xfrpc_strdup(ALLOC_CONFIG, value);
 		assert(config->auth_token);
 	} else if (MATCH("common", "tcp_mux")) {
 		config->tcp_mux = atoi(value);
 		config->tcp_mux = !!config->tcp_mux;
+	} else if (MATCH("common", "http_cache_size")) {
+		config->http_cache_size = strtoul(value, NULL, 10);
+	} else if (MATCH("common", "crypto_threads")) {
+		config->crypto_threads = atoi(value);
+	} else if (MATCH("common", "crypto_offload_size")) {
+		config->crypto_offload_size = strtoul(value, NULL, 10);
+	} else if (MATCH("common", "tls_enable")) {
+		config->tls_enable = is_true(value);
+	} else if (MATCH("common", "tls_cert_file")) {
+		xfrpc_free(config->tls_cert_file);
+		config->tls_cert_file = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->tls_cert_file);
+	} else if (MATCH("common", "tls_key_file")) {
+		xfrpc_free(config->tls_key_file);
+		config->tls_key_file = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->tls_key_file);
+	} else if (MATCH("common", "tls_trusted_ca_file")) {
+		xfrpc_free(config->tls_trusted_ca_file);
+		config->tls_trusted_ca_file = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->tls_trusted_ca_file);
+	} else if (MATCH("common", "tls_server_name")) {
+		xfrpc_free(config->tls_server_name);
+		config->tls_server_name = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->tls_server_name);
+	} else if (MATCH("common", "disable_custom_tls_first_byte")) {
+		config->disable_custom_tls_first_byte = is_true(value);
+	} else if (MATCH("common", "protocol")) {
+		if (strcmp(value, "tcp") == 0) {
+			config->protocol = PROTOCOL_TCP;
+		} else if (strcmp(value, "kcp") == 0) {
+			config->protocol = PROTOCOL_KCP;
+		} else {
+			debug(LOG_ERR, "protocol %s is not supportted", value);
+			exit(0);
+		}
+	} else if (MATCH("common", "kcp_nodelay")) {
+		config->kcp_nodelay = atoi(value);
+	} else if (MATCH("common", "kcp_interval")) {
+		config->kcp_interval = atoi(value);
+	} else if (MATCH("common", "kcp_resend")) {
+		config->kcp_resend = atoi(value);
+	} else if (MATCH("common", "kcp_nc")) {
+		config->kcp_nc = atoi(value);
+	} else if (MATCH("common", "kcp_snd_wnd")) {
+		config->kcp_snd_wnd = atoi(value);
+	} else if (MATCH("common", "kcp_rcv_wnd")) {
+		config->kcp_rcv_wnd = atoi(value);
+	} else if (MATCH("common", "kcp_mtu")) {
+		config->kcp_mtu = atoi(value);
+	} else if (MATCH("common", "bandwidth_limit")) {
+		config->bandwidth_limit = parse_bandwidth(value);
+	} else if (MATCH("common", "setup_slow_ms")) {
+		config->setup_slow_ms = atoi(value);
+	} else if (MATCH("common", "flight_recorder")) {
+		config->flight_recorder = !!atoi(value);
+	} else if (MATCH("common", "capture_file")) {
+		xfrpc_free(config->capture_file);
+		config->capture_file = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->capture_file);
+	} else if (MATCH("common", "replay_file")) {
+		xfrpc_free(config->replay_file);
+		config->replay_file = xfrpc_strdup(ALLOC_CONFIG, value);
+		assert(config->replay_file);
+	} else if (MATCH("common", "replay_max_speed")) {
+		config->replay_max_speed = !!atoi(value);
+	} else if (MATCH("common", "tcp_info_interval")) {
+		config->tcp_info_interval = atoi(value);
+	} else if (MATCH("common", "tcp_rtt_warn_ms")) {
+		config->tcp_rtt_warn_ms = atoi(value);
+	} else if (MATCH("common", "tcp_retrans_warn")) {
+		config->tcp_retrans_warn = atoi(value);
+	} else if (MATCH("common", "tcp_redial_rtt_ms")) {
+		config->tcp_redial_rtt_ms = atoi(value);
+	} else if (MATCH("common", "rotate_drain_timeout")) {
+		config->rotate_drain_timeout = atoi(value);
+	} else if (MATCH("common", "sockmap")) {
+		config->sockmap = !!atoi(value);
 	}
 	return 1;
 }
@@ -385,12 +624,35 @@ init_common_conf(struct common_conf *config)
 	if (!config)
 		return;
 	
-	config->server_addr			= strdup("0.0.0.0");
+	config->server_addr			= xfrpc_strdup(ALLOC_CONFIG, "0.0.0.0");
 	assert(config->server_addr);
 	config->server_port			= 7000;
 	config->heartbeat_interval 	= 30;
 	config->heartbeat_timeout	= 90;
 	config->tcp_mux				= 1;
+	config->http_cache_size		= 0;
+	config->crypto_threads		= 0;
+	config->crypto_offload_size	= 16384;
+	config->tls_enable			= 0;
+	config->disable_custom_tls_first_byte = 0;
+	config->protocol			= PROTOCOL_TCP;
+	config->kcp_nodelay			= 1;
+	config->kcp_interval		= 20;
+	config->kcp_resend			= 2;
+	config->kcp_nc				= 1;
+	config->kcp_snd_wnd			= 128;
+	config->kcp_rcv_wnd			= 512;
+	config->kcp_mtu				= 1350;
+	config->bandwidth_limit		= 0;
+	config->setup_slow_ms		= 0;
+	config->flight_recorder		= 1;
+	config->replay_max_speed	= 0;
+	config->tcp_info_interval	= 0;
+	config->tcp_rtt_warn_ms		= 500;
+	config->tcp_retrans_warn	= 10;
+	config->tcp_redial_rtt_ms	= 0;
+	config->rotate_drain_timeout	= 0;
+	config->sockmap				= 0;
 	config->is_router			= 0;
 }
 
@@ -399,7 +661,7 @@ init_common_conf(struct common_conf *config)
 char *get_ftp_data_proxy_name(const char *ftp_proxy_name)
 {
 	char *ftp_tail_data_name = FTP_RMT_CTL_PROXY_SUFFIX;
-	char *ftp_data_proxy_name = (char *)calloc(1, 
+	char *ftp_data_proxy_name = (char *)xfrpc_calloc(ALLOC_CONFIG, 
 								strlen(ftp_proxy_name)+strlen(ftp_tail_data_name)+1);
 	assert(ftp_data_proxy_name);
 
@@ -412,16 +674,75 @@ char *get_ftp_data_proxy_name(const char *ftp_proxy_name)
 	return ftp_data_proxy_name;
 }
 
+static int 
+config_handler(void *user, const char *section, const char *name, const char *value)
+{
+	struct config_parse_ctx *ctx = (struct config_parse_ctx *)user;
+
+	if (strcmp(section, "common") == 0)
+		return ctx->common ? common_handler(ctx->common, section, name, value) : 1;
+
+	return proxy_service_handler(ctx, section, name, value);
+}
+
+// map the whole config file and parse it in one pass
+// return 0 if confile can not be read
+static int 
+parse_config_file(const char *confile, struct config_parse_ctx *ctx)
+{
+	struct stat st;
+	int nret = 0;
+	int fd = open(confile, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) < 0)
+		goto PARSE_END;
+
+	if (st.st_size == 0) {
+		nret = 1;
+		goto PARSE_END;
+	}
+
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto PARSE_END;
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	nret = ini_parse_buffer(data, st.st_size, config_handler, ctx) >= 0;
+	munmap(data, st.st_size);
+
+PARSE_END:
+	close(fd);
+	return nret;
+}
+
+// finish parsed proxy services, return 0 if any of them is invalid
+static int 
+init_parsed_proxy_services(struct config_parse_ctx *ctx)
+{
+	if (ctx->error || !init_all_ps(&ctx->ps_hash)) {
+		free_all_ps(&ctx->ps_hash);
+		return 0;
+	}
+
+	return 1;
+}
+
 void load_config(const char *confile)
 {
-	c_conf = (struct common_conf *)calloc(sizeof(struct common_conf), 1);
+	config_file = xfrpc_strdup(ALLOC_CONFIG, confile);
+	assert(config_file);
+
+	c_conf = (struct common_conf *)xfrpc_calloc(ALLOC_CONFIG, sizeof(struct common_conf));
 	assert(c_conf);
 	
 	init_common_conf(c_conf);
 
 	debug(LOG_DEBUG, "Reading configuration file '%s'", confile);
 	
-	if (ini_parse(confile, common_handler, c_conf) < 0) {
+	struct config_parse_ctx ctx = { .common = c_conf };
+	if (!parse_config_file(confile, &ctx)) {
 		debug(LOG_ERR, "Config file parse failed");
 		exit(0);
 	}
@@ -438,9 +759,42 @@ void load_config(const char *confile)
 		exit(0);
 	}
 	
-	ini_parse(confile, proxy_service_handler, NULL);
-	
-	dump_all_ps();
+	if (!init_parsed_proxy_services(&ctx)) {
+		debug(LOG_ERR, "Error: proxy services config invalid");
+		exit(-1);
+	}
+	all_ps = ctx.ps_hash;
+}
+
+// re-read proxy sections of the config file loaded by load_config
+// [common] section is not reloaded, it requires restart
+// return 0 if the new config is invalid, the running config should be kept
+int
+reload_proxy_services(struct proxy_service **ps_hash)
+{
+	debug(LOG_INFO, "Reloading configuration file '%s'", config_file);
+
+	struct config_parse_ctx ctx = { .common = NULL };
+	if (!parse_config_file(config_file, &ctx) || !init_parsed_proxy_services(&ctx)) {
+		debug(LOG_ERR, "Config file reload failed, keep running config");
+		return 0;
+	}
+
+	*ps_hash = ctx.ps_hash;
+	return 1;
+}
+
+void
+add_proxy_service(struct proxy_service *ps)
+{
+	HASH_ADD_KEYPTR(hh, all_ps, ps->proxy_name, strlen(ps->proxy_name), ps);
+}
+
+void
+del_proxy_service(struct proxy_service *ps)
+{
+	HASH_DEL(all_ps, ps);
+	free_proxy_service(ps);
 }
 
 int is_running_in_router()
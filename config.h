@@ -33,6 +33,11 @@
 #define DEFAULT_SOCKS5_PORT		1980
 #define FTP_RMT_CTL_PROXY_SUFFIX	"_ftp_remote_ctl_proxy"
 
+enum transport_protocol {
+	PROTOCOL_TCP = 0,
+	PROTOCOL_KCP,
+};
+
 //client common config
 struct common_conf {
 	char	*server_addr; 	/* default 0.0.0.0 */
@@ -41,6 +46,35 @@ struct common_conf {
 	int		heartbeat_interval; /* default 10 */
 	int		heartbeat_timeout;	/* default 30 */
 	int 	tcp_mux;		/* default 0 */
+	size_t 	http_cache_size;	/* bytes of http proxy response cache, default 0 disabled */
+	int 	crypto_threads;		/* workers encrypting bulk data of work connections, default 0 inline */
+	size_t 	crypto_offload_size;	/* data smaller than it is encrypted inline, default 16384 */
+	int 	tls_enable;		/* connect frps through tls, default 0 */
+	char	*tls_cert_file;		/* client certificate sent to frps */
+	char	*tls_key_file;
+	char	*tls_trusted_ca_file;	/* frps is verified only if it is set */
+	char	*tls_server_name;	/* default server_addr */
+	int 	disable_custom_tls_first_byte;	/* default 0, 1 allows kernel tls */
+	int 	protocol;		/* transport to frps, tcp or kcp, default tcp */
+	int 	kcp_nodelay;	/* kcp tunables, default as frpc: 1 */
+	int 	kcp_interval;	/* ms, default 20 */
+	int 	kcp_resend;		/* default 2 */
+	int 	kcp_nc;			/* no congestion window, default 1 */
+	int 	kcp_snd_wnd;	/* default 128 */
+	int 	kcp_rcv_wnd;	/* default 512 */
+	int 	kcp_mtu;		/* default 1350 */
+	size_t 	bandwidth_limit;	/* bytes per second of all proxies to frps, default 0 unlimited */
+	int 	setup_slow_ms;	/* log work connection setup slower than it, default 0 disabled */
+	int 	flight_recorder;	/* record tcp_mux stream events for dump on SIGUSR1, default 1 */
+	char	*capture_file;		/* append bytes read from frps to it */
+	char	*replay_file;		/* replay capture instead of connecting frps */
+	int 	replay_max_speed;	/* replay as fast as possible, default 0 recorded speed */
+	int 	tcp_info_interval;	/* seconds between TCP_INFO samples, default 0 disabled */
+	int 	tcp_rtt_warn_ms;	/* log connection with rtt above it, default 500 */
+	int 	tcp_retrans_warn;	/* log connection retransmitting it between samples, default 10 */
+	int 	tcp_redial_rtt_ms;	/* redial frps when control rtt stays above it, default 0 disabled */
+	int 	rotate_drain_timeout;	/* seconds streams drain on a rotated session, default 0 no rotation */
+	int 	sockmap;			/* relay pass-through pairs in kernel with bpf sockmap, default 0 */
 
 	/* private fields */
 	int 	is_router;	// to sign router (Openwrt/LEDE) or not
@@ -62,4 +96,14 @@ struct proxy_service *get_all_proxy_services();
 
 int validate_proxy(struct proxy_service *ps);
 
+int proxy_service_equal(const struct proxy_service *a, const struct proxy_service *b);
+
+int reload_proxy_services(struct proxy_service **ps_hash);
+
+void add_proxy_service(struct proxy_service *ps);
+
+void del_proxy_service(struct proxy_service *ps);
+
+void free_proxy_service(struct proxy_service *ps);
+
 #endif //_CONFIG_H_
@@ -31,11 +31,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <json-c/json.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <event2/bufferevent_ssl.h>
 
 #include "debug.h"
 #include "client.h"
@@ -49,17 +54,40 @@
 #include "common.h"
 #include "login.h"
 #include "tcpmux.h"
-
-static struct control *main_ctl;
-static int client_connected = 0;
-static int is_login = 0;
-static time_t pong_time = 0;
+#include "tcp_redir.h"
+#include "instance.h"
+#include "xfrpc.h"
+#include "crypto_pool.h"
+#include "kcp.h"
+#include "ratelimit.h"
+#include "latency.h"
+#include "replay.h"
+#include "tcpinfo.h"
+#include "proxy.h"
+#include "alloc.h"
+#include "mempressure.h"
+
+// per instance state
+#define main_ctl 			(cur_instance->main_ctl)
+#define client_connected 	(cur_instance->client_connected)
+#define is_login 			(cur_instance->is_login)
+#define pong_time 			(cur_instance->pong_time)
+#define retry_times 		(cur_instance->retry_times)
+#define tmux_hdr 			(cur_instance->tmux_hdr)
+#define stream_len 			(cur_instance->stream_len)
+#define abandon_stream 		(cur_instance->abandon_stream)
 
 static void new_work_connection(struct bufferevent *bev, struct tmux_stream *stream);
 static void recv_cb(struct bufferevent *bev, void *ctx);
 static void clear_main_control();
 static void start_base_connect();
 static void keep_control_alive();
+static void log_frps_tls(struct bufferevent *bev);
+static void control_recv_cb(struct bufferevent *bev, void *ctx);
+static void retire_session(struct xfrpc_instance *old);
+
+// first byte frps expects before tls client hello
+#define FRP_TLS_HEAD_BYTE	0x17
 
 static int 
 is_client_connected()
@@ -95,6 +123,7 @@ client_start_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
 	struct proxy_client *client = ctx;
 	assert(client);
+	set_cur_instance(client->inst);
 	struct common_conf 	*c_conf = get_common_config();
 
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
@@ -107,9 +136,12 @@ client_start_event_cb(struct bufferevent *bev, short what, void *ctx)
 		bufferevent_free(bev);
 		del_proxy_client_by_stream_id(client->stream_id);
 	} else if (what & BEV_EVENT_CONNECTED) {
+		log_frps_tls(bev);
+		trace_setup_phase(client, SETUP_FRPS_CONNECTED);
 		bufferevent_setcb(bev, recv_cb, NULL, client_start_event_cb, client);
 		bufferevent_enable(bev, EV_READ|EV_WRITE);
 		new_work_connection(bev, &main_ctl->stream);
+		trace_setup_phase(client, SETUP_NEW_WORK_CONN);
 		set_client_status(1);
 		debug(LOG_INFO, "proxy service start");
 	}
@@ -122,16 +154,18 @@ new_client_connect()
 	struct common_conf *c_conf = get_common_config();
 	assert(c_conf);
 	client->base = main_ctl->connect_base;
+	trace_setup_phase(client, SETUP_REQ_WORK_CONN);
 	
 	if (c_conf->tcp_mux) {
 		debug(LOG_DEBUG, "new client through tcp mux: %d", client->stream_id);
 		client->ctl_bev 	= main_ctl->connect_bev;
 		send_window_update(client->ctl_bev, &client->stream, 0);
 		new_work_connection(client->ctl_bev, &client->stream);
+		trace_setup_phase(client, SETUP_NEW_WORK_CONN);
 		return;
 	}
 
-	struct bufferevent *bev = connect_server(client->base, c_conf->server_addr, c_conf->server_port);
+	struct bufferevent *bev = connect_frps(client->base);
 	if (!bev) {
 		debug(LOG_DEBUG, "Connect server [%s:%d] failed", c_conf->server_addr, c_conf->server_port);
 		return;
@@ -162,7 +196,7 @@ start_proxy_services()
 			debug(LOG_ERR, "proxy service is invalid!");
 			return;
 		}
-		if (strcmp(ps->proxy_type, "mstsc") == 0) {
+		if (ps->type == PROXY_TYPE_MSTSC) {
 			debug(LOG_ERR, "no need to send mstsc service!");
 			continue;
 		}
@@ -206,7 +240,7 @@ new_work_connection(struct bufferevent *bev, struct tmux_stream *stream)
 
 	send_msg_frp_server(bev, TypeNewWorkConn, new_work_conn_request_message, nret, stream);
 
-	SAFE_FREE(new_work_conn_request_message);
+	xfrpc_free(new_work_conn_request_message);
 	SAFE_FREE(work_c);
 }
 
@@ -224,6 +258,168 @@ connect_server(struct event_base *base, const char *name, const int port)
 	return bev;
 }
 
+// keep the session ticket frps issued, next connection resumes it and skips
+// the full handshake. callback may run while another instance is current
+static int
+frps_tls_new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	struct xfrpc_instance *prev = cur_instance;
+	set_cur_instance(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	if (main_ctl->tls_session)
+		SSL_SESSION_free(main_ctl->tls_session);
+	main_ctl->tls_session = sess;
+	set_cur_instance(prev);
+	return 1;	// reference of sess is kept
+}
+
+static SSL_CTX *
+new_frps_tls_ctx()
+{
+	struct common_conf *c_conf = get_common_config();
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	assert(ctx);
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	// like frpc, frps is verified only when trusted ca is configured
+	if (c_conf->tls_trusted_ca_file) {
+		if (!SSL_CTX_load_verify_locations(ctx, c_conf->tls_trusted_ca_file, NULL)) {
+			debug(LOG_ERR, "load tls trusted ca file [%s] failed", c_conf->tls_trusted_ca_file);
+			exit(0);
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	if (c_conf->tls_cert_file && c_conf->tls_key_file) {
+		if (!SSL_CTX_use_certificate_chain_file(ctx, c_conf->tls_cert_file) ||
+			!SSL_CTX_use_PrivateKey_file(ctx, c_conf->tls_key_file, SSL_FILETYPE_PEM)) {
+			debug(LOG_ERR, "load tls cert file [%s] or key file [%s] failed", 
+				c_conf->tls_cert_file, c_conf->tls_key_file);
+			exit(0);
+		}
+	}
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, frps_tls_new_session_cb);
+	SSL_CTX_set_app_data(ctx, cur_instance);
+#ifdef SSL_OP_ENABLE_KTLS
+	// record crypto moves to kernel once handshake is done, only when tls
+	// runs directly on the socket
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	return ctx;
+}
+
+static SSL *
+new_frps_ssl()
+{
+	struct common_conf *c_conf = get_common_config();
+	const char *name = c_conf->tls_server_name ? c_conf->tls_server_name : c_conf->server_addr;
+
+	SSL *ssl = SSL_new(main_ctl->tls_ctx);
+	if (!ssl)
+		return NULL;
+
+	if (!is_valid_ip_address(name))
+		SSL_set_tlsext_host_name(ssl, name);
+	if (c_conf->tls_trusted_ca_file)
+		SSL_set1_host(ssl, name);
+
+	if (main_ctl->tls_session && SSL_SESSION_is_resumable(main_ctl->tls_session))
+		SSL_set_session(ssl, main_ctl->tls_session);
+	return ssl;
+}
+
+// plain stream to frps over the configured transport
+static struct bufferevent *
+connect_frps_transport(struct event_base *base)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (c_conf->protocol == PROTOCOL_KCP)
+		return connect_kcp_server(base, main_ctl->dnsbase, c_conf->server_addr, c_conf->server_port);
+
+	return connect_server(base, c_conf->server_addr, c_conf->server_port);
+}
+
+// connect frps, through tls if tls_enable
+struct bufferevent *
+connect_frps(struct event_base *base)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!main_ctl->tls_ctx)
+		return connect_frps_transport(base);
+
+	SSL *ssl = new_frps_ssl();
+	if (!ssl)
+		return NULL;
+
+	struct bufferevent *bev = NULL;
+	if (c_conf->disable_custom_tls_first_byte && c_conf->protocol == PROTOCOL_TCP) {
+		// tls on the socket itself, kernel tls can take it over
+		bev = bufferevent_openssl_socket_new(base, -1, ssl, 
+					BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+		assert(bev);
+		if (bufferevent_socket_connect_hostname(bev, main_ctl->dnsbase, 
+							AF_INET, c_conf->server_addr, c_conf->server_port) < 0) {
+			bufferevent_free(bev);
+			return NULL;
+		}
+	} else {
+		// handshake starts once the transport is connected
+		struct bufferevent *under = connect_frps_transport(base);
+		if (!under) {
+			SSL_free(ssl);
+			return NULL;
+		}
+		// frps tells tls from plain connection by the first byte before client hello
+		if (!c_conf->disable_custom_tls_first_byte) {
+			uint8_t first_byte = FRP_TLS_HEAD_BYTE;
+			bufferevent_write(under, &first_byte, 1);
+		}
+		bev = bufferevent_openssl_filter_new(base, under, ssl, 
+					BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+		assert(bev);
+	}
+
+	// frps may close without close_notify
+	bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+	return bev;
+}
+
+static void
+log_frps_tls(struct bufferevent *bev)
+{
+	SSL *ssl = bufferevent_openssl_get_ssl(bev);
+	if (!ssl)
+		return;
+
+	debug(LOG_DEBUG, "%s with frps, session %s", SSL_get_version(ssl), 
+		SSL_session_reused(ssl) ? "resumed" : "new");
+}
+
+// connect local service listening on unix domain socket path
+struct bufferevent *
+connect_unix_server(struct event_base *base, const char *path)
+{
+	struct sockaddr_un sun;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		debug(LOG_ERR, "unix socket path [%s] too long", path);
+		return NULL;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	assert(bev);
+
+	if (bufferevent_socket_connect(bev, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+	return bev;
+}
+
 static void 
 set_ticker_ping_timer(struct event *timeout)
 {
@@ -237,12 +433,18 @@ set_ticker_ping_timer(struct event *timeout)
 static void 
 hb_sender_cb(evutil_socket_t fd, short event, void *arg)
 {
+	set_cur_instance(arg);
 	if (is_client_connected()) {
 		debug(LOG_INFO, "ping frps");
 		ping(NULL);
 	}
 
 	set_ticker_ping_timer(main_ctl->ticker_ping);	
+
+	// draining session ends on its own or at rotate_drain_timeout, pongs stop
+	// once frps hands its proxies to the new session
+	if (cur_instance->rotated_from)
+		return;
 	
 	struct common_conf 	*c_conf = get_common_config();
 	time_t current_time = time(NULL);
@@ -250,9 +452,7 @@ hb_sender_cb(evutil_socket_t fd, short event, void *arg)
 	if (pong_time && interval > c_conf->heartbeat_timeout) {
 		debug(LOG_INFO, " interval [%d] greater than heartbeat_timeout [%d]", interval, c_conf->heartbeat_timeout);
 
-		reset_session_id();
-		clear_main_control();
-		run_control();
+		redial_main_control();
 		return;
 	}
 }
@@ -353,10 +553,20 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 	switch(cmd_type) {
 	case TypeReqWorkConn: 
 	{
+		// proxies belong to the new session once it logged in
+		if (cur_instance->rotated_from && cur_instance->rotated_from->c_login->logged) {
+			debug(LOG_INFO, "draining session refuses work connection");
+			break;
+		}
 		if (! is_client_connected()) {
 			start_proxy_services();
 			set_client_status(1);
 		}
+		// the user connection fails fast, frps asks again for the next one
+		if (get_mem_level() >= MEM_HARD) {
+			debug(LOG_WARNING, "memory pressure is hard, refuse work connection");
+			break;
+		}
 		new_client_connect();
 		break;
 	}
@@ -392,6 +602,11 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 		assert(ctx);
 		struct proxy_client *client = ctx;
 		client->ps = ps;
+		if (sr->src_addr) {
+			snprintf(client->src_addr, sizeof(client->src_addr), "%s", sr->src_addr);
+			SAFE_FREE(sr->src_addr);
+		}
+		trace_setup_phase(client, SETUP_START_WORK_CONN);
 		int r_len = len - sizeof(struct msg_hdr) - msg_hton(msg->length); 
 		debug(LOG_DEBUG, 
 			"proxy service [%s] [%s:%d] start work connection. remain data length %d", 
@@ -399,9 +614,16 @@ handle_control_work(const uint8_t *buf, int len, void *ctx)
 			ps->local_ip, 
 			ps->local_port,
 			r_len);
+		if (ps->use_encryption && !(client->crypto = new_work_crypto(client))) {
+			del_proxy_client_by_stream_id(client->stream_id);
+			break;
+		}
 		if (r_len > 0) {
 			client->data_tail_size = r_len;
 			client->data_tail = msg->data + msg_hton(msg->length);
+			if (client->crypto)
+				client->data_tail_size = work_crypto_decrypt_tail(client->crypto, 
+											&client->data_tail, r_len);
 			debug(LOG_DEBUG, "data_tail is %s", client->data_tail); 
 		}
 		start_xfrp_tunnel(client);
@@ -478,13 +700,14 @@ handle_frps_msg(uint8_t *buf, int len, void *ctx)
 	}	
 }
 
-static struct tmux_stream abandon_stream;
-
 // ctx: if recv_cb was called by common control, ctx == NULL
 //		else ctx == client struct
 static void 
 recv_cb(struct bufferevent *bev, void *ctx)
 {
+	if (ctx)
+		set_cur_instance(((struct proxy_client *)ctx)->inst);
+
 	struct evbuffer *input = bufferevent_get_input(bev);
 	int len = evbuffer_get_length(input);
 	if (len <= 0) {
@@ -493,8 +716,6 @@ recv_cb(struct bufferevent *bev, void *ctx)
 
 	struct common_conf 	*c_conf = get_common_config();
 	if (c_conf->tcp_mux) {
-		static struct tcp_mux_header tmux_hdr;
-		static uint32_t stream_len = 0;
 		while (len > 0) {
 				struct tmux_stream *cur = get_cur_stream();
 				size_t nr = 0;
@@ -582,30 +803,48 @@ recv_cb(struct bufferevent *bev, void *ctx)
 				set_cur_stream(NULL);
 		}
 	} else {	
-		uint8_t *buf = calloc(len, 1);
+		uint8_t *buf = xfrpc_calloc(ALLOC_MSG, len);
 		assert(buf);
 		evbuffer_remove(input, buf, len);
 
 		handle_frps_msg(buf, len, ctx);
-		SAFE_FREE(buf);
+		xfrpc_free(buf);
 	}
 		
 
 	return;
 }
 
+// recv_cb of control connection, ctx is its instance
+static void 
+control_recv_cb(struct bufferevent *bev, void *ctx)
+{
+	set_cur_instance(ctx);
+	struct evbuffer *input = bufferevent_get_input(bev);
+	capture_recv(input);
+	recv_cb(bev, NULL);
+	capture_consumed(input);
+}
+
+static void
+reconnect_cb(evutil_socket_t fd, short what, void *arg)
+{
+	set_cur_instance(arg);
+	run_control();
+}
+
+// ctx is instance of the control connection
 static void 
 connect_event_cb (struct bufferevent *bev, short what, void *ctx)
 {
+	set_cur_instance(ctx);
 	struct common_conf 	*c_conf = get_common_config();
-	static int retry_times = 1;
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
 		if (retry_times >= 100) {
 			debug(LOG_INFO, 
 				"have retry connect to xfrp server for %d times, exit?", 
 				retry_times);
 		}
-		sleep(2);
 		retry_times++;
 		debug(LOG_ERR, "error: connect server [%s:%d] failed %s", 
 				c_conf->server_addr, 
@@ -613,10 +852,15 @@ connect_event_cb (struct bufferevent *bev, short what, void *ctx)
 				strerror(errno));
 		reset_session_id();
 		clear_main_control();
-		run_control();
+		// retry later without blocking other instances sharing the loop
+		struct timeval tv = {2, 0};
+		event_base_once(main_ctl->connect_base, -1, EV_TIMEOUT, reconnect_cb, cur_instance, &tv);
 	} else if (what & BEV_EVENT_CONNECTED) {
 		debug(LOG_DEBUG, "xfrp server connected");
+		log_frps_tls(bev);
 		retry_times = 0;
+		start_capture();
+		start_tcp_path_monitor();
 		send_window_update(bev, &main_ctl->stream, 0);
 		login();
 		
@@ -628,7 +872,8 @@ static void
 keep_control_alive() 
 {
 	debug(LOG_DEBUG, "start keep_control_alive");
-	main_ctl->ticker_ping = evtimer_new(main_ctl->connect_base, hb_sender_cb, NULL);
+	if (!main_ctl->ticker_ping)
+		main_ctl->ticker_ping = evtimer_new(main_ctl->connect_base, hb_sender_cb, cur_instance);
 	if ( !main_ctl->ticker_ping) {
 		debug(LOG_ERR, "Ping Ticker init failed!");
 		return;
@@ -644,9 +889,11 @@ start_base_connect()
 	if (main_ctl->connect_bev)
 		bufferevent_free(main_ctl->connect_bev);
 
-	main_ctl->connect_bev = connect_server(main_ctl->connect_base, 
-						c_conf->server_addr, 
-						c_conf->server_port);
+	// replay feeds a capture instead of frps
+	if (c_conf->replay_file)
+		main_ctl->connect_bev = open_replay(main_ctl->connect_base);
+	else
+		main_ctl->connect_bev = connect_frps(main_ctl->connect_base);
 	if ( ! main_ctl->connect_bev) {
 		debug(LOG_ERR, "error: connect server [%s:%d] failed: [%d: %s]", 
 						c_conf->server_addr, c_conf->server_port, errno, strerror(errno));
@@ -655,7 +902,9 @@ start_base_connect()
 
 	debug(LOG_INFO, "connect server [%s:%d]...", c_conf->server_addr, c_conf->server_port);
 	bufferevent_enable(main_ctl->connect_bev, EV_WRITE|EV_READ);
-	bufferevent_setcb(main_ctl->connect_bev, recv_cb, NULL, connect_event_cb, NULL);
+	bufferevent_setcb(main_ctl->connect_bev, control_recv_cb, NULL, connect_event_cb, cur_instance);
+	if (c_conf->replay_file)
+		connect_event_cb(main_ctl->connect_bev, BEV_EVENT_CONNECTED, cur_instance);
 }
 
 void 
@@ -670,7 +919,7 @@ login()
 	}
 	
 	send_msg_frp_server(NULL, TypeLogin, lg_msg, len, &main_ctl->stream);
-	SAFE_FREE(lg_msg);
+	xfrpc_free(lg_msg);
 }
 
 void 
@@ -693,7 +942,7 @@ send_msg_frp_server(struct bufferevent *bev,
 	debug(LOG_DEBUG, "send plain msg ----> [%c: %s]", type, msg);
 	
 	size_t len = msg_len + sizeof(struct msg_hdr);
-	struct msg_hdr *req_msg = calloc(len, 1);
+	struct msg_hdr *req_msg = xfrpc_calloc(ALLOC_MSG, len);
 	assert(req_msg);
 	req_msg->type = type;
 	req_msg->length = msg_hton((uint64_t)msg_len);
@@ -705,7 +954,7 @@ send_msg_frp_server(struct bufferevent *bev,
 	else
 		bufferevent_write(bout, (uint8_t *)req_msg, len);
 	
-	free(req_msg);
+	xfrpc_free(req_msg);
 }
 
 void 
@@ -723,7 +972,7 @@ send_enc_msg_frp_server(struct bufferevent *bev,
 	}
 	assert(bout);
 
-	struct msg_hdr *req_msg = calloc(msg_len+sizeof(struct msg_hdr), 1);
+	struct msg_hdr *req_msg = xfrpc_calloc(ALLOC_MSG, msg_len+sizeof(struct msg_hdr));
 	assert(req_msg);
 	req_msg->type = type;
 	req_msg->length = msg_hton((uint64_t)msg_len);
@@ -747,7 +996,7 @@ send_enc_msg_frp_server(struct bufferevent *bev,
 		bufferevent_write(bout, enc_msg, olen);
 
 	free(enc_msg);	
-	free(req_msg);
+	xfrpc_free(req_msg);
 }
 
 struct control *
@@ -760,7 +1009,7 @@ void
 start_login_frp_server(struct event_base *base)
 {
 	struct common_conf *c_conf = get_common_config();
-	struct bufferevent *bev = connect_server(base, c_conf->server_addr, c_conf->server_port);
+	struct bufferevent *bev = connect_frps(base);
 	if (!bev) {
 		debug(LOG_DEBUG, 
 			"Connect server [%s:%d] failed", 
@@ -772,7 +1021,7 @@ start_login_frp_server(struct event_base *base)
 	debug(LOG_INFO, "Xfrpc login: connect server [%s:%d] ...", c_conf->server_addr, c_conf->server_port);
 
 	bufferevent_enable(bev, EV_WRITE|EV_READ);
-	bufferevent_setcb(bev, NULL, NULL, connect_event_cb, NULL);
+	bufferevent_setcb(bev, NULL, NULL, connect_event_cb, cur_instance);
 }
 
 void 
@@ -793,43 +1042,173 @@ send_new_proxy(struct proxy_service *ps)
 	debug(LOG_DEBUG, "control proxy client: [Type %d : proxy_name %s : msg_len %d]", TypeNewProxy, ps->proxy_name, len);
 
 	send_enc_msg_frp_server(NULL, TypeNewProxy, new_proxy_msg, len, &main_ctl->stream);
-	SAFE_FREE(new_proxy_msg);
+	xfrpc_free(new_proxy_msg);
+}
+
+void 
+send_close_proxy(struct proxy_service *ps)
+{
+	if (! ps) {
+		debug(LOG_ERR, "proxy service is invalid!");
+		return;
+	}
+
+	char *close_proxy_msg = NULL;
+	int len = close_proxy_marshal(ps->proxy_name, &close_proxy_msg);
+	if ( ! close_proxy_msg) {
+		debug(LOG_ERR, "close proxy request marshal failed");
+		return;
+	}
+
+	debug(LOG_DEBUG, "control proxy client: [Type %d : proxy_name %s : msg_len %d]", TypeCloseProxy, ps->proxy_name, len);
+
+	send_enc_msg_frp_server(NULL, TypeCloseProxy, close_proxy_msg, len, &main_ctl->stream);
+	xfrpc_free(close_proxy_msg);
+}
+
+static int
+is_mstsc_proxy(const struct proxy_service *ps)
+{
+	return ps->type == PROXY_TYPE_MSTSC;
+}
+
+// ftp data proxy follows its ftp control proxy: it is kept when the control one is unchanged
+static int
+is_proxy_service_unchanged(struct proxy_service *ps, struct proxy_service *new_ps_hash)
+{
+	struct proxy_service *nps = NULL;
+	const char *name = ps->ftp_cfg_proxy_name ? ps->ftp_cfg_proxy_name : ps->proxy_name;
+
+	HASH_FIND_STR(new_ps_hash, name, nps);
+	if (!nps)
+		return 0;
+
+	struct proxy_service *cfg_ps = ps->ftp_cfg_proxy_name ? get_proxy_service(name) : ps;
+	if (!cfg_ps || !proxy_service_equal(cfg_ps, nps))
+		return 0;
+
+	// bandwidth_limit is changed in place, connections are kept
+	set_proxy_bandwidth_limit(ps, nps->bandwidth_limit);
+	return 1;
+}
+
+static void
+unregister_proxy_service(struct proxy_service *ps)
+{
+	if (is_client_connected() && !is_mstsc_proxy(ps))
+		send_close_proxy(ps);
+
+	close_proxy_clients(ps);
+	del_proxy_service(ps);
+}
+
+static void
+register_proxy_service(struct proxy_service *ps)
+{
+	add_proxy_service(ps);
+
+	if (is_mstsc_proxy(ps))
+		start_tcp_redir_service(ps);
+	else if (is_client_connected())
+		send_new_proxy(ps);
+}
+
+// reload proxy sections of config file and register the difference to frps:
+// removed or changed proxy services are closed, new or changed ones are registered,
+// unchanged proxy services and their working clients are untouched
+void
+reload_proxy_config()
+{
+	struct proxy_service *new_ps_hash = NULL;
+	if (!reload_proxy_services(&new_ps_hash))
+		return;
+
+	// clients of a draining session refer to proxies which may be freed
+	if (cur_instance->draining)
+		retire_session(cur_instance->draining);
+
+	struct proxy_service *all_ps = get_all_proxy_services();
+	struct proxy_service *ps = NULL, *nps = NULL, *tmp = NULL;
+	int nclose = 0, nnew = 0;
+
+	HASH_ITER(hh, all_ps, ps, tmp) {
+		if (is_proxy_service_unchanged(ps, new_ps_hash))
+			continue;
+
+		if (is_mstsc_proxy(ps)) {
+			debug(LOG_WARNING, "mstsc proxy [%s] can not be reloaded, it requires restart", ps->proxy_name);
+			continue;
+		}
+
+		debug(LOG_INFO, "unregister proxy service [%s]", ps->proxy_name);
+		unregister_proxy_service(ps);
+		nclose++;
+	}
+
+	HASH_ITER(hh, new_ps_hash, nps, tmp) {
+		HASH_DEL(new_ps_hash, nps);
+		if (get_proxy_service(nps->proxy_name)) {
+			free_proxy_service(nps);
+			continue;
+		}
+
+		debug(LOG_INFO, "register proxy service [%s]", nps->proxy_name);
+		register_proxy_service(nps);
+		nnew++;
+	}
+
+	debug(LOG_INFO, "config reloaded: %d proxy services closed, %d registered", nclose, nnew);
 }
 
 void 
 init_main_control()
 {
-	if (main_ctl && main_ctl->connect_base) {
-		event_base_loopbreak(main_ctl->connect_base);
-		free(main_ctl);
+	if (main_ctl) {
+		xfrpc_free(main_ctl);
 	}
 
-	main_ctl = calloc(sizeof(struct control), 1);
+	main_ctl = xfrpc_calloc(ALLOC_CONTROL, sizeof(struct control));
 	assert(main_ctl);
 
+	// event base is shared by all instances of the loop
 	struct common_conf *c_conf = get_common_config();
-	struct event_base *base = NULL;
-	struct evdns_base *dnsbase = NULL; 
-	base = event_base_new();
-	if (! base) {
-		debug(LOG_ERR, "error: event base init failed!");
-		exit(0);
-	}
-	main_ctl->connect_base = base;
+	assert(cur_instance->loop);
+	main_ctl->connect_base = cur_instance->loop->base;
 	
 	if (c_conf->tcp_mux) {
 		init_tmux_stream(&main_ctl->stream, get_next_session_id(), INIT);
 	}
 
+	if (c_conf->tls_enable)
+		main_ctl->tls_ctx = new_frps_tls_ctx();
+
 	// if server_addr is ip, done control init.
 	if (is_valid_ip_address((const char *)c_conf->server_addr))
 		return;
 
-	dnsbase = evdns_base_new(base, 1);
+	get_main_dnsbase();
+}
+
+// dns base is created when first needed if server_addr is ip
+struct evdns_base *
+get_main_dnsbase()
+{
+	if (main_ctl->dnsbase)
+		return main_ctl->dnsbase;
+
+	// dns base is shared by all instances of the loop too
+	struct xfrpc_loop *loop = cur_instance->loop;
+	if (loop->dnsbase) {
+		main_ctl->dnsbase = loop->dnsbase;
+		return main_ctl->dnsbase;
+	}
+
+	struct evdns_base *dnsbase = evdns_base_new(main_ctl->connect_base, 1);
 	if (! dnsbase) {
 		debug(LOG_ERR, "error: evdns base init failed!");
 		exit(0);
 	}
+	loop->dnsbase = dnsbase;
 	main_ctl->dnsbase = dnsbase;
 
 	evdns_base_set_option(dnsbase, "timeout", "1.0");
@@ -841,12 +1220,14 @@ init_main_control()
 	evdns_base_nameserver_ip_add(dnsbase, "223.5.5.5");			//AliDNS
     evdns_base_nameserver_ip_add(dnsbase, "223.6.6.6");			//AliDNS
 	evdns_base_nameserver_ip_add(dnsbase, "114.114.114.114");	//114DNS
+
+	return dnsbase;
 }
 
 static void 
 free_main_control()
 {
-	SAFE_FREE(main_ctl);
+	xfrpc_free(main_ctl);
 	main_ctl = NULL;
 }
 
@@ -856,7 +1237,11 @@ clear_main_control()
 	assert(main_ctl);
 	if (main_ctl->ticker_ping) evtimer_del(main_ctl->ticker_ping);
 	if (main_ctl->tcp_mux_ping_event) evtimer_del(main_ctl->tcp_mux_ping_event);
+	if (get_common_config()->tcp_mux)
+		flight_record(&main_ctl->stream, main_ctl->stream.id, FL_CLOSE, 0, FL_CLOSE_CONTROL);
 	clear_all_proxy_client();
+	stop_tcp_path_monitor();
+	reset_mux_rate_limit();
 	free_evp_cipher_ctx();
 	set_client_status(0);
 	pong_time = 0;	
@@ -868,11 +1253,18 @@ clear_main_control()
 void 
 close_main_control()
 {
+	if (cur_instance->draining)
+		retire_session(cur_instance->draining);
 	clear_main_control();
 
-	event_base_dispatch(main_ctl->connect_base);
-	evdns_base_free(main_ctl->dnsbase, 0);
-	event_base_free(main_ctl->connect_base);
+	// event base and dns base belong to the loop, freed by xfrpc_loop
+	if (main_ctl->ticker_ping) event_free(main_ctl->ticker_ping);
+	close_rate_limit();
+	close_capture();
+	close_tcp_path_monitor();
+	if (main_ctl->connect_bev) bufferevent_free(main_ctl->connect_bev);
+	if (main_ctl->tls_session) SSL_SESSION_free(main_ctl->tls_session);
+	if (main_ctl->tls_ctx) SSL_CTX_free(main_ctl->tls_ctx);
 
 	free_main_control();
 }
@@ -883,4 +1275,184 @@ run_control()
 	start_base_connect();
 }
 
+// drop control connection and dial frps again
+void
+redial_main_control()
+{
+	reset_session_id();
+	clear_main_control();
+	run_control();
+}
+
+// close session rotated out of current instance, its streams with it
+static void
+retire_session(struct xfrpc_instance *old)
+{
+	struct xfrpc_instance *inst = cur_instance;
+	set_cur_instance(old);
+	debug(LOG_INFO, "close rotated session, %u streams left", HASH_COUNT(old->all_pc));
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, old->all_pc, client, tmp) {
+		debug(LOG_WARNING, "kill stream %u of proxy [%s] still draining", 
+			client->stream_id, client->ps ? client->ps->proxy_name : "-");
+	}
+	event_free(old->drain_timer);
+	if (main_ctl->ticker_ping) event_free(main_ctl->ticker_ping);
+	clear_all_proxy_client();
+	free_evp_cipher_ctx();
+	close_rate_limit();
+	clear_http_cache();
+	if (main_ctl->connect_bev) bufferevent_free(main_ctl->connect_bev);
+	free_main_control();
+	free_dup_login(old->c_login);
+
+	set_cur_instance(inst);
+	inst->draining = NULL;
+	xfrpc_free(old);
+}
+
+// ctx is the rotated session
+static void
+draining_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct xfrpc_instance *old = ctx;
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		set_cur_instance(old->rotated_from);
+		retire_session(old);
+	}
+}
+
+static void
+drain_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct xfrpc_instance *old = arg;
+	if (HASH_COUNT(old->all_pc) && time(NULL) < old->drain_until)
+		return;
+
+	set_cur_instance(old->rotated_from);
+	retire_session(old);
+}
+
+// current session goes on in a new instance which only serves its streams,
+// current instance logs in a new session and gets streams frps opens there
+static void
+rotate_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct xfrpc_instance *inst = arg;
+	set_cur_instance(inst);
+	struct common_conf *c_conf = get_common_config();
+	main_ctl->rotate_pending = 0;
+	if (!main_ctl->connect_bev || !is_login)
+		return;	// reconnecting already
+
+	if (inst->draining)
+		retire_session(inst->draining);
+
+	// frames waiting for bandwidth_limit belong to the old connection
+	flush_mux_rate_limit();
+
+	int abandoned = get_cur_stream() == &abandon_stream;
+	struct xfrpc_instance *old = xfrpc_calloc(ALLOC_CONTROL, sizeof(struct xfrpc_instance));
+	assert(old);
+	*old = *inst;
+	old->next = old->loop_next = NULL;
+	old->rotated_from = inst;
+	old->c_login = dup_run_id();
+	// module state the old session must not share
+	old->rate_limit = NULL;
+	old->capture_out = NULL;
+	old->replay_in = NULL;
+	old->path_mon = NULL;
+	old->http_cache = NULL;
+	old->http_cache_bytes = 0;
+
+	// old control keeps its connection and main stream, the rest moves on
+	struct control *old_ctl = main_ctl;
+	struct control *ctl = xfrpc_calloc(ALLOC_CONTROL, sizeof(struct control));
+	assert(ctl);
+	ctl->connect_base 	= old_ctl->connect_base;
+	ctl->dnsbase 		= old_ctl->dnsbase;
+	ctl->ticker_ping 	= old_ctl->ticker_ping;
+	ctl->tls_ctx 		= old_ctl->tls_ctx;
+	ctl->tls_session 	= old_ctl->tls_session;
+	old_ctl->tls_ctx = NULL;
+	old_ctl->tls_session = NULL;
+
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, old->all_pc, client, tmp) {
+		client->inst = old;
+		if (client->crypto)
+			work_crypto_set_instance(client->crypto, old);
+	}
+	bufferevent_setcb(old_ctl->connect_bev, control_recv_cb, NULL, draining_event_cb, old);
+	if (abandoned) {
+		set_cur_instance(old);
+		set_cur_stream(&abandon_stream);
+		set_cur_instance(inst);
+	}
+	old->drain_until = time(NULL) + c_conf->rotate_drain_timeout;
+	old->drain_timer = event_new(old_ctl->connect_base, -1, EV_PERSIST, drain_timer_cb, old);
+	assert(old->drain_timer);
+	struct timeval tv = {1, 0};
+	evtimer_add(old->drain_timer, &tv);
+	// old control keeps pinging while it drains
+	old_ctl->ticker_ping = evtimer_new(old_ctl->connect_base, hb_sender_cb, old);
+	assert(old_ctl->ticker_ping);
+	set_ticker_ping_timer(old_ctl->ticker_ping);
+
+	// new session, stream ids go on so the two never share one
+	inst->draining = old;
+	main_ctl = ctl;
+	inst->all_pc = NULL;
+	inst->all_stream = NULL;
+	set_cur_stream(NULL);
+	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
+	memset(&abandon_stream, 0, sizeof(abandon_stream));
+	stream_len = 0;
+	inst->remote_go_away = inst->local_go_away = 0;
+	inst->main_encoder = inst->main_decoder = NULL;
+	inst->enc_ctx = inst->dec_ctx = NULL;
+	is_login = 0;
+	pong_time = 0;
+	set_client_status(0);
+	init_tmux_stream(&main_ctl->stream, get_next_session_id(), INIT);
+
+	debug(LOG_INFO, "rotate session, %u streams drain on the old one for %d seconds", 
+		HASH_COUNT(old->all_pc), c_conf->rotate_drain_timeout);
+	run_control();
+}
+
+// make before break on GO_AWAY of frps or degradation of the session,
+// returns 0 if rotate_drain_timeout or tcp_mux is not set
+int
+rotate_main_control()
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!c_conf->tcp_mux || c_conf->rotate_drain_timeout <= 0)
+		return 0;
+
+	// a draining session is not rotated again
+	if (cur_instance->rotated_from || main_ctl->rotate_pending)
+		return 1;
+
+	// frame being parsed belongs to current session, rotate after it
+	main_ctl->rotate_pending = 1;
+	event_base_once(main_ctl->connect_base, -1, EV_TIMEOUT, rotate_cb, cur_instance, NULL);
+	return 1;
+}
+
+// take over control connection handed over by the process upgraded from,
+// it is logged in and its proxies are registered already
+void
+adopt_main_control(struct bufferevent *bev)
+{
+	main_ctl->connect_bev = bev;
+	bufferevent_setcb(bev, control_recv_cb, NULL, connect_event_cb, cur_instance);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	is_login = 1;
+	set_client_status(1);
+	keep_control_alive();
+	start_tcp_path_monitor();
+}
+
 
@@ -27,6 +27,8 @@
 #ifndef	_CONTROL_H_
 #define	_CONTROL_H_
 
+#include <openssl/ssl.h>
+
 #include "uthash.h"
 #include "msg.h"
 
@@ -44,6 +46,10 @@ struct control {
 	struct event		*tcp_mux_ping_event;	
 	uint32_t			tcp_mux_ping_id;	
 	struct tmux_stream	stream;
+
+	SSL_CTX 			*tls_ctx;		// tls to frps, NULL if tls disabled
+	SSL_SESSION 		*tls_session;	// last session ticket, resumed by next connection
+	uint8_t 			rotate_pending;	// new session is set up after current frame
 };
 
 void connect_eventcb(struct bufferevent *bev, short events, void *ptr);
@@ -52,8 +58,16 @@ void init_main_control();
 
 void run_control();
 
+void redial_main_control();
+
+int rotate_main_control();
+
+void adopt_main_control(struct bufferevent *bev);
+
 struct control *get_main_control();
 
+struct evdns_base *get_main_dnsbase();
+
 void close_main_control();
 
 void start_login_frp_server(struct event_base *base);
@@ -78,6 +92,14 @@ void control_process(struct proxy_client *client);
 
 void send_new_proxy(struct proxy_service *ps);
 
+void send_close_proxy(struct proxy_service *ps);
+
+void reload_proxy_config();
+
 struct bufferevent *connect_server(struct event_base *base, const char *name, const int port);
 
+struct bufferevent *connect_frps(struct event_base *base);
+
+struct bufferevent *connect_unix_server(struct event_base *base, const char *path);
+
 #endif //_CONTROL_H_
@@ -0,0 +1,491 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file cpuprof.c
+    @brief sampling cpu profiler writing folded stacks and pprof profiles
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    ITIMER_PROF sends SIGPROF every 10 ms of cpu time the process uses, the
+    handler of the thread it lands on stores its call stack in a buffer set
+    up in advance. stacks come from backtrace of glibc, or from walking frame
+    pointers elsewhere, which needs -fno-omit-frame-pointer. when the profile
+    ends, stacks are written as a legacy pprof cpu profile with the memory
+    map, and as folded stacks for flamegraph.pl with names from the symbol
+    table of the binary, raw addresses if it is stripped.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <link.h>
+#include <elf.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#include <event2/event.h>
+
+#include "debug.h"
+#include "cpuprof.h"
+#include "utils.h"
+#include "commandline.h"
+
+#define PROF_HZ 			100
+#define PROF_DEPTH 			32
+#define PROF_SKIP 			2			// handler and signal trampoline
+#define PROF_MAX_SAMPLES 	12000
+#define PROF_MAX_STACK 		(8 << 20)	// frame pointer walk stays in this
+
+struct prof_sample {
+	uintptr_t 	depth;
+	void 		*pc[PROF_DEPTH];
+};
+
+struct cpu_profile {
+	struct prof_sample 	*samples;
+	uint32_t 			max;
+	uint32_t 			taken;		// passes max when buffer is full
+	int 				seconds;
+	struct event 		*stop_timer;
+	int 				stopping;	// timer off, waiting for handlers to leave
+	cpu_profile_done_cb done;
+	void 				*arg;
+};
+
+struct prof_sym {
+	uintptr_t 	addr;
+	uintptr_t 	size;
+	const char 	*name;
+};
+
+static struct cpu_profile *profile;
+static int prof_active;
+static int prof_in_handler;
+static int prof_installed;	// handler stays, a late SIGPROF must not kill us
+
+static void *
+context_pc(void *uc)
+{
+	ucontext_t *ctx = uc;
+#if defined(__x86_64__)
+	return (void *)ctx->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	return (void *)ctx->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	return (void *)ctx->uc_mcontext.pc;
+#elif defined(__arm__)
+	return (void *)ctx->uc_mcontext.arm_pc;
+#elif defined(__mips__)
+	return (void *)(uintptr_t)ctx->uc_mcontext.pc;
+#else
+	return NULL;
+#endif
+}
+
+// inlined in the handler, so frames above the interrupted one are known
+static inline __attribute__((always_inline)) int
+unwind_stack(void **pc, void *uc)
+{
+#ifdef HAVE_EXECINFO_H
+	// stack starts at the interrupted pc, found past handler and trampoline
+	void *frames[PROF_DEPTH + PROF_SKIP];
+	int n = backtrace(frames, PROF_DEPTH + PROF_SKIP);
+	void *leaf = context_pc(uc);
+	int skip = PROF_SKIP;
+	int i;
+	for (i = 0; leaf && i < n && i <= PROF_SKIP + 1; i++) {
+		if (frames[i] == leaf) {
+			skip = i;
+			break;
+		}
+	}
+	if (n <= skip)
+		return 0;
+	if (n - skip > PROF_DEPTH)
+		n = skip + PROF_DEPTH;
+	memcpy(pc, frames + skip, (n - skip) * sizeof(void *));
+	return n - skip;
+#else
+	// interrupted pc, then return addresses along saved frame pointers,
+	// frame of the handler links to the frame of the interrupted function
+	int depth = 0;
+	pc[depth] = context_pc(uc);
+	if (pc[depth])
+		depth++;
+	void **fp = __builtin_frame_address(0);
+	void **next = *fp;
+	while (depth < PROF_DEPTH) {
+		if (next <= fp || (uintptr_t)next - (uintptr_t)fp > PROF_MAX_STACK || 
+			((uintptr_t)next & (sizeof(void *) - 1)))
+			break;
+		fp = next;
+		if (!fp[1])
+			break;
+		pc[depth++] = fp[1];
+		next = *fp;
+	}
+	return depth;
+#endif
+}
+
+static void
+prof_handler(int sig, siginfo_t *si, void *uc)
+{
+	int saved_errno = errno;
+	__atomic_fetch_add(&prof_in_handler, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&prof_active, __ATOMIC_SEQ_CST)) {
+		uint32_t i = __atomic_fetch_add(&profile->taken, 1, __ATOMIC_RELAXED);
+		if (i < profile->max) {
+			struct prof_sample *s = &profile->samples[i];
+			s->depth = unwind_stack(s->pc, uc);
+		}
+	}
+	__atomic_fetch_sub(&prof_in_handler, 1, __ATOMIC_RELEASE);
+	errno = saved_errno;
+}
+
+static int
+cmp_sample(const void *a, const void *b)
+{
+	const struct prof_sample *x = a, *y = b;
+	if (x->depth != y->depth)
+		return x->depth < y->depth ? -1 : 1;
+	return memcmp(x->pc, y->pc, x->depth * sizeof(void *));
+}
+
+static int
+cmp_sym(const void *a, const void *b)
+{
+	const struct prof_sym *x = a, *y = b;
+	if (x->addr == y->addr)
+		return 0;
+	return x->addr < y->addr ? -1 : 1;
+}
+
+static int
+main_object_bias(struct dl_phdr_info *info, size_t size, void *data)
+{
+	*(uintptr_t *)data = info->dlpi_addr;
+	return 1;	// first object is the executable
+}
+
+// function symbols of the executable sorted by address, from .symtab,
+// or .dynsym if it is stripped
+static struct prof_sym *
+load_symbols(int *nsym, void **map, size_t *map_len)
+{
+	*nsym = 0;
+	*map = NULL;
+	int fd = open("/proc/self/exe", O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*map = data;
+	*map_len = st.st_size;
+
+	ElfW(Ehdr) *eh = (ElfW(Ehdr) *)data;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || 
+		eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > st.st_size)
+		return NULL;
+
+	ElfW(Shdr) *sh = (ElfW(Shdr) *)(data + eh->e_shoff);
+	ElfW(Shdr) *symtab = NULL;
+	int i;
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB || (sh[i].sh_type == SHT_DYNSYM && !symtab))
+			symtab = &sh[i];
+	}
+	if (!symtab || symtab->sh_link >= eh->e_shnum)
+		return NULL;
+	ElfW(Shdr) *strtab = &sh[symtab->sh_link];
+	if (symtab->sh_offset + symtab->sh_size > st.st_size || 
+		strtab->sh_offset + strtab->sh_size > st.st_size)
+		return NULL;
+
+	uintptr_t bias = 0;
+	if (eh->e_type == ET_DYN)
+		dl_iterate_phdr(main_object_bias, &bias);
+
+	size_t n = symtab->sh_size / sizeof(ElfW(Sym));
+	ElfW(Sym) *sym = (ElfW(Sym) *)(data + symtab->sh_offset);
+	struct prof_sym *syms = calloc(n ? n : 1, sizeof(struct prof_sym));
+	if (!syms)
+		return NULL;
+	size_t k;
+	for (k = 0; k < n; k++) {
+		// without size a pc of another object could match it
+		if (ELF64_ST_TYPE(sym[k].st_info) != STT_FUNC || !sym[k].st_value || 
+			!sym[k].st_size || sym[k].st_name >= strtab->sh_size)
+			continue;
+		syms[*nsym].addr = sym[k].st_value + bias;
+		syms[*nsym].size = sym[k].st_size;
+		syms[*nsym].name = (const char *)data + strtab->sh_offset + sym[k].st_name;
+		(*nsym)++;
+	}
+	qsort(syms, *nsym, sizeof(struct prof_sym), cmp_sym);
+	return syms;
+}
+
+static const char *
+find_symbol(struct prof_sym *syms, int nsym, uintptr_t pc)
+{
+	int lo = 0, hi = nsym - 1, found = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (syms[mid].addr <= pc) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	if (found < 0 || pc >= syms[found].addr + syms[found].size)
+		return NULL;
+	return syms[found].name;
+}
+
+struct folded_line {
+	char 		*stack;
+	uint32_t 	count;
+};
+
+static int
+cmp_folded(const void *a, const void *b)
+{
+	return strcmp(((const struct folded_line *)a)->stack, ((const struct folded_line *)b)->stack);
+}
+
+// root first, frames above the leaf are return addresses, pc - 1 is the call,
+// stacks differing only in pcs within the same functions are merged
+static void
+write_folded(FILE *fp, struct prof_sample *samples, uint32_t n)
+{
+	int nsym = 0;
+	void *map = NULL;
+	size_t map_len = 0;
+	struct prof_sym *syms = load_symbols(&nsym, &map, &map_len);
+	struct folded_line *lines = calloc(n ? n : 1, sizeof(struct folded_line));
+	uint32_t nline = 0;
+
+	uint32_t i;
+	for (i = 0; lines && i < n; i++) {
+		struct prof_sample *s = &samples[i];
+		if (!s->depth)
+			continue;
+		char buf[PROF_DEPTH * 64];
+		size_t len = 0;
+		int k;
+		for (k = s->depth - 1; k >= 0 && len < sizeof(buf); k--) {
+			uintptr_t pc = (uintptr_t)s->pc[k] - (k ? 1 : 0);
+			const char *name = find_symbol(syms, nsym, pc);
+			const char *sep = k ? ";" : "";
+			if (name)
+				len += snprintf(buf + len, sizeof(buf) - len, "%s%s", name, sep);
+			else
+				len += snprintf(buf + len, sizeof(buf) - len, "%p%s", (void *)pc, sep);
+		}
+		lines[nline].stack = strdup(buf);
+		lines[nline].count = 1;
+		if (lines[nline].stack)
+			nline++;
+	}
+
+	if (lines)
+		qsort(lines, nline, sizeof(struct folded_line), cmp_folded);
+	for (i = 0; i < nline; ) {
+		uint32_t j = i + 1, count = lines[i].count;
+		while (j < nline && strcmp(lines[i].stack, lines[j].stack) == 0)
+			count += lines[j++].count;
+		fprintf(fp, "%s %u\n", lines[i].stack, count);
+		i = j;
+	}
+
+	for (i = 0; i < nline; i++)
+		free(lines[i].stack);
+	free(lines);
+	free(syms);
+	if (map)
+		munmap(map, map_len);
+}
+
+// legacy binary cpu profile of pprof, words of native size
+static void
+write_pprof(FILE *fp, struct prof_sample *samples, uint32_t n)
+{
+	uintptr_t header[] = {0, 3, 0, 1000000 / PROF_HZ, 0};
+	fwrite(header, sizeof(header), 1, fp);
+
+	uint32_t i = 0;
+	while (i < n) {
+		uint32_t j = i + 1;
+		while (j < n && cmp_sample(&samples[i], &samples[j]) == 0)
+			j++;
+		if (!samples[i].depth) {
+			i = j;
+			continue;
+		}
+		uintptr_t rec[2] = {j - i, samples[i].depth};
+		fwrite(rec, sizeof(rec), 1, fp);
+		fwrite(samples[i].pc, sizeof(void *), samples[i].depth, fp);
+		i = j;
+	}
+
+	uintptr_t trailer[] = {0, 1, 0};
+	fwrite(trailer, sizeof(trailer), 1, fp);
+
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd >= 0) {
+		char buf[4096];
+		ssize_t len;
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			fwrite(buf, 1, len, fp);
+		close(fd);
+	}
+}
+
+static void
+stop_cpu_profile(evutil_socket_t fd, short what, void *arg)
+{
+	struct cpu_profile *p = profile;
+	if (!p->stopping) {
+		struct itimerval it;
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_PROF, &it, NULL);
+		__atomic_store_n(&prof_active, 0, __ATOMIC_SEQ_CST);
+		p->stopping = 1;
+	}
+	// a handler may still run on another thread, look again soon
+	if (__atomic_load_n(&prof_in_handler, __ATOMIC_SEQ_CST)) {
+		struct timeval tv = {0, 1000};
+		evtimer_add(p->stop_timer, &tv);
+		return;
+	}
+
+	uint32_t n = p->taken < p->max ? p->taken : p->max;
+	qsort(p->samples, n, sizeof(struct prof_sample), cmp_sample);
+
+	char prof_name[64], folded_name[64], result[2 * PATH_MAX + 128];
+	char prof_path[PATH_MAX], folded_path[PATH_MAX];
+	long now = (long)time(NULL);
+	snprintf(prof_name, sizeof(prof_name), "xfrpc_cpu.%d.%ld.prof", (int)getpid(), now);
+	snprintf(folded_name, sizeof(folded_name), "xfrpc_cpu.%d.%ld.folded", (int)getpid(), now);
+	FILE *prof_fp = open_dump_file(prof_name, prof_path, sizeof(prof_path));
+	FILE *folded_fp = prof_fp ? open_dump_file(folded_name, folded_path, sizeof(folded_path)) : NULL;
+	if (prof_fp && folded_fp) {
+		write_pprof(prof_fp, p->samples, n);
+		write_folded(folded_fp, p->samples, n);
+		snprintf(result, sizeof(result), "%u samples in %d seconds, %u dropped, written to %s and %s", 
+			n, p->seconds, p->taken - n, prof_path, folded_path);
+	} else {
+		snprintf(result, sizeof(result), "open profile in %s failed: %s", get_dump_dir(), strerror(errno));
+		if (prof_fp)
+			unlink(prof_path);
+	}
+	if (prof_fp) fclose(prof_fp);
+	if (folded_fp) fclose(folded_fp);
+	debug(LOG_INFO, "cpu profile: %s", result);
+
+	if (p->done)
+		p->done(result, p->arg);
+	event_free(p->stop_timer);
+	free(p->samples);
+	free(p);
+	profile = NULL;
+}
+
+int
+start_cpu_profile(struct event_base *base, int seconds, cpu_profile_done_cb done, void *arg)
+{
+	if (profile)
+		return -1;
+
+	struct cpu_profile *p = calloc(1, sizeof(struct cpu_profile));
+	if (!p)
+		return -1;
+	// cpu time of several threads may pass wall time
+	p->max = seconds * PROF_HZ * 2;
+	if (p->max > PROF_MAX_SAMPLES)
+		p->max = PROF_MAX_SAMPLES;
+	p->samples = calloc(p->max, sizeof(struct prof_sample));
+	p->stop_timer = evtimer_new(base, stop_cpu_profile, NULL);
+	if (!p->samples || !p->stop_timer) {
+		if (p->stop_timer) event_free(p->stop_timer);
+		free(p->samples);
+		free(p);
+		return -1;
+	}
+	p->seconds = seconds;
+	p->done = done;
+	p->arg = arg;
+
+#ifdef HAVE_EXECINFO_H
+	// first backtrace loads the unwinder, not safe in a signal handler
+	void *warm[4];
+	backtrace(warm, 4);
+#endif
+
+	profile = p;
+	__atomic_store_n(&prof_active, 1, __ATOMIC_SEQ_CST);
+	if (!prof_installed) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = prof_handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGPROF, &sa, NULL);
+		prof_installed = 1;
+	}
+
+	struct itimerval it;
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / PROF_HZ;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_PROF, &it, NULL);
+
+	struct timeval tv = {seconds, 0};
+	evtimer_add(p->stop_timer, &tv);
+	debug(LOG_INFO, "cpu profile for %d seconds at %d Hz", seconds, PROF_HZ);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file cpuprof.h
+    @brief sampling cpu profiler writing folded stacks and pprof profiles
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _CPUPROF_H_
+#define _CPUPROF_H_
+
+struct event_base;
+
+typedef void (*cpu_profile_done_cb)(const char *result, void *arg);
+
+// samples cpu time of all threads for seconds, done is called in the loop
+// of base with the files written, returns -1 if a profile is running
+int start_cpu_profile(struct event_base *base, int seconds, cpu_profile_done_cb done, void *arg);
+
+#endif //_CPUPROF_H_
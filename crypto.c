@@ -38,13 +38,16 @@
 #include "config.h"
 #include "common.h"
 #include "debug.h"
+#include "instance.h"
 
 static const char *default_salt = "frp";
 static const size_t block_size = 16;
-static struct frp_coder *main_encoder = NULL;
-static struct frp_coder *main_decoder = NULL;
-static EVP_CIPHER_CTX *enc_ctx = NULL;
-static EVP_CIPHER_CTX *dec_ctx = NULL;
+
+// per instance state
+#define main_encoder 	(cur_instance->main_encoder)
+#define main_decoder 	(cur_instance->main_decoder)
+#define enc_ctx 		(cur_instance->enc_ctx)
+#define dec_ctx 		(cur_instance->dec_ctx)
 
 static void
 free_frp_coder(struct frp_coder *coder)
@@ -270,6 +273,86 @@ D_END:
 	return outlen;
 }
 
+// aes-128-cfb cipher of one direction of a work connection, its key is
+// derived from auth token as the key of control connection
+EVP_CIPHER_CTX *
+new_work_cipher(const uint8_t *iv, int enc)
+{
+	struct common_conf *c_conf = get_common_config();
+	const char *token = c_conf->auth_token ? c_conf->auth_token : "";
+	uint8_t key[16];
+	encrypt_key(token, strlen(token), default_salt, key, block_size);
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	assert(ctx);
+	if (!EVP_CipherInit_ex(ctx, EVP_aes_128_cfb(), NULL, key, iv, enc)) {
+		debug(LOG_ERR, "EVP_CipherInit_ex error!");
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+// cfb needs no padding, data is crypted in place
+void
+work_cipher_update(EVP_CIPHER_CTX *ctx, uint8_t *data, size_t len)
+{
+	int outlen = 0;
+	if (!EVP_CipherUpdate(ctx, data, &outlen, data, (int)len))
+		debug(LOG_ERR, "EVP_CipherUpdate error!");
+}
+
+static void
+save_cipher_state(const struct frp_coder *coder, EVP_CIPHER_CTX *ctx, struct cipher_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	if (coder) {
+		st->has_coder = 1;
+		memcpy(st->iv, coder->iv, block_size);
+	}
+	if (ctx) {
+		st->has_ctx = 1;
+		memcpy(st->ctx_iv, EVP_CIPHER_CTX_iv(ctx), block_size);
+		st->num = EVP_CIPHER_CTX_num(ctx);
+	}
+}
+
+static EVP_CIPHER_CTX *
+load_cipher_state(struct frp_coder **coder, const struct cipher_state *st, int enc)
+{
+	if (!st->has_coder)
+		return NULL;
+
+	struct common_conf *c_conf = get_common_config();
+	*coder = new_coder(c_conf->auth_token, default_salt);
+	memcpy((*coder)->iv, st->iv, block_size);
+	if (!st->has_ctx)
+		return NULL;
+
+	// cfb goes on from the register and position the old process stopped at
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	assert(ctx);
+	EVP_CipherInit_ex(ctx, EVP_aes_128_cfb(), NULL, (*coder)->key, st->ctx_iv, enc);
+	EVP_CIPHER_CTX_set_num(ctx, st->num);
+	return ctx;
+}
+
+// running state of control connection ciphers, to resume them in upgraded process
+void
+save_main_cipher_state(struct cipher_state *enc, struct cipher_state *dec)
+{
+	save_cipher_state(main_encoder, enc_ctx, enc);
+	save_cipher_state(main_decoder, dec_ctx, dec);
+}
+
+void
+load_main_cipher_state(const struct cipher_state *enc, const struct cipher_state *dec)
+{
+	free_evp_cipher_ctx();
+	enc_ctx = load_cipher_state(&main_encoder, enc, 1);
+	dec_ctx = load_cipher_state(&main_decoder, dec, 0);
+}
+
 void 
 free_encoder(struct frp_coder *encoder) {
 	if (encoder) {
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <openssl/evp.h>
 
 #include "common.h"
 
@@ -41,6 +42,15 @@ struct frp_coder {
 	char 		*token;
 };
 
+// control connection cipher of one direction, handed over on upgrade
+struct cipher_state {
+	int 	has_coder;
+	uint8_t iv[16];		// iv the cipher started with
+	int 	has_ctx;
+	uint8_t ctx_iv[16];	// cfb register of running cipher
+	int 	num;		// position in cfb register
+};
+
 size_t get_encrypt_block_size();
 size_t decrypt_data(const uint8_t *enc_data, size_t enc_len, struct frp_coder *decoder, uint8_t **ret);
 int is_encoder_inited();
@@ -56,5 +66,9 @@ struct frp_coder *get_main_decoder();
 size_t get_block_size();
 void free_encoder(struct frp_coder *encoder);
 void free_evp_cipher_ctx();
+EVP_CIPHER_CTX *new_work_cipher(const uint8_t *iv, int enc);
+void work_cipher_update(EVP_CIPHER_CTX *ctx, uint8_t *data, size_t len);
+void save_main_cipher_state(struct cipher_state *enc, struct cipher_state *dec);
+void load_main_cipher_state(const struct cipher_state *enc, const struct cipher_state *dec);
 
 #endif // _CRYPTO_H_
@@ -0,0 +1,646 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file crypto_pool.c
+    @brief encryption of work connections and its worker pool
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "common.h"
+#include "config.h"
+#include "crypto.h"
+#include "proxy.h"
+#include "tcpmux.h"
+#include "control.h"
+#include "instance.h"
+#include "crypto_pool.h"
+#include "alloc.h"
+
+#define CRYPTO_MAX_THREADS 	16
+#define CRYPTO_JOB_SIZE 	(64*1024)	// bulk data is split into jobs of this size
+#define CRYPTO_INFLIGHT_MAX	(256*1024)	// reading is paused above this, each direction
+
+// encryption of a work connection when use_encryption is set, compatible
+// with frps: each side sends its 16 bytes iv first, then aes-128-cfb data
+struct work_crypto {
+	struct proxy_client 	*client;	// NULL when client is freed
+	struct xfrpc_instance 	*inst;
+	struct crypto_done 		*done;		// queue of the loop, set when pool is used
+	int 	refcnt;		// client and jobs in flight, touched by event loop only
+	int 	worker;		// jobs of a connection run one by one on its worker
+
+	EVP_CIPHER_CTX 	*enc;	// xfrpc ---> frps
+	EVP_CIPHER_CTX 	*dec;	// frps ---> xfrpc, created when iv received
+	uint8_t 	dec_iv[16];
+	int 		dec_iv_len;
+	size_t 		dec_plain;	// decrypted bytes at head of work connection input
+
+	// data can not bypass jobs in flight of the same direction
+	int 		enc_jobs;
+	int 		dec_jobs;
+	size_t 		enc_inflight;
+	size_t 		dec_inflight;
+	int 		local_paused;	// reading of local service paused by pool
+	int 		remote_paused;	// reading of work connection paused by pool
+	short 		close_what;		// local service closed while its data in pool
+};
+
+struct crypto_job {
+	struct work_crypto 	*wc;
+	int 	enc;
+	size_t 	len;
+	struct crypto_job 	*next;
+	uint8_t data[];
+};
+
+struct crypto_worker {
+	pthread_t 	tid;
+	pthread_mutex_t lock;
+	pthread_cond_t 	cond;
+	struct crypto_job 	*head;
+	struct crypto_job 	*tail;
+};
+
+// jobs done for an event loop, pushed by workers without lock
+struct crypto_done {
+	struct crypto_job 	*jobs;	// last done first
+	int 	notify[2];
+	struct event 	*event;
+};
+
+// workers are shared by all loops, created when first needed
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct crypto_worker *workers = NULL;
+static int 	nworkers = 0;
+static int 	next_worker = 0;
+
+static __thread struct crypto_done *loop_done = NULL;
+static __thread int pool_workers = 0;	// nworkers seen by this thread
+
+static void finish_crypto_job(struct crypto_job *job);
+
+static void *
+crypto_worker_run(void *arg)
+{
+	struct crypto_worker *w = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->head)
+			pthread_cond_wait(&w->cond, &w->lock);
+		struct crypto_job *job = w->head;
+		w->head = job->next;
+		if (!w->head)
+			w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		struct work_crypto *wc = job->wc;
+		work_cipher_update(job->enc ? wc->enc : wc->dec, job->data, job->len);
+
+		// wake up the loop only when its queue was empty
+		struct crypto_done *done = wc->done;
+		struct crypto_job *head = __atomic_load_n(&done->jobs, __ATOMIC_RELAXED);
+		do {
+			job->next = head;
+		} while (!__atomic_compare_exchange_n(&done->jobs, &head, job, 1, 
+											__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		if (!head && write(done->notify[1], "j", 1) != 1)
+			debug(LOG_ERR, "error: notify crypto done failed: %s", strerror(errno));
+	}
+
+	return NULL;
+}
+
+static void
+crypto_done_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct crypto_done *done = arg;
+	char buf[64];
+
+	// drain notify before taking jobs, or a wake up may be lost
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	struct crypto_job *job = __atomic_exchange_n(&done->jobs, NULL, __ATOMIC_ACQUIRE);
+	struct crypto_job *list = NULL;
+	while (job) {
+		struct crypto_job *next = job->next;
+		job->next = list;
+		list = job;
+		job = next;
+	}
+
+	// jobs of a connection are done in the order they are queued
+	while (list) {
+		struct crypto_job *next = list->next;
+		finish_crypto_job(list);
+		list = next;
+	}
+}
+
+static int
+start_crypto_workers(int n)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (!workers) {
+		if (n > CRYPTO_MAX_THREADS)
+			n = CRYPTO_MAX_THREADS;
+		workers = calloc(n, sizeof(struct crypto_worker));
+		assert(workers);
+		int i;
+		for (i = 0; i < n; i++) {
+			pthread_mutex_init(&workers[i].lock, NULL);
+			pthread_cond_init(&workers[i].cond, NULL);
+			if (pthread_create(&workers[i].tid, NULL, crypto_worker_run, &workers[i]) != 0) {
+				debug(LOG_ERR, "error: create crypto worker %d failed!", i);
+				break;
+			}
+			pthread_detach(workers[i].tid);
+		}
+		nworkers = i;
+		debug(LOG_INFO, "%d crypto workers started", nworkers);
+	}
+	n = nworkers;
+	pthread_mutex_unlock(&pool_lock);
+	return n;
+}
+
+// attach connection to pool, return 0 if pool can not be used
+static int
+attach_crypto_pool(struct work_crypto *wc, struct event_base *base)
+{
+	if (wc->done)
+		return 1;
+
+	if (!pool_workers)
+		pool_workers = start_crypto_workers(get_common_config()->crypto_threads);
+	if (!pool_workers)
+		return 0;
+
+	if (!loop_done) {
+		struct crypto_done *done = calloc(1, sizeof(struct crypto_done));
+		assert(done);
+		if (pipe(done->notify) < 0) {
+			debug(LOG_ERR, "error: crypto done pipe init failed: %s", strerror(errno));
+			free(done);
+			return 0;
+		}
+		evutil_make_socket_nonblocking(done->notify[0]);
+		evutil_make_socket_nonblocking(done->notify[1]);
+		done->event = event_new(base, done->notify[0], EV_READ|EV_PERSIST, crypto_done_cb, done);
+		assert(done->event);
+		event_add(done->event, NULL);
+		loop_done = done;
+	}
+
+	wc->done = loop_done;
+	wc->worker = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % pool_workers;
+	return 1;
+}
+
+// small data is crypted inline, data behind jobs in flight goes to pool to keep order
+static int
+use_crypto_pool(struct work_crypto *wc, size_t len, int jobs)
+{
+	if (jobs > 0)
+		return 1;
+
+	struct common_conf *c_conf = get_common_config();
+	if (c_conf->crypto_threads <= 0 || len < c_conf->crypto_offload_size)
+		return 0;
+
+	return attach_crypto_pool(wc, wc->client->base);
+}
+
+static struct crypto_job *
+new_crypto_job(struct work_crypto *wc, int enc, size_t len)
+{
+	struct crypto_job *job = xfrpc_malloc(ALLOC_CRYPTO, sizeof(struct crypto_job) + len);
+	assert(job);
+	job->wc = wc;
+	job->enc = enc;
+	job->len = len;
+	job->next = NULL;
+	return job;
+}
+
+static void
+queue_crypto_job(struct crypto_job *job)
+{
+	struct work_crypto *wc = job->wc;
+	wc->refcnt++;
+	if (job->enc) {
+		wc->enc_jobs++;
+		wc->enc_inflight += job->len;
+	} else {
+		wc->dec_jobs++;
+		wc->dec_inflight += job->len;
+	}
+
+	struct crypto_worker *w = &workers[wc->worker];
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = job;
+	else
+		w->head = job;
+	w->tail = job;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void
+put_work_crypto(struct work_crypto *wc)
+{
+	if (--wc->refcnt > 0)
+		return;
+
+	if (wc->enc) EVP_CIPHER_CTX_free(wc->enc);
+	if (wc->dec) EVP_CIPHER_CTX_free(wc->dec);
+	xfrpc_free(wc);
+}
+
+static int
+stream_closed(struct tmux_stream *stream)
+{
+	return stream->state == LOCAL_CLOSE || stream->state == CLOSED || stream->state == RESET;
+}
+
+// write encrypted data to frps
+static uint32_t
+send_remote_raw(struct work_crypto *wc, uint8_t *data, uint32_t len)
+{
+	struct proxy_client *client = wc->client;
+	if (get_common_config()->tcp_mux)
+		return tmux_stream_send(client->ctl_bev, data, len, &client->stream);
+
+	bufferevent_write(client->ctl_bev, data, len);
+	return len;
+}
+
+static int
+enc_over_limit(struct work_crypto *wc)
+{
+	if (wc->enc_inflight >= CRYPTO_INFLIGHT_MAX)
+		return 1;
+	if (!get_common_config()->tcp_mux)
+		return 0;
+
+	// data in pool is sent when done, keep it within stream send window
+	struct tmux_stream *stream = &wc->client->stream;
+	return wc->enc_inflight + stream->tx_ring.sz >= stream->send_window;
+}
+
+static void
+resume_reading(struct work_crypto *wc)
+{
+	struct proxy_client *client = wc->client;
+	if (wc->local_paused && !enc_over_limit(wc)) {
+		wc->local_paused = 0;
+		if (client->local_proxy_bev)
+			bufferevent_enable(client->local_proxy_bev, EV_READ);
+	}
+
+	if (wc->remote_paused && wc->dec_inflight < CRYPTO_INFLIGHT_MAX) {
+		wc->remote_paused = 0;
+		bufferevent_enable(client->ctl_bev, EV_READ);
+	}
+}
+
+static void
+finish_crypto_job(struct crypto_job *job)
+{
+	struct work_crypto *wc = job->wc;
+	struct proxy_client *client = wc->client;
+	set_cur_instance(wc->inst);
+
+	if (job->enc) {
+		wc->enc_jobs--;
+		wc->enc_inflight -= job->len;
+		if (client && send_remote_raw(wc, job->data, job->len) < job->len && client->local_proxy_bev) {
+			// send window used up, reading resumes on window update
+			bufferevent_disable(client->local_proxy_bev, EV_READ);
+		}
+	} else {
+		wc->dec_jobs--;
+		wc->dec_inflight -= job->len;
+		if (client && client->local_proxy_bev)
+			bufferevent_write(client->local_proxy_bev, job->data, job->len);
+		// window of decrypted data is opened
+		if (client && get_common_config()->tcp_mux && !stream_closed(&client->stream))
+			send_window_update(get_main_control()->connect_bev, &client->stream, wc->dec_inflight);
+	}
+	xfrpc_free(job);
+
+	if (client)
+		resume_reading(wc);
+
+	// local service closed when its data was in pool
+	if (client && wc->close_what && !wc->enc_jobs) {
+		short what = wc->close_what;
+		wc->close_what = 0;
+		xfrp_proxy_event_cb(client->local_proxy_bev, what, client);
+	}
+
+	put_work_crypto(wc);
+}
+
+// set up encryption of work connection and send iv to frps
+struct work_crypto *
+new_work_crypto(struct proxy_client *client)
+{
+	uint8_t iv[16];
+	if (RAND_bytes(iv, sizeof(iv)) != 1) {
+		debug(LOG_ERR, "error: generate iv of work connection failed!");
+		return NULL;
+	}
+
+	struct work_crypto *wc = xfrpc_calloc(ALLOC_CRYPTO, sizeof(struct work_crypto));
+	assert(wc);
+	wc->client = client;
+	wc->inst = client->inst;
+	wc->refcnt = 1;
+	wc->enc = new_work_cipher(iv, 1);
+	if (!wc->enc) {
+		xfrpc_free(wc);
+		return NULL;
+	}
+
+	send_remote_raw(wc, iv, sizeof(iv));
+	if (get_common_config()->tcp_mux)
+		client->stream.crypto = wc;
+	return wc;
+}
+
+void
+free_work_crypto(struct work_crypto *wc)
+{
+	wc->client = NULL;
+	put_work_crypto(wc);
+}
+
+// encrypt data to frps, return length accepted as tmux_stream_write does
+uint32_t
+work_crypto_send(struct work_crypto *wc, uint8_t *data, uint32_t len)
+{
+	if (len == 0)
+		return 0;
+
+	if (wc->enc_jobs > 0) {
+		if (get_common_config()->tcp_mux && stream_closed(&wc->client->stream))
+			return 0;
+		struct crypto_job *job = new_crypto_job(wc, 1, len);
+		memcpy(job->data, data, len);
+		queue_crypto_job(job);
+		return len;
+	}
+
+	uint8_t *out = xfrpc_malloc(ALLOC_CRYPTO, len);
+	assert(out);
+	memcpy(out, data, len);
+	work_cipher_update(wc->enc, out, len);
+	uint32_t nw = send_remote_raw(wc, out, len);
+	xfrpc_free(out);
+	return nw;
+}
+
+// send data of local service bev in buf to frps, bulk data is encrypted by pool
+void
+work_crypto_send_buffer(struct work_crypto *wc, struct bufferevent *bev, struct evbuffer *buf)
+{
+	size_t len = evbuffer_get_length(buf);
+	if (len == 0)
+		return;
+
+	int tcp_mux = get_common_config()->tcp_mux;
+	if (!use_crypto_pool(wc, len, wc->enc_jobs)) {
+		uint32_t nw = work_crypto_send(wc, evbuffer_pullup(buf, len), len);
+		if (tcp_mux && nw < len && bev) {
+			debug(LOG_DEBUG, "stream_id [%d] len is %d encrypted %d data, disable read", 
+				wc->client->stream_id, len, nw);
+			bufferevent_disable(bev, EV_READ);
+		}
+		evbuffer_drain(buf, len);
+		return;
+	}
+
+	if (tcp_mux && stream_closed(&wc->client->stream)) {
+		evbuffer_drain(buf, len);
+		return;
+	}
+
+	while (len > 0) {
+		size_t n = len > CRYPTO_JOB_SIZE ? CRYPTO_JOB_SIZE : len;
+		struct crypto_job *job = new_crypto_job(wc, 1, n);
+		evbuffer_remove(buf, job->data, n);
+		queue_crypto_job(job);
+		len -= n;
+	}
+
+	if (bev && enc_over_limit(wc)) {
+		bufferevent_disable(bev, EV_READ);
+		wc->local_paused = 1;
+	}
+}
+
+static void
+init_work_decoder(struct work_crypto *wc)
+{
+	wc->dec = new_work_cipher(wc->dec_iv, 0);
+	if (!wc->dec)
+		debug(LOG_ERR, "error: work connection %d decoder init failed", wc->client->stream_id);
+}
+
+// decrypt len bytes of input from offset in place
+static void
+decrypt_buffer(struct work_crypto *wc, struct evbuffer *input, size_t offset, size_t len)
+{
+	struct evbuffer_ptr ptr;
+	evbuffer_ptr_set(input, &ptr, offset, EVBUFFER_PTR_SET);
+	int n = evbuffer_peek(input, len, &ptr, NULL, 0);
+	struct evbuffer_iovec v[n];
+	evbuffer_peek(input, len, &ptr, v, n);
+
+	int i;
+	for (i = 0; i < n && len > 0; i++) {
+		size_t l = v[i].iov_len < len ? v[i].iov_len : len;
+		work_cipher_update(wc->dec, v[i].iov_base, l);
+		len -= l;
+	}
+}
+
+// decrypt data of work connection bev and pass it to on_remote_data of ops
+void
+work_crypto_recv(struct work_crypto *wc, struct bufferevent *bev, const struct proxy_type_ops *ops)
+{
+	struct proxy_client *client = wc->client;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	if (wc->dec_iv_len < sizeof(wc->dec_iv)) {
+		wc->dec_iv_len += evbuffer_remove(input, wc->dec_iv + wc->dec_iv_len, 
+										sizeof(wc->dec_iv) - wc->dec_iv_len);
+		if (wc->dec_iv_len < sizeof(wc->dec_iv))
+			return;
+		init_work_decoder(wc);
+	}
+
+	size_t len = evbuffer_get_length(input);
+	if (!wc->dec || len <= wc->dec_plain)
+		return;
+
+	// data forwarded as is can be decrypted by pool
+	size_t fresh = len - wc->dec_plain;
+	if ((ops->flags & PROXY_F_FORWARD) && !wc->dec_plain && use_crypto_pool(wc, fresh, wc->dec_jobs)) {
+		while (fresh > 0) {
+			size_t n = fresh > CRYPTO_JOB_SIZE ? CRYPTO_JOB_SIZE : fresh;
+			struct crypto_job *job = new_crypto_job(wc, 0, n);
+			evbuffer_remove(input, job->data, n);
+			queue_crypto_job(job);
+			fresh -= n;
+		}
+		if (wc->dec_inflight >= CRYPTO_INFLIGHT_MAX) {
+			bufferevent_disable(bev, EV_READ);
+			wc->remote_paused = 1;
+		}
+		return;
+	}
+
+	decrypt_buffer(wc, input, wc->dec_plain, fresh);
+
+	// handler may free client, data it leaves in input has been decrypted
+	wc->refcnt++;
+	ops->on_remote_data(bev, client);
+	if (wc->client)
+		wc->dec_plain = evbuffer_get_length(input);
+	put_work_crypto(wc);
+}
+
+// decrypt newest len bytes of stream in rb and pass them to on_mux_data of ops
+// return length as on_mux_data does, or bytes in pool whose window is kept closed
+uint32_t
+work_crypto_mux_data(struct work_crypto *wc, struct ring_buffer *rb, int len, 
+					const struct proxy_type_ops *ops)
+{
+	struct proxy_client *client = wc->client;
+	uint32_t nret = 0;
+
+	// iv comes first, nothing is left in rb before it
+	if (wc->dec_iv_len < sizeof(wc->dec_iv)) {
+		uint32_t n = sizeof(wc->dec_iv) - wc->dec_iv_len;
+		if (n > len)
+			n = len;
+		rx_ring_buffer_pop(rb, wc->dec_iv + wc->dec_iv_len, n);
+		wc->dec_iv_len += n;
+		len -= n;
+		nret = n;
+		if (wc->dec_iv_len < sizeof(wc->dec_iv))
+			return nret;
+		init_work_decoder(wc);
+	}
+
+	if (!wc->dec || len == 0)
+		return nret;
+
+	if ((ops->flags & PROXY_F_FORWARD) && rb->sz == len && use_crypto_pool(wc, len, wc->dec_jobs)) {
+		while (len > 0) {
+			uint32_t n = len > CRYPTO_JOB_SIZE ? CRYPTO_JOB_SIZE : len;
+			struct crypto_job *job = new_crypto_job(wc, 0, n);
+			rx_ring_buffer_pop(rb, job->data, n);
+			queue_crypto_job(job);
+			len -= n;
+		}
+		return wc->dec_inflight;
+	}
+
+	uint32_t start = (rb->end + RBUF_SIZE - len) % RBUF_SIZE;
+	uint32_t first = RBUF_SIZE - start;
+	if (first >= len) {
+		work_cipher_update(wc->dec, &rb->data[start], len);
+	} else {
+		work_cipher_update(wc->dec, &rb->data[start], first);
+		work_cipher_update(wc->dec, rb->data, len - first);
+	}
+
+	return nret + ops->on_mux_data(client, rb, len);
+}
+
+// decrypt data received together with StartWorkConn in place
+// return its length without iv of frps
+size_t
+work_crypto_decrypt_tail(struct work_crypto *wc, uint8_t **data, size_t len)
+{
+	if (wc->dec_iv_len < sizeof(wc->dec_iv)) {
+		size_t n = sizeof(wc->dec_iv) - wc->dec_iv_len;
+		if (n > len)
+			n = len;
+		memcpy(wc->dec_iv + wc->dec_iv_len, *data, n);
+		wc->dec_iv_len += n;
+		*data += n;
+		len -= n;
+		if (wc->dec_iv_len < sizeof(wc->dec_iv))
+			return 0;
+		init_work_decoder(wc);
+	}
+
+	if (!wc->dec)
+		return 0;
+
+	work_cipher_update(wc->dec, *data, len);
+	return len;
+}
+
+// stream send window increased, local service may be read again
+void
+work_crypto_window_update(struct work_crypto *wc)
+{
+	resume_reading(wc);
+}
+
+// local service is closed after its data in pool is sent
+// return 1 if closing is deferred
+int
+work_crypto_defer_close(struct work_crypto *wc, short what)
+{
+	if (!wc->enc_jobs)
+		return 0;
+
+	wc->close_what = what;
+	return 1;
+}
+
+void
+work_crypto_set_instance(struct work_crypto *wc, struct xfrpc_instance *inst)
+{
+	wc->inst = inst;
+}
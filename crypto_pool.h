@@ -0,0 +1,62 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file crypto_pool.h
+    @brief encryption of work connections and its worker pool
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _CRYPTO_POOL_H_
+#define _CRYPTO_POOL_H_
+
+#include <stdint.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+struct proxy_client;
+struct proxy_type_ops;
+struct ring_buffer;
+struct work_crypto;
+struct xfrpc_instance;
+
+struct work_crypto *new_work_crypto(struct proxy_client *client);
+
+void free_work_crypto(struct work_crypto *wc);
+
+uint32_t work_crypto_send(struct work_crypto *wc, uint8_t *data, uint32_t len);
+
+void work_crypto_send_buffer(struct work_crypto *wc, struct bufferevent *bev, struct evbuffer *buf);
+
+void work_crypto_recv(struct work_crypto *wc, struct bufferevent *bev, const struct proxy_type_ops *ops);
+
+uint32_t work_crypto_mux_data(struct work_crypto *wc, struct ring_buffer *rb, int len, 
+							const struct proxy_type_ops *ops);
+
+size_t work_crypto_decrypt_tail(struct work_crypto *wc, uint8_t **data, size_t len);
+
+void work_crypto_window_update(struct work_crypto *wc);
+
+int work_crypto_defer_close(struct work_crypto *wc, short what);
+
+// client moved to another instance, jobs in flight finish there
+void work_crypto_set_instance(struct work_crypto *wc, struct xfrpc_instance *inst);
+
+#endif //_CRYPTO_POOL_H_
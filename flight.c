@@ -0,0 +1,185 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file flight.c
+    @brief flight recorder of tcp_mux streams
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    Frames sent and received, window updates, stalls, state changes and close
+    reasons are recorded with ns monotonic time in a ring of each stream and
+    a ring of the instance. The rings are fixed size and written only by the
+    event loop of the instance, so recording is a clock read and a copy of
+    24 bytes, no lock and no allocation after the first event. SIGUSR1 and
+    the flight admin command write them as text to the dump directory, to
+    tell why a stream stalled after the fact.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "debug.h"
+#include "config.h"
+#include "tcpmux.h"
+#include "instance.h"
+#include "utils.h"
+#include "flight.h"
+
+struct flight_ring {
+	uint32_t 	head;
+	struct flight_rec 	ev[FLIGHT_GLOBAL_EVENTS];
+};
+
+// per instance state
+#define flight_log 	(cur_instance->flight_log)
+#define all_stream 	(cur_instance->all_stream)
+
+static const char *event_names[] = {
+	[FL_RX_DATA] 		= "rx_data",
+	[FL_RX_WINDOW] 		= "rx_window",
+	[FL_RX_PING] 		= "rx_ping",
+	[FL_RX_GO_AWAY] 	= "rx_go_away",
+	[FL_TX_DATA] 		= "tx_data",
+	[FL_TX_WINDOW] 		= "tx_window",
+	[FL_TX_PING] 		= "tx_ping",
+	[FL_TX_GO_AWAY] 	= "tx_go_away",
+	[FL_STALL_WINDOW] 	= "stall_window",
+	[FL_STALL_RATE] 	= "stall_rate",
+	[FL_STALL_RX_RING] 	= "stall_rx_ring",
+	[FL_STATE] 			= "state",
+	[FL_CLOSE] 			= "close",
+};
+
+static const char *close_names[] = {
+	[FL_CLOSE_REMOTE_FIN] 	= "remote_fin",
+	[FL_CLOSE_REMOTE_RST] 	= "remote_rst",
+	[FL_CLOSE_LOCAL_FIN] 	= "local_fin",
+	[FL_CLOSE_PROXY] 		= "proxy_closed",
+	[FL_CLOSE_CONTROL] 		= "control_lost",
+};
+
+static const char *state_names[] = {
+	[INIT] 			= "INIT",
+	[SYN_SEND] 		= "SYN_SEND",
+	[SYN_RECEIVED] 	= "SYN_RECEIVED",
+	[ESTABLISHED] 	= "ESTABLISHED",
+	[LOCAL_CLOSE] 	= "LOCAL_CLOSE",
+	[REMOTE_CLOSE] 	= "REMOTE_CLOSE",
+	[CLOSED] 		= "CLOSED",
+	[RESET] 		= "RESET",
+};
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+flight_record(struct tmux_stream *stream, uint32_t stream_id, enum flight_event event, 
+			uint16_t flags, uint32_t arg)
+{
+	uint32_t window = 0;
+	uint8_t state = 0;
+	if (stream) {
+		window = event == FL_RX_DATA ? stream->recv_window : stream->send_window;
+		state = stream->state;
+	}
+	FLIGHT_PROBE(event, stream_id, arg, window);
+
+	if (!get_common_config()->flight_recorder)
+		return;
+
+	struct flight_rec rec = {now_ns(), stream_id, arg, window, flags, event, state};
+	if (stream)
+		stream->flight.ev[stream->flight.head++ % FLIGHT_STREAM_EVENTS] = rec;
+
+	if (!flight_log) {
+		flight_log = calloc(1, sizeof(struct flight_ring));
+		assert(flight_log);
+	}
+	flight_log->ev[flight_log->head++ % FLIGHT_GLOBAL_EVENTS] = rec;
+}
+
+static const char *
+name_of(const char **names, size_t n, uint32_t i)
+{
+	return i < n && names[i] ? names[i] : "?";
+}
+
+#define NAME_OF(names, i) name_of(names, sizeof(names) / sizeof(names[0]), i)
+
+static void
+dump_ring(FILE *fp, const struct flight_rec *ev, uint32_t head, uint32_t size, uint64_t now)
+{
+	uint32_t i = head > size ? head - size : 0;
+	for (; i < head; i++) {
+		const struct flight_rec *r = &ev[i % size];
+		fprintf(fp, "%12.3f ms  stream %-6u %-13s flags 0x%-2x %-12s window %-7u ", 
+			-(double)(now - r->ts) / 1e6, r->stream_id, NAME_OF(event_names, r->event), 
+			r->flags, NAME_OF(state_names, r->state), r->window);
+		if (r->event == FL_STATE)
+			fprintf(fp, "from %s\n", NAME_OF(state_names, r->arg));
+		else if (r->event == FL_CLOSE)
+			fprintf(fp, "reason %s\n", NAME_OF(close_names, r->arg));
+		else
+			fprintf(fp, "arg %u\n", r->arg);
+	}
+}
+
+void
+dump_flight_recorder()
+{
+	if (!flight_log)
+		return;
+
+	char name[64], path[PATH_MAX];
+	snprintf(name, sizeof(name), "xfrpc_flight.%d.%d.%ld.txt", (int)getpid(), cur_instance->id, 
+		(long)time(NULL));
+	FILE *fp = open_dump_file(name, path, sizeof(path));
+	if (!fp) {
+		debug(LOG_ERR, "open flight recorder dump %s failed: %s", path, strerror(errno));
+		return;
+	}
+
+	// time of events is relative to the dump
+	uint64_t now = now_ns();
+	fprintf(fp, "# instance %d, %u events of all streams\n", cur_instance->id, flight_log->head);
+	dump_ring(fp, flight_log->ev, flight_log->head, FLIGHT_GLOBAL_EVENTS, now);
+
+	struct tmux_stream *s, *tmp;
+	HASH_ITER(hh, all_stream, s, tmp) {
+		fprintf(fp, "\n# stream %u %s send_window %u recv_window %u tx_ring %u rx_ring %u, %u events\n", 
+			s->id, NAME_OF(state_names, s->state), s->send_window, s->recv_window, 
+			s->tx_ring.sz, s->rx_ring.sz, s->flight.head);
+		dump_ring(fp, s->flight.ev, s->flight.head, FLIGHT_STREAM_EVENTS, now);
+	}
+	fclose(fp);
+	debug(LOG_INFO, "flight recorder of instance %d dumped to %s", cur_instance->id, path);
+}
@@ -0,0 +1,92 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file flight.h
+    @brief flight recorder of tcp_mux streams
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stdint.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+// usdt probe xfrpc:flight for bpftrace, args are event, stream id, arg, window
+#define FLIGHT_PROBE(ev, id, arg, window)	DTRACE_PROBE4(xfrpc, flight, ev, id, arg, window)
+#else
+#define FLIGHT_PROBE(ev, id, arg, window)
+#endif
+
+#define FLIGHT_STREAM_EVENTS	32		// last events of each stream
+#define FLIGHT_GLOBAL_EVENTS	4096	// last events of all streams of an instance
+
+struct tmux_stream;
+
+enum flight_event {
+	FL_RX_DATA = 1,		// arg is length
+	FL_RX_WINDOW,		// window update, arg is delta
+	FL_RX_PING,
+	FL_RX_GO_AWAY,		// arg is code
+	FL_TX_DATA,
+	FL_TX_WINDOW,
+	FL_TX_PING,
+	FL_TX_GO_AWAY,
+	FL_STALL_WINDOW,	// send window used up, arg is data queued in tx ring
+	FL_STALL_RATE,		// frame waits for bandwidth_limit, arg is queued bytes
+	FL_STALL_RX_RING,	// rx ring can not take frame data, arg is length
+	FL_STATE,			// arg is previous state
+	FL_CLOSE,			// arg is enum flight_close
+};
+
+enum flight_close {
+	FL_CLOSE_REMOTE_FIN = 1,	// closed by FIN of frps after local FIN
+	FL_CLOSE_REMOTE_RST,
+	FL_CLOSE_LOCAL_FIN,			// closed by local FIN after FIN of frps
+	FL_CLOSE_PROXY,				// proxy unregistered
+	FL_CLOSE_CONTROL,			// control connection lost
+};
+
+// 24 bytes, written only by the event loop thread of the instance
+struct flight_rec {
+	uint64_t 	ts;			// CLOCK_MONOTONIC ns
+	uint32_t 	stream_id;
+	uint32_t 	arg;
+	uint32_t 	window;		// send window, or recv window for received data
+	uint16_t 	flags;		// tcp_mux flags of frame
+	uint8_t 	event;
+	uint8_t 	state;		// stream state after event
+};
+
+struct flight_stream_ring {
+	uint32_t 	head;		// events recorded, next slot is head % FLIGHT_STREAM_EVENTS
+	struct flight_rec 	ev[FLIGHT_STREAM_EVENTS];
+};
+
+// stream is NULL for frames of unknown streams and of the session
+void flight_record(struct tmux_stream *stream, uint32_t stream_id, enum flight_event event, 
+				uint16_t flags, uint32_t arg);
+
+// write recorder of current instance to a file in /tmp
+void dump_flight_recorder();
+
+#endif //_FLIGHT_H_
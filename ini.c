@@ -199,3 +199,49 @@ int ini_parse(const char* filename, ini_handler handler, void* user)
     fclose(file);
     return error;
 }
+
+/* An ini_reader function to read the next line from a string buffer. This
+   is the fgets() equivalent used by ini_parse_buffer(). */
+typedef struct {
+    const char* ptr;
+    size_t num_left;
+} ini_parse_string_ctx;
+
+static char* ini_reader_string(char* str, int num, void* stream)
+{
+    ini_parse_string_ctx* ctx = (ini_parse_string_ctx*)stream;
+    const char* eol;
+    size_t len;
+
+    if (ctx->num_left == 0 || num < 2)
+        return NULL;
+
+    len = (size_t)(num - 1) < ctx->num_left ? (size_t)(num - 1) : ctx->num_left;
+    eol = memchr(ctx->ptr, '\n', len);
+    if (eol)
+        len = eol - ctx->ptr + 1;
+
+    memcpy(str, ctx->ptr, len);
+    str[len] = '\0';
+    ctx->ptr += len;
+    ctx->num_left -= len;
+    return str;
+}
+
+/* See documentation in header file. */
+int ini_parse_buffer(const char* buffer, size_t len, ini_handler handler,
+                     void* user)
+{
+    ini_parse_string_ctx ctx;
+
+    ctx.ptr = buffer;
+    ctx.num_left = len;
+    return ini_parse_stream((ini_reader)ini_reader_string, &ctx, handler,
+                            user);
+}
+
+/* See documentation in header file. */
+int ini_parse_string(const char* string, ini_handler handler, void* user)
+{
+    return ini_parse_buffer(string, strlen(string), handler, user);
+}
@@ -59,6 +59,16 @@ int ini_parse_file(FILE* file, ini_handler handler, void* user);
 int ini_parse_stream(ini_reader reader, void* stream, ini_handler handler,
                      void* user);
 
+/* Same as ini_parse(), but takes a zero-terminated string with the INI data
+   instead of a file. Useful for parsing INI data from a network socket or
+   already in memory. */
+int ini_parse_string(const char* string, ini_handler handler, void* user);
+
+/* Same as ini_parse_string(), but takes a buffer of given length which does
+   not need to be zero-terminated, e.g. a memory mapped file. */
+int ini_parse_buffer(const char* buffer, size_t len, ini_handler handler,
+                     void* user);
+
 /* Nonzero to allow multi-line value parsing, in the style of Python's
    configparser. If allowed, ini_parse() will call the handler with the same
    name for each subsequent line parsed. */
@@ -0,0 +1,76 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file instance.c
+    @brief xfrpc instance implemented
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <assert.h>
+#include <syslog.h>
+
+#include "debug.h"
+#include "config.h"
+#include "login.h"
+#include "instance.h"
+
+__thread struct xfrpc_instance *cur_instance = NULL;
+
+static struct xfrpc_instance *all_instances = NULL;
+static struct xfrpc_instance *last_instance = NULL;
+static int 	instance_count = 0;
+
+// create instance of confile and make it current, exit if confile is invalid
+struct xfrpc_instance *
+new_xfrpc_instance(const char *confile)
+{
+	struct xfrpc_instance *inst = calloc(1, sizeof(struct xfrpc_instance));
+	assert(inst);
+	inst->id = instance_count++;
+	inst->g_session_id = 1;
+	inst->retry_times = 1;
+
+	if (last_instance)
+		last_instance->next = inst;
+	else
+		all_instances = inst;
+	last_instance = inst;
+
+	set_cur_instance(inst);
+	load_config(confile);
+	init_login();
+
+	debug(LOG_DEBUG, "instance %d of config file '%s' created", inst->id, confile);
+	return inst;
+}
+
+struct xfrpc_instance *
+get_all_instances()
+{
+	return all_instances;
+}
+
+int
+get_instance_count()
+{
+	return instance_count;
+}
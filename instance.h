@@ -0,0 +1,138 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file instance.h
+    @brief xfrpc instance, state of one client profile
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _INSTANCE_H_
+#define _INSTANCE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "tcpmux.h"
+
+struct common_conf;
+struct proxy_service;
+struct proxy_client;
+struct login;
+struct control;
+struct event;
+struct frp_coder;
+struct http_cache_entry;
+struct xfrpc_loop;
+struct rate_limiter;
+struct flight_ring;
+struct capture_state;
+struct replay_state;
+struct path_monitor;
+
+// one xfrpc profile loaded from its own config file, logged in to its own frps
+// many instances can share an event loop, each module keeps its state here
+// and reaches it through cur_instance which is switched by event callbacks
+struct xfrpc_instance {
+	int 	id;
+	struct xfrpc_loop 	*loop;	// event loop running the instance
+
+	// config.c
+	struct common_conf 	*c_conf;
+	struct proxy_service *all_ps;
+	char 	*config_file;
+
+	// login.c
+	struct login 	*c_login;
+
+	// control.c
+	struct control 	*main_ctl;
+	int 	client_connected;
+	int 	is_login;
+	time_t 	pong_time;
+	int 	retry_times;
+	struct tcp_mux_header 	tmux_hdr;	// header of stream data being read
+	uint32_t 	stream_len;
+	struct tmux_stream 	abandon_stream;
+	struct xfrpc_instance *draining;		// session rotated out, its streams drain
+	struct xfrpc_instance *rotated_from;	// set in a draining session
+	struct event 	*drain_timer;
+	time_t 	drain_until;
+
+	// client.c
+	struct proxy_client *all_pc;
+
+	// tcpmux.c
+	uint8_t 	remote_go_away;
+	uint8_t 	local_go_away;
+	uint32_t 	g_session_id;
+	struct tmux_stream 	*cur_stream;
+	struct tmux_stream 	*all_stream;
+
+	// crypto.c
+	struct frp_coder 	*main_encoder;
+	struct frp_coder 	*main_decoder;
+	EVP_CIPHER_CTX 		*enc_ctx;
+	EVP_CIPHER_CTX 		*dec_ctx;
+
+	// proxy_http.c
+	struct http_cache_entry *http_cache;
+	size_t 	http_cache_bytes;
+
+	// ratelimit.c
+	struct rate_limiter 	*rate_limit;
+
+	// flight.c
+	struct flight_ring 	*flight_log;
+
+	// replay.c
+	struct capture_state 	*capture_out;
+	struct replay_state 	*replay_in;
+
+	// tcpinfo.c
+	struct path_monitor 	*path_mon;
+
+	struct xfrpc_instance *next;		// all instances
+	struct xfrpc_instance *loop_next;	// instances of the same loop
+};
+
+// instance whose event is being handled by this thread
+extern __thread struct xfrpc_instance *cur_instance;
+
+static inline void
+set_cur_instance(struct xfrpc_instance *inst)
+{
+	cur_instance = inst;
+}
+
+static inline struct xfrpc_instance *
+get_cur_instance()
+{
+	return cur_instance;
+}
+
+struct xfrpc_instance *new_xfrpc_instance(const char *confile);
+
+struct xfrpc_instance *get_all_instances();
+
+int get_instance_count();
+
+#endif //_INSTANCE_H_
@@ -0,0 +1,1061 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file kcp.c
+    @brief kcp (reliable udp) transport to frps implemented
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/rand.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+
+#include "debug.h"
+#include "config.h"
+#include "kcp.h"
+#include "alloc.h"
+
+#define KCP_RTO_NDL			30	// min rto of nodelay mode
+#define KCP_RTO_MIN			100
+#define KCP_RTO_DEF			200
+#define KCP_RTO_MAX			60000
+#define KCP_ASK_SEND		1
+#define KCP_ASK_TELL		2
+#define KCP_WND_SND			32
+#define KCP_WND_RCV			128
+#define KCP_MTU_DEF			1400
+#define KCP_INTERVAL		100
+#define KCP_THRESH_INIT		2
+#define KCP_THRESH_MIN		2
+#define KCP_PROBE_INIT		7000
+#define KCP_PROBE_LIMIT		120000
+#define KCP_FASTACK_LIMIT	5
+#define KCP_DEADLINK		20
+
+// kcp-go fec header frps puts before kcp segments, parity shards are ignored
+#define FEC_HEADER_SIZE		8
+#define FEC_TYPE_DATA		0xf1
+#define FEC_TYPE_PARITY		0xf2
+
+#define KCP_PACKET_MAX		2048
+#define KCP_RECV_PENDING	(256*1024)	// stream data bufferevent may hold
+
+struct kcp_seg {
+	struct kcp_seg 	*prev;
+	struct kcp_seg 	*next;
+	uint32_t 	conv, cmd, frg, wnd, ts, sn, una, len;
+	uint32_t 	resendts, rto, fastack, xmit;
+	uint8_t 	data[];
+};
+
+// udp socket, timer and bufferevent pair of one kcp session
+struct kcp_conn {
+	struct kcp_cb 		*kcp;
+	int 				fd;
+	int 				port;
+	struct sockaddr_in 	addr;	// frps
+	struct event 		*read_ev;
+	struct event 		*timer;
+	struct bufferevent 	*user;	// pair end given to caller
+	struct bufferevent 	*inner;	// pair end pumped by kcp
+	struct event_base 	*base;
+};
+
+static inline int32_t
+timediff(uint32_t later, uint32_t earlier)
+{
+	return (int32_t)(later - earlier);
+}
+
+static inline uint32_t
+bound(uint32_t lower, uint32_t middle, uint32_t upper)
+{
+	if (middle < lower) return lower;
+	if (middle > upper) return upper;
+	return middle;
+}
+
+static uint32_t
+kcp_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+queue_init(struct kcp_queue *q)
+{
+	q->next = q->prev = (struct kcp_seg *)q;
+}
+
+static int
+queue_empty(const struct kcp_queue *q)
+{
+	return q->next == (const struct kcp_seg *)q;
+}
+
+#define queue_end(q)	((struct kcp_seg *)(q))
+
+static void
+seg_insert_after(struct kcp_seg *pos, struct kcp_seg *seg)
+{
+	seg->prev = pos;
+	seg->next = pos->next;
+	pos->next->prev = seg;
+	pos->next = seg;
+}
+
+static void
+seg_unlink(struct kcp_seg *seg)
+{
+	seg->prev->next = seg->next;
+	seg->next->prev = seg->prev;
+	seg->next = seg->prev = NULL;
+}
+
+static void
+seg_add_tail(struct kcp_queue *q, struct kcp_seg *seg)
+{
+	seg_insert_after(q->prev, seg);
+}
+
+static struct kcp_seg *
+seg_new(int size)
+{
+	struct kcp_seg *seg = xfrpc_calloc(ALLOC_KCP, sizeof(struct kcp_seg) + size);
+	assert(seg);
+	return seg;
+}
+
+static void
+queue_free(struct kcp_queue *q)
+{
+	while (!queue_empty(q)) {
+		struct kcp_seg *seg = q->next;
+		seg_unlink(seg);
+		xfrpc_free(seg);
+	}
+}
+
+static uint8_t *
+encode32(uint8_t *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+	return p + 4;
+}
+
+static uint8_t *
+encode16(uint8_t *p, uint16_t v)
+{
+	p[0] = v; p[1] = v >> 8;
+	return p + 2;
+}
+
+static uint32_t
+decode32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t
+decode16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint8_t *
+encode_seg(uint8_t *p, const struct kcp_seg *seg)
+{
+	p = encode32(p, seg->conv);
+	*p++ = seg->cmd;
+	*p++ = seg->frg;
+	p = encode16(p, seg->wnd);
+	p = encode32(p, seg->ts);
+	p = encode32(p, seg->sn);
+	p = encode32(p, seg->una);
+	p = encode32(p, seg->len);
+	return p;
+}
+
+struct kcp_cb *
+kcp_create(uint32_t conv, void *user)
+{
+	struct kcp_cb *kcp = xfrpc_calloc(ALLOC_KCP, sizeof(struct kcp_cb));
+	assert(kcp);
+	kcp->conv = conv;
+	kcp->user = user;
+	kcp->snd_wnd = KCP_WND_SND;
+	kcp->rcv_wnd = KCP_WND_RCV;
+	kcp->rmt_wnd = KCP_WND_RCV;
+	kcp->mtu = KCP_MTU_DEF;
+	kcp->mss = kcp->mtu - KCP_OVERHEAD;
+	kcp->buffer = xfrpc_malloc(ALLOC_KCP, (kcp->mtu + KCP_OVERHEAD) * 3);
+	assert(kcp->buffer);
+	queue_init(&kcp->snd_queue);
+	queue_init(&kcp->rcv_queue);
+	queue_init(&kcp->snd_buf);
+	queue_init(&kcp->rcv_buf);
+	kcp->rx_rto = KCP_RTO_DEF;
+	kcp->rx_minrto = KCP_RTO_MIN;
+	kcp->interval = KCP_INTERVAL;
+	kcp->ts_flush = KCP_INTERVAL;
+	kcp->ssthresh = KCP_THRESH_INIT;
+	kcp->fastlimit = KCP_FASTACK_LIMIT;
+	kcp->dead_link = KCP_DEADLINK;
+	return kcp;
+}
+
+void
+kcp_release(struct kcp_cb *kcp)
+{
+	if (!kcp)
+		return;
+
+	queue_free(&kcp->snd_queue);
+	queue_free(&kcp->rcv_queue);
+	queue_free(&kcp->snd_buf);
+	queue_free(&kcp->rcv_buf);
+	xfrpc_free(kcp->acklist);
+	xfrpc_free(kcp->buffer);
+	xfrpc_free(kcp);
+}
+
+int
+kcp_peeksize(const struct kcp_cb *kcp)
+{
+	if (queue_empty(&kcp->rcv_queue))
+		return -1;
+
+	const struct kcp_seg *seg = kcp->rcv_queue.next;
+	if (seg->frg == 0)
+		return seg->len;
+	if (kcp->nrcv_que < seg->frg + 1)
+		return -1;
+
+	int length = 0;
+	for (; seg != (const struct kcp_seg *)&kcp->rcv_queue; seg = seg->next) {
+		length += seg->len;
+		if (seg->frg == 0)
+			break;
+	}
+	return length;
+}
+
+// move in order segments of rcv_buf to rcv_queue
+static void
+kcp_move_rcv_buf(struct kcp_cb *kcp)
+{
+	while (!queue_empty(&kcp->rcv_buf)) {
+		struct kcp_seg *seg = kcp->rcv_buf.next;
+		if (seg->sn != kcp->rcv_nxt || kcp->nrcv_que >= kcp->rcv_wnd)
+			break;
+		seg_unlink(seg);
+		kcp->nrcv_buf--;
+		seg_add_tail(&kcp->rcv_queue, seg);
+		kcp->nrcv_que++;
+		kcp->rcv_nxt++;
+	}
+}
+
+// receive one message, or in stream mode one segment, return its length
+int
+kcp_recv(struct kcp_cb *kcp, uint8_t *buf, int len)
+{
+	int peeksize = kcp_peeksize(kcp);
+	if (peeksize < 0)
+		return -1;
+	if (peeksize > len)
+		return -2;
+
+	int recover = kcp->nrcv_que >= kcp->rcv_wnd;
+	int n = 0;
+	while (!queue_empty(&kcp->rcv_queue)) {
+		struct kcp_seg *seg = kcp->rcv_queue.next;
+		memcpy(buf + n, seg->data, seg->len);
+		n += seg->len;
+		int frg = seg->frg;
+		seg_unlink(seg);
+		xfrpc_free(seg);
+		kcp->nrcv_que--;
+		if (frg == 0)
+			break;
+	}
+
+	kcp_move_rcv_buf(kcp);
+
+	// window reopened, tell remote at once
+	if (recover && kcp->nrcv_que < kcp->rcv_wnd)
+		kcp->probe |= KCP_ASK_TELL;
+	return n;
+}
+
+int
+kcp_send(struct kcp_cb *kcp, const uint8_t *buf, int len)
+{
+	int sent = 0;
+	if (len <= 0)
+		return -1;
+
+	// stream mode fills up the last queued segment first
+	if (kcp->stream && !queue_empty(&kcp->snd_queue)) {
+		struct kcp_seg *old = kcp->snd_queue.prev;
+		if (old->len < kcp->mss) {
+			int extend = kcp->mss - old->len;
+			if (len < extend)
+				extend = len;
+			struct kcp_seg *seg = seg_new(old->len + extend);
+			memcpy(seg->data, old->data, old->len);
+			memcpy(seg->data + old->len, buf, extend);
+			seg->len = old->len + extend;
+			seg_insert_after(old, seg);
+			seg_unlink(old);
+			xfrpc_free(old);
+			buf += extend;
+			len -= extend;
+			sent = extend;
+		}
+		if (len <= 0)
+			return sent;
+	}
+
+	int count = len <= (int)kcp->mss ? 1 : (len + kcp->mss - 1) / kcp->mss;
+	if (!kcp->stream && count >= KCP_WND_RCV)
+		return -2;
+
+	for (int i = 0; i < count; i++) {
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		struct kcp_seg *seg = seg_new(size);
+		memcpy(seg->data, buf, size);
+		seg->len = size;
+		seg->frg = kcp->stream ? 0 : count - i - 1;
+		seg_add_tail(&kcp->snd_queue, seg);
+		kcp->nsnd_que++;
+		buf += size;
+		len -= size;
+		sent += size;
+	}
+	return sent;
+}
+
+static void
+kcp_update_ack(struct kcp_cb *kcp, int32_t rtt)
+{
+	if (kcp->rx_srtt == 0) {
+		kcp->rx_srtt = rtt;
+		kcp->rx_rttval = rtt / 2;
+	} else {
+		int32_t delta = rtt - kcp->rx_srtt;
+		if (delta < 0) delta = -delta;
+		kcp->rx_rttval = (3 * kcp->rx_rttval + delta) / 4;
+		kcp->rx_srtt = (7 * kcp->rx_srtt + rtt) / 8;
+		if (kcp->rx_srtt < 1) kcp->rx_srtt = 1;
+	}
+	int32_t rttval = 4 * kcp->rx_rttval;
+	int32_t rto = kcp->rx_srtt + ((int32_t)kcp->interval > rttval ? (int32_t)kcp->interval : rttval);
+	kcp->rx_rto = bound(kcp->rx_minrto, rto, KCP_RTO_MAX);
+}
+
+static void
+kcp_shrink_buf(struct kcp_cb *kcp)
+{
+	if (!queue_empty(&kcp->snd_buf))
+		kcp->snd_una = kcp->snd_buf.next->sn;
+	else
+		kcp->snd_una = kcp->snd_nxt;
+}
+
+static void
+kcp_parse_ack(struct kcp_cb *kcp, uint32_t sn)
+{
+	if (timediff(sn, kcp->snd_una) < 0 || timediff(sn, kcp->snd_nxt) >= 0)
+		return;
+
+	struct kcp_seg *seg, *next;
+	for (seg = kcp->snd_buf.next; seg != queue_end(&kcp->snd_buf); seg = next) {
+		next = seg->next;
+		if (sn == seg->sn) {
+			seg_unlink(seg);
+			xfrpc_free(seg);
+			kcp->nsnd_buf--;
+			break;
+		}
+		if (timediff(sn, seg->sn) < 0)
+			break;
+	}
+}
+
+static void
+kcp_parse_una(struct kcp_cb *kcp, uint32_t una)
+{
+	struct kcp_seg *seg, *next;
+	for (seg = kcp->snd_buf.next; seg != queue_end(&kcp->snd_buf); seg = next) {
+		next = seg->next;
+		if (timediff(una, seg->sn) <= 0)
+			break;
+		seg_unlink(seg);
+		xfrpc_free(seg);
+		kcp->nsnd_buf--;
+	}
+}
+
+static void
+kcp_parse_fastack(struct kcp_cb *kcp, uint32_t sn, uint32_t ts)
+{
+	if (timediff(sn, kcp->snd_una) < 0 || timediff(sn, kcp->snd_nxt) >= 0)
+		return;
+
+	struct kcp_seg *seg;
+	for (seg = kcp->snd_buf.next; seg != queue_end(&kcp->snd_buf); seg = seg->next) {
+		if (timediff(sn, seg->sn) < 0)
+			break;
+		if (sn != seg->sn && timediff(ts, seg->ts) >= 0)
+			seg->fastack++;
+	}
+}
+
+static void
+kcp_ack_push(struct kcp_cb *kcp, uint32_t sn, uint32_t ts)
+{
+	if (kcp->ackcount + 1 > kcp->ackblock) {
+		uint32_t block = kcp->ackblock ? kcp->ackblock * 2 : 8;
+		uint32_t *acklist = xfrpc_realloc(ALLOC_KCP, kcp->acklist, block * 2 * sizeof(uint32_t));
+		assert(acklist);
+		kcp->acklist = acklist;
+		kcp->ackblock = block;
+	}
+	kcp->acklist[kcp->ackcount * 2] = sn;
+	kcp->acklist[kcp->ackcount * 2 + 1] = ts;
+	kcp->ackcount++;
+}
+
+static void
+kcp_parse_data(struct kcp_cb *kcp, struct kcp_seg *newseg)
+{
+	uint32_t sn = newseg->sn;
+	if (timediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 || timediff(sn, kcp->rcv_nxt) < 0) {
+		xfrpc_free(newseg);
+		return;
+	}
+
+	// rcv_buf is sorted by sn, search from the tail
+	int repeat = 0;
+	struct kcp_seg *seg;
+	for (seg = kcp->rcv_buf.prev; seg != queue_end(&kcp->rcv_buf); seg = seg->prev) {
+		if (seg->sn == sn) {
+			repeat = 1;
+			break;
+		}
+		if (timediff(sn, seg->sn) > 0)
+			break;
+	}
+
+	if (repeat) {
+		xfrpc_free(newseg);
+	} else {
+		seg_insert_after(seg, newseg);
+		kcp->nrcv_buf++;
+	}
+
+	kcp_move_rcv_buf(kcp);
+}
+
+int
+kcp_input(struct kcp_cb *kcp, const uint8_t *data, int size)
+{
+	uint32_t prev_una = kcp->snd_una;
+	uint32_t maxack = 0, latest_ts = 0;
+	int flag = 0;
+
+	if (!data || size < KCP_OVERHEAD)
+		return -1;
+
+	while (size >= KCP_OVERHEAD) {
+		uint32_t conv = decode32(data);
+		uint8_t cmd = data[4];
+		uint8_t frg = data[5];
+		uint16_t wnd = decode16(data + 6);
+		uint32_t ts = decode32(data + 8);
+		uint32_t sn = decode32(data + 12);
+		uint32_t una = decode32(data + 16);
+		uint32_t len = decode32(data + 20);
+		data += KCP_OVERHEAD;
+		size -= KCP_OVERHEAD;
+
+		if (conv != kcp->conv)
+			return -1;
+		if ((uint32_t)size < len)
+			return -2;
+		if (cmd < KCP_CMD_PUSH || cmd > KCP_CMD_WINS)
+			return -3;
+
+		kcp->rmt_wnd = wnd;
+		kcp_parse_una(kcp, una);
+		kcp_shrink_buf(kcp);
+
+		if (cmd == KCP_CMD_ACK) {
+			if (timediff(kcp->current, ts) >= 0)
+				kcp_update_ack(kcp, timediff(kcp->current, ts));
+			kcp_parse_ack(kcp, sn);
+			kcp_shrink_buf(kcp);
+			if (!flag) {
+				flag = 1;
+				maxack = sn;
+				latest_ts = ts;
+			} else if (timediff(sn, maxack) > 0 && timediff(ts, latest_ts) > 0) {
+				maxack = sn;
+				latest_ts = ts;
+			}
+		} else if (cmd == KCP_CMD_PUSH) {
+			if (timediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+				kcp_ack_push(kcp, sn, ts);
+				if (timediff(sn, kcp->rcv_nxt) >= 0) {
+					struct kcp_seg *seg = seg_new(len);
+					seg->conv = conv;
+					seg->cmd = cmd;
+					seg->frg = frg;
+					seg->wnd = wnd;
+					seg->ts = ts;
+					seg->sn = sn;
+					seg->una = una;
+					seg->len = len;
+					memcpy(seg->data, data, len);
+					kcp_parse_data(kcp, seg);
+				}
+			}
+		} else if (cmd == KCP_CMD_WASK) {
+			kcp->probe |= KCP_ASK_TELL;
+		}
+
+		data += len;
+		size -= len;
+	}
+
+	if (flag)
+		kcp_parse_fastack(kcp, maxack, latest_ts);
+
+	// congestion window grows with new acks
+	if (timediff(kcp->snd_una, prev_una) > 0 && kcp->cwnd < kcp->rmt_wnd) {
+		uint32_t mss = kcp->mss;
+		if (kcp->cwnd < kcp->ssthresh) {
+			kcp->cwnd++;
+			kcp->incr += mss;
+		} else {
+			if (kcp->incr < mss)
+				kcp->incr = mss;
+			kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+			if ((kcp->cwnd + 1) * mss <= kcp->incr)
+				kcp->cwnd = (kcp->incr + mss - 1) / (mss > 0 ? mss : 1);
+		}
+		if (kcp->cwnd > kcp->rmt_wnd) {
+			kcp->cwnd = kcp->rmt_wnd;
+			kcp->incr = kcp->rmt_wnd * mss;
+		}
+	}
+	return 0;
+}
+
+static uint32_t
+kcp_wnd_unused(const struct kcp_cb *kcp)
+{
+	return kcp->nrcv_que < kcp->rcv_wnd ? kcp->rcv_wnd - kcp->nrcv_que : 0;
+}
+
+// output packet being built if seg of need bytes does not fit in
+static uint8_t *
+kcp_make_room(struct kcp_cb *kcp, uint8_t *ptr, int need)
+{
+	int size = ptr - kcp->buffer;
+	if (size + need > (int)kcp->mtu) {
+		kcp->output(kcp->buffer, size, kcp->user);
+		return kcp->buffer;
+	}
+	return ptr;
+}
+
+void
+kcp_flush(struct kcp_cb *kcp)
+{
+	uint32_t current = kcp->current;
+	uint8_t *ptr = kcp->buffer;
+	int change = 0, lost = 0;
+
+	if (!kcp->updated)
+		return;
+
+	struct kcp_seg seg;
+	memset(&seg, 0, sizeof(seg));
+	seg.conv = kcp->conv;
+	seg.cmd = KCP_CMD_ACK;
+	seg.wnd = kcp_wnd_unused(kcp);
+	seg.una = kcp->rcv_nxt;
+
+	for (uint32_t i = 0; i < kcp->ackcount; i++) {
+		ptr = kcp_make_room(kcp, ptr, KCP_OVERHEAD);
+		seg.sn = kcp->acklist[i * 2];
+		seg.ts = kcp->acklist[i * 2 + 1];
+		ptr = encode_seg(ptr, &seg);
+	}
+	kcp->ackcount = 0;
+
+	// remote window is zero, probe it from time to time
+	if (kcp->rmt_wnd == 0) {
+		if (kcp->probe_wait == 0) {
+			kcp->probe_wait = KCP_PROBE_INIT;
+			kcp->ts_probe = current + kcp->probe_wait;
+		} else if (timediff(current, kcp->ts_probe) >= 0) {
+			if (kcp->probe_wait < KCP_PROBE_INIT)
+				kcp->probe_wait = KCP_PROBE_INIT;
+			kcp->probe_wait += kcp->probe_wait / 2;
+			if (kcp->probe_wait > KCP_PROBE_LIMIT)
+				kcp->probe_wait = KCP_PROBE_LIMIT;
+			kcp->ts_probe = current + kcp->probe_wait;
+			kcp->probe |= KCP_ASK_SEND;
+		}
+	} else {
+		kcp->ts_probe = 0;
+		kcp->probe_wait = 0;
+	}
+
+	seg.sn = seg.ts = 0;
+	if (kcp->probe & KCP_ASK_SEND) {
+		seg.cmd = KCP_CMD_WASK;
+		ptr = kcp_make_room(kcp, ptr, KCP_OVERHEAD);
+		ptr = encode_seg(ptr, &seg);
+	}
+	if (kcp->probe & KCP_ASK_TELL) {
+		seg.cmd = KCP_CMD_WINS;
+		ptr = kcp_make_room(kcp, ptr, KCP_OVERHEAD);
+		ptr = encode_seg(ptr, &seg);
+	}
+	kcp->probe = 0;
+
+	uint32_t cwnd = kcp->snd_wnd < kcp->rmt_wnd ? kcp->snd_wnd : kcp->rmt_wnd;
+	if (!kcp->nocwnd && kcp->cwnd < cwnd)
+		cwnd = kcp->cwnd;
+
+	while (timediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0 && !queue_empty(&kcp->snd_queue)) {
+		struct kcp_seg *newseg = kcp->snd_queue.next;
+		seg_unlink(newseg);
+		seg_add_tail(&kcp->snd_buf, newseg);
+		kcp->nsnd_que--;
+		kcp->nsnd_buf++;
+		newseg->conv = kcp->conv;
+		newseg->cmd = KCP_CMD_PUSH;
+		newseg->wnd = seg.wnd;
+		newseg->ts = current;
+		newseg->sn = kcp->snd_nxt++;
+		newseg->una = kcp->rcv_nxt;
+		newseg->resendts = current;
+		newseg->rto = kcp->rx_rto;
+		newseg->fastack = 0;
+		newseg->xmit = 0;
+	}
+
+	uint32_t resent = kcp->fastresend > 0 ? (uint32_t)kcp->fastresend : 0xffffffff;
+	uint32_t rtomin = kcp->nodelay == 0 ? (kcp->rx_rto >> 3) : 0;
+
+	struct kcp_seg *p;
+	for (p = kcp->snd_buf.next; p != queue_end(&kcp->snd_buf); p = p->next) {
+		int needsend = 0;
+		if (p->xmit == 0) {
+			needsend = 1;
+			p->xmit++;
+			p->rto = kcp->rx_rto;
+			p->resendts = current + p->rto + rtomin;
+		} else if (timediff(current, p->resendts) >= 0) {
+			needsend = 1;
+			p->xmit++;
+			kcp->xmit++;
+			if (kcp->nodelay == 0) {
+				p->rto += p->rto > (uint32_t)kcp->rx_rto ? p->rto : (uint32_t)kcp->rx_rto;
+			} else {
+				int32_t step = kcp->nodelay < 2 ? (int32_t)p->rto : kcp->rx_rto;
+				p->rto += step / 2;
+			}
+			p->resendts = current + p->rto;
+			lost = 1;
+		} else if (p->fastack >= resent) {
+			if ((int)p->xmit <= kcp->fastlimit || kcp->fastlimit <= 0) {
+				needsend = 1;
+				p->xmit++;
+				p->fastack = 0;
+				p->resendts = current + p->rto;
+				change++;
+			}
+		}
+
+		if (needsend) {
+			p->ts = current;
+			p->wnd = seg.wnd;
+			p->una = kcp->rcv_nxt;
+			ptr = kcp_make_room(kcp, ptr, KCP_OVERHEAD + p->len);
+			ptr = encode_seg(ptr, p);
+			if (p->len > 0) {
+				memcpy(ptr, p->data, p->len);
+				ptr += p->len;
+			}
+			if (p->xmit >= kcp->dead_link)
+				kcp->state = (uint32_t)-1;
+		}
+	}
+
+	if (ptr > kcp->buffer)
+		kcp->output(kcp->buffer, ptr - kcp->buffer, kcp->user);
+
+	if (change) {
+		uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
+		kcp->ssthresh = inflight / 2;
+		if (kcp->ssthresh < KCP_THRESH_MIN)
+			kcp->ssthresh = KCP_THRESH_MIN;
+		kcp->cwnd = kcp->ssthresh + resent;
+		kcp->incr = kcp->cwnd * kcp->mss;
+	}
+
+	if (lost) {
+		kcp->ssthresh = cwnd / 2;
+		if (kcp->ssthresh < KCP_THRESH_MIN)
+			kcp->ssthresh = KCP_THRESH_MIN;
+		kcp->cwnd = 1;
+		kcp->incr = kcp->mss;
+	}
+
+	if (kcp->cwnd < 1) {
+		kcp->cwnd = 1;
+		kcp->incr = kcp->mss;
+	}
+}
+
+// called every interval ms, flushes when due
+void
+kcp_update(struct kcp_cb *kcp, uint32_t current)
+{
+	kcp->current = current;
+	if (!kcp->updated) {
+		kcp->updated = 1;
+		kcp->ts_flush = current;
+	}
+
+	int32_t slap = timediff(current, kcp->ts_flush);
+	if (slap >= 10000 || slap < -10000) {
+		kcp->ts_flush = current;
+		slap = 0;
+	}
+
+	if (slap >= 0) {
+		kcp->ts_flush += kcp->interval;
+		if (timediff(current, kcp->ts_flush) >= 0)
+			kcp->ts_flush = current + kcp->interval;
+		kcp_flush(kcp);
+	}
+}
+
+int
+kcp_waitsnd(const struct kcp_cb *kcp)
+{
+	return kcp->nsnd_buf + kcp->nsnd_que;
+}
+
+void
+kcp_nodelay(struct kcp_cb *kcp, int nodelay, int interval, int resend, int nc)
+{
+	if (nodelay >= 0) {
+		kcp->nodelay = nodelay;
+		kcp->rx_minrto = nodelay ? KCP_RTO_NDL : KCP_RTO_MIN;
+	}
+	if (interval >= 0)
+		kcp->interval = bound(10, interval, 5000);
+	if (resend >= 0)
+		kcp->fastresend = resend;
+	if (nc >= 0)
+		kcp->nocwnd = nc;
+}
+
+void
+kcp_wndsize(struct kcp_cb *kcp, int sndwnd, int rcvwnd)
+{
+	if (sndwnd > 0)
+		kcp->snd_wnd = sndwnd;
+	if (rcvwnd > 0)
+		kcp->rcv_wnd = rcvwnd > KCP_WND_RCV ? rcvwnd : KCP_WND_RCV;
+}
+
+int
+kcp_setmtu(struct kcp_cb *kcp, int mtu)
+{
+	if (mtu < 50 || mtu < KCP_OVERHEAD)
+		return -1;
+
+	uint8_t *buffer = xfrpc_malloc(ALLOC_KCP, (mtu + KCP_OVERHEAD) * 3);
+	if (!buffer)
+		return -2;
+	xfrpc_free(kcp->buffer);
+	kcp->buffer = buffer;
+	kcp->mtu = mtu;
+	kcp->mss = mtu - KCP_OVERHEAD;
+	return 0;
+}
+
+static void
+kcp_output_cb(const uint8_t *buf, int len, void *user)
+{
+	struct kcp_conn *conn = user;
+	// lost datagrams are resent by kcp
+	if (send(conn->fd, buf, len, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
+		debug(LOG_DEBUG, "kcp send error: %s", strerror(errno));
+}
+
+static void
+free_kcp_conn(struct kcp_conn *conn)
+{
+	if (conn->read_ev) event_free(conn->read_ev);
+	if (conn->timer) event_free(conn->timer);
+	if (conn->fd >= 0) close(conn->fd);
+	if (conn->inner) bufferevent_free(conn->inner);
+	kcp_release(conn->kcp);
+	xfrpc_free(conn);
+}
+
+// report error to the user end as a broken socket would, then drop the session
+static void
+kcp_conn_fail(struct kcp_conn *conn)
+{
+	if (bufferevent_pair_get_partner(conn->inner))
+		bufferevent_trigger_event(conn->user, BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
+	free_kcp_conn(conn);
+}
+
+// move stream data written by user into kcp while send window has room
+static void
+kcp_conn_pump_send(struct kcp_conn *conn)
+{
+	struct evbuffer *input = bufferevent_get_input(conn->inner);
+	int limit = conn->kcp->snd_wnd * 2;
+
+	while (evbuffer_get_length(input) > 0 && kcp_waitsnd(conn->kcp) < limit) {
+		size_t len = evbuffer_get_contiguous_space(input);
+		if (len > 64*1024)
+			len = 64*1024;
+		kcp_send(conn->kcp, evbuffer_pullup(input, len), len);
+		evbuffer_drain(input, len);
+	}
+
+	// stop taking more until acks free the window, resumed by timer
+	if (evbuffer_get_length(input) > 0)
+		bufferevent_disable(conn->inner, EV_READ);
+	else
+		bufferevent_enable(conn->inner, EV_READ);
+}
+
+// hand received stream data to user unless it holds too much already
+static void
+kcp_conn_pump_recv(struct kcp_conn *conn)
+{
+	uint8_t buf[KCP_PACKET_MAX];
+	struct evbuffer *output = bufferevent_get_output(conn->inner);
+
+	while (evbuffer_get_length(output) < KCP_RECV_PENDING) {
+		int size = kcp_peeksize(conn->kcp);
+		if (size <= 0)
+			break;
+		if (size > (int)sizeof(buf)) {
+			uint8_t *big = xfrpc_malloc(ALLOC_KCP, size);
+			assert(big);
+			kcp_recv(conn->kcp, big, size);
+			bufferevent_write(conn->inner, big, size);
+			xfrpc_free(big);
+		} else {
+			kcp_recv(conn->kcp, buf, size);
+			bufferevent_write(conn->inner, buf, size);
+		}
+	}
+}
+
+static void
+kcp_inner_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct kcp_conn *conn = ctx;
+	kcp_conn_pump_send(conn);
+	kcp_flush(conn->kcp);
+}
+
+static void
+kcp_udp_read_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct kcp_conn *conn = ctx;
+	uint8_t buf[KCP_PACKET_MAX];
+	ssize_t n;
+
+	conn->kcp->current = kcp_clock();
+	while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		uint8_t *data = buf;
+		if (n >= FEC_HEADER_SIZE) {
+			uint16_t type = decode16(buf + 4);
+			if (type == FEC_TYPE_PARITY)
+				continue;
+			if (type == FEC_TYPE_DATA) {
+				uint16_t size = decode16(buf + 6);
+				if (size < 2 || size - 2 > n - FEC_HEADER_SIZE)
+					continue;
+				data = buf + FEC_HEADER_SIZE;
+				n = size - 2;
+			}
+		}
+		kcp_input(conn->kcp, data, n);
+	}
+
+	kcp_conn_pump_recv(conn);
+}
+
+static void
+kcp_timer_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	struct kcp_conn *conn = ctx;
+
+	// user freed its end
+	if (!bufferevent_pair_get_partner(conn->inner)) {
+		free_kcp_conn(conn);
+		return;
+	}
+
+	kcp_update(conn->kcp, kcp_clock());
+	if (conn->kcp->state == (uint32_t)-1) {
+		debug(LOG_ERR, "kcp session %u dead", conn->kcp->conv);
+		kcp_conn_fail(conn);
+		return;
+	}
+
+	kcp_conn_pump_send(conn);
+	kcp_conn_pump_recv(conn);
+}
+
+static void
+kcp_conn_start(struct kcp_conn *conn, struct sockaddr_in *sin)
+{
+	// user freed its end before the session started
+	if (!bufferevent_pair_get_partner(conn->inner)) {
+		free_kcp_conn(conn);
+		return;
+	}
+
+	sin->sin_port = htons(conn->port);
+	conn->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (conn->fd < 0 || evutil_make_socket_nonblocking(conn->fd) < 0 ||
+		connect(conn->fd, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		debug(LOG_ERR, "kcp udp socket error: %s", strerror(errno));
+		kcp_conn_fail(conn);
+		return;
+	}
+
+	conn->read_ev = event_new(conn->base, conn->fd, EV_READ|EV_PERSIST, kcp_udp_read_cb, conn);
+	conn->timer = event_new(conn->base, -1, EV_PERSIST, kcp_timer_cb, conn);
+	assert(conn->read_ev && conn->timer);
+	struct timeval tv = {0, conn->kcp->interval * 1000};
+	event_add(conn->read_ev, NULL);
+	event_add(conn->timer, &tv);
+
+	bufferevent_setcb(conn->inner, kcp_inner_read_cb, NULL, NULL, conn);
+	bufferevent_enable(conn->inner, EV_READ|EV_WRITE);
+
+	// udp has no handshake, session is usable at once
+	debug(LOG_DEBUG, "kcp session %u started", conn->kcp->conv);
+	bufferevent_trigger_event(conn->user, BEV_EVENT_CONNECTED, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+static void
+kcp_dns_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	struct kcp_conn *conn = arg;
+	if (result != 0 || !res) {
+		debug(LOG_ERR, "kcp resolve server failed: %s", evutil_gai_strerror(result));
+		kcp_conn_fail(conn);
+		return;
+	}
+
+	struct sockaddr_in sin = *(struct sockaddr_in *)res->ai_addr;
+	evutil_freeaddrinfo(res);
+	kcp_conn_start(conn, &sin);
+}
+
+static void
+kcp_start_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct kcp_conn *conn = arg;
+	kcp_conn_start(conn, &conn->addr);
+}
+
+struct bufferevent *
+connect_kcp_server(struct event_base *base, struct evdns_base *dnsbase, const char *host, int port)
+{
+	struct bufferevent *pair[2];
+	if (bufferevent_pair_new(base, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS, pair) < 0)
+		return NULL;
+
+	struct kcp_conn *conn = xfrpc_calloc(ALLOC_KCP, sizeof(struct kcp_conn));
+	assert(conn);
+	conn->fd = -1;
+	conn->port = port;
+	conn->base = base;
+	conn->user = pair[0];
+	conn->inner = pair[1];
+
+	// stream mode and tunables as frpc dials kcp
+	struct common_conf *c_conf = get_common_config();
+	uint32_t conv = 0;
+	RAND_bytes((uint8_t *)&conv, sizeof(conv));
+	conn->kcp = kcp_create(conv, conn);
+	conn->kcp->output = kcp_output_cb;
+	conn->kcp->stream = 1;
+	kcp_nodelay(conn->kcp, c_conf->kcp_nodelay, c_conf->kcp_interval, c_conf->kcp_resend, c_conf->kcp_nc);
+	kcp_wndsize(conn->kcp, c_conf->kcp_snd_wnd, c_conf->kcp_rcv_wnd);
+	kcp_setmtu(conn->kcp, c_conf->kcp_mtu);
+
+	// session starts from the loop, caller sets its callbacks first
+	memset(&conn->addr, 0, sizeof(conn->addr));
+	conn->addr.sin_family = AF_INET;
+	if (inet_pton(AF_INET, host, &conn->addr.sin_addr) == 1) {
+		struct timeval tv = {0, 0};
+		event_base_once(base, -1, EV_TIMEOUT, kcp_start_cb, conn, &tv);
+		return conn->user;
+	}
+
+	struct evutil_addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	evdns_getaddrinfo(dnsbase, host, NULL, &hints, kcp_dns_cb, conn);
+	return conn->user;
+}
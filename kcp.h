@@ -0,0 +1,103 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file kcp.h
+    @brief kcp (reliable udp) transport to frps
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _KCP_H_
+#define _KCP_H_
+
+#include <stdint.h>
+
+#define KCP_OVERHEAD		24
+#define KCP_CMD_PUSH		81
+#define KCP_CMD_ACK			82
+#define KCP_CMD_WASK		83	// ask remote window
+#define KCP_CMD_WINS		84	// tell local window
+
+struct event_base;
+struct evdns_base;
+struct bufferevent;
+struct kcp_seg;
+
+// segment queue, head is a sentinel
+struct kcp_queue {
+	struct kcp_seg 	*prev;
+	struct kcp_seg 	*next;
+};
+
+// arq state of one kcp session, same protocol as ikcp and kcp-go used by frps
+struct kcp_cb {
+	uint32_t 	conv, mtu, mss, state;
+	uint32_t 	snd_una, snd_nxt, rcv_nxt;
+	uint32_t 	ssthresh;
+	int32_t 	rx_rttval, rx_srtt, rx_rto, rx_minrto;
+	uint32_t 	snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
+	uint32_t 	current, interval, ts_flush, xmit;
+	uint32_t 	nrcv_buf, nsnd_buf, nrcv_que, nsnd_que;
+	uint32_t 	nodelay, updated;
+	uint32_t 	ts_probe, probe_wait;
+	uint32_t 	dead_link, incr;
+	struct kcp_queue 	snd_queue;	// waiting for send window
+	struct kcp_queue 	rcv_queue;	// in order, ready for user
+	struct kcp_queue 	snd_buf;	// sent, waiting for ack
+	struct kcp_queue 	rcv_buf;	// out of order
+	uint32_t 	*acklist;	// sn and ts pairs to ack
+	uint32_t 	ackcount, ackblock;
+	uint8_t 	*buffer;	// packet being flushed
+	int 		fastresend, fastlimit;
+	int 		nocwnd, stream;
+	void 		*user;
+	void 		(*output)(const uint8_t *buf, int len, void *user);
+};
+
+struct kcp_cb *kcp_create(uint32_t conv, void *user);
+
+void kcp_release(struct kcp_cb *kcp);
+
+int kcp_send(struct kcp_cb *kcp, const uint8_t *buf, int len);
+
+int kcp_recv(struct kcp_cb *kcp, uint8_t *buf, int len);
+
+int kcp_peeksize(const struct kcp_cb *kcp);
+
+int kcp_input(struct kcp_cb *kcp, const uint8_t *data, int size);
+
+void kcp_update(struct kcp_cb *kcp, uint32_t current);
+
+void kcp_flush(struct kcp_cb *kcp);
+
+int kcp_waitsnd(const struct kcp_cb *kcp);
+
+void kcp_nodelay(struct kcp_cb *kcp, int nodelay, int interval, int resend, int nc);
+
+void kcp_wndsize(struct kcp_cb *kcp, int sndwnd, int rcvwnd);
+
+int kcp_setmtu(struct kcp_cb *kcp, int mtu);
+
+// open a kcp session to host:port, returns bufferevent carrying its stream,
+// BEV_EVENT_CONNECTED or BEV_EVENT_ERROR is reported like a tcp socket
+struct bufferevent *connect_kcp_server(struct event_base *base, struct evdns_base *dnsbase,
+				const char *host, int port);
+
+#endif //_KCP_H_
@@ -0,0 +1,198 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file latency.c
+    @brief setup latency of work connections, per proxy histograms
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    Each proxy client keeps monotonic time of the phases of its setup, from
+    ReqWorkConn to the first data in each direction. Time between phases goes
+    to histograms of its proxy, dumped on SIGUSR1; setup slower than
+    setup_slow_ms of common section is logged with its breakdown, which
+    tells whether dns and frps, or the local service, is slow.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "debug.h"
+#include "config.h"
+#include "client.h"
+#include "proxy.h"
+#include "instance.h"
+#include "latency.h"
+
+static const char *phase_names[SETUP_PHASE_MAX] = {
+	"req_work_conn",
+	"frps_connect",
+	"new_work_conn",
+	"start_work_conn",
+	"local_connect",
+	"first_down",
+	"first_up",
+};
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// phase the time of phase is counted from, -1 if none reached
+static int
+prev_phase(const struct proxy_client *client, int phase)
+{
+	// first data in each direction is counted from the connected setup
+	int p = phase < SETUP_FIRST_DOWN ? phase : SETUP_FIRST_DOWN;
+	while (--p >= 0) {
+		if (client->setup_ts[p])
+			return p;
+	}
+	return -1;
+}
+
+static int
+hist_bucket(uint64_t us)
+{
+	int b = 0;
+	while (us > 1 && b < SETUP_HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+// proxy of client is known since StartWorkConn, phases before it are counted then
+static void
+account_phases(struct proxy_client *client)
+{
+	struct proxy_service *ps = client->ps;
+	if (!ps)
+		return;
+
+	int p;
+	for (p = 1; p < SETUP_PHASE_MAX; p++) {
+		int q = prev_phase(client, p);
+		if (!client->setup_ts[p] || (client->setup_counted & (1 << p)) || q < 0)
+			continue;
+
+		if (!ps->setup_stats) {
+			ps->setup_stats = calloc(1, sizeof(struct setup_stats));
+			assert(ps->setup_stats);
+		}
+		struct setup_stats *st = ps->setup_stats;
+		uint64_t us = (client->setup_ts[p] - client->setup_ts[q]) / 1000;
+		st->count[p]++;
+		st->sum_us[p] += us;
+		if (us > st->max_us[p])
+			st->max_us[p] = us;
+		st->hist[p][hist_bucket(us)]++;
+		client->setup_counted |= 1 << p;
+	}
+}
+
+static void
+log_slow_setup(struct proxy_client *client, uint64_t end)
+{
+	int slow_ms = get_common_config()->setup_slow_ms;
+	uint64_t start = client->setup_ts[SETUP_REQ_WORK_CONN];
+	if (client->setup_logged || slow_ms <= 0 || !start || (end - start) / 1000000 < (uint64_t)slow_ms)
+		return;
+	client->setup_logged = 1;
+
+	char line[512];
+	int n = 0, p;
+	for (p = 1; p < SETUP_PHASE_MAX && n < sizeof(line); p++) {
+		int q = prev_phase(client, p);
+		if (client->setup_ts[p] && q >= 0)
+			n += snprintf(line + n, sizeof(line) - n, " %s %.1f", phase_names[p], 
+					(client->setup_ts[p] - client->setup_ts[q]) / 1e6);
+		else
+			n += snprintf(line + n, sizeof(line) - n, " %s -", phase_names[p]);
+	}
+	debug(LOG_WARNING, "proxy [%s] stream %u slow setup %.1f ms:%s", 
+		client->ps ? client->ps->proxy_name : "-", client->stream_id, (end - start) / 1e6, line);
+}
+
+void
+trace_setup_phase(struct proxy_client *client, enum setup_phase phase)
+{
+	if (client->setup_ts[phase])
+		return;
+
+	client->setup_ts[phase] = now_ns();
+	account_phases(client);
+	// setup is done when local service answers
+	if (phase == SETUP_FIRST_UP)
+		log_slow_setup(client, client->setup_ts[phase]);
+}
+
+void
+end_setup_trace(struct proxy_client *client)
+{
+	// closed before frps or the local service answered
+	int stuck = !client->setup_ts[SETUP_START_WORK_CONN] ||
+		(client->ps && get_proxy_type_ops(client->ps->type)->connect && 
+		 !client->setup_ts[SETUP_LOCAL_CONNECTED]);
+	if (stuck)
+		log_slow_setup(client, now_ns());
+}
+
+// upper bound of the bucket where the percentile falls, in ms
+static double
+hist_percentile(const struct setup_stats *st, int phase, double pct)
+{
+	uint32_t rank = (uint32_t)(st->count[phase] * pct), seen = 0;
+	int b;
+	for (b = 0; b < SETUP_HIST_BUCKETS; b++) {
+		seen += st->hist[phase][b];
+		if (seen > rank)
+			break;
+	}
+	return b >= SETUP_HIST_BUCKETS - 1 ? st->max_us[phase] / 1e3 : (double)(2ULL << b) / 1e3;
+}
+
+void
+dump_setup_stats()
+{
+	struct proxy_service *ps, *tmp;
+	HASH_ITER(hh, cur_instance->all_ps, ps, tmp) {
+		struct setup_stats *st = ps->setup_stats;
+		if (!st)
+			continue;
+
+		int p;
+		for (p = 1; p < SETUP_PHASE_MAX; p++) {
+			if (!st->count[p])
+				continue;
+			debug(LOG_INFO, "proxy [%s] setup %-15s n %u avg %.2f p50 %.2f p99 %.2f max %.2f ms",
+				ps->proxy_name, phase_names[p], st->count[p], 
+				st->sum_us[p] / 1e3 / st->count[p],
+				hist_percentile(st, p, 0.5), hist_percentile(st, p, 0.99),
+				st->max_us[p] / 1e3);
+		}
+	}
+}
@@ -0,0 +1,66 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file latency.h
+    @brief setup latency of work connections, per proxy histograms
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+
+struct proxy_client;
+struct proxy_service;
+
+// phases of a work connection in the order they are reached
+enum setup_phase {
+	SETUP_REQ_WORK_CONN,	// ReqWorkConn received
+	SETUP_FRPS_CONNECTED,	// work connection to frps connected, not with tcp_mux
+	SETUP_NEW_WORK_CONN,	// NewWorkConn sent
+	SETUP_START_WORK_CONN,	// StartWorkConn received
+	SETUP_LOCAL_CONNECTED,	// local service connected
+	SETUP_FIRST_DOWN,		// first data frps ---> local service
+	SETUP_FIRST_UP,			// first data local service ---> frps
+	SETUP_PHASE_MAX,
+};
+
+#define SETUP_HIST_BUCKETS	24	// log2 of microseconds, last one is 8s and above
+
+// time to reach each phase from the phase before it, per proxy
+struct setup_stats {
+	uint32_t 	count[SETUP_PHASE_MAX];
+	uint64_t 	sum_us[SETUP_PHASE_MAX];
+	uint64_t 	max_us[SETUP_PHASE_MAX];
+	uint32_t 	hist[SETUP_PHASE_MAX][SETUP_HIST_BUCKETS];
+};
+
+// record the first time client reaches phase
+void trace_setup_phase(struct proxy_client *client, enum setup_phase phase);
+
+// client is freed, setup which did not finish is logged if it was slow
+void end_setup_trace(struct proxy_client *client);
+
+// log setup latency of all proxies of current instance
+void dump_setup_stats();
+
+#endif //_LATENCY_H_
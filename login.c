@@ -42,8 +42,10 @@
 #include "version.h"
 #include "login.h"
 #include "utils.h"
+#include "instance.h"
 
-static struct login 		*c_login;
+// per instance state
+#define c_login 	(cur_instance->c_login)
 
 char *get_run_id()
 {
@@ -60,6 +62,25 @@ int is_logged()
 	return c_login->logged;
 }
 
+// session rotated out keeps a copy of the run_id, next login sends the same
+// one so frps replaces the old control and hands its proxies to the new session
+struct login *dup_run_id()
+{
+	struct login *lg = calloc(1, sizeof(struct login));
+	assert(lg);
+	lg->run_id = strdup(c_login->run_id);
+	assert(lg->run_id);
+	lg->logged = c_login->logged;
+	c_login->logged = 0;
+	return lg;
+}
+
+void free_dup_login(struct login *lg)
+{
+	SAFE_FREE(lg->run_id);
+	free(lg);
+}
+
 void init_login()
 {
 	if (! c_login) 
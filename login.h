@@ -60,6 +60,8 @@ void init_login();
 char *get_run_id();
 struct login *get_common_login_config();
 int is_logged();
+struct login *dup_run_id();
+void free_dup_login(struct login *lg);
 int login_resp_check(struct login_resp *lr);
 
 #endif //_LOGIN_H_
@@ -26,11 +26,9 @@
 
 #include "xfrpc.h"
 #include "commandline.h"
-#include "login.h"
 
 int main(int argc, char **argv)
 {
 	parse_commandline(argc, argv);
-	init_login();
 	xfrpc_loop();
 }
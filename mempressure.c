@@ -0,0 +1,384 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file mempressure.c
+    @brief degrade under memory pressure of cgroup or system
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    loop 0 samples memory every second: usage against memory.max of the
+    cgroup v2 xfrpc runs in, or against MemTotal without one, psi of memory
+    and how often memory.max was hit. past the soft percent or when tasks
+    stall on memory, receive windows of tcp_mux streams shrink, http caches
+    and allocator caches are dropped and the largest backlogs stop reading
+    until they drain. past the hard percent, when memory.max is hit or all
+    tasks stall, new work connections are refused. the level goes down
+    after some calm samples only, so it does not flap.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "config.h"
+#include "client.h"
+#include "control.h"
+#include "tcpmux.h"
+#include "proxy.h"
+#include "alloc.h"
+#include "xfrpc.h"
+#include "instance.h"
+#include "mempressure.h"
+
+#define MEM_CHECK_SEC 		1
+#define MEM_CALM_SAMPLES 	5			// samples below thresholds before level goes down
+#define PSI_SOME_SOFT 		10.0		// percent of last 10s some task stalled on memory
+#define PSI_FULL_HARD 		10.0		// percent of last 10s all tasks stalled
+#define BACKLOG_MIN 		(64 * 1024)
+#define PAUSE_MAX 			8			// backlogs paused at once in each instance
+#define PAUSE_TO_LOCAL 		1			// frps side stopped, local service is slow
+#define PAUSE_TO_FRPS 		2			// local side stopped, frps is slow
+
+struct mem_sample {
+	uint64_t 	usage;
+	uint64_t 	limit;
+	uint64_t 	max_events;		// times memory.max was hit
+	double 		some10;
+	double 		full10;
+};
+
+static int soft_pct = 0;
+static int hard_pct = 0;
+static int mem_level = MEM_OK;
+static int calm_samples = 0;
+static uint64_t last_max_events = 0;
+static char cgroup_dir[256];	// empty without cgroup v2
+// cgroup_dir and the longest file name read in it always fit
+#define CGROUP_FILE_LEN 	(sizeof(cgroup_dir) + sizeof("/memory.pressure"))
+
+static const char *level_names[] = {"ok", "soft", "hard"};
+
+static int
+read_u64(const char *path, uint64_t *v)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	char buf[64];
+	int ok = fgets(buf, sizeof(buf), fp) != NULL;
+	fclose(fp);
+	if (!ok)
+		return 0;
+	*v = strncmp(buf, "max", 3) == 0 ? 0 : strtoull(buf, NULL, 10);
+	return 1;
+}
+
+// value of "key value" or "key: value kB" line
+static int
+read_key(const char *path, const char *key, uint64_t *v)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	char line[256];
+	size_t klen = strlen(key);
+	int found = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, key, klen) == 0 && (line[klen] == ' ' || line[klen] == ':')) {
+			*v = strtoull(line + klen + 1, NULL, 10);
+			found = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	return found;
+}
+
+static void
+read_psi(const char *path, double *some10, double *full10)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "some ", 5) == 0)
+			sscanf(line, "some avg10=%lf", some10);
+		else if (strncmp(line, "full ", 5) == 0)
+			sscanf(line, "full avg10=%lf", full10);
+	}
+	fclose(fp);
+}
+
+// cgroup v2 has the single "0::/path" line
+static void
+find_cgroup()
+{
+	cgroup_dir[0] = '\0';
+	FILE *fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return;
+	char line[256], path[256];
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "0::%255s", path) != 1)
+			continue;
+		int n = snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup%s", 
+			strcmp(path, "/") ? path : "");
+		if (n < 0 || n >= sizeof(cgroup_dir)) {
+			debug(LOG_WARNING, "cgroup path %s too long, use memory of the device", path);
+			cgroup_dir[0] = '\0';
+			break;
+		}
+		char current[CGROUP_FILE_LEN];
+		snprintf(current, sizeof(current), "%s/memory.current", cgroup_dir);
+		if (access(current, R_OK) != 0)
+			cgroup_dir[0] = '\0';
+		break;
+	}
+	fclose(fp);
+}
+
+static void
+sample_memory(struct mem_sample *s)
+{
+	char path[CGROUP_FILE_LEN];
+	memset(s, 0, sizeof(*s));
+	if (cgroup_dir[0]) {
+		snprintf(path, sizeof(path), "%s/memory.current", cgroup_dir);
+		read_u64(path, &s->usage);
+		snprintf(path, sizeof(path), "%s/memory.max", cgroup_dir);
+		read_u64(path, &s->limit);
+		snprintf(path, sizeof(path), "%s/memory.events", cgroup_dir);
+		read_key(path, "max", &s->max_events);
+		snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_dir);
+		read_psi(path, &s->some10, &s->full10);
+	} else
+		read_psi("/proc/pressure/memory", &s->some10, &s->full10);
+
+	// no limit of the cgroup, memory of the device is the limit
+	if (!s->limit) {
+		uint64_t total = 0, avail = 0;
+		if (read_key("/proc/meminfo", "MemTotal", &total) && 
+			read_key("/proc/meminfo", "MemAvailable", &avail)) {
+			s->limit = total << 10;
+			if (!cgroup_dir[0])
+				s->usage = (total - avail) << 10;
+		}
+	}
+}
+
+static void
+update_mem_level()
+{
+	struct mem_sample s;
+	sample_memory(&s);
+
+	int pct = s.limit ? (int)(s.usage * 100 / s.limit) : 0;
+	int level = MEM_OK;
+	if (pct >= hard_pct)
+		level = MEM_HARD;
+	else if (pct >= soft_pct)
+		level = MEM_SOFT;
+	if (s.full10 >= PSI_FULL_HARD || s.max_events > last_max_events)
+		level = MEM_HARD;
+	else if (s.some10 >= PSI_SOME_SOFT && level < MEM_SOFT)
+		level = MEM_SOFT;
+	last_max_events = s.max_events;
+
+	int cur = get_mem_level();
+	if (level < cur && ++calm_samples < MEM_CALM_SAMPLES)
+		return;
+	calm_samples = 0;
+	if (level == cur)
+		return;
+
+	debug(level > cur ? LOG_WARNING : LOG_INFO, 
+		"memory pressure %s: %llu of %llu KB used, psi some %.1f full %.1f, memory.max hit %llu times", 
+		level_names[level], (unsigned long long)s.usage >> 10, (unsigned long long)s.limit >> 10, 
+		s.some10, s.full10, (unsigned long long)s.max_events);
+	__atomic_store_n(&mem_level, level, __ATOMIC_RELEASE);
+}
+
+static void
+pause_client(struct proxy_client *client, size_t to_local, size_t to_frps, int mux)
+{
+	if (to_local >= to_frps) {
+		// frps stops sending when the window is used up
+		if (mux)
+			client->stream.rx_paused = 1;
+		else
+			bufferevent_disable(client->ctl_bev, EV_READ);
+		client->mem_paused |= PAUSE_TO_LOCAL;
+	} else {
+		bufferevent_disable(client->local_proxy_bev, EV_READ);
+		client->mem_paused |= PAUSE_TO_FRPS;
+	}
+	debug(LOG_INFO, "memory pressure, pause stream %u with %zu bytes to local and %zu to frps", 
+		client->stream_id, to_local, to_frps);
+}
+
+static void
+resume_client(struct proxy_client *client, int mux)
+{
+	if (client->mem_paused & PAUSE_TO_LOCAL) {
+		if (mux) {
+			client->stream.rx_paused = 0;
+			if (client->stream.state == ESTABLISHED)
+				send_window_update(get_main_control()->connect_bev, &client->stream, 0);
+		} else if (client->ctl_bev)
+			bufferevent_enable(client->ctl_bev, EV_READ);
+	}
+	if ((client->mem_paused & PAUSE_TO_FRPS) && client->local_proxy_bev)
+		bufferevent_enable(client->local_proxy_bev, EV_READ);
+	client->mem_paused = 0;
+}
+
+// pause the largest backlogs of current instance, resume drained ones
+static void
+relieve_backlogs(int level)
+{
+	struct common_conf *c_conf = get_common_config();
+	int mux = c_conf->tcp_mux;
+	struct proxy_client *top[PAUSE_MAX];
+	size_t top_local[PAUSE_MAX], top_frps[PAUSE_MAX];
+	int ntop = 0;
+
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, cur_instance->all_pc, client, tmp) {
+		size_t to_local = client->local_proxy_bev ? 
+			evbuffer_get_length(bufferevent_get_output(client->local_proxy_bev)) : 0;
+		size_t to_frps = (!mux && client->ctl_bev) ? 
+			evbuffer_get_length(bufferevent_get_output(client->ctl_bev)) : 0;
+		size_t backlog = to_local + to_frps;
+		if (client->mem_paused && (level == MEM_OK || backlog < BACKLOG_MIN / 4))
+			resume_client(client, mux);
+		if (level == MEM_OK || client->mem_paused || backlog < BACKLOG_MIN || 
+			client->sockmap == SOCKMAP_RELAYED || !client->local_proxy_bev)
+			continue;
+
+		// kept sorted, largest first
+		if (ntop == PAUSE_MAX && top_local[ntop - 1] + top_frps[ntop - 1] >= backlog)
+			continue;
+		int i = ntop < PAUSE_MAX ? ntop++ : PAUSE_MAX - 1;
+		for (; i > 0 && top_local[i - 1] + top_frps[i - 1] < backlog; i--) {
+			top[i] = top[i - 1];
+			top_local[i] = top_local[i - 1];
+			top_frps[i] = top_frps[i - 1];
+		}
+		top[i] = client;
+		top_local[i] = to_local;
+		top_frps[i] = to_frps;
+	}
+
+	int i;
+	for (i = 0; i < ntop; i++)
+		pause_client(top[i], top_local[i], top_frps[i], mux);
+}
+
+static void
+mem_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct xfrpc_loop *loop = arg;
+	if (loop->id == 0)
+		update_mem_level();
+	int level = get_mem_level();
+
+	// caches are dropped once, when pressure starts
+	if (level > MEM_OK && loop->mem_level == MEM_OK)
+		trim_allocator();
+
+	struct xfrpc_instance *inst;
+	for (inst = loop->instances; inst; inst = inst->loop_next) {
+		struct xfrpc_instance *i = inst;
+		for (; i; i = i == inst ? inst->draining : NULL) {
+			set_cur_instance(i);
+			if (level > MEM_OK && loop->mem_level == MEM_OK)
+				clear_http_cache();
+			relieve_backlogs(level);
+		}
+	}
+	loop->mem_level = level;
+}
+
+void
+init_mem_pressure(int soft, int hard)
+{
+	if (hard <= 0)
+		return;
+	hard_pct = hard > 100 ? 100 : hard;
+	soft_pct = soft > 0 && soft < hard_pct ? soft : hard_pct;
+
+	find_cgroup();
+	struct mem_sample s;
+	sample_memory(&s);
+	last_max_events = s.max_events;
+	debug(LOG_INFO, "memory pressure at %d%% and %d%% of %llu KB, %s", soft_pct, hard_pct, 
+		(unsigned long long)s.limit >> 10, cgroup_dir[0] ? cgroup_dir : "no cgroup v2");
+}
+
+void
+start_mem_pressure(struct xfrpc_loop *loop)
+{
+	if (!hard_pct)
+		return;
+	loop->mem_event = event_new(loop->base, -1, EV_PERSIST, mem_timer_cb, loop);
+	if (!loop->mem_event) {
+		debug(LOG_ERR, "error: memory pressure timer init failed!");
+		return;
+	}
+	struct timeval tv = {MEM_CHECK_SEC, 0};
+	event_add(loop->mem_event, &tv);
+}
+
+void
+stop_mem_pressure(struct xfrpc_loop *loop)
+{
+	if (loop->mem_event)
+		event_free(loop->mem_event);
+	loop->mem_event = NULL;
+}
+
+int
+get_mem_level()
+{
+	return __atomic_load_n(&mem_level, __ATOMIC_ACQUIRE);
+}
+
+uint32_t
+mux_window_max()
+{
+	switch (get_mem_level()) {
+	case MEM_HARD:
+		return MAX_STREAM_WINDOW_SIZE / 16;
+	case MEM_SOFT:
+		return MAX_STREAM_WINDOW_SIZE / 4;
+	default:
+		return MAX_STREAM_WINDOW_SIZE;
+	}
+}
@@ -0,0 +1,53 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file mempressure.h
+    @brief degrade under memory pressure of cgroup or system
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _MEMPRESSURE_H_
+#define _MEMPRESSURE_H_
+
+#include <stdint.h>
+
+struct xfrpc_loop;
+
+enum mem_level {
+	MEM_OK = 0,
+	MEM_SOFT,		// windows cut, caches dropped, biggest backlogs paused
+	MEM_HARD,		// new work connections refused as well
+};
+
+// soft and hard are percents of the memory limit, 0 disables it
+void init_mem_pressure(int soft, int hard);
+
+void start_mem_pressure(struct xfrpc_loop *loop);
+
+void stop_mem_pressure(struct xfrpc_loop *loop);
+
+int get_mem_level();
+
+// receive window a tcp_mux stream is granted at current level
+uint32_t mux_window_max();
+
+#endif //_MEMPRESSURE_H_
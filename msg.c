@@ -39,7 +39,9 @@
 #include "common.h"
 #include "login.h"
 #include "client.h"
+#include "proxy.h"
 #include "utils.h"
+#include "alloc.h"
 
 #define JSON_MARSHAL_TYPE(jobj,key,jtype,item)		\
 json_object_object_add(jobj, key, json_object_new_##jtype((item)));
@@ -51,6 +53,7 @@ const char msg_types[] = {TypeLogin,
 						 TypeLoginResp, 
 						 TypeNewProxy, 
 						 TypeNewProxyResp, 
+						 TypeCloseProxy, 
 						 TypeNewWorkConn, 
 						 TypeReqWorkConn, 
 						 TypeStartWorkConn, 
@@ -160,7 +163,7 @@ login_request_marshal(char **msg)
 	tmp = json_object_to_json_string(j_login_req);
 	if (tmp && strlen(tmp) > 0) {
 		nret = strlen(tmp);
-		*msg = strdup(tmp);
+		*msg = xfrpc_strdup(ALLOC_MSG, tmp);
 		assert(*msg);
 	}
 	json_object_put(j_login_req);
@@ -181,20 +184,13 @@ new_proxy_service_marshal(const struct proxy_service *np_req, char **msg)
 		return 0;
 	
 	JSON_MARSHAL_TYPE(j_np_req, "proxy_name", string, np_req->proxy_name);
-	// if proxy_type is socks5, set the proxy_type to tcp
-	if (strcmp(np_req->proxy_type, "socks5") == 0 || strcmp(np_req->proxy_type, "mstsc") == 0) {
-		JSON_MARSHAL_TYPE(j_np_req, "proxy_type", string, "tcp");
-	} else {
-		JSON_MARSHAL_TYPE(j_np_req, "proxy_type", string, np_req->proxy_type);
-	}
+	// socks5 and mstsc are registered as tcp proxy
+	const struct proxy_type_ops *ops = get_proxy_type_ops(np_req->type);
+	JSON_MARSHAL_TYPE(j_np_req, "proxy_type", string, ops->wire_name);
 	JSON_MARSHAL_TYPE(j_np_req, "use_encryption", boolean, np_req->use_encryption);
 	JSON_MARSHAL_TYPE(j_np_req, "use_compression", boolean, np_req->use_compression);
 
-	// if proxy_type is tcp, http, https and socks5, set group and group_key to j_np_req
-	if (strcmp(np_req->proxy_type, "tcp") == 0 || 
-		strcmp(np_req->proxy_type, "http") == 0 || 
-		strcmp(np_req->proxy_type, "https") == 0 || 
-		strcmp(np_req->proxy_type, "socks5") == 0) {
+	if (ops->flags & PROXY_F_GROUP) {
 		
 		if (np_req->group) {
 			JSON_MARSHAL_TYPE(j_np_req, "group", string, np_req->group);
@@ -241,7 +237,7 @@ new_proxy_service_marshal(const struct proxy_service *np_req, char **msg)
 	tmp = json_object_to_json_string(j_np_req);
 	if (tmp && strlen(tmp) > 0) {
 		nret = strlen(tmp);
-		*msg = strdup(tmp);
+		*msg = xfrpc_strdup(ALLOC_MSG, tmp);
 		assert(*msg);
 	}
 	json_object_put(j_np_req);
@@ -262,7 +258,7 @@ new_work_conn_marshal(const struct work_conn *work_c, char **msg)
 	tmp = json_object_to_json_string(j_new_work_conn);
 	if (tmp && strlen(tmp) > 0) {
 		nret = strlen(tmp);
-		*msg = strdup(tmp);
+		*msg = xfrpc_strdup(ALLOC_MSG, tmp);
 		assert(*msg);
 	}
 
@@ -271,6 +267,28 @@ new_work_conn_marshal(const struct work_conn *work_c, char **msg)
 	return nret;
 }
 
+int 
+close_proxy_marshal(const char *proxy_name, char **msg)
+{
+	const char *tmp = NULL;
+	int nret = 0;
+	struct json_object *j_close_proxy = json_object_new_object();
+	if (! j_close_proxy)
+		return 0;
+
+	JSON_MARSHAL_TYPE(j_close_proxy, "proxy_name", string, SAFE_JSON_STRING(proxy_name));
+	tmp = json_object_to_json_string(j_close_proxy);
+	if (tmp && strlen(tmp) > 0) {
+		nret = strlen(tmp);
+		*msg = xfrpc_strdup(ALLOC_MSG, tmp);
+		assert(*msg);
+	}
+
+	json_object_put(j_close_proxy);
+
+	return nret;
+}
+
 // result returned of this func need be free
 struct new_proxy_response *
 new_proxy_resp_unmarshal(const char *jres)
@@ -364,6 +382,14 @@ start_work_conn_resp_unmarshal(const char *resp_msg)
 	sr->proxy_name = strdup(json_object_get_string(pn));
 	assert(sr->proxy_name);
 
+	struct json_object *sa = NULL;
+	const char *src_addr = NULL;
+	if (json_object_object_get_ex(j_start_w_res, "src_addr", &sa) && 
+		(src_addr = json_object_get_string(sa)) && *src_addr) {
+		sr->src_addr = strdup(src_addr);
+		assert(sr->src_addr);
+	}
+
 START_W_C_R_END:
 	json_object_put(j_start_w_res);
 	return sr;
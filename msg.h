@@ -94,6 +94,7 @@ struct __attribute__((__packed__)) msg_hdr {
 
 struct start_work_conn_resp {
 	char 	*proxy_name;
+	char 	*src_addr;	// address of the user, NULL if frps did not tell
 };
 
 int new_proxy_service_marshal(const struct proxy_service *np_req, char **msg);
@@ -111,6 +112,7 @@ struct start_work_conn_resp *start_work_conn_resp_unmarshal(const char *resp_msg
 struct control_response *control_response_unmarshal(const char *jres);
 struct work_conn *new_work_conn();
 int new_work_conn_marshal(const struct work_conn *work_c, char **msg);
+int close_proxy_marshal(const char *proxy_name, char **msg);
 
 void control_response_free(struct control_response *res);
 
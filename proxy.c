@@ -41,20 +41,114 @@
 #include "proxy.h"
 #include "config.h"
 
-struct proxy *
-new_proxy_obj(struct bufferevent *bev)
+static const struct proxy_type_ops proxy_types[PROXY_TYPE_MAX] = {
+	[PROXY_TYPE_TCP] = {
+		.name 			= "tcp",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_GROUP|PROXY_F_FORWARD,
+		.connect 		= tcp_proxy_connect,
+		.on_local_data 	= tcp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= tcp_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+	},
+	// mstsc is a tcp proxy whose local service is served by tcp_redir
+	[PROXY_TYPE_MSTSC] = {
+		.name 			= "mstsc",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_FORWARD,
+		.connect 		= tcp_proxy_connect,
+		.on_local_data 	= tcp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= tcp_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+	},
+	// socks5 connects its target after parsing the request from frps
+	[PROXY_TYPE_SOCKS5] = {
+		.name 			= "socks5",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_GROUP,
+		.on_local_data 	= tcp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= handle_socks5,
+		.on_connected 	= socks5_proxy_connected,
+		.on_close 		= socks5_proxy_close,
+		.on_free 		= socks5_proxy_free,
+	},
+	[PROXY_TYPE_HTTP] = {
+		.name 			= "http",
+		.wire_name 		= "http",
+		.flags 			= PROXY_F_GROUP,
+		.connect 		= http_proxy_connect,
+		.on_local_data 	= http_proxy_c2s_cb,
+		.on_remote_data = http_proxy_s2c_cb,
+		.on_mux_data 	= http_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+		.on_free 		= http_proxy_free,
+	},
+	[PROXY_TYPE_HTTPS] = {
+		.name 			= "https",
+		.wire_name 		= "https",
+		.flags 			= PROXY_F_GROUP|PROXY_F_FORWARD,
+		.connect 		= tcp_proxy_connect,
+		.on_local_data 	= tcp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= tcp_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+	},
+	// ftp control connection, passive replies are rewritten to frps data port
+	[PROXY_TYPE_FTP] = {
+		.name 			= "ftp",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_FORWARD,
+		.connect 		= tcp_proxy_connect,
+		.on_local_data 	= ftp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= tcp_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+		.on_free 		= ftp_proxy_free,
+	},
+	// ftp data connection, connects passive endpoint announced by ftp server
+	[PROXY_TYPE_FTP_DATA] = {
+		.name 			= "ftp_data",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_INTERNAL|PROXY_F_FORWARD,
+		.connect 		= ftp_data_proxy_connect,
+		.on_local_data 	= tcp_proxy_c2s_cb,
+		.on_remote_data = tcp_proxy_s2c_cb,
+		.on_mux_data 	= tcp_proxy_mux_data,
+		.on_close 		= tcp_proxy_close,
+	},
+	// local directory served on work connection, no local service
+	[PROXY_TYPE_STATIC_FILE] = {
+		.name 			= "static_file",
+		.wire_name 		= "tcp",
+		.flags 			= PROXY_F_GROUP,
+		.on_remote_data = static_file_proxy_s2c_cb,
+		.on_mux_data 	= static_file_proxy_mux_data,
+		.on_window_update = static_file_proxy_window_update,
+		.on_free 		= static_file_proxy_free,
+	},
+};
+
+const struct proxy_type_ops *
+get_proxy_type_ops(enum proxy_type type)
 {
-	struct proxy *p = (struct proxy *)calloc(1, sizeof(struct proxy));
-	assert(p);
-	p->bev = bev;
-	p->remote_data_port = -1;
-	p->proxy_name = NULL;
-	return p;
+	assert(type >= 0 && type < PROXY_TYPE_MAX);
+	return &proxy_types[type];
 }
 
-void 
-free_proxy_obj(struct proxy *p)
+// return -1 if name is not a supported proxy type
+int 
+get_proxy_type_by_name(const char *name)
 {
-	SAFE_FREE(p->proxy_name);
-	SAFE_FREE(p);
+	if (!name)
+		return -1;
+
+	for (int i = 0; i < PROXY_TYPE_MAX; i++) {
+		if (!(proxy_types[i].flags & PROXY_F_INTERNAL) && strcmp(proxy_types[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
 }
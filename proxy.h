@@ -38,31 +38,65 @@
 #include "common.h"
 #include "tcpmux.h"
 
-#define IP_LEN 16
+struct xfrpc_instance;
 
-struct ftp_pasv {
-	int 	code;
-	char	ftp_server_ip[IP_LEN];
-	int		ftp_server_port;
-};
+#define PROXY_F_GROUP		0x01	// support load balance group
+#define PROXY_F_INTERNAL	0x02	// created by xfrpc, can not be set in config file
+#define PROXY_F_FORWARD		0x04	// data of frps is forwarded to local service as is
+
+// per proxy type handlers, dispatched by proxy_service type on the data path
+struct proxy_type_ops {
+	const char 	*name;		// type name in config file
+	const char 	*wire_name;	// type name registered to frps
+	int 		flags;
 
-struct proxy {
-	struct bufferevent 	*bev;
-	char 				*proxy_name;
-	int 				remote_data_port;	//used in ftp proxy
+	// connect local service when work connection started, return 0 if failed
+	// NULL means local service is connected later by on_mux_data
+	int 		(*connect)(struct proxy_client *client);
+	// local service ---> xfrpc
+	bufferevent_data_cb on_local_data;
+	// frps ---> xfrpc when tcp_mux disabled
+	bufferevent_data_cb on_remote_data;
+	// frps ---> xfrpc when tcp_mux enabled, return consumed length of rb
+	uint32_t 	(*on_mux_data)(struct proxy_client *client, struct ring_buffer *rb, int len);
+	// local service connected
+	void 		(*on_connected)(struct proxy_client *client);
+	// send window of stream increased when tcp_mux enabled
+	void 		(*on_window_update)(struct proxy_client *client);
+	// local service connection closed
+	void 		(*on_close)(struct proxy_client *client);
+	// client is being freed
+	void 		(*on_free)(struct proxy_client *client);
 };
 
+const struct proxy_type_ops *get_proxy_type_ops(enum proxy_type type);
+int get_proxy_type_by_name(const char *name);
+
 void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
 void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
 void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
-void ftp_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
-struct proxy *new_proxy_obj(struct bufferevent *bev);
-void free_proxy_obj(struct proxy *p);
-void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name, 
-								struct ftp_pasv *local_fp, 
-								struct ftp_pasv *remote_fp);
+int ftp_data_proxy_connect(struct proxy_client *client);
+void ftp_proxy_free(struct proxy_client *client);
+void http_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
+void http_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
+int http_proxy_connect(struct proxy_client *client);
+uint32_t http_proxy_mux_data(struct proxy_client *client, struct ring_buffer *rb, int len);
+void http_proxy_free(struct proxy_client *client);
+void clear_http_cache();
+int get_http_start_line(const char *head, size_t len, char *line, size_t line_len);
+int get_http_header(const char *head, size_t len, const char *name, char *value, size_t value_len);
+void static_file_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
+uint32_t static_file_proxy_mux_data(struct proxy_client *client, struct ring_buffer *rb, int len);
+void static_file_proxy_window_update(struct proxy_client *client);
+void static_file_proxy_free(struct proxy_client *client);
 
+int tcp_proxy_connect(struct proxy_client *client);
+uint32_t tcp_proxy_mux_data(struct proxy_client *client, struct ring_buffer *rb, int len);
+void tcp_proxy_close(struct proxy_client *client);
+void tcp_proxy_send_remote(struct proxy_client *client, struct bufferevent *bev, struct evbuffer *buf);
+void socks5_proxy_connected(struct proxy_client *client);
+void socks5_proxy_close(struct proxy_client *client);
+void socks5_proxy_free(struct proxy_client *client);
 uint32_t handle_socks5(struct proxy_client *client, struct ring_buffer *rb, int len);
-uint32_t handle_ss5(struct proxy_client *client, struct ring_buffer *rb, int len);
 
 #endif //_PROXY_H_
@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <syslog.h>
 
@@ -19,249 +21,310 @@
 #include "proxy.h"
 #include "config.h"
 #include "client.h"
+#include "control.h"
+#include "utils.h"
+#include "tcpmux.h"
+#include "crypto_pool.h"
+#include "instance.h"
 
 #define FTP_PRO_BUF 		256
 #define FTP_PASV_PORT_BLOCK 256
-
-static struct ftp_pasv *new_ftp_pasv();
-static void free_ftp_pasv(struct ftp_pasv *fp);
-static struct ftp_pasv * pasv_unpack(char *data);
-static size_t pasv_pack(struct ftp_pasv *fp, char **pack_p);
-
-void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name, 
-								struct ftp_pasv *local_fp, 
-								struct ftp_pasv *remote_fp)
+#define FTP_REPLY_CODE_LEN	4		// "227 "
+#define FTP_DATA_EP_TTL		60		// seconds a passive endpoint waits for its data connection
+#define FTP_DATA_EP_MAX		8		// pending endpoints of one control connection
+
+// local passive endpoint announced by ftp server on a control connection,
+// consumed by a data connection of the same ftp user
+struct ftp_data_endpoint {
+	char 	ip[INET6_ADDRSTRLEN];
+	int 	port;
+	time_t 	expire;
+	struct ftp_data_endpoint *next;
+};
+
+// drop endpoints whose data connection never came
+static void
+expire_data_endpoints(struct proxy_client *client, time_t now)
 {
-	struct proxy_service *ps = NULL;
-	char *ftp_data_proxy_name = get_ftp_data_proxy_name(ftp_proxy_name);
-
-	struct proxy_service *p_services = get_all_proxy_services();
-	HASH_FIND_STR(p_services, ftp_data_proxy_name, ps);
-	if (!ps) {
-		debug(LOG_ERR, 
-			"error: ftp data proxy not inserted in proxy-service queue, it should not happend!");
-		goto FTP_DATA_PROXY_TUNNEL_END;
+	struct ftp_data_endpoint *ep;
+	while ((ep = client->ftp_data_eps) && ep->expire <= now) {
+		client->ftp_data_eps = ep->next;
+		free(ep);
 	}
+}
 
-	ps->local_port = local_fp->ftp_server_port;
-	ps->local_ip = strdup(local_fp->ftp_server_ip);
-	assert(ps->local_ip);
-
-	ps->remote_port = remote_fp->ftp_server_port;
-
-	debug(LOG_DEBUG, 
-		"set ftp proxy DATA port [local:remote] = [%d:%d]", 
-		ps->local_port, ps->remote_port);
+static void
+push_data_endpoint(struct proxy_client *client, const char *ip, int port)
+{
+	time_t now = time(NULL);
+	expire_data_endpoints(client, now);
+
+	struct ftp_data_endpoint **pp = &client->ftp_data_eps;
+	int count = 0;
+	for (; *pp; pp = &(*pp)->next)
+		count++;
+	// drop the oldest endpoint when the ftp client never connects its data channel
+	if (count >= FTP_DATA_EP_MAX) {
+		struct ftp_data_endpoint *ep = client->ftp_data_eps;
+		client->ftp_data_eps = ep->next;
+		if (!ep->next)
+			pp = &client->ftp_data_eps;
+		free(ep);
+	}
 
-FTP_DATA_PROXY_TUNNEL_END:
-	free(ftp_data_proxy_name);
+	struct ftp_data_endpoint *ep = calloc(1, sizeof(struct ftp_data_endpoint));
+	assert(ep);
+	snprintf(ep->ip, sizeof(ep->ip), "%s", ip);
+	ep->port = port;
+	ep->expire = now + FTP_DATA_EP_TTL;
+	*pp = ep;
 }
 
-// read from client-working host port
-void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
+// pop the oldest endpoint of the control connections of proxy_name whose ftp
+// user is at src_addr, any user matches if frps did not tell an address.
+// control connections of a draining session still get their data connections
+static struct ftp_data_endpoint *
+pop_data_endpoint(const char *proxy_name, const char *src_addr)
 {
-	struct proxy *p = (struct proxy *)ctx;
-	assert(p);
-	struct bufferevent *partner = p->bev;
-
-	struct evbuffer *src, *dst;
-	size_t len;
-	src = bufferevent_get_input(bev);
-	len = evbuffer_get_length(src);
-	if (len < 0)
-		return;
+	struct xfrpc_instance *insts[] = {cur_instance, cur_instance->draining};
+	struct proxy_client *owner = NULL;
+	time_t now = time(NULL);
+
+	for (int i = 0; i < 2 && insts[i]; i++) {
+		struct proxy_client *c, *tmp;
+		HASH_ITER(hh, insts[i]->all_pc, c, tmp) {
+			if (!c->ps || c->ps->type != PROXY_TYPE_FTP || strcmp(c->ps->proxy_name, proxy_name))
+				continue;
+			expire_data_endpoints(c, now);
+			if (!c->ftp_data_eps || (src_addr[0] && c->src_addr[0] && strcmp(c->src_addr, src_addr)))
+				continue;
+			if (!owner || c->ftp_data_eps->expire < owner->ftp_data_eps->expire)
+				owner = c;
+		}
+	}
 
-	dst = bufferevent_get_output(partner);
-	assert(dst);
+	if (!owner)
+		return NULL;
+	struct ftp_data_endpoint *ep = owner->ftp_data_eps;
+	owner->ftp_data_eps = ep->next;
+	return ep;
+}
 
-	unsigned char *buf = calloc(1, len);
-	assert(buf);
-	size_t read_n = 0;
-	read_n = evbuffer_remove(src, buf, len);
-
-// #define FTP_P_DEBUG 1
-#ifdef FTP_P_DEBUG
-	char *dbg_buf = calloc(1, read_n * 7 + 1);
-	assert(dbg_buf);
-	unsigned int i = 0;
-	for(i = 0; i<read_n && ((2 * i) < (read_n * 2 + 1)); i++) {
-		snprintf(dbg_buf + 7*i, 8, "%3u[%c] ", 
-			(unsigned char)buf[i], 
-			(unsigned char)buf[i]);
+void
+ftp_proxy_free(struct proxy_client *client)
+{
+	struct ftp_data_endpoint *ep, *next;
+	for (ep = client->ftp_data_eps; ep; ep = next) {
+		next = ep->next;
+		free(ep);
 	}
-	debug(LOG_DEBUG, "FTP Client RECV ctl byte:%s", dbg_buf);
-	debug(LOG_DEBUG, "FTP Client RECV ctl stri:%s", buf);
-	SAFE_FREE(dbg_buf);
-#endif //FTP_P_DEBUG
+	client->ftp_data_eps = NULL;
+}
 
-	struct ftp_pasv *local_fp = pasv_unpack((char *)buf);
+// connect the ftp server passive endpoint announced earlier
+int
+ftp_data_proxy_connect(struct proxy_client *client)
+{
+	struct proxy_service *ps = client->ps;
+	struct ftp_data_endpoint *ep = pop_data_endpoint(ps->ftp_cfg_proxy_name, client->src_addr);
+	if (!ep) {
+		debug(LOG_ERR, "ftp data proxy [%s] has no pending passive endpoint", ps->proxy_name);
+		return 0;
+	}
 
-	if (local_fp) {
-		struct common_conf *c_conf = get_common_config();
-		struct ftp_pasv *r_fp = new_ftp_pasv();
-		r_fp->code = local_fp->code;
+	debug(LOG_DEBUG, "ftp data proxy [%s] connect [%s:%d]", ps->proxy_name, ep->ip, ep->port);
+	client->local_proxy_bev = connect_server(client->base, ep->ip, ep->port);
+	free(ep);
+	if (!client->local_proxy_bev) {
+		debug(LOG_ERR, "ftp data proxy [%s] connect failed!", ps->proxy_name);
+		return 0;
+	}
 
-		if (! c_conf->server_addr) {
-			debug(LOG_ERR, "error: FTP proxy without server ip!");
-			exit(0);
-		}
+	return 1;
+}
 
-		strncpy(r_fp->ftp_server_ip, c_conf->server_addr, IP_LEN);
-		r_fp->ftp_server_port = p->remote_data_port;
+// ipv4 address of frps that ftp clients connect for data channel
+static int
+get_ftp_server_ip(char *ip, size_t len)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (is_valid_ip_address(c_conf->server_addr)) {
+		snprintf(ip, len, "%s", c_conf->server_addr);
+		return 1;
+	}
 
-		if (r_fp->ftp_server_port <= 0) {
-			debug(LOG_ERR, "error: remote ftp data port is not init!");
-			goto FTP_C2S_CB_END;
-		}
+	// server_addr is a domain, use the address control connection resolved
+	struct bufferevent *bev = get_main_control()->connect_bev;
+	if (bev && bufferevent_get_underlying(bev))
+		bev = bufferevent_get_underlying(bev);	// tls filter over the socket
+	struct sockaddr_in sin;
+	socklen_t sin_len = sizeof(sin);
+	if (!bev || getpeername(bufferevent_getfd(bev), (struct sockaddr *)&sin, &sin_len) < 0 ||
+		sin.sin_family != AF_INET)
+		return 0;
+
+	return inet_ntop(AF_INET, &sin.sin_addr, ip, len) != NULL;
+}
 
-		char *pasv_msg = NULL;
-		size_t pack_len = pasv_pack(r_fp, &pasv_msg);
-		if ( ! pack_len){
-			debug(LOG_ERR, "error: ftp proxy replace failed!");
-			SAFE_FREE(pasv_msg);
-			goto FTP_C2S_CB_END;
-		}
+// rewrite "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)" to frps address
+// return length of rewritten reply in out, 0 if line is not understood
+static size_t
+rewrite_pasv_reply(struct proxy_client *client, const char *line, char *out, size_t out_len)
+{
+	unsigned int h[4], p[2];
+	const char *args = strchr(line + FTP_REPLY_CODE_LEN, '(');
+	if (!args) {
+		// some servers omit the parentheses
+		args = line + FTP_REPLY_CODE_LEN;
+		while (*args && (*args < '0' || *args > '9'))
+			args++;
+	} else {
+		args++;
+	}
 
-#ifdef FTP_P_DEBUG
-		debug(LOG_DEBUG, "ftp pack result:%s", pasv_msg);
-#endif //FTP_P_DEBUG
+	if (sscanf(args, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6 ||
+		h[0] > 255 || h[1] > 255 || h[2] > 255 || h[3] > 255 || p[0] > 255 || p[1] > 255)
+		return 0;
+
+	char local_ip[INET6_ADDRSTRLEN];
+	snprintf(local_ip, sizeof(local_ip), "%u.%u.%u.%u", h[0], h[1], h[2], h[3]);
+	// server listening on any address is reached by local_ip of proxy
+	if (strcmp(local_ip, "0.0.0.0") == 0 && client->ps->local_ip)
+		snprintf(local_ip, sizeof(local_ip), "%s", client->ps->local_ip);
+
+	char server_ip[INET_ADDRSTRLEN];
+	int port = client->ps->remote_data_port;
+	if (port <= 0 || !get_ftp_server_ip(server_ip, sizeof(server_ip))) {
+		debug(LOG_ERR, "error: ftp proxy [%s] remote data address is not ready!", client->ps->proxy_name);
+		return 0;
+	}
 
-		set_ftp_data_proxy_tunnel(p->proxy_name, local_fp, r_fp);
-		evbuffer_add(dst, pasv_msg, pack_len);
-		SAFE_FREE(pasv_msg);
-	} else {
-		evbuffer_add(dst, buf, read_n);
+	for (char *c = server_ip; *c; c++) {
+		if (*c == '.')
+			*c = ',';
 	}
 
-FTP_C2S_CB_END:
-	SAFE_FREE(buf);
-	free_ftp_pasv(local_fp);
-	return;
+	push_data_endpoint(client, local_ip, p[0] * FTP_PASV_PORT_BLOCK + p[1]);
+	return snprintf(out, out_len, "227 Entering Passive Mode (%s,%d,%d).\r\n",
+					server_ip, port / FTP_PASV_PORT_BLOCK, port % FTP_PASV_PORT_BLOCK);
 }
 
-void ftp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
+// rewrite "229 Entering Extended Passive Mode (|||port|)", the address of
+// epsv is the one of control connection, so only port is replaced
+static size_t
+rewrite_epsv_reply(struct proxy_client *client, const char *line, char *out, size_t out_len)
 {
-	tcp_proxy_s2c_cb(bev, ctx);
+	unsigned int port;
+	char delim;
+	const char *args = strchr(line + FTP_REPLY_CODE_LEN, '(');
+	if (!args || sscanf(args + 1, "%c%*c%*c%u", &delim, &port) != 2 || port > 65535)
+		return 0;
+
+	if (client->ps->remote_data_port <= 0) {
+		debug(LOG_ERR, "error: ftp proxy [%s] remote data port is not ready!", client->ps->proxy_name);
+		return 0;
+	}
+
+	const char *local_ip = client->ps->local_ip ? client->ps->local_ip : "127.0.0.1";
+	push_data_endpoint(client, local_ip, port);
+	return snprintf(out, out_len, "229 Entering Extended Passive Mode (%c%c%c%d%c)\r\n",
+					delim, delim, delim, client->ps->remote_data_port, delim);
 }
 
-static struct ftp_pasv *pasv_unpack(char *data)
+// handle the line at start of src which is a 227 or 229 reply
+// return 0 if more data needed
+static int
+handle_passive_reply(struct proxy_client *client, struct evbuffer *src, struct evbuffer *dst)
 {
-	char cd_buf[4] = {0};
-	snprintf(cd_buf, 4, "%s", data);
-	int code = atoi(cd_buf);
-	if (code != 227 && code != 211 && code != 229)
-		return NULL;
+	size_t eol_len = 0;
+	struct evbuffer_ptr eol = evbuffer_search_eol(src, NULL, &eol_len, EVBUFFER_EOL_LF);
+	if (eol.pos < 0) {
+		if (evbuffer_get_length(src) < FTP_PRO_BUF)
+			return 0;
+		// too long to be a passive reply, forward it as is
+		client->ftp_in_line = 1;
+		return 1;
+	}
 
-	struct ftp_pasv *fp = new_ftp_pasv();
-	assert(fp);
-
-	fp->code = code;
-	switch(fp->code) {
-		case 227:
-		{
-			int i = 0, ip_i = 0, port_i = 0, ip_start = 0, comma_n = 0;
-			char port[2][4] = { {0}, {0} };
-			for (i=0; i<strlen(data) && ip_i<IP_LEN; i++) {
-				if (data[i] == '(') {
-					ip_start = 1;
-					continue;
-				}
-				if (! ip_start)
-					continue;
-
-				if (data[i] == ')')
-					break;
-
-				if (data[i] == ','){
-					comma_n++;
-					port_i = 0;
-					if (comma_n < 4){
-						fp->ftp_server_ip[ip_i] = '.';
-						ip_i++;
-					}
-					continue;
-				}
-
-				if (comma_n >= 4 && port_i < 4) {
-					port[comma_n - 4][port_i] = data[i];
-					port_i++;
-					continue;
-				}
-				fp->ftp_server_ip[ip_i] = data[i];
-				ip_i++;
-			}
+	size_t line_len = eol.pos + eol_len;
+	if (line_len >= FTP_PRO_BUF) {
+		evbuffer_remove_buffer(src, dst, line_len);
+		return 1;
+	}
 
-			fp->ftp_server_port = atoi(port[0]) * FTP_PASV_PORT_BLOCK + atoi(port[1]);
-			debug(LOG_DEBUG, "ftp pasv unpack:[%s:%d]", fp->ftp_server_ip, fp->ftp_server_port);
-			break;
-		}
-		default:
-			free_ftp_pasv(fp);
-			break;
+	char line[FTP_PRO_BUF] = {0};
+	char reply[FTP_PRO_BUF];
+	size_t reply_len = 0;
+	evbuffer_copyout(src, line, line_len);
+	if (line[2] == '7')
+		reply_len = rewrite_pasv_reply(client, line, reply, sizeof(reply));
+	else
+		reply_len = rewrite_epsv_reply(client, line, reply, sizeof(reply));
+
+	if (reply_len > 0 && reply_len < sizeof(reply)) {
+		debug(LOG_DEBUG, "ftp proxy [%s] rewrite reply: %.*s",
+			client->ps->proxy_name, (int)(reply_len - 2), reply);
+		evbuffer_drain(src, line_len);
+		evbuffer_add(dst, reply, reply_len);
+	} else {
+		evbuffer_remove_buffer(src, dst, line_len);
 	}
 
-	return fp;
+	return 1;
 }
 
-// the value returned need FREE after using
-static size_t pasv_pack(struct ftp_pasv *fp, char **pack_p)
+// parse ftp control replies line by line, only reply line starts are inspected
+// and lines other than passive replies are moved to dst without copy
+static void
+ftp_ctl_stream(struct proxy_client *client, struct evbuffer *src, struct evbuffer *dst)
 {
-	*pack_p = (char *)calloc(1, FTP_PRO_BUF);
-	assert(*pack_p);
-	size_t pack_len = 0;
-
-	switch (fp->code){
-		case 227:
-		{
-			char ftp_ip[IP_LEN] = {0};
-			int i =0;
-			for (i=0; i<strlen(fp->ftp_server_ip) && i < IP_LEN; i++) {
-				if (fp->ftp_server_ip[i] == '.') {
-					ftp_ip[i] = ',';
-					continue;
-				}
-				
-				ftp_ip[i] = fp->ftp_server_ip[i];
+	size_t len;
+	while ((len = evbuffer_get_length(src)) > 0) {
+		if (!client->ftp_in_line) {
+			char code[FTP_REPLY_CODE_LEN];
+			size_t n = evbuffer_copyout(src, code, sizeof(code));
+			if (n < sizeof(code) && !memchr(code, '\n', n))
+				return;
+
+			if (n == sizeof(code) && code[3] == ' ' && code[0] == '2' && code[1] == '2' &&
+				(code[2] == '7' || code[2] == '9')) {
+				if (!handle_passive_reply(client, src, dst))
+					return;
+				continue;
 			}
-			snprintf(*pack_p, 
-				FTP_PRO_BUF, 
-				"227 Entering Passive Mode (%s,%d,%d).\n", 
-				ftp_ip, 
-				fp->ftp_server_port / FTP_PASV_PORT_BLOCK, 
-				fp->ftp_server_port % FTP_PASV_PORT_BLOCK);
-
-			pack_len = strlen(*pack_p);
-			break;
+			client->ftp_in_line = 1;
 		}
-		default:
-			debug(LOG_DEBUG, "ftp pasv protocol data not supportted in pasv_pack");
-			free(*pack_p);
-			break;
-	}
-
-	return pack_len;
-}
-
-// need be free after using
-static struct ftp_pasv *new_ftp_pasv()
-{
-	struct ftp_pasv *fp = (struct ftp_pasv *)calloc(1, sizeof(struct ftp_pasv));
-	if (! fp)
-		return NULL;
 
-	memset(fp->ftp_server_ip, 0, IP_LEN);
-	fp->ftp_server_port = -1;
-	fp->code = -1;
+		size_t eol_len = 0;
+		struct evbuffer_ptr eol = evbuffer_search_eol(src, NULL, &eol_len, EVBUFFER_EOL_LF);
+		if (eol.pos < 0) {
+			evbuffer_add_buffer(dst, src);
+			return;
+		}
 
-	return fp;	 
+		evbuffer_remove_buffer(src, dst, eol.pos + eol_len);
+		client->ftp_in_line = 0;
+	}
 }
 
-// can be used to free NULL pointer also
-static void free_ftp_pasv(struct ftp_pasv *fp)
+// read ftp control replies from local ftp server
+void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 {
-	if (!fp)
+	struct common_conf  *c_conf = get_common_config();
+	struct proxy_client *client = (struct proxy_client *)ctx;
+	assert(client);
+	struct bufferevent *partner = client->ctl_bev;
+	assert(partner);
+	struct evbuffer *src = bufferevent_get_input(bev);
+
+	if (!c_conf->tcp_mux && !client->crypto) {
+		ftp_ctl_stream(client, src, bufferevent_get_output(partner));
 		return;
-	
-	SAFE_FREE(fp);
-	fp = NULL;
+	}
+
+	struct evbuffer *dst = evbuffer_new();
+	assert(dst);
+	ftp_ctl_stream(client, src, dst);
+	tcp_proxy_send_remote(client, bev, dst);
+	evbuffer_free(dst);
 }
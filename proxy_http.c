@@ -0,0 +1,678 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file proxy_http.c
+    @brief xfrp http proxy with response cache implemented
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <syslog.h>
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#include "debug.h"
+#include "uthash.h"
+#include "common.h"
+#include "proxy.h"
+#include "config.h"
+#include "client.h"
+#include "tcpmux.h"
+#include "instance.h"
+#include "alloc.h"
+
+#define HTTP_HEAD_MAX		(16*1024)	// longer head is forwarded without caching
+#define HTTP_VALUE_LEN		256
+#define HTTP_KEY_LEN		2048
+#define HTTP_ENTRY_DIV		8			// an entry takes at most 1/8 of cache size
+
+// cached 200 response, entries are kept in LRU order, the oldest first
+struct http_cache_entry {
+	char 	*key;		// host and request target
+	uint8_t *data;		// response head and body
+	size_t 	len;
+	char 	*etag;
+	char 	*last_modified;
+	time_t 	expire;		// fresh until, revalidated afterwards
+	UT_hash_handle hh;
+};
+
+// request forwarded to local service whose response is not finished yet
+struct http_request {
+	char 	*key;		// NULL if response can not be cached
+	int 	head;		// HEAD request has no response body
+	int 	revalidate;	// validators of cached entry are added
+	int 	cookie;		// cache is not served to it, only a public response is stored
+	char 	*etag;		// validators and freshness of response
+	char 	*last_modified;
+	time_t 	expire;
+	struct http_request *next;
+};
+
+struct http_conn {
+	struct evbuffer *req;		// frps ---> local service not parsed yet
+	struct evbuffer *resp;		// local service ---> frps not parsed yet
+	size_t 	req_body;			// request body left to forward
+	size_t 	resp_body;			// response body left to forward
+	int 	passthrough;		// message framing is unknown, forward all as is
+	struct http_request *pending;	// in order of requests
+	struct http_request *pending_tail;
+	struct http_request *cur;		// request of response body being forwarded
+	struct evbuffer *capture;		// response of cur to be cached
+};
+
+// per instance state, the cache is bounded by http_cache_size of each instance
+#define http_cache 			(cur_instance->http_cache)
+#define http_cache_bytes 	(cur_instance->http_cache_bytes)
+
+static void
+free_http_request(struct http_request *req)
+{
+	xfrpc_free(req->key);
+	xfrpc_free(req->etag);
+	xfrpc_free(req->last_modified);
+	xfrpc_free(req);
+}
+
+static void
+free_cache_entry(struct http_cache_entry *entry)
+{
+	HASH_DEL(http_cache, entry);
+	http_cache_bytes -= entry->len;
+	xfrpc_free(entry->key);
+	xfrpc_free(entry->data);
+	xfrpc_free(entry->etag);
+	xfrpc_free(entry->last_modified);
+	xfrpc_free(entry);
+}
+
+void
+clear_http_cache()
+{
+	while (http_cache)
+		free_cache_entry(http_cache);
+}
+
+// find entry and move it to the newest of LRU
+static struct http_cache_entry *
+get_cache_entry(const char *key)
+{
+	struct http_cache_entry *entry = NULL;
+	HASH_FIND_STR(http_cache, key, entry);
+	if (!entry)
+		return NULL;
+
+	HASH_DEL(http_cache, entry);
+	HASH_ADD_KEYPTR(hh, http_cache, entry->key, strlen(entry->key), entry);
+	return entry;
+}
+
+static void
+put_cache_entry(struct http_request *req, struct evbuffer *resp)
+{
+	struct common_conf *c_conf = get_common_config();
+	size_t len = evbuffer_get_length(resp);
+	struct http_cache_entry *entry = NULL;
+	HASH_FIND_STR(http_cache, req->key, entry);
+	if (entry)
+		free_cache_entry(entry);
+
+	while (http_cache && http_cache_bytes + len > c_conf->http_cache_size)
+		free_cache_entry(http_cache);
+
+	entry = xfrpc_calloc(ALLOC_HTTP, sizeof(struct http_cache_entry));
+	assert(entry);
+	entry->data = xfrpc_malloc(ALLOC_HTTP, len);
+	assert(entry->data);
+	evbuffer_remove(resp, entry->data, len);
+	entry->len = len;
+	entry->key = req->key;
+	entry->etag = req->etag;
+	entry->last_modified = req->last_modified;
+	entry->expire = req->expire;
+	req->key = req->etag = req->last_modified = NULL;
+
+	HASH_ADD_KEYPTR(hh, http_cache, entry->key, strlen(entry->key), entry);
+	http_cache_bytes += len;
+	debug(LOG_DEBUG, "http cache store [%s] %d bytes, total %d", entry->key, len, http_cache_bytes);
+}
+
+// copy start line of head, which is not zero terminated, into line
+// return 0 if head has no complete start line or it does not fit
+int
+get_http_start_line(const char *head, size_t len, char *line, size_t line_len)
+{
+	const char *eol = memchr(head, '\n', len);
+	if (!eol || eol - head >= line_len)
+		return 0;
+
+	size_t n = eol - head;
+	memcpy(line, head, n);
+	line[n] = '\0';
+	return 1;
+}
+
+// copy value of header name into value, return 0 if head has no such header
+int
+get_http_header(const char *head, size_t len, const char *name, char *value, size_t value_len)
+{
+	size_t name_len = strlen(name);
+	const char *end = head + len;
+	const char *p = memchr(head, '\n', len); // skip start line
+
+	while (p && ++p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol)
+			break;
+
+		if (eol - p > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0) {
+			const char *v = p + name_len + 1;
+			const char *ve = eol;
+			while (v < ve && (*v == ' ' || *v == '\t'))
+				v++;
+			while (ve > v && (ve[-1] == '\r' || ve[-1] == ' ' || ve[-1] == '\t'))
+				ve--;
+
+			size_t n = ve - v;
+			if (n >= value_len)
+				n = value_len - 1;
+			memcpy(value, v, n);
+			value[n] = '\0';
+			return 1;
+		}
+		p = eol;
+	}
+
+	return 0;
+}
+
+// case insensitive search of directive in header value
+static const char *
+http_directive(const char *value, const char *directive)
+{
+	size_t n = strlen(directive);
+	for (const char *p = value; *p; p++) {
+		if (strncasecmp(p, directive, n) == 0)
+			return p + n;
+	}
+	return NULL;
+}
+
+// room of stream to take len bytes at once, data beyond send window is
+// queued in tx ring which must not overflow
+static int
+http_can_send(struct proxy_client *client, size_t len)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!c_conf->tcp_mux)
+		return 1;
+
+	return len + client->stream.tx_ring.sz <= client->stream.send_window + WBUF_SIZE;
+}
+
+static void
+http_send_remote(struct proxy_client *client, const uint8_t *data, size_t len)
+{
+	struct evbuffer *buf = evbuffer_new();
+	assert(buf);
+	evbuffer_add_reference(buf, data, len, NULL, NULL);
+	tcp_proxy_send_remote(client, client->local_proxy_bev, buf);
+	evbuffer_free(buf);
+}
+
+static void
+push_http_request(struct http_conn *conn, struct http_request *req)
+{
+	if (conn->pending_tail)
+		conn->pending_tail->next = req;
+	else
+		conn->pending = req;
+	conn->pending_tail = req;
+}
+
+static struct http_request *
+pop_http_request(struct http_conn *conn)
+{
+	struct http_request *req = conn->pending;
+	if (req) {
+		conn->pending = req->next;
+		if (!conn->pending)
+			conn->pending_tail = NULL;
+		req->next = NULL;
+	}
+	return req;
+}
+
+// answer request of head_len at start of conn->req from cache
+// return 0 if it has to be forwarded to local service
+static int
+serve_from_cache(struct proxy_client *client, struct http_cache_entry *entry, const char *head, size_t head_len)
+{
+	struct http_conn *conn = client->http;
+	char value[HTTP_VALUE_LEN];
+
+	if (entry->expire <= time(NULL) || !http_can_send(client, entry->len))
+		return 0;
+	if (get_http_header(head, head_len, "Cache-Control", value, sizeof(value)) &&
+		(http_directive(value, "no-cache") || http_directive(value, "max-age=0")))
+		return 0;
+	if (get_http_header(head, head_len, "Pragma", value, sizeof(value)) && http_directive(value, "no-cache"))
+		return 0;
+
+	int not_modified = 0;
+	if (get_http_header(head, head_len, "If-None-Match", value, sizeof(value)))
+		not_modified = entry->etag && strstr(value, entry->etag) != NULL;
+	else if (get_http_header(head, head_len, "If-Modified-Since", value, sizeof(value)))
+		not_modified = entry->last_modified && strcmp(value, entry->last_modified) == 0;
+
+	evbuffer_drain(conn->req, head_len);
+	if (not_modified) {
+		struct evbuffer *reply = evbuffer_new();
+		assert(reply);
+		evbuffer_add_printf(reply, "HTTP/1.1 304 Not Modified\r\n");
+		if (entry->etag)
+			evbuffer_add_printf(reply, "ETag: %s\r\n", entry->etag);
+		if (entry->last_modified)
+			evbuffer_add_printf(reply, "Last-Modified: %s\r\n", entry->last_modified);
+		evbuffer_add_printf(reply, "\r\n");
+		tcp_proxy_send_remote(client, client->local_proxy_bev, reply);
+		evbuffer_free(reply);
+	} else {
+		http_send_remote(client, entry->data, entry->len);
+	}
+
+	debug(LOG_DEBUG, "http proxy [%s] cache hit [%s]%s", client->ps->proxy_name, entry->key,
+		not_modified ? " not modified" : "");
+	return 1;
+}
+
+// handle request head of head_len at start of conn->req
+static void
+handle_request_head(struct proxy_client *client, size_t head_len)
+{
+	struct http_conn *conn = client->http;
+	struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
+	const char *head = (const char *)evbuffer_pullup(conn->req, head_len);
+	char method[16], target[HTTP_KEY_LEN / 2], value[HTTP_VALUE_LEN];
+	char key[HTTP_KEY_LEN];
+
+	if (!get_http_start_line(head, head_len, key, sizeof(key)) || 
+		sscanf(key, "%15s %1023s HTTP/1.%*c", method, target) != 2) {
+		conn->passthrough = 1;
+		return;
+	}
+
+	// message framing xfrpc does not follow
+	if (get_http_header(head, head_len, "Transfer-Encoding", value, sizeof(value)) ||
+		get_http_header(head, head_len, "Upgrade", value, sizeof(value)) ||
+		strcmp(method, "CONNECT") == 0) {
+		conn->passthrough = 1;
+		return;
+	}
+
+	if (get_http_header(head, head_len, "Content-Length", value, sizeof(value)))
+		conn->req_body = strtoul(value, NULL, 10);
+
+	struct http_request *req = xfrpc_calloc(ALLOC_HTTP, sizeof(struct http_request));
+	assert(req);
+	req->head = strcmp(method, "HEAD") == 0;
+
+	int cacheable = strcmp(method, "GET") == 0 && conn->req_body == 0 &&
+		!get_http_header(head, head_len, "Authorization", value, sizeof(value)) &&
+		!(get_http_header(head, head_len, "Cache-Control", value, sizeof(value)) &&
+			http_directive(value, "no-store"));
+	if (!cacheable) {
+		push_http_request(conn, req);
+		evbuffer_remove_buffer(conn->req, dst, head_len);
+		return;
+	}
+
+	if (!get_http_header(head, head_len, "Host", value, sizeof(value)))
+		value[0] = '\0';
+	snprintf(key, sizeof(key), "%s%s", value, target);
+	req->key = xfrpc_strdup(ALLOC_HTTP, key);
+	assert(req->key);
+
+	// cache is shared by every user of the proxy, a cookie may pick the page
+	req->cookie = get_http_header(head, head_len, "Cookie", value, sizeof(value));
+
+	// cached response is only sent when no response is due before it
+	struct http_cache_entry *entry = req->cookie ? NULL : get_cache_entry(key);
+	int idle = !conn->pending && !conn->cur;
+	if (entry && idle && serve_from_cache(client, entry, head, head_len)) {
+		free_http_request(req);
+		return;
+	}
+
+	// stale entry with validators, ask local service whether it changed
+	if (entry && idle && (entry->etag || entry->last_modified) && http_can_send(client, entry->len) &&
+		!get_http_header(head, head_len, "If-None-Match", value, sizeof(value)) &&
+		!get_http_header(head, head_len, "If-Modified-Since", value, sizeof(value))) {
+		size_t line_len = (const char *)memchr(head, '\n', head_len) - head + 1;
+		evbuffer_remove_buffer(conn->req, dst, line_len);
+		if (entry->etag)
+			evbuffer_add_printf(dst, "If-None-Match: %s\r\n", entry->etag);
+		if (entry->last_modified)
+			evbuffer_add_printf(dst, "If-Modified-Since: %s\r\n", entry->last_modified);
+		head_len -= line_len;
+		req->revalidate = 1;
+	}
+
+	push_http_request(conn, req);
+	evbuffer_remove_buffer(conn->req, dst, head_len);
+}
+
+// freshness and validators of a cacheable response, return 0 if not cacheable
+static int
+parse_cache_policy(struct http_request *req, const char *head, size_t head_len)
+{
+	char value[HTTP_VALUE_LEN];
+	const char *age = NULL;
+	time_t now = time(NULL);
+
+	if (get_http_header(head, head_len, "Set-Cookie", value, sizeof(value)) ||
+		get_http_header(head, head_len, "Vary", value, sizeof(value)))
+		return 0;
+
+	req->expire = now;
+	int cc = get_http_header(head, head_len, "Cache-Control", value, sizeof(value));
+	if (req->cookie && !(cc && http_directive(value, "public")))
+		return 0;
+	if (cc) {
+		if (http_directive(value, "no-store") || http_directive(value, "private"))
+			return 0;
+		if (!http_directive(value, "no-cache")) {
+			age = http_directive(value, "s-maxage=");
+			if (!age)
+				age = http_directive(value, "max-age=");
+			if (age)
+				req->expire = now + strtol(age, NULL, 10);
+		}
+	}
+
+	if (get_http_header(head, head_len, "ETag", value, sizeof(value)))
+		req->etag = xfrpc_strdup(ALLOC_HTTP, value);
+	if (get_http_header(head, head_len, "Last-Modified", value, sizeof(value)))
+		req->last_modified = xfrpc_strdup(ALLOC_HTTP, value);
+
+	// without freshness nor validators it can never be reused
+	return req->expire > now || req->etag || req->last_modified;
+}
+
+// response of conn->cur is done, stored if it is complete
+static void
+finish_response(struct http_conn *conn, int complete)
+{
+	if (conn->capture && complete)
+		put_cache_entry(conn->cur, conn->capture);
+
+	if (conn->capture)
+		evbuffer_free(conn->capture);
+	if (conn->cur)
+		free_http_request(conn->cur);
+	conn->capture = NULL;
+	conn->cur = NULL;
+}
+
+// handle response head of head_len at start of conn->resp
+static void
+handle_response_head(struct proxy_client *client, size_t head_len, struct evbuffer *dst)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct http_conn *conn = client->http;
+	const char *head = (const char *)evbuffer_pullup(conn->resp, head_len);
+	char value[HTTP_VALUE_LEN];
+	int status = 0;
+
+	if (!get_http_start_line(head, head_len, value, sizeof(value)) || 
+		sscanf(value, "HTTP/1.%*c %3d", &status) != 1 || status == 101) {
+		conn->passthrough = 1;
+		return;
+	}
+
+	// interim response, the final one follows
+	if (status / 100 == 1) {
+		evbuffer_remove_buffer(conn->resp, dst, head_len);
+		return;
+	}
+
+	struct http_request *req = pop_http_request(conn);
+	if (!req) {
+		// request went to local service before parsing started
+		conn->passthrough = 1;
+		return;
+	}
+
+	size_t body = 0;
+	if (!req->head && status != 204 && status != 304) {
+		if (get_http_header(head, head_len, "Transfer-Encoding", value, sizeof(value)) ||
+			!get_http_header(head, head_len, "Content-Length", value, sizeof(value))) {
+			// chunked or close delimited
+			free_http_request(req);
+			conn->passthrough = 1;
+			return;
+		}
+		body = strtoul(value, NULL, 10);
+	}
+
+	struct http_cache_entry *entry = NULL;
+	if (status == 304 && req->revalidate && (entry = get_cache_entry(req->key))) {
+		struct http_request fresh = {0};
+		if (parse_cache_policy(&fresh, head, head_len))
+			entry->expire = fresh.expire;
+		xfrpc_free(fresh.etag);
+		xfrpc_free(fresh.last_modified);
+
+		debug(LOG_DEBUG, "http proxy [%s] cache revalidated [%s]", client->ps->proxy_name, entry->key);
+		evbuffer_drain(conn->resp, head_len);
+		evbuffer_add(dst, entry->data, entry->len);
+		free_http_request(req);
+		return;
+	}
+
+	conn->cur = req;
+	if (status == 200 && req->key && !req->head &&
+		(head_len + body) * HTTP_ENTRY_DIV <= c_conf->http_cache_size &&
+		parse_cache_policy(req, head, head_len)) {
+		conn->capture = evbuffer_new();
+		assert(conn->capture);
+		evbuffer_add(conn->capture, head, head_len);
+	}
+
+	evbuffer_remove_buffer(conn->resp, dst, head_len);
+	conn->resp_body = body;
+	if (body == 0)
+		finish_response(conn, 1);
+}
+
+static void
+process_requests(struct proxy_client *client)
+{
+	struct http_conn *conn = client->http;
+	struct evbuffer *dst = bufferevent_get_output(client->local_proxy_bev);
+	size_t len;
+
+	while ((len = evbuffer_get_length(conn->req)) > 0) {
+		if (conn->passthrough) {
+			evbuffer_add_buffer(dst, conn->req);
+			return;
+		}
+
+		if (conn->req_body > 0) {
+			size_t n = len < conn->req_body ? len : conn->req_body;
+			evbuffer_remove_buffer(conn->req, dst, n);
+			conn->req_body -= n;
+			continue;
+		}
+
+		struct evbuffer_ptr end = evbuffer_search(conn->req, "\r\n\r\n", 4, NULL);
+		if (end.pos < 0) {
+			if (len > HTTP_HEAD_MAX)
+				conn->passthrough = 1;
+			else
+				return;
+			continue;
+		}
+
+		handle_request_head(client, end.pos + 4);
+	}
+}
+
+static void
+process_responses(struct proxy_client *client, struct evbuffer *dst)
+{
+	struct http_conn *conn = client->http;
+	size_t len;
+
+	while ((len = evbuffer_get_length(conn->resp)) > 0) {
+		if (conn->passthrough) {
+			finish_response(conn, 0);
+			evbuffer_add_buffer(dst, conn->resp);
+			return;
+		}
+
+		if (conn->resp_body > 0) {
+			size_t n = len < conn->resp_body ? len : conn->resp_body;
+			if (conn->capture)
+				evbuffer_add(conn->capture, evbuffer_pullup(conn->resp, n), n);
+			evbuffer_remove_buffer(conn->resp, dst, n);
+			conn->resp_body -= n;
+			if (conn->resp_body == 0)
+				finish_response(conn, 1);
+			continue;
+		}
+
+		struct evbuffer_ptr end = evbuffer_search(conn->resp, "\r\n\r\n", 4, NULL);
+		if (end.pos < 0) {
+			if (len > HTTP_HEAD_MAX)
+				conn->passthrough = 1;
+			else
+				return;
+			continue;
+		}
+
+		handle_response_head(client, end.pos + 4, dst);
+	}
+}
+
+// connect local http service, the cache follows requests and responses
+// of work connection when http_cache_size is set
+int
+http_proxy_connect(struct proxy_client *client)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!tcp_proxy_connect(client))
+		return 0;
+
+	if (c_conf->http_cache_size > 0) {
+		struct http_conn *conn = xfrpc_calloc(ALLOC_HTTP, sizeof(struct http_conn));
+		assert(conn);
+		conn->req = evbuffer_new();
+		conn->resp = evbuffer_new();
+		assert(conn->req && conn->resp);
+		client->http = conn;
+	}
+
+	return 1;
+}
+
+// frps ---> local http service when tcp_mux enabled
+uint32_t
+http_proxy_mux_data(struct proxy_client *client, struct ring_buffer *rb, int len)
+{
+	struct http_conn *conn = client->http;
+	if (!conn)
+		return tcp_proxy_mux_data(client, rb, len);
+
+	if (len > rb->sz)
+		len = rb->sz;
+
+	struct evbuffer_iovec v;
+	if (len <= 0 || evbuffer_reserve_space(conn->req, len, &v, 1) < 1)
+		return 0;
+	rx_ring_buffer_pop(rb, v.iov_base, len);
+	v.iov_len = len;
+	evbuffer_commit_space(conn->req, &v, 1);
+
+	process_requests(client);
+	return len;
+}
+
+// frps ---> local http service when tcp_mux disabled
+void
+http_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = (struct proxy_client *)ctx;
+	assert(client);
+	if (!client->http) {
+		tcp_proxy_s2c_cb(bev, ctx);
+		return;
+	}
+
+	evbuffer_add_buffer(client->http->req, bufferevent_get_input(bev));
+	process_requests(client);
+}
+
+// local http service ---> frps
+void
+http_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = (struct proxy_client *)ctx;
+	assert(client);
+	if (!client->http) {
+		tcp_proxy_c2s_cb(bev, ctx);
+		return;
+	}
+
+	struct evbuffer *dst = evbuffer_new();
+	assert(dst);
+	evbuffer_add_buffer(client->http->resp, bufferevent_get_input(bev));
+	process_responses(client, dst);
+	tcp_proxy_send_remote(client, bev, dst);
+	evbuffer_free(dst);
+}
+
+void
+http_proxy_free(struct proxy_client *client)
+{
+	struct http_conn *conn = client->http;
+	if (!conn)
+		return;
+
+	struct http_request *req;
+	while ((req = pop_http_request(conn)))
+		free_http_request(req);
+	if (conn->cur)
+		free_http_request(conn->cur);
+	if (conn->capture)
+		evbuffer_free(conn->capture);
+	evbuffer_free(conn->req);
+	evbuffer_free(conn->resp);
+	xfrpc_free(conn);
+	client->http = NULL;
+}
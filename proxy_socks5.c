@@ -0,0 +1,712 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file proxy_socks5.c
+    @brief xfrp socks5 proxy implemented
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+#include "debug.h"
+#include "common.h"
+#include "proxy.h"
+#include "config.h"
+#include "tcpmux.h"
+#include "control.h"
+#include "uthash.h"
+#include "instance.h"
+#include "ratelimit.h"
+
+#define SOCKS5_VERSION			0x05
+#define SOCKS5_CMD_CONNECT		0x01
+#define SOCKS5_AUTH_NONE		0x00
+#define SOCKS5_AUTH_NO_ACCEPT	0xff
+
+#define SOCKS5_ATYP_IPV4		0x01
+#define SOCKS5_ATYP_DOMAIN		0x03
+#define SOCKS5_ATYP_IPV6		0x04
+
+#define SOCKS5_REP_OK			0x00
+#define SOCKS5_REP_FAILURE		0x01
+#define SOCKS5_REP_NET_UNREACH	0x03
+#define SOCKS5_REP_HOST_UNREACH	0x04
+#define SOCKS5_REP_REFUSED		0x05
+#define SOCKS5_REP_CMD			0x07
+#define SOCKS5_REP_ATYP			0x08
+
+#define SOCKS5_PARSE_AGAIN		0
+#define SOCKS5_PARSE_ERROR		-1
+
+#define SOCKS5_RACE_MAX			4		// addresses raced for one destination
+#define SOCKS5_RACE_DELAY_MS	250		// delay before racing next address
+#define SOCKS5_CONNECT_TIMEOUT	10		// seconds
+#define SOCKS5_FAILED_DEST_TTL	10		// seconds
+#define SOCKS5_FAILED_DEST_MAX	1024
+
+// parse [ATYP][ADDR][PORT] at offset of rb without consuming it
+// return parsed length, SOCKS5_PARSE_AGAIN if more data needed or SOCKS5_PARSE_ERROR
+static int
+parse_socks5_addr(struct ring_buffer *rb, uint32_t offset, struct socks5_addr *addr)
+{
+	uint8_t type, dlen;
+	uint32_t hlen = 1, alen = 0;
+
+	if (!rx_ring_buffer_peek(rb, offset, &type, 1))
+		return SOCKS5_PARSE_AGAIN;
+
+	switch(type) {
+	case SOCKS5_ATYP_IPV4:
+		alen = 4;
+		break;
+	case SOCKS5_ATYP_IPV6:
+		alen = 16;
+		break;
+	case SOCKS5_ATYP_DOMAIN:
+		if (!rx_ring_buffer_peek(rb, offset + 1, &dlen, 1))
+			return SOCKS5_PARSE_AGAIN;
+		if (dlen == 0)
+			return SOCKS5_PARSE_ERROR;
+		hlen = 2;
+		alen = dlen;
+		break;
+	default:
+		return SOCKS5_PARSE_ERROR;
+	}
+
+	if (offset + hlen + alen + 2 > rb->sz)
+		return SOCKS5_PARSE_AGAIN;
+
+	memset(addr, 0, sizeof(struct socks5_addr));
+	rx_ring_buffer_peek(rb, offset + hlen, addr->addr, alen);
+	rx_ring_buffer_peek(rb, offset + hlen + alen, (uint8_t *)&addr->port, 2);
+	addr->type = type;
+
+	return hlen + alen + 2;
+}
+
+// client may be gone when callback runs, so it is found by stream id
+struct socks5_free_arg {
+	struct xfrpc_instance 	*inst;
+	uint32_t 				stream_id;
+	int 					fin;	// close after reply instead of freeing
+};
+
+static void
+free_socks5_client_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks5_free_arg *fa = arg;
+	set_cur_instance(fa->inst);
+	struct proxy_client *client = get_proxy_client(fa->stream_id);
+	if (fa->fin && client)
+		tmux_stream_close(client->ctl_bev, &client->stream);
+	else
+		del_proxy_client_by_stream_id(fa->stream_id);
+	free(fa);
+}
+
+static void
+socks5_close_later(struct proxy_client *client, int fin)
+{
+	client->state = SOCKS5_CLOSED;
+	struct socks5_free_arg *fa = calloc(1, sizeof(struct socks5_free_arg));
+	assert(fa);
+	fa->inst = client->inst;
+	fa->stream_id = client->stream_id;
+	fa->fin = fin;
+	event_base_once(client->base, -1, EV_TIMEOUT, free_socks5_client_cb, fa, NULL);
+}
+
+// reset the stream of client, client is freed after current frame processed
+static uint32_t
+socks5_proxy_abort(struct proxy_client *client)
+{
+	debug(LOG_ERR, "socks5 client %d handshake failed, reset it", client->stream_id);
+	tcp_mux_send_win_update_rst(client->ctl_bev, client->stream_id);
+	client->stream.state = RESET;
+	socks5_close_later(client, 0);
+	return 0;
+}
+
+// [VER][REP][RSV][ATYP][BND.ADDR][BND.PORT], bound address of target socket on success
+static void
+socks5_send_reply(struct proxy_client *client, uint8_t rep)
+{
+	uint8_t reply[22] = {SOCKS5_VERSION, rep, 0x00, SOCKS5_ATYP_IPV4};
+	uint32_t len = 10;
+	struct sockaddr_storage ss;
+	socklen_t slen = sizeof(ss);
+
+	if (rep == SOCKS5_REP_OK && client->local_proxy_bev && 
+		getsockname(bufferevent_getfd(client->local_proxy_bev), (struct sockaddr *)&ss, &slen) == 0) {
+		if (ss.ss_family == AF_INET6) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+			reply[3] = SOCKS5_ATYP_IPV6;
+			memcpy(reply + 4, &sin6->sin6_addr, 16);
+			memcpy(reply + 20, &sin6->sin6_port, 2);
+			len = 22;
+		} else if (ss.ss_family == AF_INET) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+			memcpy(reply + 4, &sin->sin_addr, 4);
+			memcpy(reply + 8, &sin->sin_port, 2);
+		}
+	}
+	tmux_stream_write(client->ctl_bev, reply, len, &client->stream);
+}
+
+// socks5 client gets the reply code before the stream is closed,
+// ss5 has no reply and is reset
+static uint32_t
+socks5_proxy_refuse(struct proxy_client *client, uint8_t rep)
+{
+	if (!client->socks5_reply)
+		return socks5_proxy_abort(client);
+
+	debug(LOG_INFO, "socks5 client %d refused with reply %d", client->stream_id, rep);
+	socks5_send_reply(client, rep);
+	socks5_close_later(client, 1);
+	return 0;
+}
+
+// destinations failed to connect recently, requests to them are refused
+// until expired instead of waiting for another connect timeout
+struct socks5_failed_dest {
+	char 			key[SOCKS5_ADDRES_LEN + 8];	// host:port
+	time_t 			expire;
+	uint8_t 		rep;	// reply code of the failure
+	UT_hash_handle 	hh;
+};
+
+// connect attempts of one socks5 request, addresses are raced in
+// SOCKS5_RACE_DELAY_MS steps and the first connected one wins
+struct socks5_connector {
+	struct proxy_client 	*client;
+	struct evdns_getaddrinfo_request *dns_req;
+	struct event 			*race_timer;
+	struct event 			*timeout_timer;
+	struct sockaddr_storage addrs[SOCKS5_RACE_MAX];
+	int 					naddr;
+	int 					next_addr;
+	struct bufferevent 		*bevs[SOCKS5_RACE_MAX];
+	int 					npending;
+	uint8_t 				rep;	// reply code if all addresses fail
+	struct evbuffer 		*held;	// client data received while connecting
+	char 					dest[SOCKS5_ADDRES_LEN + 8];
+};
+
+// shared by instances of the same event loop
+static __thread struct socks5_failed_dest *failed_dests = NULL;
+
+static void socks5_connector_fail(struct socks5_connector *conn);
+
+// return reply code of recent failure, SOCKS5_REP_OK if there is none
+static uint8_t
+is_failed_dest(const char *dest)
+{
+	struct socks5_failed_dest *fd = NULL;
+	HASH_FIND_STR(failed_dests, dest, fd);
+	if (!fd)
+		return SOCKS5_REP_OK;
+
+	if (fd->expire > time(NULL))
+		return fd->rep;
+
+	HASH_DEL(failed_dests, fd);
+	free(fd);
+	return SOCKS5_REP_OK;
+}
+
+static void
+add_failed_dest(const char *dest, uint8_t rep)
+{
+	struct socks5_failed_dest *fd = NULL, *tmp = NULL;
+	time_t now = time(NULL);
+
+	HASH_FIND_STR(failed_dests, dest, fd);
+	if (fd) {
+		fd->expire = now + SOCKS5_FAILED_DEST_TTL;
+		fd->rep = rep;
+		return;
+	}
+
+	if (HASH_COUNT(failed_dests) >= SOCKS5_FAILED_DEST_MAX) {
+		// hash keeps insertion order, drop expired and oldest ones
+		HASH_ITER(hh, failed_dests, fd, tmp) {
+			if (fd->expire > now && HASH_COUNT(failed_dests) < SOCKS5_FAILED_DEST_MAX)
+				break;
+			HASH_DEL(failed_dests, fd);
+			free(fd);
+		}
+	}
+
+	fd = calloc(1, sizeof(struct socks5_failed_dest));
+	assert(fd);
+	snprintf(fd->key, sizeof(fd->key), "%s", dest);
+	fd->expire = now + SOCKS5_FAILED_DEST_TTL;
+	fd->rep = rep;
+	HASH_ADD_STR(failed_dests, key, fd);
+}
+
+static void
+get_socks5_dest(const struct socks5_addr *addr, char *dest, size_t len)
+{
+	char host[INET6_ADDRSTRLEN] = {0};
+
+	switch(addr->type) {
+	case SOCKS5_ATYP_IPV4:
+		inet_ntop(AF_INET, addr->addr, host, sizeof(host));
+		snprintf(dest, len, "%s:%d", host, ntohs(addr->port));
+		break;
+	case SOCKS5_ATYP_IPV6:
+		inet_ntop(AF_INET6, addr->addr, host, sizeof(host));
+		snprintf(dest, len, "[%s]:%d", host, ntohs(addr->port));
+		break;
+	default:
+		snprintf(dest, len, "%s:%d", (const char *)addr->addr, ntohs(addr->port));
+	}
+}
+
+static void
+free_socks5_connector(struct socks5_connector *conn)
+{
+	if (conn->dns_req)
+		evdns_getaddrinfo_cancel(conn->dns_req);
+	for (int i = 0; i < SOCKS5_RACE_MAX; i++) {
+		if (conn->bevs[i])
+			bufferevent_free(conn->bevs[i]);
+	}
+	if (conn->race_timer)
+		event_free(conn->race_timer);
+	if (conn->timeout_timer)
+		event_free(conn->timeout_timer);
+	evbuffer_free(conn->held);
+	if (conn->client)
+		conn->client->connector = NULL;
+	free(conn);
+}
+
+static void
+socks5_connector_win(struct socks5_connector *conn, int index)
+{
+	struct proxy_client *client = conn->client;
+	struct bufferevent *bev = conn->bevs[index];
+
+	debug(LOG_DEBUG, "socks5 client %d connected [%s] by address %d of %d, %zu bytes held", 
+		client->stream_id, conn->dest, index, conn->naddr, evbuffer_get_length(conn->held));
+	conn->bevs[index] = NULL;
+	bufferevent_write_buffer(bev, conn->held);
+	free_socks5_connector(conn);
+
+	client->local_proxy_bev = bev;
+	bufferevent_setcb(bev, xfrp_proxy_local_cb, NULL, xfrp_proxy_event_cb, client);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	limit_local_bev(client);
+	xfrp_proxy_event_cb(bev, BEV_EVENT_CONNECTED, client);
+}
+
+static void socks5_connector_next(struct socks5_connector *conn);
+
+static void
+socks5_race_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	struct socks5_connector *conn = ctx;
+	set_cur_instance(conn->client->inst);
+	int index = 0;
+	while (conn->bevs[index] != bev)
+		index++;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		socks5_connector_win(conn, index);
+		return;
+	}
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		int err = EVUTIL_SOCKET_ERROR();
+		debug(LOG_DEBUG, "socks5 connect [%s] address %d failed: %s", 
+			conn->dest, index, evutil_socket_error_to_string(err));
+		if (err == ECONNREFUSED)
+			conn->rep = SOCKS5_REP_REFUSED;
+		else if (err == ENETUNREACH && conn->rep != SOCKS5_REP_REFUSED)
+			conn->rep = SOCKS5_REP_NET_UNREACH;
+		bufferevent_free(bev);
+		conn->bevs[index] = NULL;
+		conn->npending--;
+		// no need to wait for race delay, try next address now
+		socks5_connector_next(conn);
+	}
+}
+
+// start connecting next address, fail when nothing is left to wait for
+static void
+socks5_connector_next(struct socks5_connector *conn)
+{
+	while (conn->next_addr < conn->naddr) {
+		int index = conn->next_addr++;
+		struct sockaddr *sa = (struct sockaddr *)&conn->addrs[index];
+		socklen_t len = sa->sa_family == AF_INET6 ? 
+						sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+		struct bufferevent *bev = bufferevent_socket_new(conn->client->base, -1, BEV_OPT_CLOSE_ON_FREE);
+		assert(bev);
+		if (bufferevent_socket_connect(bev, sa, len) < 0) {
+			bufferevent_free(bev);
+			continue;
+		}
+
+		// set callbacks after connecting, immediate failure is handled above
+		conn->bevs[index] = bev;
+		conn->npending++;
+		bufferevent_setcb(bev, NULL, NULL, socks5_race_event_cb, conn);
+
+		if (conn->next_addr < conn->naddr) {
+			struct timeval tv = {0, SOCKS5_RACE_DELAY_MS * 1000};
+			evtimer_add(conn->race_timer, &tv);
+		}
+		return;
+	}
+
+	if (conn->npending == 0)
+		socks5_connector_fail(conn);
+}
+
+static void
+socks5_race_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks5_connector *conn = arg;
+	set_cur_instance(conn->client->inst);
+	socks5_connector_next(conn);
+}
+
+static void
+socks5_timeout_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks5_connector *conn = arg;
+	set_cur_instance(conn->client->inst);
+	debug(LOG_INFO, "socks5 connect [%s] timeout", conn->dest);
+	socks5_connector_fail(conn);
+}
+
+static void
+add_connector_addr(struct socks5_connector *conn, const struct sockaddr *sa, socklen_t len)
+{
+	if (conn->naddr >= SOCKS5_RACE_MAX || len > sizeof(struct sockaddr_storage))
+		return;
+
+	memcpy(&conn->addrs[conn->naddr++], sa, len);
+}
+
+static void
+socks5_dns_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	// connector has been freed when request canceled
+	if (result == EVUTIL_EAI_CANCEL)
+		return;
+
+	struct socks5_connector *conn = arg;
+	set_cur_instance(conn->client->inst);
+	conn->dns_req = NULL;
+	if (result != 0) {
+		debug(LOG_INFO, "socks5 resolve [%s] failed: %s", conn->dest, evutil_gai_strerror(result));
+		socks5_connector_fail(conn);
+		return;
+	}
+
+	// interleave address families as happy eyeballs does, starting with
+	// the family of the first answer
+	struct evutil_addrinfo *first = res, *other = res;
+	while (other && other->ai_family == res->ai_family)
+		other = other->ai_next;
+	while (first || other) {
+		for (; first && first->ai_family != res->ai_family; first = first->ai_next);
+		for (; other && other->ai_family == res->ai_family; other = other->ai_next);
+		if (first) {
+			add_connector_addr(conn, first->ai_addr, first->ai_addrlen);
+			first = first->ai_next;
+		}
+		if (other) {
+			add_connector_addr(conn, other->ai_addr, other->ai_addrlen);
+			other = other->ai_next;
+		}
+	}
+	evutil_freeaddrinfo(res);
+
+	socks5_connector_next(conn);
+}
+
+// connect target address of client asynchronously
+// return SOCKS5_REP_OK if connecting started, otherwise reply code to refuse with
+static uint8_t
+socks5_proxy_connect(struct proxy_client *client, struct socks5_addr *addr)
+{
+	struct socks5_connector *conn = calloc(1, sizeof(struct socks5_connector));
+	assert(conn);
+	conn->client = client;
+	conn->rep = SOCKS5_REP_HOST_UNREACH;
+	get_socks5_dest(addr, conn->dest, sizeof(conn->dest));
+
+	uint8_t rep = is_failed_dest(conn->dest);
+	if (rep != SOCKS5_REP_OK) {
+		debug(LOG_INFO, "socks5 destination [%s] failed recently, refuse it", conn->dest);
+		free(conn);
+		return rep;
+	}
+
+	conn->held = evbuffer_new();
+	assert(conn->held);
+
+	conn->race_timer = evtimer_new(client->base, socks5_race_timer_cb, conn);
+	conn->timeout_timer = evtimer_new(client->base, socks5_timeout_timer_cb, conn);
+	assert(conn->race_timer && conn->timeout_timer);
+	struct timeval tv = {SOCKS5_CONNECT_TIMEOUT, 0};
+	evtimer_add(conn->timeout_timer, &tv);
+	client->connector = conn;
+
+	debug(LOG_DEBUG, "socks5_proxy_connect [%s]", conn->dest);
+	switch(addr->type) {
+	case SOCKS5_ATYP_IPV4:
+	{
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = addr->port;
+		memcpy(&sin.sin_addr, addr->addr, 4);
+		add_connector_addr(conn, (struct sockaddr *)&sin, sizeof(sin));
+		break;
+	}
+	case SOCKS5_ATYP_IPV6:
+	{
+		struct sockaddr_in6 sin6;
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_port = addr->port;
+		memcpy(&sin6.sin6_addr, addr->addr, 16);
+		add_connector_addr(conn, (struct sockaddr *)&sin6, sizeof(sin6));
+		break;
+	}
+	case SOCKS5_ATYP_DOMAIN:
+	{
+		// resolved by evdns asynchronously, both ipv4 and ipv6 answers raced
+		struct evutil_addrinfo hints;
+		char port[8] = {0};
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		snprintf(port, sizeof(port), "%d", ntohs(addr->port));
+		// callback may be called before evdns_getaddrinfo returns
+		struct evdns_getaddrinfo_request *req = evdns_getaddrinfo(get_main_dnsbase(), 
+						(const char *)addr->addr, port, &hints, socks5_dns_cb, conn);
+		if (req)
+			conn->dns_req = req;
+		return SOCKS5_REP_OK;
+	}
+	}
+
+	socks5_connector_next(conn);
+	return SOCKS5_REP_OK;
+}
+
+// all addresses of the connector failed, remember the destination and reset client
+static void
+socks5_connector_fail(struct socks5_connector *conn)
+{
+	struct proxy_client *client = conn->client;
+	uint8_t rep = conn->rep;
+
+	add_failed_dest(conn->dest, rep);
+	free_socks5_connector(conn);
+	socks5_proxy_refuse(client, rep);
+}
+
+// connector is canceled when client freed during connecting
+void
+socks5_proxy_free(struct proxy_client *client)
+{
+	if (client->connector) {
+		client->connector->client = NULL;
+		free_socks5_connector(client->connector);
+		client->connector = NULL;
+	}
+}
+
+// target not connected yet: client data moves from rx ring, which is smaller
+// than the stream window, to the connector and no window is granted meanwhile
+static uint32_t
+socks5_proxy_hold(struct proxy_client *client, struct ring_buffer *rb)
+{
+	uint32_t n = rb->sz;
+	if (n == 0 || !client->connector)
+		return 0;
+
+	struct evbuffer_iovec v;
+	if (evbuffer_reserve_space(client->connector->held, n, &v, 1) < 1)
+		return 0;
+	rx_ring_buffer_pop(rb, v.iov_base, n);
+	v.iov_len = n;
+	evbuffer_commit_space(client->connector->held, &v, 1);
+	return n;
+}
+
+// parse target address and connect it, data after the address is held
+// and sent when target connected
+static uint32_t
+socks5_proxy_request(struct proxy_client *client, struct ring_buffer *rb, uint32_t offset)
+{
+	int n = parse_socks5_addr(rb, offset, &client->remote_addr);
+	if (n == SOCKS5_PARSE_AGAIN)
+		return 0;
+	if (n == SOCKS5_PARSE_ERROR)
+		return socks5_proxy_refuse(client, SOCKS5_REP_ATYP);
+
+	rx_ring_buffer_drop(rb, offset + n);
+	client->state = SOCKS5_CONNECT;
+	client->stream.rx_paused = 1;
+	uint8_t rep = socks5_proxy_connect(client, &client->remote_addr);
+	if (rep != SOCKS5_REP_OK)
+		return offset + n + socks5_proxy_refuse(client, rep);
+
+	// connecting may have failed already
+	if (client->state != SOCKS5_CONNECT)
+		return offset + n;
+	return offset + n + socks5_proxy_hold(client, rb);
+}
+
+static uint32_t
+socks5_proxy_forward(struct proxy_client *client, struct ring_buffer *rb)
+{
+	if (rb->sz == 0)
+		return 0;
+
+	return tx_ring_buffer_write(client->local_proxy_bev, rb, rb->sz);
+}
+
+// rfc1928 socks5 with no authentication and CONNECT command only, or ss5
+// which is socks5 without greeting: [ATYP][ADDR][PORT][DATA...]
+// first byte tells them apart, no ATYP equals SOCKS5_VERSION
+// rb may hold data of previous frames, so whole rb is parsed instead of len
+uint32_t
+handle_socks5(struct proxy_client *client, struct ring_buffer *rb, int len)
+{
+	uint8_t buf[4];
+
+	switch(client->state) {
+	case SOCKS5_ESTABLISHED:
+		return socks5_proxy_forward(client, rb);
+	case SOCKS5_INIT:
+	{
+		// [VER][NMETHODS][METHODS...]
+		if (!rx_ring_buffer_peek(rb, 0, buf, 1))
+			return 0;
+		if (buf[0] != SOCKS5_VERSION)
+			return socks5_proxy_request(client, rb, 0);
+		if (!rx_ring_buffer_peek(rb, 0, buf, 2))
+			return 0;
+		if (buf[1] == 0)
+			return socks5_proxy_abort(client);
+
+		uint8_t methods[UINT8_MAX];
+		uint8_t nmethods = buf[1];
+		if (!rx_ring_buffer_peek(rb, 2, methods, nmethods))
+			return 0;
+		rx_ring_buffer_drop(rb, 2 + nmethods);
+
+		uint8_t reply[2] = {SOCKS5_VERSION, SOCKS5_AUTH_NO_ACCEPT};
+		if (memchr(methods, SOCKS5_AUTH_NONE, nmethods))
+			reply[1] = SOCKS5_AUTH_NONE;
+		tmux_stream_write(client->ctl_bev, reply, sizeof(reply), &client->stream);
+		if (reply[1] != SOCKS5_AUTH_NONE) {
+			socks5_close_later(client, 1);
+			return 2 + nmethods;
+		}
+
+		client->socks5_reply = 1;
+		client->state = SOCKS5_HANDSHAKE;
+		return 2 + nmethods + handle_socks5(client, rb, len);
+	}
+	case SOCKS5_HANDSHAKE:
+	{
+		// [VER][CMD][RSV][ATYP][ADDR][PORT], replied once target connected or failed
+		if (!rx_ring_buffer_peek(rb, 0, buf, 3))
+			return 0;
+		if (buf[0] != SOCKS5_VERSION)
+			return socks5_proxy_refuse(client, SOCKS5_REP_FAILURE);
+		if (buf[1] != SOCKS5_CMD_CONNECT)
+			return socks5_proxy_refuse(client, SOCKS5_REP_CMD);
+
+		return socks5_proxy_request(client, rb, 3);
+	}
+	case SOCKS5_CONNECT:
+		return socks5_proxy_hold(client, rb);
+	default:
+	{
+		// closing, data is dropped
+		uint32_t n = rb->sz;
+		rx_ring_buffer_drop(rb, n);
+		return n;
+	}
+	}
+}
+
+// socks5 target connected, data held during connecting has been written to it
+void
+socks5_proxy_connected(struct proxy_client *client)
+{
+	struct ring_buffer *rb = &client->stream.rx_ring;
+	client->state = SOCKS5_ESTABLISHED;
+	if (client->socks5_reply)
+		socks5_send_reply(client, SOCKS5_REP_OK);
+	uint32_t n = socks5_proxy_forward(client, rb);
+
+	// window of held and forwarded bytes is granted again
+	client->stream.rx_paused = 0;
+	if (client->stream.state == ESTABLISHED)
+		send_window_update(client->ctl_bev, &client->stream, rb->sz);
+	debug(LOG_DEBUG, "socks5 client %d established, %u bytes forwarded from ring", 
+		client->stream_id, n);
+}
+
+void
+socks5_proxy_close(struct proxy_client *client)
+{
+	if (client->remote_addr.type == SOCKS5_ATYP_DOMAIN)
+		debug(LOG_DEBUG, "xfrpc socks5 proxy close connect [%s:%d] stream_id %d: %s",
+						client->remote_addr.addr, ntohs(client->remote_addr.port),
+						client->stream_id, strerror(errno));
+	else
+		debug(LOG_DEBUG, "xfrpc socks5 proxy close connect [%d:%d] stream_id %d: %s",
+						client->remote_addr.type, ntohs(client->remote_addr.port),
+						client->stream_id, strerror(errno));
+}
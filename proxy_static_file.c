@@ -0,0 +1,957 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file proxy_static_file.c
+    @brief xfrp static file proxy implemented, local directory is served
+    		on work connection without local service
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "debug.h"
+#include "uthash.h"
+#include "common.h"
+#include "proxy.h"
+#include "config.h"
+#include "client.h"
+#include "tcpmux.h"
+#include "crypto_pool.h"
+#include "instance.h"
+#include "alloc.h"
+
+#define SF_HEAD_MAX			(16*1024)
+#define SF_PATH_LEN			4096
+#define SF_VALUE_LEN		256
+#define SF_CHUNK			(16*1024)	// file data read at once when tcp_mux enabled
+#define SF_FD_CACHE_MAX		64			// opened files kept for later requests
+#define SF_IO_THREADS		2			// file system is touched by these threads only
+
+// opened file shared by requests, kept in LRU order, the oldest first
+// it is closed when evicted and no response refers to it
+struct sf_file {
+	char 	*path;
+	int 	fd;
+	off_t 	size;
+	ino_t 	ino;
+	time_t 	mtime;
+	int 	refs;		// fd cache, file segment and response being sent
+	struct evbuffer_file_segment *seg;	// for sendfile when tcp_mux disabled
+	UT_hash_handle hh;
+};
+
+struct static_file_conn {
+	struct proxy_client *client;	// NULL when client freed with a job in flight
+	struct evbuffer *req;	// frps ---> xfrpc not parsed yet
+	size_t 	req_body;		// request body left to discard
+	size_t 	head_len;		// request head being looked up
+	int 	busy;			// job of the conn on io thread
+	struct evbuffer *out;	// response head to send when tcp_mux enabled
+	struct sf_file *file;	// response body being sent when tcp_mux enabled
+	off_t 	off;
+	off_t 	left;
+};
+
+enum sf_job_type {
+	SF_JOB_LOOKUP,	// resolve and open target of request
+	SF_JOB_READ,	// read next chunk of response body
+};
+
+// blocking file system work of a conn, done on io thread so a slow disk
+// does not stall the tunnels of the event loop
+struct sf_job {
+	enum sf_job_type 	type;
+	struct static_file_conn *conn;
+	struct sf_done 		*done;
+	struct sf_job 		*next;
+
+	// SF_JOB_LOOKUP
+	char 	*root;
+	char 	rel[SF_PATH_LEN];
+	int 	head_only;
+	int 	status;		// http status to answer with, 0 if path or listing is served
+	char 	*path;		// resolved path of file served
+	struct stat st;
+	struct evbuffer *listing;
+
+	// both, fd is owned by job until handed to fd cache
+	int 	fd;
+	off_t 	off;
+	size_t 	len;
+	ssize_t nr;
+	int 	err;
+	uint8_t *data;
+};
+
+// jobs done for an event loop, pushed by io threads without lock
+struct sf_done {
+	struct sf_job 	*jobs;	// last done first
+	int 	notify[2];
+	struct event 	*event;
+};
+
+// io threads are shared by all loops, created when first needed
+static pthread_mutex_t sf_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sf_io_cond = PTHREAD_COND_INITIALIZER;
+static struct sf_job *sf_io_head = NULL;
+static struct sf_job *sf_io_tail = NULL;
+static int 	sf_io_threads = 0;
+
+static __thread struct sf_done *loop_done = NULL;
+
+// shared by instances of the same event loop
+static __thread struct sf_file *fd_cache = NULL;
+static __thread int 	fd_cache_count = 0;
+
+static const struct {
+	const char *ext;
+	const char *type;
+} mime_types[] = {
+	{"html",	"text/html"},
+	{"htm",		"text/html"},
+	{"css",		"text/css"},
+	{"js",		"application/javascript"},
+	{"json",	"application/json"},
+	{"txt",		"text/plain"},
+	{"log",		"text/plain"},
+	{"xml",		"text/xml"},
+	{"png",		"image/png"},
+	{"jpg",		"image/jpeg"},
+	{"jpeg",	"image/jpeg"},
+	{"gif",		"image/gif"},
+	{"svg",		"image/svg+xml"},
+	{"ico",		"image/x-icon"},
+	{"gz",		"application/gzip"},
+	{"zip",		"application/zip"},
+	{"pdf",		"application/pdf"},
+};
+
+static const char *
+get_mime_type(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	if (ext && !strchr(ext, '/')) {
+		for (int i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+			if (strcasecmp(ext + 1, mime_types[i].ext) == 0)
+				return mime_types[i].type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+static void
+put_sf_file(struct sf_file *file)
+{
+	if (--file->refs > 0)
+		return;
+
+	debug(LOG_DEBUG, "static file close [%s]", file->path);
+	close(file->fd);
+	xfrpc_free(file->path);
+	xfrpc_free(file);
+}
+
+// last reference of file segment dropped by libevent
+static void
+sf_segment_cleanup(struct evbuffer_file_segment const *seg, int flags, void *arg)
+{
+	put_sf_file((struct sf_file *)arg);
+}
+
+static void
+evict_sf_file(struct sf_file *file)
+{
+	HASH_DEL(fd_cache, file);
+	fd_cache_count--;
+	evbuffer_file_segment_free(file->seg);
+	put_sf_file(file);
+}
+
+// get regular file of path from fd cache, fd opened by io thread is taken
+// instead when the cached one changed on disk, return NULL on failure
+static struct sf_file *
+get_sf_file(const char *path, const struct stat *st, int fd)
+{
+	struct sf_file *file = NULL;
+	HASH_FIND_STR(fd_cache, path, file);
+	if (file) {
+		if (file->ino == st->st_ino && file->size == st->st_size && file->mtime == st->st_mtime) {
+			close(fd);
+			HASH_DEL(fd_cache, file);
+			HASH_ADD_KEYPTR(hh, fd_cache, file->path, strlen(file->path), file);
+			return file;
+		}
+		evict_sf_file(file);
+	}
+
+	file = xfrpc_calloc(ALLOC_STATIC_FILE, sizeof(struct sf_file));
+	assert(file);
+	file->path = xfrpc_strdup(ALLOC_STATIC_FILE, path);
+	assert(file->path);
+	file->fd = fd;
+	file->size = st->st_size;
+	file->ino = st->st_ino;
+	file->mtime = st->st_mtime;
+	file->refs = 2;	// fd cache and file segment
+	file->seg = evbuffer_file_segment_new(fd, 0, -1, 0);
+	if (!file->seg) {
+		debug(LOG_ERR, "static file [%s] segment failed", path);
+		close(fd);
+		xfrpc_free(file->path);
+		xfrpc_free(file);
+		return NULL;
+	}
+	evbuffer_file_segment_add_cleanup_cb(file->seg, sf_segment_cleanup, file);
+
+	while (fd_cache && fd_cache_count >= SF_FD_CACHE_MAX)
+		evict_sf_file(fd_cache);
+	HASH_ADD_KEYPTR(hh, fd_cache, file->path, strlen(file->path), file);
+	fd_cache_count++;
+	return file;
+}
+
+// decode request target into path relative to local_path
+// return 0 if it is invalid or escapes local_path
+static int
+decode_target(const char *target, char *path, size_t path_len)
+{
+	size_t n = 0;
+	if (target[0] != '/')
+		return 0;
+
+	for (const char *p = target; *p && *p != '?' && *p != '#'; p++) {
+		char c = *p;
+		if (c == '%') {
+			if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2]))
+				return 0;
+			char hex[3] = {p[1], p[2], '\0'};
+			c = (char)strtol(hex, NULL, 16);
+			p += 2;
+		}
+		if (c == '\0' || n + 1 >= path_len)
+			return 0;
+		path[n++] = c;
+	}
+	path[n] = '\0';
+
+	// no ".." segment
+	for (const char *p = path; (p = strstr(p, "..")); p += 2) {
+		if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+format_http_time(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// parse single range of Range header for file of size
+// return 1 if satisfiable, -1 if not, 0 if the whole file is to be sent
+static int
+parse_range(const char *value, off_t size, off_t *start, off_t *end)
+{
+	char *e = NULL;
+	if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ','))
+		return 0;
+
+	const char *p = value + 6;
+	if (*p == '-') {
+		off_t suffix = strtoll(p + 1, &e, 10);
+		if (e == p + 1 || suffix <= 0)
+			return -1;
+		*start = suffix < size ? size - suffix : 0;
+		*end = size - 1;
+	} else {
+		*start = strtoll(p, &e, 10);
+		if (e == p || *e != '-')
+			return 0;
+		p = e + 1;
+		*end = *p ? strtoll(p, &e, 10) : size - 1;
+		if (*end >= size)
+			*end = size - 1;
+	}
+
+	return *start <= *end && *start < size ? 1 : -1;
+}
+
+// send buf to frps, it is queued until stream window opens when tcp_mux enabled
+static void
+static_file_send(struct proxy_client *client, struct evbuffer *buf)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (c_conf->tcp_mux)
+		evbuffer_add_buffer(client->static_file->out, buf);
+	else if (client->crypto)
+		work_crypto_send_buffer(client->crypto, NULL, buf);
+	else
+		evbuffer_add_buffer(bufferevent_get_output(client->ctl_bev), buf);
+}
+
+static void
+send_http_error(struct proxy_client *client, int status, const char *reason, const char *location)
+{
+	struct evbuffer *buf = evbuffer_new();
+	assert(buf);
+	evbuffer_add_printf(buf, "HTTP/1.1 %d %s\r\n", status, reason);
+	if (location)
+		evbuffer_add_printf(buf, "Location: %s\r\n", location);
+	evbuffer_add_printf(buf, "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n%d %s\n",
+		(int)(strlen(reason) + 5), status, reason);
+	static_file_send(client, buf);
+	evbuffer_free(buf);
+}
+
+static void
+add_html_escaped(struct evbuffer *buf, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '<': evbuffer_add(buf, "&lt;", 4); break;
+		case '>': evbuffer_add(buf, "&gt;", 4); break;
+		case '&': evbuffer_add(buf, "&amp;", 5); break;
+		case '"': evbuffer_add(buf, "&quot;", 6); break;
+		default: evbuffer_add(buf, s, 1); break;
+		}
+	}
+}
+
+static void
+add_url_escaped(struct evbuffer *buf, const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (isalnum(c) || strchr("-._~", c))
+			evbuffer_add(buf, s, 1);
+		else
+			evbuffer_add_printf(buf, "%%%02X", c);
+	}
+}
+
+// runs on io thread, return NULL if dir can not be read
+static struct evbuffer *
+build_dir_listing(const char *dir, const char *rel)
+{
+	DIR *d = opendir(dir);
+	if (!d)
+		return NULL;
+
+	struct evbuffer *body = evbuffer_new();
+	assert(body);
+	evbuffer_add_printf(body, "<html><head><title>");
+	add_html_escaped(body, rel);
+	evbuffer_add_printf(body, "</title></head><body><pre>\n");
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0)
+			continue;
+		int is_dir = de->d_type == DT_DIR;
+		evbuffer_add_printf(body, "<a href=\"");
+		add_url_escaped(body, de->d_name);
+		evbuffer_add_printf(body, "%s\">", is_dir ? "/" : "");
+		add_html_escaped(body, de->d_name);
+		evbuffer_add_printf(body, "%s</a>\n", is_dir ? "/" : "");
+	}
+	closedir(d);
+	evbuffer_add_printf(body, "</pre></body></html>\n");
+	return body;
+}
+
+static void
+send_dir_listing(struct proxy_client *client, struct evbuffer *body, int head_only)
+{
+	struct evbuffer *buf = evbuffer_new();
+	assert(buf);
+	evbuffer_add_printf(buf, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n",
+		evbuffer_get_length(body));
+	if (!head_only)
+		evbuffer_add_buffer(buf, body);
+	static_file_send(client, buf);
+	evbuffer_free(buf);
+}
+
+// fd is taken and set to -1 when file is sent
+static void
+send_file(struct proxy_client *client, const char *path, const struct stat *st, int *fd,
+	const char *head, size_t head_len, int head_only)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct static_file_conn *conn = client->static_file;
+	char value[SF_VALUE_LEN], mtime[64];
+	off_t start = 0, end = st->st_size - 1;
+	int range = 0;
+
+	format_http_time(st->st_mtime, mtime, sizeof(mtime));
+	if (get_http_header(head, head_len, "If-Modified-Since", value, sizeof(value)) &&
+		strcmp(value, mtime) == 0) {
+		struct evbuffer *buf = evbuffer_new();
+		assert(buf);
+		evbuffer_add_printf(buf, "HTTP/1.1 304 Not Modified\r\nLast-Modified: %s\r\n\r\n", mtime);
+		static_file_send(client, buf);
+		evbuffer_free(buf);
+		return;
+	}
+
+	if (get_http_header(head, head_len, "Range", value, sizeof(value)) &&
+		(range = parse_range(value, st->st_size, &start, &end)) < 0) {
+		struct evbuffer *buf = evbuffer_new();
+		assert(buf);
+		evbuffer_add_printf(buf, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", (long long)st->st_size);
+		static_file_send(client, buf);
+		evbuffer_free(buf);
+		return;
+	}
+
+	struct sf_file *file = get_sf_file(path, st, *fd);
+	*fd = -1;
+	if (!file) {
+		send_http_error(client, 403, "Forbidden", NULL);
+		return;
+	}
+
+	off_t len = st->st_size > 0 ? end - start + 1 : 0;
+	struct evbuffer *buf = evbuffer_new();
+	assert(buf);
+	if (range)
+		evbuffer_add_printf(buf, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+			(long long)start, (long long)end, (long long)st->st_size);
+	else
+		evbuffer_add_printf(buf, "HTTP/1.1 200 OK\r\n");
+	evbuffer_add_printf(buf, "Content-Type: %s\r\nContent-Length: %lld\r\n"
+		"Last-Modified: %s\r\nAccept-Ranges: bytes\r\n\r\n",
+		get_mime_type(path), (long long)len, mtime);
+
+	if (head_only || len == 0) {
+		static_file_send(client, buf);
+	} else if (!c_conf->tcp_mux) {
+		// file segment is written with sendfile by socket bufferevent
+		evbuffer_add_file_segment(buf, file->seg, start, len);
+		static_file_send(client, buf);
+	} else {
+		static_file_send(client, buf);
+		file->refs++;
+		conn->file = file;
+		conn->off = start;
+		conn->left = len;
+	}
+	evbuffer_free(buf);
+}
+
+// runs on io thread: resolve rel under root without leaving it by symlinks,
+// then open the file or list the directory
+static void
+lookup_target(struct sf_job *job)
+{
+	char root[PATH_MAX], real[PATH_MAX], path[SF_PATH_LEN * 2];
+
+	snprintf(path, sizeof(path), "%s%s", job->root, job->rel);
+	if (!realpath(job->root, root) || !realpath(path, real)) {
+		job->status = 404;
+		return;
+	}
+	size_t n = strlen(root);
+	if (strncmp(real, root, n) != 0 || (n > 1 && real[n] != '/' && real[n] != '\0')) {
+		debug(LOG_WARNING, "static file [%s] resolves out of [%s], refuse it", job->rel, root);
+		job->status = 403;
+		return;
+	}
+	if (stat(real, &job->st) < 0) {
+		job->status = 404;
+		return;
+	}
+
+	if (S_ISDIR(job->st.st_mode)) {
+		if (job->rel[strlen(job->rel) - 1] != '/') {
+			job->status = 301;
+			return;
+		}
+		// index.html is opened without following a link out of root
+		strncat(real, "/index.html", sizeof(real) - strlen(real) - 1);
+		job->fd = open(real, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (job->fd < 0 || fstat(job->fd, &job->st) < 0 || !S_ISREG(job->st.st_mode)) {
+			real[strlen(real) - strlen("/index.html")] = '\0';
+			if (!(job->listing = build_dir_listing(real, job->rel)))
+				job->status = 403;
+			return;
+		}
+	} else {
+		job->fd = open(real, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (job->fd < 0 || fstat(job->fd, &job->st) < 0 || !S_ISREG(job->st.st_mode)) {
+			job->status = 403;
+			return;
+		}
+	}
+	job->path = xfrpc_strdup(ALLOC_STATIC_FILE, real);
+	assert(job->path);
+}
+
+static void *
+sf_io_run(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&sf_io_lock);
+		while (!sf_io_head)
+			pthread_cond_wait(&sf_io_cond, &sf_io_lock);
+		struct sf_job *job = sf_io_head;
+		sf_io_head = job->next;
+		if (!sf_io_head)
+			sf_io_tail = NULL;
+		pthread_mutex_unlock(&sf_io_lock);
+
+		if (job->type == SF_JOB_LOOKUP) {
+			lookup_target(job);
+		} else {
+			job->nr = pread(job->fd, job->data, job->len, job->off);
+			job->err = errno;
+		}
+
+		// wake up the loop only when its queue was empty
+		struct sf_done *done = job->done;
+		struct sf_job *head = __atomic_load_n(&done->jobs, __ATOMIC_RELAXED);
+		do {
+			job->next = head;
+		} while (!__atomic_compare_exchange_n(&done->jobs, &head, job, 1, 
+											__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		if (!head && write(done->notify[1], "j", 1) != 1)
+			debug(LOG_ERR, "error: notify static file done failed: %s", strerror(errno));
+	}
+
+	return NULL;
+}
+
+static void sf_done_cb(evutil_socket_t fd, short events, void *arg);
+
+// return 0 if io threads or done queue of the loop can not be set up
+static int
+attach_sf_io(struct event_base *base)
+{
+	pthread_mutex_lock(&sf_io_lock);
+	for (; sf_io_threads < SF_IO_THREADS; sf_io_threads++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, sf_io_run, NULL) != 0) {
+			debug(LOG_ERR, "error: create static file io thread failed!");
+			break;
+		}
+		pthread_detach(tid);
+	}
+	int n = sf_io_threads;
+	pthread_mutex_unlock(&sf_io_lock);
+	if (!n)
+		return 0;
+
+	if (!loop_done) {
+		struct sf_done *done = xfrpc_calloc(ALLOC_STATIC_FILE, sizeof(struct sf_done));
+		assert(done);
+		if (pipe(done->notify) < 0) {
+			debug(LOG_ERR, "error: static file done pipe init failed: %s", strerror(errno));
+			xfrpc_free(done);
+			return 0;
+		}
+		evutil_make_socket_nonblocking(done->notify[0]);
+		evutil_make_socket_nonblocking(done->notify[1]);
+		done->event = event_new(base, done->notify[0], EV_READ|EV_PERSIST, sf_done_cb, done);
+		assert(done->event);
+		event_add(done->event, NULL);
+		loop_done = done;
+	}
+	return 1;
+}
+
+static struct sf_job *
+new_sf_job(struct proxy_client *client, enum sf_job_type type)
+{
+	if (!attach_sf_io(client->base))
+		return NULL;
+
+	struct sf_job *job = xfrpc_calloc(ALLOC_STATIC_FILE, sizeof(struct sf_job));
+	assert(job);
+	job->type = type;
+	job->conn = client->static_file;
+	job->done = loop_done;
+	job->fd = -1;
+	return job;
+}
+
+static void
+queue_sf_job(struct sf_job *job)
+{
+	job->conn->busy = 1;
+	pthread_mutex_lock(&sf_io_lock);
+	if (sf_io_tail)
+		sf_io_tail->next = job;
+	else
+		sf_io_head = job;
+	sf_io_tail = job;
+	pthread_cond_signal(&sf_io_cond);
+	pthread_mutex_unlock(&sf_io_lock);
+}
+
+static void
+free_sf_job(struct sf_job *job)
+{
+	if (job->type == SF_JOB_LOOKUP && job->fd >= 0)
+		close(job->fd);
+	if (job->listing)
+		evbuffer_free(job->listing);
+	xfrpc_free(job->root);
+	xfrpc_free(job->path);
+	xfrpc_free(job->data);
+	xfrpc_free(job);
+}
+
+// handle request head of head_len at start of conn->req
+// return 0 if its target is being looked up, the request is answered then
+static int
+handle_request_head(struct proxy_client *client, size_t head_len)
+{
+	struct static_file_conn *conn = client->static_file;
+	const char *head = (const char *)evbuffer_pullup(conn->req, head_len);
+	char method[16], target[SF_PATH_LEN], value[SF_VALUE_LEN];
+	char line[SF_PATH_LEN + 32];
+
+	if (get_http_header(head, head_len, "Content-Length", value, sizeof(value)))
+		conn->req_body = strtoul(value, NULL, 10);
+
+	if (!get_http_start_line(head, head_len, line, sizeof(line)) || 
+		sscanf(line, "%15s %4095s HTTP/1.%*c", method, target) != 2) {
+		send_http_error(client, 400, "Bad Request", NULL);
+		return 1;
+	}
+
+	int head_only = strcmp(method, "HEAD") == 0;
+	if (!head_only && strcmp(method, "GET") != 0) {
+		send_http_error(client, 405, "Method Not Allowed", NULL);
+		return 1;
+	}
+
+	struct sf_job *job = new_sf_job(client, SF_JOB_LOOKUP);
+	if (!job) {
+		send_http_error(client, 503, "Service Unavailable", NULL);
+		return 1;
+	}
+	if (!decode_target(target, job->rel, sizeof(job->rel))) {
+		free_sf_job(job);
+		send_http_error(client, 400, "Bad Request", NULL);
+		return 1;
+	}
+
+	debug(LOG_DEBUG, "static file proxy [%s] %s [%s]", client->ps->proxy_name, method, job->rel);
+	job->root = xfrpc_strdup(ALLOC_STATIC_FILE, client->ps->local_path);
+	assert(job->root);
+	job->head_only = head_only;
+	conn->head_len = head_len;
+	queue_sf_job(job);
+	return 0;
+}
+
+// target of request looked up, answer it
+static void
+finish_lookup(struct proxy_client *client, struct sf_job *job)
+{
+	struct static_file_conn *conn = client->static_file;
+	const char *head = (const char *)evbuffer_pullup(conn->req, conn->head_len);
+
+	switch (job->status) {
+	case 0:
+		if (job->listing)
+			send_dir_listing(client, job->listing, job->head_only);
+		else
+			send_file(client, job->path, &job->st, &job->fd, head, conn->head_len, job->head_only);
+		break;
+	case 301:
+	{
+		// directory without trailing slash, location is request target with it
+		char line[SF_PATH_LEN + 32], method[16], target[SF_PATH_LEN];
+		if (get_http_start_line(head, conn->head_len, line, sizeof(line)) && 
+			sscanf(line, "%15s %4095s", method, target) == 2) {
+			char *q = strchr(target, '?');
+			if (q)
+				*q = '\0';
+			strncat(target, "/", sizeof(target) - strlen(target) - 1);
+			send_http_error(client, 301, "Moved Permanently", target);
+		}
+		break;
+	}
+	case 403:
+		send_http_error(client, 403, "Forbidden", NULL);
+		break;
+	default:
+		send_http_error(client, 404, "Not Found", NULL);
+	}
+	evbuffer_drain(conn->req, conn->head_len);
+	conn->head_len = 0;
+}
+
+static void
+release_file(struct static_file_conn *conn)
+{
+	if (conn->file)
+		put_sf_file(conn->file);
+	conn->file = NULL;
+	conn->left = 0;
+}
+
+// send queued response within stream send window when tcp_mux enabled
+// return 1 if nothing is left to send
+static int
+flush_response(struct proxy_client *client)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct static_file_conn *conn = client->static_file;
+	struct tmux_stream *stream = &client->stream;
+
+	if (!c_conf->tcp_mux)
+		return 1;
+
+	for (;;) {
+		// never queue data in tx ring, the rest waits for window update
+		size_t room = stream->send_window > stream->tx_ring.sz ?
+			stream->send_window - stream->tx_ring.sz : 0;
+		size_t len = evbuffer_get_length(conn->out);
+		if (len > 0) {
+			if (room == 0)
+				return 0;
+			if (len > room)
+				len = room;
+			uint32_t nw = tmux_stream_write(client->ctl_bev, evbuffer_pullup(conn->out, len), len, stream);
+			evbuffer_drain(conn->out, nw ? len : evbuffer_get_length(conn->out));
+			if (!nw)
+				release_file(conn); // stream closed
+			continue;
+		}
+
+		if (!conn->file)
+			return 1;
+		if (room == 0)
+			return 0;
+
+		if (room > SF_CHUNK)
+			room = SF_CHUNK;
+		if (room > conn->left)
+			room = conn->left;
+
+		// chunk is read on io thread, sending goes on when it is done
+		struct sf_job *job = new_sf_job(client, SF_JOB_READ);
+		if (!job) {
+			release_file(conn);
+			return 1;
+		}
+		job->fd = conn->file->fd;
+		job->off = conn->off;
+		job->len = room;
+		job->data = xfrpc_malloc(ALLOC_STATIC_FILE, room);
+		assert(job->data);
+		queue_sf_job(job);
+		return 0;
+	}
+}
+
+// chunk of response body read, send it
+static void
+finish_read(struct proxy_client *client, struct sf_job *job)
+{
+	struct static_file_conn *conn = client->static_file;
+	if (!conn->file)
+		return;
+	if (job->nr <= 0) {
+		debug(LOG_ERR, "static file read [%s] failed: %s", conn->file->path, 
+			job->nr < 0 ? strerror(job->err) : "end of file");
+		release_file(conn);
+		return;
+	}
+
+	uint32_t nw = tmux_stream_write(client->ctl_bev, job->data, job->nr, &client->stream);
+	conn->off += job->nr;
+	conn->left -= job->nr;
+	if (conn->left == 0 || !nw)
+		release_file(conn);
+}
+
+// requests are answered one by one, the next waits until the body of
+// current response is sent
+static void
+process_requests(struct proxy_client *client)
+{
+	struct static_file_conn *conn = client->static_file;
+	size_t len;
+
+	while (!conn->busy && flush_response(client) && (len = evbuffer_get_length(conn->req)) > 0) {
+		if (conn->req_body > 0) {
+			size_t n = len < conn->req_body ? len : conn->req_body;
+			evbuffer_drain(conn->req, n);
+			conn->req_body -= n;
+			continue;
+		}
+
+		struct evbuffer_ptr end = evbuffer_search(conn->req, "\r\n\r\n", 4, NULL);
+		if (end.pos < 0) {
+			if (len > SF_HEAD_MAX) {
+				send_http_error(client, 431, "Request Header Fields Too Large", NULL);
+				evbuffer_drain(conn->req, len);
+			}
+			break;
+		}
+
+		if (!handle_request_head(client, end.pos + 4))
+			break;
+		evbuffer_drain(conn->req, end.pos + 4);
+	}
+}
+
+static void
+free_static_file_conn(struct static_file_conn *conn)
+{
+	release_file(conn);
+	evbuffer_free(conn->req);
+	evbuffer_free(conn->out);
+	xfrpc_free(conn);
+}
+
+static void
+sf_done_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct sf_done *done = arg;
+	char buf[64];
+
+	// drain notify before taking jobs, or a wake up may be lost
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	struct sf_job *job = __atomic_exchange_n(&done->jobs, NULL, __ATOMIC_ACQUIRE);
+	while (job) {
+		struct sf_job *next = job->next;
+		struct static_file_conn *conn = job->conn;
+		struct proxy_client *client = conn->client;
+		conn->busy = 0;
+		if (!client) {
+			free_static_file_conn(conn);
+		} else {
+			set_cur_instance(client->inst);
+			if (job->type == SF_JOB_LOOKUP)
+				finish_lookup(client, job);
+			else
+				finish_read(client, job);
+			process_requests(client);
+		}
+		free_sf_job(job);
+		job = next;
+	}
+}
+
+static struct static_file_conn *
+get_static_file_conn(struct proxy_client *client)
+{
+	if (client->static_file)
+		return client->static_file;
+
+	struct static_file_conn *conn = xfrpc_calloc(ALLOC_STATIC_FILE, sizeof(struct static_file_conn));
+	assert(conn);
+	conn->req = evbuffer_new();
+	conn->out = evbuffer_new();
+	assert(conn->req && conn->out);
+	conn->client = client;
+	client->static_file = conn;
+
+	// request read together with StartWorkConn message
+	if (client->data_tail_size > 0) {
+		evbuffer_add(conn->req, client->data_tail, client->data_tail_size);
+		client->data_tail = NULL;
+		client->data_tail_size = 0;
+	}
+	return conn;
+}
+
+// frps ---> xfrpc when tcp_mux enabled
+uint32_t
+static_file_proxy_mux_data(struct proxy_client *client, struct ring_buffer *rb, int len)
+{
+	struct static_file_conn *conn = get_static_file_conn(client);
+	if (len > rb->sz)
+		len = rb->sz;
+
+	struct evbuffer_iovec v;
+	if (len <= 0 || evbuffer_reserve_space(conn->req, len, &v, 1) < 1)
+		return 0;
+	rx_ring_buffer_pop(rb, v.iov_base, len);
+	v.iov_len = len;
+	evbuffer_commit_space(conn->req, &v, 1);
+
+	process_requests(client);
+	return len;
+}
+
+// frps ---> xfrpc when tcp_mux disabled
+void
+static_file_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
+{
+	struct proxy_client *client = (struct proxy_client *)ctx;
+	assert(client);
+	struct static_file_conn *conn = get_static_file_conn(client);
+	evbuffer_add_buffer(conn->req, bufferevent_get_input(bev));
+	process_requests(client);
+}
+
+// send window of stream opened, go on with response
+void
+static_file_proxy_window_update(struct proxy_client *client)
+{
+	if (client->static_file)
+		process_requests(client);
+}
+
+void
+static_file_proxy_free(struct proxy_client *client)
+{
+	struct static_file_conn *conn = client->static_file;
+	if (!conn)
+		return;
+
+	// freed when its job is done
+	client->static_file = NULL;
+	if (conn->busy) {
+		conn->client = NULL;
+		return;
+	}
+	free_static_file_conn(conn);
+}
@@ -0,0 +1,289 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file ratelimit.c
+    @brief bandwidth_limit of proxies and of all proxies to frps
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    bandwidth_limit of a proxy section is a libevent rate limit group shared
+    by the local connections of the proxy, so what the proxy sends to frps is
+    limited where it is read. bandwidth_limit of common section limits all
+    proxies together: without tcp_mux the work connections share a group;
+    with tcp_mux there is one connection to frps, data frames of proxy streams
+    take tokens of a bucket in the mux write path and wait in a queue when it
+    is empty, while control messages, pings and window updates are not queued,
+    so heartbeat keeps going under bulk load.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "config.h"
+#include "client.h"
+#include "control.h"
+#include "tcpmux.h"
+#include "instance.h"
+#include "ratelimit.h"
+
+#define RATE_TICK_MS		100		// tokens of libevent groups are given every tick
+#define MUX_BURST_MS		100		// tokens saved up by idle tcp_mux bucket
+#define MUX_MIN_BURST		16384
+
+struct rate_limiter {
+	// tcp_mux: frames of proxy streams waiting for tokens
+	struct evbuffer 	*queue;
+	struct event 		*refill;
+	double 				tokens;		// below 0 when a large frame was sent
+	struct timespec 	last;
+
+	// no tcp_mux: all work connections of the instance
+	struct bufferevent_rate_limit_group *work_group;
+};
+
+// per instance state
+#define rate_limit 	(cur_instance->rate_limit)
+
+static struct rate_limiter *
+get_rate_limit()
+{
+	if (!rate_limit) {
+		rate_limit = calloc(1, sizeof(struct rate_limiter));
+		assert(rate_limit);
+	}
+	return rate_limit;
+}
+
+// limit of 0 is unlimited
+static struct ev_token_bucket_cfg *
+new_rate_cfg(size_t read_limit, size_t write_limit)
+{
+	struct timeval tick = {0, RATE_TICK_MS * 1000};
+	size_t ticks = 1000 / RATE_TICK_MS;
+	size_t read_rate = read_limit ? (read_limit + ticks - 1) / ticks : EV_RATE_LIMIT_MAX;
+	size_t write_rate = write_limit ? (write_limit + ticks - 1) / ticks : EV_RATE_LIMIT_MAX;
+	return ev_token_bucket_cfg_new(read_rate, read_rate, write_rate, write_rate, &tick);
+}
+
+static struct bufferevent_rate_limit_group *
+new_rate_group(struct event_base *base, size_t read_limit, size_t write_limit)
+{
+	struct ev_token_bucket_cfg *cfg = new_rate_cfg(read_limit, write_limit);
+	if (!cfg) {
+		debug(LOG_ERR, "bandwidth limit %zu %zu is invalid", read_limit, write_limit);
+		return NULL;
+	}
+
+	struct bufferevent_rate_limit_group *group = bufferevent_rate_limit_group_new(base, cfg);
+	ev_token_bucket_cfg_free(cfg);
+	if (!group)
+		debug(LOG_ERR, "create rate limit group failed");
+	return group;
+}
+
+void
+limit_local_bev(struct proxy_client *client)
+{
+	struct proxy_service *ps = client->ps;
+	if (!ps || !ps->bandwidth_limit || !client->local_proxy_bev)
+		return;
+
+	if (!ps->rate_group)
+		ps->rate_group = new_rate_group(client->base, ps->bandwidth_limit, 0);
+	if (ps->rate_group)
+		bufferevent_add_to_rate_limit_group(client->local_proxy_bev, ps->rate_group);
+}
+
+void
+limit_work_bev(struct bufferevent *bev)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!bev || c_conf->tcp_mux || !c_conf->bandwidth_limit)
+		return;
+
+	struct rate_limiter *rl = get_rate_limit();
+	if (!rl->work_group)
+		rl->work_group = new_rate_group(bufferevent_get_base(bev), 0, c_conf->bandwidth_limit);
+	if (rl->work_group)
+		bufferevent_add_to_rate_limit_group(bev, rl->work_group);
+}
+
+void
+unlimit_bev(struct bufferevent *bev)
+{
+	// bev leaves its group only when it is finalized, which may be after
+	// the group is freed, so leave now
+	if (bev)
+		bufferevent_remove_from_rate_limit_group(bev);
+}
+
+void
+set_proxy_bandwidth_limit(struct proxy_service *ps, size_t limit)
+{
+	if (ps->bandwidth_limit == limit)
+		return;
+
+	debug(LOG_INFO, "proxy [%s] bandwidth limit %zu -> %zu", ps->proxy_name, ps->bandwidth_limit, limit);
+	ps->bandwidth_limit = limit;
+	if (ps->rate_group) {
+		struct ev_token_bucket_cfg *cfg = new_rate_cfg(limit, 0);
+		if (cfg) {
+			bufferevent_rate_limit_group_set_cfg(ps->rate_group, cfg);
+			ev_token_bucket_cfg_free(cfg);
+		}
+		return;
+	}
+
+	// connections of the proxy were not limited before
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, cur_instance->all_pc, client, tmp) {
+		if (client->ps == ps)
+			limit_local_bev(client);
+	}
+}
+
+static double
+mux_burst(size_t limit)
+{
+	double burst = (double)limit * MUX_BURST_MS / 1000;
+	return burst < MUX_MIN_BURST ? MUX_MIN_BURST : burst;
+}
+
+static void
+refill_tokens(struct rate_limiter *rl, size_t limit)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - rl->last.tv_sec) + (now.tv_nsec - rl->last.tv_nsec) / 1e9;
+	rl->last = now;
+	rl->tokens += elapsed * limit;
+	if (rl->tokens > mux_burst(limit))
+		rl->tokens = mux_burst(limit);
+}
+
+static void
+schedule_refill(struct rate_limiter *rl, size_t limit)
+{
+	if (evtimer_pending(rl->refill, NULL))
+		return;
+
+	// wait until there is a token again
+	double wait = rl->tokens < 0 ? (1 - rl->tokens) / limit : 0.001;
+	struct timeval tv = {(time_t)wait, (suseconds_t)((wait - (time_t)wait) * 1e6)};
+	if (tv.tv_sec == 0 && tv.tv_usec < 1000)
+		tv.tv_usec = 1000;
+	evtimer_add(rl->refill, &tv);
+}
+
+// move whole frames to frps, all of them or as many as tokens allow
+static void
+release_frames(struct rate_limiter *rl, int all)
+{
+	struct bufferevent *bout = get_main_control()->connect_bev;
+	struct tcp_mux_header hdr;
+	while (evbuffer_get_length(rl->queue) >= sizeof(hdr) && (all || rl->tokens > 0)) {
+		evbuffer_copyout(rl->queue, &hdr, sizeof(hdr));
+		size_t len = hdr.type == DATA ? ntohl(hdr.length) : 0;
+		if (bout)
+			evbuffer_remove_buffer(rl->queue, bufferevent_get_output(bout), sizeof(hdr) + len);
+		else
+			evbuffer_drain(rl->queue, sizeof(hdr) + len);
+		rl->tokens -= len;
+	}
+}
+
+static void
+mux_refill_cb(evutil_socket_t fd, short what, void *arg)
+{
+	set_cur_instance(arg);
+	struct rate_limiter *rl = rate_limit;
+	size_t limit = get_common_config()->bandwidth_limit;
+	refill_tokens(rl, limit);
+	release_frames(rl, 0);
+	if (evbuffer_get_length(rl->queue) > 0)
+		schedule_refill(rl, limit);
+}
+
+struct evbuffer *
+mux_stream_output(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length)
+{
+	struct common_conf *c_conf = get_common_config();
+	struct evbuffer *out = bufferevent_get_output(bout);
+	if (!c_conf->tcp_mux || !c_conf->bandwidth_limit || stream == &get_main_control()->stream)
+		return out;
+
+	struct rate_limiter *rl = get_rate_limit();
+	if (!rl->queue) {
+		rl->queue = evbuffer_new();
+		rl->refill = evtimer_new(get_main_control()->connect_base, mux_refill_cb, cur_instance);
+		assert(rl->queue && rl->refill);
+		rl->tokens = mux_burst(c_conf->bandwidth_limit);
+		clock_gettime(CLOCK_MONOTONIC, &rl->last);
+	}
+
+	// frames of a stream keep their order, data goes after queued frames
+	refill_tokens(rl, c_conf->bandwidth_limit);
+	if (evbuffer_get_length(rl->queue) == 0 && rl->tokens > 0) {
+		rl->tokens -= length;
+		return out;
+	}
+
+	schedule_refill(rl, c_conf->bandwidth_limit);
+	flight_record(stream, stream->id, FL_STALL_RATE, 0, evbuffer_get_length(rl->queue));
+	return rl->queue;
+}
+
+void
+flush_mux_rate_limit()
+{
+	if (rate_limit && rate_limit->queue)
+		release_frames(rate_limit, 1);
+}
+
+void
+reset_mux_rate_limit()
+{
+	if (!rate_limit || !rate_limit->queue)
+		return;
+
+	evbuffer_drain(rate_limit->queue, evbuffer_get_length(rate_limit->queue));
+	evtimer_del(rate_limit->refill);
+}
+
+void
+close_rate_limit()
+{
+	if (!rate_limit || !rate_limit->queue)
+		return;
+
+	evbuffer_free(rate_limit->queue);
+	event_free(rate_limit->refill);
+	rate_limit->queue = NULL;
+	rate_limit->refill = NULL;
+}
@@ -0,0 +1,65 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file ratelimit.h
+    @brief bandwidth_limit of proxies and of all proxies to frps
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct bufferevent;
+struct evbuffer;
+struct proxy_client;
+struct proxy_service;
+struct tmux_stream;
+
+// local connection of client joins the rate limit group of its proxy
+void limit_local_bev(struct proxy_client *client);
+
+// work connection without tcp_mux joins the group of all work connections
+void limit_work_bev(struct bufferevent *bev);
+
+// bev leaves its group, it must be called before the bev is freed
+void unlimit_bev(struct bufferevent *bev);
+
+// apply bandwidth_limit of reloaded proxy, connections are kept
+void set_proxy_bandwidth_limit(struct proxy_service *ps, size_t limit);
+
+// output for a tcp_mux frame of stream carrying length bytes of data,
+// frames of proxy streams are queued while over bandwidth_limit of common
+struct evbuffer *mux_stream_output(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length);
+
+// send queued frames now regardless of the limit
+void flush_mux_rate_limit();
+
+// drop queued frames, control connection is closed
+void reset_mux_rate_limit();
+
+// free tcp_mux queue of closing control, group of work connections stays as
+// they may outlive it
+void close_rate_limit();
+
+#endif //_RATELIMIT_H_
@@ -0,0 +1,298 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file replay.c
+    @brief capture the byte stream from frps and replay it offline
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    With capture_file set, what the control connection reads from frps, login
+    response, control messages and the whole tcp_mux traffic, is appended to
+    the file with its time. With replay_file set, the instance does not
+    connect frps; its control connection is one end of a bufferevent pair
+    whose other end is a stub frps writing the capture back, at recorded or
+    at maximum speed, while what xfrpc sends is dropped. The capture then
+    goes through recv_cb, handle_tcp_mux_stream and handle_control_work as
+    it did in production, which makes real traffic mixes a benchmark.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <syslog.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "config.h"
+#include "instance.h"
+#include "replay.h"
+
+struct capture_state {
+	FILE 	*fp;
+	struct timespec 	start;
+	size_t 	left;	// bytes of input captured but not consumed by recv_cb
+};
+
+struct replay_state {
+	FILE 	*fp;
+	struct bufferevent 	*stub;	// frps side of the pair
+	struct event 	*timer;
+	struct capture_rec 	next;
+	uint8_t 	*data;		// data of next
+	uint32_t 	size;
+	int 	has_next;
+	int 	sessions;
+	uint64_t 	base_ts;	// ts of the session record
+	struct timespec 	start;
+	uint64_t 	records;
+	uint64_t 	rx_bytes;	// bytes fed to xfrpc
+	uint64_t 	tx_bytes;	// bytes xfrpc sent to the stub
+};
+
+// per instance state
+#define capture_out 	(cur_instance->capture_out)
+#define replay_in 		(cur_instance->replay_in)
+
+static uint64_t
+elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 + now.tv_nsec - start->tv_nsec;
+}
+
+static void
+write_capture_rec(struct capture_state *cap, const struct evbuffer_iovec *vec, int n, uint32_t len)
+{
+	struct capture_rec rec = {elapsed_ns(&cap->start), len};
+	fwrite(&rec, sizeof(rec), 1, cap->fp);
+	for (int i = 0; i < n && len > 0; i++) {
+		size_t l = vec[i].iov_len < len ? vec[i].iov_len : len;
+		fwrite(vec[i].iov_base, 1, l, cap->fp);
+		len -= l;
+	}
+}
+
+// called when control connection is connected, it starts a session
+void
+start_capture()
+{
+	struct common_conf *c_conf = get_common_config();
+	if (!c_conf->capture_file || c_conf->replay_file)
+		return;
+
+	if (!capture_out) {
+		FILE *fp = fopen(c_conf->capture_file, "a");
+		if (!fp) {
+			debug(LOG_ERR, "open capture_file %s failed", c_conf->capture_file);
+			return;
+		}
+		if (ftell(fp) == 0)
+			fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), fp);
+
+		capture_out = calloc(1, sizeof(struct capture_state));
+		assert(capture_out);
+		capture_out->fp = fp;
+		clock_gettime(CLOCK_MONOTONIC, &capture_out->start);
+	}
+
+	capture_out->left = 0;
+	write_capture_rec(capture_out, NULL, 0, 0);
+	fflush(capture_out->fp);
+	debug(LOG_INFO, "capture control connection to %s", c_conf->capture_file);
+}
+
+// record input added since recv_cb returned last time
+void
+capture_recv(struct evbuffer *input)
+{
+	if (!capture_out)
+		return;
+
+	size_t len = evbuffer_get_length(input);
+	if (len <= capture_out->left)
+		return;
+
+	struct evbuffer_ptr pos;
+	evbuffer_ptr_set(input, &pos, capture_out->left, EVBUFFER_PTR_SET);
+	int n = evbuffer_peek(input, len - capture_out->left, &pos, NULL, 0);
+	struct evbuffer_iovec vec[n];
+	evbuffer_peek(input, len - capture_out->left, &pos, vec, n);
+	write_capture_rec(capture_out, vec, n, len - capture_out->left);
+}
+
+void
+capture_consumed(struct evbuffer *input)
+{
+	if (capture_out)
+		capture_out->left = evbuffer_get_length(input);
+}
+
+void
+close_capture()
+{
+	if (!capture_out)
+		return;
+
+	fclose(capture_out->fp);
+	free(capture_out);
+	capture_out = NULL;
+}
+
+static int
+read_replay_rec(struct replay_state *rp)
+{
+	if (fread(&rp->next, sizeof(rp->next), 1, rp->fp) != 1)
+		return 0;
+
+	if (rp->next.len > rp->size) {
+		rp->data = realloc(rp->data, rp->next.len);
+		assert(rp->data);
+		rp->size = rp->next.len;
+	}
+	if (rp->next.len && fread(rp->data, 1, rp->next.len, rp->fp) != rp->next.len)
+		return 0;
+
+	rp->has_next = 1;
+	return 1;
+}
+
+static void
+finish_replay(struct replay_state *rp)
+{
+	double ms = elapsed_ns(&rp->start) / 1e6;
+	debug(LOG_NOTICE, "replay of %s done: %llu records, %llu bytes in, %llu bytes out, %.3f ms, %.2f MB/s", 
+		get_common_config()->replay_file, (unsigned long long)rp->records, 
+		(unsigned long long)rp->rx_bytes, (unsigned long long)rp->tx_bytes, 
+		ms, ms > 0 ? rp->rx_bytes / 1e3 / ms : 0);
+	exit(0);
+}
+
+// feed the records that are due, one at a time at maximum speed so that
+// local connections are served between records as they are from a socket
+static void
+replay_cb(evutil_socket_t fd, short what, void *arg)
+{
+	set_cur_instance(arg);
+	struct replay_state *rp = replay_in;
+	int max_speed = get_common_config()->replay_max_speed;
+
+	for (;;) {
+		if (!rp->has_next && !read_replay_rec(rp)) {
+			finish_replay(rp);
+			return;
+		}
+
+		if (rp->next.len == 0) {
+			// sessions after the first one were new control connections
+			if (rp->sessions++ > 0) {
+				finish_replay(rp);
+				return;
+			}
+			rp->base_ts = rp->next.ts;
+			clock_gettime(CLOCK_MONOTONIC, &rp->start);
+			rp->has_next = 0;
+			continue;
+		}
+
+		struct timeval tv = {0, 0};
+		if (!max_speed) {
+			uint64_t due = rp->next.ts - rp->base_ts;
+			uint64_t now = elapsed_ns(&rp->start);
+			if (due > now) {
+				tv.tv_sec = (due - now) / 1000000000;
+				tv.tv_usec = (due - now) % 1000000000 / 1000;
+				evtimer_add(rp->timer, &tv);
+				return;
+			}
+		}
+
+		bufferevent_write(rp->stub, rp->data, rp->next.len);
+		rp->records++;
+		rp->rx_bytes += rp->next.len;
+		rp->has_next = 0;
+
+		if (max_speed) {
+			evtimer_add(rp->timer, &tv);
+			return;
+		}
+	}
+}
+
+// stub frps drops what xfrpc sends
+static void
+stub_read_cb(struct bufferevent *bev, void *ctx)
+{
+	set_cur_instance(ctx);
+	struct evbuffer *input = bufferevent_get_input(bev);
+	replay_in->tx_bytes += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+struct bufferevent *
+open_replay(struct event_base *base)
+{
+	struct common_conf *c_conf = get_common_config();
+	if (replay_in) {
+		// heartbeat timeout or error dropped the control connection
+		debug(LOG_ERR, "control connection of replay closed");
+		finish_replay(replay_in);
+	}
+	if (!c_conf->tcp_mux) {
+		debug(LOG_ERR, "replay_file needs tcp_mux, work connections are not captured");
+		return NULL;
+	}
+
+	FILE *fp = fopen(c_conf->replay_file, "r");
+	char magic[sizeof(CAPTURE_MAGIC)] = {0};
+	if (!fp || fread(magic, 1, strlen(CAPTURE_MAGIC), fp) != strlen(CAPTURE_MAGIC) || 
+		strcmp(magic, CAPTURE_MAGIC)) {
+		debug(LOG_ERR, "%s is not a capture file", c_conf->replay_file);
+		if (fp) fclose(fp);
+		return NULL;
+	}
+
+	struct bufferevent *pair[2];
+	if (bufferevent_pair_new(base, BEV_OPT_CLOSE_ON_FREE, pair) < 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	replay_in = calloc(1, sizeof(struct replay_state));
+	assert(replay_in);
+	replay_in->fp = fp;
+	replay_in->stub = pair[1];
+	replay_in->timer = evtimer_new(base, replay_cb, cur_instance);
+	assert(replay_in->timer);
+	bufferevent_setcb(pair[1], stub_read_cb, NULL, NULL, cur_instance);
+	bufferevent_enable(pair[1], EV_READ|EV_WRITE);
+
+	// records are fed from the loop, after login is sent on the pair
+	struct timeval tv = {0, 0};
+	evtimer_add(replay_in->timer, &tv);
+	debug(LOG_INFO, "replay %s at %s speed", c_conf->replay_file, 
+		c_conf->replay_max_speed ? "maximum" : "recorded");
+	return pair[0];
+}
@@ -0,0 +1,58 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file replay.h
+    @brief capture the byte stream from frps and replay it offline
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC	"XFRPCAP1"
+
+struct evbuffer;
+struct event_base;
+struct bufferevent;
+
+// capture file is CAPTURE_MAGIC followed by records in host byte order,
+// a record of len 0 starts a session, that is a new control connection
+struct capture_rec {
+	uint64_t 	ts;		// CLOCK_MONOTONIC ns since the file was opened
+	uint32_t 	len;	// bytes of data following the record
+} __attribute__((packed));
+
+// capture side, control connection of current instance
+
+void start_capture();
+
+void capture_recv(struct evbuffer *input);
+
+void capture_consumed(struct evbuffer *input);
+
+void close_capture();
+
+// replay side, returns control connection fed from replay_file
+struct bufferevent *open_replay(struct event_base *base);
+
+#endif //_REPLAY_H_
@@ -0,0 +1,267 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file sockmap.c
+    @brief relay pass-through socket pairs in kernel with a bpf sockmap
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    Both sockets of a pair go into a sockhash, each under the key of the
+    other one: the 4-tuple of the other socket as an skb arriving on it sees
+    it. The sk_skb verdict program builds that key from the skb and redirects
+    it to the egress of the socket found, so the kernel forwards the bytes
+    and userspace only sees EOF. At EOF of one socket the other one is shut
+    for writing, and the pair is closed once that one reads EOF too. Programs
+    are built with the bpf syscall, without libbpf; if bpf is not permitted
+    every pair keeps its bufferevents.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "sockmap.h"
+
+// as __sk_buff of the socket the skb arrives on
+struct sockmap_key {
+	uint32_t 	remote_ip4;		// network order
+	uint32_t 	local_ip4;
+	uint32_t 	remote_port;	// network order in low 16 bits
+	uint32_t 	local_port;		// host order
+};
+
+#define INSN(c, d, s, o, i)		((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define LDX_W(d, s, o)			INSN(BPF_LDX|BPF_MEM|BPF_W, d, s, o, 0)
+#define STX_W(d, s, o)			INSN(BPF_STX|BPF_MEM|BPF_W, d, s, o, 0)
+#define MOV_REG(d, s)			INSN(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i)			INSN(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define ADD_IMM(d, i)			INSN(BPF_ALU64|BPF_ADD|BPF_K, d, 0, 0, i)
+#define RSH_IMM(d, i)			INSN(BPF_ALU64|BPF_RSH|BPF_K, d, 0, 0, i)
+#define JLE_IMM(d, i, o)		INSN(BPF_JMP|BPF_JLE|BPF_K, d, 0, o, i)
+#define LD_MAP_FD(d, fd)		INSN(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(f)					INSN(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define EXIT()					INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+
+#define SKB_OFF(f)	offsetof(struct __sk_buff, f)
+
+static pthread_once_t sockmap_once = PTHREAD_ONCE_INIT;
+static int 	map_fd = -1;	// -1 if sockmap is not available
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+load_prog(const struct bpf_insn *insns, int n)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uint64_t)(unsigned long)insns;
+	attr.insn_cnt = n;
+	attr.license = (uint64_t)(unsigned long)"GPL";
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int
+attach_prog(int prog_fd, int fd, enum bpf_attach_type type)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = fd;
+	attr.attach_bpf_fd = prog_fd;
+	attr.attach_type = type;
+	return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+static void
+init_sockmap()
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+	attr.key_size = sizeof(struct sockmap_key);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = SOCKMAP_MAX_ENTRIES;
+	int fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (fd < 0) {
+		debug(LOG_INFO, "bpf sockmap is not available: %s, relay in userspace", strerror(errno));
+		return;
+	}
+
+	// whole skb is a message
+	struct bpf_insn parser[] = {
+		LDX_W(BPF_REG_0, BPF_REG_1, SKB_OFF(len)),
+		EXIT(),
+	};
+
+	// redirect to the socket stored under the key of the receiving socket,
+	// remote_port is shifted to high 16 bits by little endian kernels
+	struct bpf_insn verdict[] = {
+		MOV_REG(BPF_REG_6, BPF_REG_1),
+		LDX_W(BPF_REG_2, BPF_REG_6, SKB_OFF(remote_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_2, -16),
+		LDX_W(BPF_REG_2, BPF_REG_6, SKB_OFF(local_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_2, -12),
+		LDX_W(BPF_REG_2, BPF_REG_6, SKB_OFF(remote_port)),
+		JLE_IMM(BPF_REG_2, 0xffff, 1),
+		RSH_IMM(BPF_REG_2, 16),
+		STX_W(BPF_REG_10, BPF_REG_2, -8),
+		LDX_W(BPF_REG_2, BPF_REG_6, SKB_OFF(local_port)),
+		STX_W(BPF_REG_10, BPF_REG_2, -4),
+		MOV_REG(BPF_REG_1, BPF_REG_6),
+		LD_MAP_FD(BPF_REG_2, fd),
+		MOV_REG(BPF_REG_3, BPF_REG_10),
+		ADD_IMM(BPF_REG_3, -16),
+		MOV_IMM(BPF_REG_4, 0),
+		CALL(BPF_FUNC_sk_redirect_hash),
+		EXIT(),
+	};
+
+	int parser_fd = load_prog(parser, sizeof(parser) / sizeof(parser[0]));
+	int verdict_fd = load_prog(verdict, sizeof(verdict) / sizeof(verdict[0]));
+	if (parser_fd < 0 || verdict_fd < 0 || 
+		attach_prog(parser_fd, fd, BPF_SK_SKB_STREAM_PARSER) < 0 || 
+		attach_prog(verdict_fd, fd, BPF_SK_SKB_STREAM_VERDICT) < 0) {
+		debug(LOG_INFO, "load bpf sockmap programs failed: %s, relay in userspace", strerror(errno));
+		close(fd);
+	} else {
+		debug(LOG_INFO, "bpf sockmap ready, pass-through pairs are relayed in kernel");
+		map_fd = fd;
+	}
+
+	// map keeps attached programs
+	if (parser_fd >= 0) close(parser_fd);
+	if (verdict_fd >= 0) close(verdict_fd);
+}
+
+// key of fd as skb arriving on fd sees it, 0 if it is not tcp over ipv4
+static int
+sockmap_key_of(int fd, struct sockmap_key *key)
+{
+	struct sockaddr_in local, remote;
+	socklen_t llen = sizeof(local), rlen = sizeof(remote);
+	if (getsockname(fd, (struct sockaddr *)&local, &llen) < 0 || 
+		getpeername(fd, (struct sockaddr *)&remote, &rlen) < 0 || 
+		local.sin_family != AF_INET || remote.sin_family != AF_INET)
+		return 0;
+
+	key->remote_ip4 	= remote.sin_addr.s_addr;
+	key->local_ip4 		= local.sin_addr.s_addr;
+	key->remote_port 	= remote.sin_port;
+	key->local_port 	= ntohs(local.sin_port);
+	return 1;
+}
+
+static int
+update_elem(struct sockmap_key *key, int fd)
+{
+	uint32_t value = fd;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.value = (uint64_t)(unsigned long)&value;
+	attr.flags = BPF_NOEXIST;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+delete_elem(struct sockmap_key *key)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int
+is_idle(struct bufferevent *bev)
+{
+	return evbuffer_get_length(bufferevent_get_input(bev)) == 0 && 
+			evbuffer_get_length(bufferevent_get_output(bev)) == 0;
+}
+
+int
+sockmap_bev_pair(struct bufferevent *a, struct bufferevent *b)
+{
+	pthread_once(&sockmap_once, init_sockmap);
+	if (map_fd < 0)
+		return 0;
+
+	// bytes buffered in userspace would be overtaken by redirected ones
+	if (!is_idle(a) || !is_idle(b))
+		return 0;
+
+	int fd_a = bufferevent_getfd(a), fd_b = bufferevent_getfd(b);
+	struct sockmap_key key_a, key_b;
+	if (fd_a < 0 || fd_b < 0 || !sockmap_key_of(fd_a, &key_a) || !sockmap_key_of(fd_b, &key_b))
+		return 0;
+
+	if (update_elem(&key_a, fd_b) < 0) {
+		debug(LOG_DEBUG, "sockmap add fd %d failed: %s", fd_b, strerror(errno));
+		return 0;
+	}
+	if (update_elem(&key_b, fd_a) < 0) {
+		debug(LOG_DEBUG, "sockmap add fd %d failed: %s", fd_a, strerror(errno));
+		delete_elem(&key_a);
+		return 0;
+	}
+
+	// sockets leave the map when they are closed
+	return 1;
+}
+
+int
+sockmap_bev_eof(struct bufferevent *bev, struct bufferevent *peer)
+{
+	// libevent stops reading a bufferevent at its EOF
+	if (map_fd < 0 || !peer || !(bufferevent_get_enabled(peer) & EV_READ))
+		return 0;
+
+	// nothing arrives on bev any more, its entry leaves the map and what
+	// comes from peer is relayed by the bufferevents until peer is at EOF
+	struct sockmap_key key;
+	int fd = bufferevent_getfd(bev), peer_fd = bufferevent_getfd(peer);
+	if (fd < 0 || peer_fd < 0 || !sockmap_key_of(fd, &key) || delete_elem(&key) < 0)
+		return 0;
+
+	// FIN goes after the bytes already redirected to peer
+	if (shutdown(peer_fd, SHUT_WR) < 0)
+		debug(LOG_DEBUG, "sockmap shutdown fd %d failed: %s", peer_fd, strerror(errno));
+	return 1;
+}
@@ -0,0 +1,43 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file sockmap.h
+    @brief relay pass-through socket pairs in kernel with a bpf sockmap
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _SOCKMAP_H_
+#define _SOCKMAP_H_
+
+#define SOCKMAP_MAX_ENTRIES	65536	// sockets, two for each pair
+
+struct bufferevent;
+
+// splice the sockets of a and b in kernel once nothing of them is buffered in
+// userspace, returns 1 if done, 0 if the pair stays relayed by bufferevents
+int sockmap_bev_pair(struct bufferevent *a, struct bufferevent *b);
+
+// bev of a pair read EOF: returns 1 if the pair is relayed in kernel and
+// stays until peer reads EOF too, peer gets FIN after bytes redirected to it.
+// returns 0 if the pair can be closed now
+int sockmap_bev_eof(struct bufferevent *bev, struct bufferevent *peer);
+
+#endif //_SOCKMAP_H_
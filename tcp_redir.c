@@ -31,6 +31,9 @@
 #include "debug.h"
 #include "config.h"
 #include "tcp_redir.h"
+#include "instance.h"
+#include "upgrade.h"
+#include "sockmap.h"
 
 
 // define a struct for tcp_redir which include proxy_service and event_base
@@ -55,6 +58,9 @@ static void event_cb(struct bufferevent *bev, short events, void *arg)
 {
     struct bufferevent *partner = (struct bufferevent *)arg;
     if (events & BEV_EVENT_EOF) {
+        // relayed in kernel, partner gets FIN and the pair waits for its EOF
+        if (get_common_config()->sockmap && sockmap_bev_eof(bev, partner))
+            return;
         debug(LOG_INFO, "connection closed");
         bufferevent_free(bev);
         bufferevent_free(partner);
@@ -88,14 +94,27 @@ static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
     bufferevent_enable(bev_in, EV_READ|EV_WRITE);
     bufferevent_enable(bev_out, EV_READ|EV_WRITE);
 
+    // nothing is added to the stream, kernel can relay it
+    if (get_common_config()->sockmap && sockmap_bev_pair(bev_in, bev_out))
+        debug(LOG_DEBUG, "tcp_redir [%s] pair relayed in kernel", trs->ps->proxy_name);
+
     debug(LOG_INFO, "connect to remote port success!");
     return;
 }
 
+struct tcp_redir_arg {
+    struct proxy_service *ps;
+    struct xfrpc_instance *inst;
+};
+
 // define a thread worker function for tcp_redir
 static void *tcp_redir_worker(void *arg)
 {
-    struct proxy_service *ps = (struct proxy_service *)arg;
+    // worker thread reads config of the instance which started it
+    struct tcp_redir_arg *ra = (struct tcp_redir_arg *)arg;
+    struct proxy_service *ps = ra->ps;
+    set_cur_instance(ra->inst);
+    free(ra);
     struct common_conf *c_conf = get_common_config();
     // the worker is based on libevent and bufferevent
     // it listens on the local port and forward the data to the remote port
@@ -135,13 +154,21 @@ static void *tcp_redir_worker(void *arg)
         exit(1);
     }
     
-    // create a listener
-    listener = evconnlistener_new_bind(base, accept_cb, (void *)&trs,
-        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr *)&sin, sizeof(sin));
+    // create a listener, or keep listening on the socket of the process upgraded from
+    int fd = take_upgrade_listener(ps->local_port);
+    if (fd >= 0) {
+        evutil_make_socket_nonblocking(fd);
+        listener = evconnlistener_new(base, accept_cb, (void *)&trs,
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, fd);
+    } else {
+        listener = evconnlistener_new_bind(base, accept_cb, (void *)&trs,
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr *)&sin, sizeof(sin));
+    }
     if (!listener) {
         debug(LOG_ERR, "create listener failed!");
         exit(1);
     }
+    register_upgrade_listener(ps->local_port, evconnlistener_get_fd(listener));
 
     // start the event loop
     event_base_dispatch(base);
@@ -158,7 +185,11 @@ void start_tcp_redir_service(struct proxy_service *ps)
 {
     // create a thread 
     pthread_t tid;
-    if (pthread_create(&tid, NULL, tcp_redir_worker, (void *)ps) != 0) {
+    struct tcp_redir_arg *ra = calloc(1, sizeof(struct tcp_redir_arg));
+    assert(ra);
+    ra->ps = ps;
+    ra->inst = cur_instance;
+    if (pthread_create(&tid, NULL, tcp_redir_worker, (void *)ra) != 0) {
         debug(LOG_ERR, "create tcp_redir worker thread failed!");
         exit(1);
     }
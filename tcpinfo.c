@@ -0,0 +1,212 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file tcpinfo.c
+    @brief TCP_INFO path telemetry of frps and local connections
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    Every tcp_info_interval seconds the control connection and the sockets
+    of work connections, to frps without tcp_mux and to local services, are
+    sampled with TCP_INFO and SIOCOUTQNSD. A connection whose rtt goes above
+    tcp_rtt_warn_ms or which retransmits tcp_retrans_warn segments between
+    samples is logged once when it turns slow and once when it recovers, which
+    tells a slow uplink from a slow local service. A control connection whose
+    rtt stays above tcp_redial_rtt_ms is dropped and frps dialed again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "config.h"
+#include "client.h"
+#include "control.h"
+#include "instance.h"
+#include "tcpinfo.h"
+
+struct path_monitor {
+	struct event 	*timer;
+	struct tcp_path_state 	ctl;
+	int 	rtt_high;	// samples in a row above tcp_redial_rtt_ms
+};
+
+// per instance state
+#define path_mon 	(cur_instance->path_mon)
+#define all_pc 		(cur_instance->all_pc)
+
+int
+sample_tcp_path(int fd, struct tcp_path *path)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return 0;
+
+	int notsent = 0;
+	if (ioctl(fd, SIOCOUTQNSD, &notsent) < 0)
+		notsent = 0;
+
+	path->rtt_us 		= ti.tcpi_rtt;
+	path->rttvar_us 	= ti.tcpi_rttvar;
+	path->cwnd 			= ti.tcpi_snd_cwnd;
+	path->total_retrans = ti.tcpi_total_retrans;
+	path->lost 			= ti.tcpi_lost;
+	path->unacked 		= ti.tcpi_unacked;
+	path->notsent 		= notsent;
+	return 1;
+}
+
+static int
+bev_path(struct bufferevent *bev, struct tcp_path *path)
+{
+	return bev && sample_tcp_path(bufferevent_getfd(bev), path);
+}
+
+#define PATH_FMT	"rtt %.1f ms var %.1f cwnd %u retrans %u lost %u unacked %u notsent %u"
+#define PATH_ARGS(p)	(p)->rtt_us / 1e3, (p)->rttvar_us / 1e3, (p)->cwnd, (p)->total_retrans, \
+						(p)->lost, (p)->unacked, (p)->notsent
+
+// sample bev and log when it crosses the thresholds, returns 0 if not sampled
+static int
+check_path(struct bufferevent *bev, struct tcp_path_state *st, const char *name, struct tcp_path *path)
+{
+	if (!bev_path(bev, path))
+		return 0;
+
+	struct common_conf *c_conf = get_common_config();
+	uint32_t retrans = st->sampled ? path->total_retrans - st->retrans : 0;
+	st->retrans = path->total_retrans;
+	st->sampled = 1;
+
+	int slow = (c_conf->tcp_rtt_warn_ms && path->rtt_us > c_conf->tcp_rtt_warn_ms * 1000) || 
+				(c_conf->tcp_retrans_warn && retrans >= c_conf->tcp_retrans_warn);
+	if (slow && !st->slow)
+		debug(LOG_WARNING, "%s path is slow, %u retransmits: " PATH_FMT, name, retrans, PATH_ARGS(path));
+	else if (!slow && st->slow)
+		debug(LOG_INFO, "%s path recovered: " PATH_FMT, name, PATH_ARGS(path));
+	st->slow = slow;
+	return 1;
+}
+
+static void
+path_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	set_cur_instance(arg);
+	struct common_conf *c_conf = get_common_config();
+	struct tcp_path path;
+	char name[128];
+
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, all_pc, client, tmp) {
+		const char *proxy = client->ps ? client->ps->proxy_name : "-";
+		snprintf(name, sizeof(name), "proxy [%s] stream %u local", proxy, client->stream_id);
+		check_path(client->local_proxy_bev, &client->local_path, name, &path);
+		if (!c_conf->tcp_mux) {
+			snprintf(name, sizeof(name), "proxy [%s] stream %u frps", proxy, client->stream_id);
+			check_path(client->ctl_bev, &client->frps_path, name, &path);
+		}
+	}
+
+	if (!check_path(get_main_control()->connect_bev, &path_mon->ctl, "frps control", &path))
+		return;
+
+	// rtt blown up stays high on this connection, a new one may take another route
+	if (c_conf->tcp_redial_rtt_ms && path.rtt_us > c_conf->tcp_redial_rtt_ms * 1000) {
+		if (++path_mon->rtt_high >= TCP_REDIAL_SAMPLES) {
+			debug(LOG_WARNING, "control rtt %.1f ms above tcp_redial_rtt_ms %d, redial frps", 
+				path.rtt_us / 1e3, c_conf->tcp_redial_rtt_ms);
+			path_mon->rtt_high = 0;
+			// streams of the session drain if rotation is enabled
+			if (!rotate_main_control())
+				redial_main_control();
+		}
+	} else {
+		path_mon->rtt_high = 0;
+	}
+}
+
+// called when control connection is connected
+void
+start_tcp_path_monitor()
+{
+	struct common_conf *c_conf = get_common_config();
+	if (c_conf->tcp_info_interval <= 0)
+		return;
+
+	if (!path_mon) {
+		path_mon = calloc(1, sizeof(struct path_monitor));
+		assert(path_mon);
+		path_mon->timer = event_new(get_main_control()->connect_base, -1, EV_PERSIST, 
+							path_timer_cb, cur_instance);
+		assert(path_mon->timer);
+	}
+
+	memset(&path_mon->ctl, 0, sizeof(path_mon->ctl));
+	path_mon->rtt_high = 0;
+	struct timeval tv = {c_conf->tcp_info_interval, 0};
+	evtimer_add(path_mon->timer, &tv);
+}
+
+void
+stop_tcp_path_monitor()
+{
+	if (path_mon)
+		evtimer_del(path_mon->timer);
+}
+
+void
+close_tcp_path_monitor()
+{
+	if (!path_mon)
+		return;
+
+	event_free(path_mon->timer);
+	free(path_mon);
+	path_mon = NULL;
+}
+
+void
+dump_tcp_paths()
+{
+	struct tcp_path path;
+	if (bev_path(get_main_control()->connect_bev, &path))
+		debug(LOG_INFO, "instance %d frps control " PATH_FMT, cur_instance->id, PATH_ARGS(&path));
+
+	struct proxy_client *client, *tmp;
+	HASH_ITER(hh, all_pc, client, tmp) {
+		const char *proxy = client->ps ? client->ps->proxy_name : "-";
+		if (bev_path(client->local_proxy_bev, &path))
+			debug(LOG_INFO, "proxy [%s] stream %u local " PATH_FMT, proxy, client->stream_id, PATH_ARGS(&path));
+		if (!get_common_config()->tcp_mux && bev_path(client->ctl_bev, &path))
+			debug(LOG_INFO, "proxy [%s] stream %u frps " PATH_FMT, proxy, client->stream_id, PATH_ARGS(&path));
+	}
+}
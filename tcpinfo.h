@@ -0,0 +1,65 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file tcpinfo.h
+    @brief TCP_INFO path telemetry of frps and local connections
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _TCPINFO_H_
+#define _TCPINFO_H_
+
+#include <stdint.h>
+
+#define TCP_REDIAL_SAMPLES	3	// control rtt above tcp_redial_rtt_ms this many times in a row
+
+// one sample of a tcp socket
+struct tcp_path {
+	uint32_t 	rtt_us;
+	uint32_t 	rttvar_us;
+	uint32_t 	cwnd;			// segments
+	uint32_t 	total_retrans;
+	uint32_t 	lost;
+	uint32_t 	unacked;		// segments in flight
+	uint32_t 	notsent;		// bytes not sent yet
+};
+
+// state of a monitored socket between samples
+struct tcp_path_state {
+	uint32_t 	retrans;	// total_retrans of last sample
+	uint8_t 	sampled;
+	uint8_t 	slow;		// threshold crossed, logged
+};
+
+// sample fd, returns 0 if it is not a tcp socket
+int sample_tcp_path(int fd, struct tcp_path *path);
+
+// sample control and work connections every tcp_info_interval of current instance
+void start_tcp_path_monitor();
+
+void stop_tcp_path_monitor();
+
+void close_tcp_path_monitor();
+
+// log last samples of all connections of current instance
+void dump_tcp_paths();
+
+#endif //_TCPINFO_H_
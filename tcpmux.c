@@ -34,13 +34,20 @@
 #include "debug.h"
 #include "control.h"
 #include "proxy.h"
+#include "instance.h"
+#include "crypto_pool.h"
+#include "ratelimit.h"
+#include "alloc.h"
+#include "mempressure.h"
 
 static uint8_t proto_version = 0;
-static uint8_t remote_go_away;
-static uint8_t local_go_away;
-static uint32_t g_session_id = 1;
-static struct tmux_stream *cur_stream = NULL;
-static struct tmux_stream *all_stream;
+
+// per instance state
+#define remote_go_away 	(cur_instance->remote_go_away)
+#define local_go_away 	(cur_instance->local_go_away)
+#define g_session_id 	(cur_instance->g_session_id)
+#define cur_stream 		(cur_instance->cur_stream)
+#define all_stream 		(cur_instance->all_stream)
 
 
 void
@@ -97,9 +104,12 @@ init_tmux_stream(struct tmux_stream *stream, uint32_t id, enum tcp_mux_state sta
 	stream->state = state;
 	stream->recv_window = MAX_STREAM_WINDOW_SIZE;
 	stream->send_window = MAX_STREAM_WINDOW_SIZE;
+	stream->crypto = NULL;
 	
 	memset(&stream->tx_ring, 0, sizeof(struct ring_buffer));
 	memset(&stream->rx_ring, 0, sizeof(struct ring_buffer));
+	stream->flight.head = 0;
+	stream->rx_paused = 0;
 
 	add_stream(stream);
 };
@@ -151,6 +161,7 @@ tcp_mux_send_win_update(struct bufferevent *bout, enum tcp_mux_flag flags, uint3
 	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
 	tcp_mux_encode(WINDOW_UPDATE, flags, stream_id, delta, &tmux_hdr);
 	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	flight_record(get_stream_by_id(stream_id), stream_id, FL_TX_WINDOW, flags, delta);
 }
 
 void
@@ -184,16 +195,22 @@ tcp_mux_send_win_update_rst(struct bufferevent *bout, uint32_t stream_id)
 
 	tcp_mux_send_win_update(bout, RST, stream_id, 0);
 }
+static void
+tcp_mux_add_header(struct evbuffer *out, enum tcp_mux_type type, uint16_t flags, uint32_t stream_id, uint32_t length)
+{
+	struct tcp_mux_header tmux_hdr;
+	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
+	tcp_mux_encode(type, flags, stream_id, length, &tmux_hdr);
+	evbuffer_add(out, &tmux_hdr, sizeof(tmux_hdr));
+}
+
 void
 tcp_mux_send_data(struct bufferevent *bout, uint16_t flags, uint32_t stream_id, uint32_t length)
 {
 	if (!tcp_mux_flag()) return;
 
-	struct tcp_mux_header tmux_hdr;
-	memset(&tmux_hdr, 0, sizeof(tmux_hdr));
-	tcp_mux_encode(DATA, flags, stream_id, length, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux [%d] send data len : %d", stream_id, length);
-	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	tcp_mux_add_header(bufferevent_get_output(bout), DATA, flags, stream_id, length);
 }
 
 void 
@@ -206,6 +223,7 @@ tcp_mux_send_ping(struct bufferevent *bout, uint32_t ping_id)
 	tcp_mux_encode(PING, SYN, 0, ping_id, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping syn : %d", ping_id);
 	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	flight_record(NULL, 0, FL_TX_PING, SYN, ping_id);
 }
 
 static void 
@@ -218,6 +236,7 @@ tcp_mux_handle_ping(struct bufferevent *bout, uint32_t ping_id)
 	tcp_mux_encode(PING, ACK, 0, ping_id, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping ack : %d", ping_id);
 	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	flight_record(NULL, 0, FL_TX_PING, ACK, ping_id);
 }
 
 static void
@@ -230,7 +249,15 @@ tcp_mux_send_go_away(struct bufferevent *bout, uint32_t reason)
 	tcp_mux_encode(GO_AWAY, 0, 0, reason, &tmux_hdr);
 	//debug(LOG_DEBUG, "tcp mux send ping ack : %d", ping_id);
 	bufferevent_write(bout, (uint8_t *)&tmux_hdr, sizeof(tmux_hdr));
+	flight_record(NULL, 0, FL_TX_GO_AWAY, 0, reason);
+}
 
+static void
+set_stream_state(struct tmux_stream *stream, enum tcp_mux_state state)
+{
+	enum tcp_mux_state old = stream->state;
+	stream->state = state;
+	flight_record(stream, stream->id, FL_STATE, 0, old);
 }
 
 static int
@@ -239,16 +266,16 @@ process_flags(uint16_t flags, struct tmux_stream *stream)
 	uint32_t close_stream = 0;
 	if ( (flags&ACK) == ACK ) {
 		if (stream->state == SYN_SEND)
-			stream->state = ESTABLISHED;
+			set_stream_state(stream, ESTABLISHED);
 	} else if ( (flags&FIN) == FIN ) {
 		switch(stream->state) {
 		case SYN_SEND:
 		case SYN_RECEIVED:
 		case ESTABLISHED:
-			stream->state = REMOTE_CLOSE;
+			set_stream_state(stream, REMOTE_CLOSE);
 			break;
 		case LOCAL_CLOSE:
-			stream->state = CLOSED;
+			set_stream_state(stream, CLOSED);
 			close_stream = 1;
 			break;
 		default:
@@ -257,12 +284,14 @@ process_flags(uint16_t flags, struct tmux_stream *stream)
 			return 0;
 		}
 	} else if ( (flags&RST) == RST ) {
-		stream->state = RESET;
+		set_stream_state(stream, RESET);
 		close_stream = 1;
 	}
 
 	if (close_stream) {
 		debug(LOG_DEBUG, "free stream %d", stream->id);		
+		flight_record(stream, stream->id, FL_CLOSE, flags, 
+			stream->state == RESET ? FL_CLOSE_REMOTE_RST : FL_CLOSE_REMOTE_FIN);
 		del_proxy_client_by_stream_id(stream->id);
 	}
 
@@ -277,11 +306,11 @@ get_send_flags(struct tmux_stream *stream)
 	switch (stream->state) {
 	case INIT:
 		flags |= SYN;
-		stream->state = SYN_SEND;
+		set_stream_state(stream, SYN_SEND);
 		break;			
 	case SYN_RECEIVED:
 		flags |= ACK;
-		stream->state = ESTABLISHED;
+		set_stream_state(stream, ESTABLISHED);
 		break;
 	default:
 		break;
@@ -293,12 +322,14 @@ get_send_flags(struct tmux_stream *stream)
 void
 send_window_update(struct bufferevent *bout, struct tmux_stream *stream, uint32_t length)
 {
-	uint32_t max = MAX_STREAM_WINDOW_SIZE;
-	uint32_t delta = (max - length) - stream->recv_window;
+	uint32_t max = mux_window_max();
+	uint32_t want = max > length ? max - length : 0;
+	uint32_t delta = want > stream->recv_window ? want - stream->recv_window : 0;
 
 	uint16_t flags = get_send_flags(stream);	
 
-	if (delta < max/2 && flags == 0)
+	// paused stream gets no window, frps stops sending when it is used up
+	if ((delta < max/2 || stream->rx_paused) && flags == 0)
 		return;
 
 	stream->recv_window += delta;
@@ -326,6 +357,34 @@ rx_ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len)
 	return len;
 }
 
+// copy len bytes at offset of ring without consuming them
+// return 0 if ring has not enough data
+int
+rx_ring_buffer_peek(struct ring_buffer *ring, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	if (offset + len > ring->sz)
+		return 0;
+
+	uint32_t start = (ring->cur + offset) % RBUF_SIZE;
+	uint32_t first = RBUF_SIZE - start;
+	if (first >= len) {
+		memcpy(data, &ring->data[start], len);
+	} else {
+		memcpy(data, &ring->data[start], first);
+		memcpy(data + first, ring->data, len - first);
+	}
+
+	return 1;
+}
+
+void
+rx_ring_buffer_drop(struct ring_buffer *ring, uint32_t len)
+{
+	assert(ring->sz >= len);
+	ring->cur = (ring->cur + len) % RBUF_SIZE;
+	ring->sz -= len;
+}
+
 static int
 process_data(struct tmux_stream *stream, uint32_t length, uint16_t flags, 
 				void (*fn)(uint8_t *, int, void *), void *param)
@@ -350,17 +409,20 @@ process_data(struct tmux_stream *stream, uint32_t length, uint16_t flags,
 
 	uint32_t nret = 0;
 	struct proxy_client *pc = (struct proxy_client *)param;
-	if (!pc || (pc && !pc->local_proxy_bev && !is_socks5_proxy(pc->ps))) {
-		uint8_t *data = (uint8_t *)calloc(length, 1);
+	// proxy service of work connection is unknown until StartWorkConn received
+	const struct proxy_type_ops *ops = (pc && pc->ps) ? get_proxy_type_ops(pc->ps->type) : NULL;
+	// proxy types without connect handler set up local connection from stream data
+	if (!ops || (!pc->local_proxy_bev && ops->connect)) {
+		uint8_t *data = (uint8_t *)xfrpc_calloc(ALLOC_TCPMUX, length);
 		nret = rx_ring_buffer_pop(&stream->rx_ring, data, length);
 		fn(data, length, pc);
-		free(data);
-	} else if (is_socks5_proxy(pc->ps)) {
-		// if pc's type is socks5, we should send data to socks5 client
-		nret = handle_ss5(pc, &stream->rx_ring, length);
+		xfrpc_free(data);
+	} else if (pc->crypto) {
+		trace_setup_phase(pc, SETUP_FIRST_DOWN);
+		nret = work_crypto_mux_data(pc->crypto, &stream->rx_ring, length, ops);
 	} else {
-		nret = tx_ring_buffer_write(pc->local_proxy_bev, &stream->rx_ring, length);
-
+		trace_setup_phase(pc, SETUP_FIRST_DOWN);
+		nret = ops->on_mux_data(pc, &stream->rx_ring, length);
 	}
 
 	if (nret != length) {
@@ -390,7 +452,7 @@ incr_send_window(struct bufferevent *bev, struct tcp_mux_header *tmux_hdr, uint1
 
 	uint32_t length = ntohl(tmux_hdr->length);
 
-	if (stream->send_window == 0) bufferevent_enable(bev, EV_READ);
+	if (stream->send_window == 0 && bev) bufferevent_enable(bev, EV_READ);
 	stream->send_window += length;
 	//debug(LOG_DEBUG, "incr_send_window : stream_id %d length %d send_window %d", 
 	//				stream->id, length, stream->send_window);
@@ -417,6 +479,7 @@ handle_tcp_mux_ping(struct tcp_mux_header *tmux_hdr)
 {
 	uint16_t flags = ntohs(tmux_hdr->flags);
 	uint32_t ping_id = ntohl(tmux_hdr->length);
+	flight_record(NULL, 0, FL_RX_PING, flags, ping_id);
 
 	if ( (flags&SYN) == SYN) {
 		struct bufferevent *bout = get_main_control()->connect_bev;
@@ -428,9 +491,13 @@ void
 handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr)
 {
 	uint32_t code = ntohl(tmux_hdr->length);
+	flight_record(NULL, 0, FL_RX_GO_AWAY, ntohs(tmux_hdr->flags), code);
 	switch(code) {
 	case NORMAL:
 		remote_go_away = 1;
+		// frps drains the session, new streams go to a new one
+		if (rotate_main_control())
+			debug(LOG_INFO, "receive go away, rotate session");
 		break;
 	case PROTO_ERR:
 		debug(LOG_ERR, "receive protocol error go away");	
@@ -450,6 +517,8 @@ tmux_stream_read(struct bufferevent *bev, struct tmux_stream *stream, uint32_t l
 	if (stream->state != ESTABLISHED) {
 		debug(LOG_WARNING, "stream %d state is %d : not ESTABLISHED, discard its data len %d", stream->id, stream->state, len);
 	}
+	if (len > RBUF_SIZE - stream->rx_ring.sz)
+		flight_record(stream, stream->id, FL_STALL_RX_RING, 0, len);
 
 	return rx_ring_buffer_read(bev, &stream->rx_ring, len);
 }
@@ -469,6 +538,8 @@ handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
 	}
 
 	struct tmux_stream *stream = get_stream_by_id(stream_id);
+	flight_record(stream, stream_id, tmux_hdr->type == WINDOW_UPDATE ? FL_RX_WINDOW : FL_RX_DATA, 
+		flags, ntohl(tmux_hdr->length));
 
     if(!stream){
         return 0;
@@ -481,6 +552,16 @@ handle_tcp_mux_stream(struct tcp_mux_header *tmux_hdr, handle_data_fn_t fn)
 		if (!incr_send_window(bev, tmux_hdr, flags, stream)) {
 			struct bufferevent *bout = get_main_control()->connect_bev;
 			tcp_mux_send_go_away(bout, PROTO_ERR);
+			return 0;
+		}
+		// stream and its client may be freed by flags
+		pc = get_proxy_client(stream_id);
+		if (pc && pc->ps && get_stream_by_id(stream_id)) {
+			const struct proxy_type_ops *ops = get_proxy_type_ops(pc->ps->type);
+			if (pc->crypto)
+				work_crypto_window_update(pc->crypto);
+			if (ops->on_window_update)
+				ops->on_window_update(pc);
 		}
 		return 0;
 	}
@@ -572,8 +653,38 @@ tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring, uint32_t
 	return nwrite - len;
 }
 
+static uint32_t
+tx_ring_buffer_add(struct evbuffer *out, struct ring_buffer *ring, uint32_t len)
+{
+	if (len > ring->sz)
+		len = ring->sz;
+
+	uint32_t left = len;
+	while (left > 0) {
+		uint32_t n = WBUF_SIZE - ring->cur;
+		if (n > left) n = left;
+		evbuffer_add(out, &ring->data[ring->cur], n);
+		ring->cur += n;
+		if (ring->cur == WBUF_SIZE) ring->cur = 0;
+		ring->sz -= n;
+		left -= n;
+	}
+
+	return len;
+}
+
+// data of encrypted work connection goes through its cipher first
 uint32_t 
 tmux_stream_write(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_stream *stream)
+{
+	if (stream->crypto)
+		return work_crypto_send(stream->crypto, data, length);
+
+	return tmux_stream_send(bev, data, length, stream);
+}
+
+uint32_t 
+tmux_stream_send(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_stream *stream)
 {
 	switch(stream->state) {
 	case LOCAL_CLOSE:
@@ -590,37 +701,33 @@ tmux_stream_write(struct bufferevent *bev, uint8_t *data, uint32_t length, struc
 	if (stream->send_window == 0) {
 		debug(LOG_INFO, "stream %d send_window is zero, length %d left %d", stream->id, length, left);
 		tx_ring_buffer_append(tx_ring, data, length);
+		flight_record(stream, stream->id, FL_STALL_WINDOW, 0, tx_ring->sz);
 		return 0;
 	}
 
 	uint16_t flags = get_send_flags(stream);
-	uint32_t max = length;
-	struct bufferevent *bout = get_main_control()->connect_bev;
+	uint32_t max = stream->send_window < tx_ring->sz + length ? stream->send_window : tx_ring->sz + length;
+	// frame of proxy stream may wait for bandwidth_limit
+	struct evbuffer *out = mux_stream_output(bev, stream, max);
 	//debug(LOG_DEBUG, "tmux_stream_write stream id %u: send_window %u tx_ring sz %u length %u", 
 	//				stream->id, stream->send_window, tx_ring->sz, length);
+	tcp_mux_add_header(out, DATA, flags, stream->id, max);
 	if (stream->send_window < tx_ring->sz) {
 		debug(LOG_INFO, " send_window %u less than tx_ring size %u", stream->send_window, tx_ring->sz);
-		max = stream->send_window;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		tx_ring_buffer_write(bev, tx_ring, max);
+		tx_ring_buffer_add(out, tx_ring, max);
 		tx_ring_buffer_append(tx_ring, data, length);
 	} else if (stream->send_window < tx_ring->sz + length) {
 		debug(LOG_INFO, " send_window %u less than  %u", stream->send_window, tx_ring->sz+length);
-		max = stream->send_window;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		if (tx_ring->sz > 0)
-			tx_ring_buffer_write(bev, tx_ring, tx_ring->sz);
-		bufferevent_write(bev, data, max - tx_ring->sz);
-		tx_ring_buffer_append(tx_ring, data + max - tx_ring->sz, length + tx_ring->sz - max);
+		uint32_t nring = tx_ring_buffer_add(out, tx_ring, tx_ring->sz);
+		evbuffer_add(out, data, max - nring);
+		tx_ring_buffer_append(tx_ring, data + max - nring, length + nring - max);
 	} else {
-		max = tx_ring->sz + length;
-		tcp_mux_send_data(bout, flags, stream->id, max);
-		if (tx_ring->sz > 0)
-			tx_ring_buffer_write(bev, tx_ring, tx_ring->sz);
-		bufferevent_write(bev, data, length);
+		tx_ring_buffer_add(out, tx_ring, tx_ring->sz);
+		evbuffer_add(out, data, length);
 	}
 	
 	stream->send_window -= max;
+	flight_record(stream, stream->id, FL_TX_DATA, flags, max);
 
 	return max;
 }
@@ -633,12 +740,12 @@ tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream)
 	case SYN_SEND:
 	case SYN_RECEIVED:
 	case ESTABLISHED:
-		stream->state = LOCAL_CLOSE;
+		set_stream_state(stream, LOCAL_CLOSE);
 		break;
 	case LOCAL_CLOSE:
 	case REMOTE_CLOSE:
 		flag = 1;
-		stream->state = CLOSED;
+		set_stream_state(stream, CLOSED);
 		break;
 	case CLOSED:
 	case RESET:
@@ -648,10 +755,13 @@ tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream)
 	
 	uint16_t flags = get_send_flags(stream);
 	flags |= FIN;
-	tcp_mux_send_win_update(bout, flags, stream->id, 0);	
+	// FIN goes after data of the stream waiting for bandwidth_limit
+	tcp_mux_add_header(mux_stream_output(bout, stream, 0), WINDOW_UPDATE, flags, stream->id, 0);
+	flight_record(stream, stream->id, FL_TX_WINDOW, flags, 0);
 	if (!flag) return 1;
 
 	debug(LOG_DEBUG, "del proxy client %d", stream->id);
+	flight_record(stream, stream->id, FL_CLOSE, flags, FL_CLOSE_LOCAL_FIN);
 	del_proxy_client_by_stream_id(stream->id);
 	return 0;
 }
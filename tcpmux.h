@@ -28,10 +28,13 @@
 #define	__TCP_MUX__
 
 #include "uthash.h"
+#include "flight.h"
 
-#define	MAX_STREAM_WINDOW_SIZE	256*1024
-#define	RBUF_SIZE	32*1024
-#define	WBUF_SIZE	32*1024
+#define	MAX_STREAM_WINDOW_SIZE	(256*1024)
+#define	RBUF_SIZE	(32*1024)
+#define	WBUF_SIZE	(32*1024)
+
+struct work_crypto;
 
 
 struct ring_buffer {
@@ -98,6 +101,9 @@ struct tmux_stream {
 	enum tcp_mux_state state;	
 	struct ring_buffer	tx_ring;
 	struct ring_buffer 	rx_ring;
+	struct work_crypto 	*crypto;	// cipher of encrypted work connection
+	struct flight_stream_ring 	flight;	// last events of the stream
+	uint8_t 	rx_paused;	// window held back under memory pressure
 
 	// private arguments
 	UT_hash_handle hh;
@@ -136,6 +142,8 @@ void handle_tcp_mux_go_away(struct tcp_mux_header *tmux_hdr);
 
 uint32_t tmux_stream_write(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_stream *stream);
 
+uint32_t tmux_stream_send(struct bufferevent *bev, uint8_t *data, uint32_t length, struct tmux_stream *stream);
+
 uint32_t tmux_stream_read(struct bufferevent *bev, struct tmux_stream *stream, uint32_t len);
 
 void reset_session_id();
@@ -156,6 +164,10 @@ int tmux_stream_close(struct bufferevent *bout, struct tmux_stream *stream);
 
 int rx_ring_buffer_pop(struct ring_buffer *ring, uint8_t *data, uint32_t len);
 
+int rx_ring_buffer_peek(struct ring_buffer *ring, uint32_t offset, uint8_t *data, uint32_t len);
+
+void rx_ring_buffer_drop(struct ring_buffer *ring, uint32_t len);
+
 uint32_t rx_ring_buffer_read(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len);
 
 uint32_t tx_ring_buffer_write(struct bufferevent *bev, struct ring_buffer *ring, uint32_t len);
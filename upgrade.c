@@ -0,0 +1,828 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file upgrade.c
+    @brief hand connections over to a new xfrpc binary without reconnecting
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+
+    On SIGUSR2 the running xfrpc starts the binary at the path it was started
+    from, resolved at startup, with the
+    same arguments and a unix socket to it. Once the new process has loaded
+    its config, each event loop of the old one sends for every instance its
+    frps control connection, tcp_mux session state and streams forwarding to
+    local services, sockets passed by SCM_RIGHTS. The old process exits and
+    the new one carries on those connections; frps does not see a reconnect.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "debug.h"
+#include "config.h"
+#include "client.h"
+#include "control.h"
+#include "crypto.h"
+#include "login.h"
+#include "proxy.h"
+#include "tcpmux.h"
+#include "instance.h"
+#include "xfrpc.h"
+#include "ratelimit.h"
+#include "upgrade.h"
+
+#define UPGRADE_FD_ENV			"XFRPC_UPGRADE_FD"
+#define UPGRADE_VERSION			1		// bumped when record payload changes
+#define UPGRADE_READY_TIMEOUT	10		// seconds for new process to load its config
+
+enum upgrade_record_type {
+	UPGRADE_INSTANCE = 1,	// control connection of an instance
+	UPGRADE_CLIENT,			// tcp_mux stream and its local connection
+	UPGRADE_LISTENER,		// listening socket of local service
+};
+
+struct upgrade_record_hdr {
+	uint32_t 	type;
+	uint32_t 	id;		// instance id, port of listener
+	uint32_t 	len;	// payload following the header
+};
+
+struct upgrade_record {
+	uint32_t 	type;
+	uint32_t 	id;
+	int 		fd;		// socket passed along
+	uint8_t 	*data;
+	uint32_t 	len;
+	struct upgrade_record *next;
+};
+
+struct upgrade_listener {
+	int 	port;
+	int 	fd;
+	struct upgrade_listener *next;
+};
+
+struct upgrade_reader {
+	const uint8_t 	*p;
+	uint32_t 	left;
+	int 		err;
+};
+
+extern char **environ;
+
+static char 	**upgrade_argv = NULL;
+static char 	upgrade_exe[PATH_MAX];	// binary path resolved at startup
+static int 		upgrade_fd = -1;		// old process, socket to new process
+static pid_t 	upgrade_pid = 0;		// new process not ready yet
+static struct event *upgrade_ready_event = NULL;
+static void 	(*upgrade_ready_notify)() = NULL;
+static int 		upgrade_compatible = 0;
+static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upgrade_listener *local_listeners = NULL;		// sent on upgrade
+static struct upgrade_listener *inherited_listeners = NULL;	// received
+static struct upgrade_record *records = NULL;				// received
+
+// the binary replaced on disk is started, so its path is kept, not /proc/self/exe
+void
+set_upgrade_argv(char **argv)
+{
+	ssize_t n = readlink("/proc/self/exe", upgrade_exe, sizeof(upgrade_exe) - 1);
+	if (n <= 0) {
+		debug(LOG_WARNING, "path of xfrpc binary unknown, upgrade disabled");
+		return;
+	}
+	upgrade_exe[n] = '\0';
+	upgrade_argv = argv;
+}
+
+int
+is_upgrading()
+{
+	return upgrade_fd >= 0;
+}
+
+static int
+write_full(int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_full(int fd, uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// record header carries the socket, so it arrives with the header bytes
+static int
+send_record(uint32_t type, uint32_t id, int fd, struct evbuffer *payload)
+{
+	struct upgrade_record_hdr hdr = {type, id, payload ? evbuffer_get_length(payload) : 0};
+	struct iovec iov = {&hdr, sizeof(hdr)};
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+
+	int ret = -1;
+	pthread_mutex_lock(&upgrade_lock);
+	if (sendmsg(upgrade_fd, &msg, 0) == sizeof(hdr) &&
+		(!hdr.len || write_full(upgrade_fd, evbuffer_pullup(payload, -1), hdr.len) == 0))
+		ret = 0;
+	pthread_mutex_unlock(&upgrade_lock);
+
+	if (ret < 0)
+		debug(LOG_ERR, "send upgrade record %u failed: %s", type, strerror(errno));
+	return ret;
+}
+
+static struct upgrade_record *
+recv_record(int sock)
+{
+	struct upgrade_record_hdr hdr;
+	struct iovec iov = {&hdr, sizeof(hdr)};
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(hdr))
+		return NULL;
+
+	struct upgrade_record *rec = calloc(1, sizeof(struct upgrade_record));
+	assert(rec);
+	rec->type = hdr.type;
+	rec->id = hdr.id;
+	rec->len = hdr.len;
+	rec->fd = -1;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&rec->fd, CMSG_DATA(cm), sizeof(int));
+
+	rec->data = malloc(hdr.len + 1);
+	assert(rec->data);
+	if (read_full(sock, rec->data, hdr.len) < 0) {
+		if (rec->fd >= 0) close(rec->fd);
+		free(rec->data);
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+static void
+put_u32(struct evbuffer *b, uint32_t v)
+{
+	evbuffer_add(b, &v, sizeof(v));
+}
+
+static void
+put_blob(struct evbuffer *b, const void *data, uint32_t len)
+{
+	put_u32(b, len);
+	if (len)
+		evbuffer_add(b, data, len);
+}
+
+static void
+put_evbuffer(struct evbuffer *b, struct evbuffer *src)
+{
+	uint32_t len = evbuffer_get_length(src);
+	put_blob(b, len ? evbuffer_pullup(src, -1) : NULL, len);
+}
+
+static void
+put_ring(struct evbuffer *b, const struct ring_buffer *ring)
+{
+	put_u32(b, ring->sz);
+	uint32_t i, pos = ring->cur;
+	for (i = 0; i < ring->sz; i++) {
+		evbuffer_add(b, &ring->data[pos], 1);
+		if (++pos == RBUF_SIZE) pos = 0;
+	}
+}
+
+static void
+put_stream(struct evbuffer *b, const struct tmux_stream *stream)
+{
+	put_u32(b, stream->id);
+	put_u32(b, stream->state);
+	put_u32(b, stream->recv_window);
+	put_u32(b, stream->send_window);
+	put_ring(b, &stream->tx_ring);
+	put_ring(b, &stream->rx_ring);
+}
+
+static void
+put_cipher_state(struct evbuffer *b, const struct cipher_state *st)
+{
+	put_u32(b, st->has_coder);
+	put_blob(b, st->iv, sizeof(st->iv));
+	put_u32(b, st->has_ctx);
+	put_blob(b, st->ctx_iv, sizeof(st->ctx_iv));
+	put_u32(b, st->num);
+}
+
+static uint32_t
+get_u32(struct upgrade_reader *r)
+{
+	uint32_t v = 0;
+	if (r->left < sizeof(v)) {
+		r->err = 1;
+		return 0;
+	}
+	memcpy(&v, r->p, sizeof(v));
+	r->p += sizeof(v);
+	r->left -= sizeof(v);
+	return v;
+}
+
+static const uint8_t *
+get_blob(struct upgrade_reader *r, uint32_t *len)
+{
+	*len = get_u32(r);
+	if (r->err || r->left < *len) {
+		r->err = 1;
+		*len = 0;
+		return NULL;
+	}
+	const uint8_t *data = r->p;
+	r->p += *len;
+	r->left -= *len;
+	return data;
+}
+
+static void
+get_fixed(struct upgrade_reader *r, void *out, uint32_t size)
+{
+	uint32_t len;
+	const uint8_t *data = get_blob(r, &len);
+	if (len != size) {
+		r->err = 1;
+		return;
+	}
+	memcpy(out, data, size);
+}
+
+static void
+get_ring(struct upgrade_reader *r, struct ring_buffer *ring)
+{
+	uint32_t sz = get_u32(r);
+	if (r->err || sz > RBUF_SIZE || r->left < sz) {
+		r->err = 1;
+		return;
+	}
+	memcpy(ring->data, r->p, sz);
+	r->p += sz;
+	r->left -= sz;
+	ring->cur = 0;
+	ring->sz = sz;
+	ring->end = sz % RBUF_SIZE;
+}
+
+// stream is added to stream table with its old id
+static void
+get_stream(struct upgrade_reader *r, struct tmux_stream *stream)
+{
+	uint32_t id = get_u32(r);
+	enum tcp_mux_state state = get_u32(r);
+	uint32_t recv_window = get_u32(r);
+	uint32_t send_window = get_u32(r);
+
+	del_stream(stream->id);
+	init_tmux_stream(stream, id, state);
+	stream->recv_window = recv_window;
+	stream->send_window = send_window;
+	get_ring(r, &stream->tx_ring);
+	get_ring(r, &stream->rx_ring);
+}
+
+static void
+get_cipher_state(struct upgrade_reader *r, struct cipher_state *st)
+{
+	st->has_coder = get_u32(r);
+	get_fixed(r, st->iv, sizeof(st->iv));
+	st->has_ctx = get_u32(r);
+	get_fixed(r, st->ctx_iv, sizeof(st->ctx_iv));
+	st->num = get_u32(r);
+}
+
+// listener of local service, old process hands it over so no connection is refused
+void
+register_upgrade_listener(int port, int fd)
+{
+	struct upgrade_listener *l = calloc(1, sizeof(struct upgrade_listener));
+	assert(l);
+	l->port = port;
+	l->fd = fd;
+	pthread_mutex_lock(&upgrade_lock);
+	l->next = local_listeners;
+	local_listeners = l;
+	pthread_mutex_unlock(&upgrade_lock);
+}
+
+int
+take_upgrade_listener(int port)
+{
+	int fd = -1;
+	pthread_mutex_lock(&upgrade_lock);
+	struct upgrade_listener **pl;
+	for (pl = &inherited_listeners; *pl; pl = &(*pl)->next) {
+		if ((*pl)->port == port) {
+			struct upgrade_listener *l = *pl;
+			fd = l->fd;
+			*pl = l->next;
+			free(l);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&upgrade_lock);
+	return fd;
+}
+
+// new process failed to start, it is killed and reaped
+static void
+abort_spawn(int sock)
+{
+	event_free(upgrade_ready_event);
+	upgrade_ready_event = NULL;
+	close(sock);
+	kill(upgrade_pid, SIGKILL);
+	waitpid(upgrade_pid, NULL, 0);
+	upgrade_pid = 0;
+}
+
+static void
+upgrade_ready_event_cb(evutil_socket_t sock, short what, void *arg)
+{
+	uint32_t version = 0;
+	if (!(what & EV_READ) || read_full(sock, (uint8_t *)&version, sizeof(version)) < 0) {
+		debug(LOG_ERR, "new xfrpc [%s] did not start, upgrade aborted", upgrade_exe);
+		abort_spawn(sock);
+		return;
+	}
+
+	event_free(upgrade_ready_event);
+	upgrade_ready_event = NULL;
+	upgrade_compatible = version == UPGRADE_VERSION;
+	if (!upgrade_compatible)
+		debug(LOG_WARNING, "new xfrpc upgrade format %u is not %u, its instances reconnect",
+			version, UPGRADE_VERSION);
+	upgrade_fd = sock;
+	debug(LOG_INFO, "new xfrpc %d started, hand connections over to it", upgrade_pid);
+	upgrade_pid = 0;
+	upgrade_ready_notify();
+}
+
+// environment of new process with the upgrade socket, built before fork
+// as the child of a threaded process may only call async signal safe functions
+static char **
+build_upgrade_envp(int fd, char **fd_env)
+{
+	size_t n = 0, i, k = 0;
+	while (environ[n])
+		n++;
+	char **envp = calloc(n + 2, sizeof(char *));
+	assert(envp);
+	size_t klen = strlen(UPGRADE_FD_ENV);
+	for (i = 0; i < n; i++) {
+		if (strncmp(environ[i], UPGRADE_FD_ENV, klen) != 0 || environ[i][klen] != '=')
+			envp[k++] = environ[i];
+	}
+	char *val = malloc(klen + 16);
+	assert(val);
+	snprintf(val, klen + 16, "%s=%d", UPGRADE_FD_ENV, fd);
+	envp[k] = val;
+	*fd_env = val;
+	return envp;
+}
+
+// start the new binary, ready is called on base once it tells its upgrade
+// format after its config is loaded, the loop is not blocked meanwhile
+int
+spawn_upgrade(struct event_base *base, void (*ready)())
+{
+	if (!upgrade_argv) {
+		debug(LOG_WARNING, "upgrade is disabled");
+		return -1;
+	}
+	if (is_upgrading() || upgrade_pid) {
+		debug(LOG_WARNING, "upgrade is in progress already");
+		return -1;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		debug(LOG_ERR, "upgrade socketpair failed: %s", strerror(errno));
+		return -1;
+	}
+
+	// only the upgrade socket is inherited, above stdio which daemon closes
+	int fd = fcntl(sv[1], F_DUPFD, 3);
+	close(sv[1]);
+	if (fd < 0) {
+		debug(LOG_ERR, "upgrade socket dup failed: %s", strerror(errno));
+		close(sv[0]);
+		return -1;
+	}
+	struct rlimit rl;
+	int maxfd = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 65536 ? (int)rl.rlim_cur : 65536;
+	char *fd_env = NULL;
+	char **envp = build_upgrade_envp(fd, &fd_env);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		int i;
+		for (i = 3; i < maxfd; i++) {
+			if (i != fd)
+				close(i);
+		}
+		execve(upgrade_exe, upgrade_argv, envp);
+		_exit(1);
+	}
+
+	free(fd_env);
+	free(envp);
+	close(fd);
+	if (pid < 0) {
+		debug(LOG_ERR, "upgrade fork failed: %s", strerror(errno));
+		close(sv[0]);
+		return -1;
+	}
+
+	upgrade_pid = pid;
+	upgrade_ready_notify = ready;
+	upgrade_ready_event = event_new(base, sv[0], EV_READ, upgrade_ready_event_cb, NULL);
+	assert(upgrade_ready_event);
+	struct timeval tv = {UPGRADE_READY_TIMEOUT, 0};
+	event_add(upgrade_ready_event, &tv);
+	return 0;
+}
+
+// mux stream forwarding to a connected local service without extra state
+static int
+can_hand_over(struct proxy_client *pc)
+{
+	if (!pc->ps || !pc->local_proxy_bev || !pc->connected || pc->crypto || pc->data_tail_size)
+		return 0;
+	if (pc->stream.state != ESTABLISHED)
+		return 0;
+	return get_proxy_type_ops(pc->ps->type)->flags & PROXY_F_FORWARD;
+}
+
+static void
+upgrade_client(struct proxy_client *pc)
+{
+	struct evbuffer *b = evbuffer_new();
+	assert(b);
+	put_blob(b, pc->ps->proxy_name, strlen(pc->ps->proxy_name));
+	put_stream(b, &pc->stream);
+	put_u32(b, pc->ftp_in_line);
+	put_evbuffer(b, bufferevent_get_input(pc->local_proxy_bev));
+	put_evbuffer(b, bufferevent_get_output(pc->local_proxy_bev));
+	send_record(UPGRADE_CLIENT, cur_instance->id, bufferevent_getfd(pc->local_proxy_bev), b);
+	evbuffer_free(b);
+}
+
+static void
+upgrade_instance()
+{
+	struct common_conf *c_conf = get_common_config();
+	struct control *ctl = get_main_control();
+	if (!upgrade_compatible || !c_conf->tcp_mux || c_conf->protocol != PROTOCOL_TCP ||
+		c_conf->tls_enable || !cur_instance->is_login || !ctl->connect_bev) {
+		debug(LOG_INFO, "instance %d reconnects after upgrade", cur_instance->id);
+		return;
+	}
+
+	// streams which can not be handed over are reset, before output is taken
+	struct proxy_client *pc, *tmp;
+	int nclient = 0;
+	HASH_ITER(hh, cur_instance->all_pc, pc, tmp) {
+		if (can_hand_over(pc))
+			nclient++;
+		else if (get_stream_by_id(pc->stream_id))
+			tcp_mux_send_win_update_rst(ctl->connect_bev, pc->stream_id);
+	}
+
+	// frames waiting for bandwidth_limit are handed over as unsent output
+	flush_mux_rate_limit();
+
+	struct cipher_state enc, dec;
+	save_main_cipher_state(&enc, &dec);
+
+	uint32_t cur_kind = 0, cur_id = 0;
+	struct tmux_stream *cur = get_cur_stream();
+	if (cur == &cur_instance->abandon_stream) {
+		cur_kind = 1;
+	} else if (cur) {
+		cur_kind = 2;
+		cur_id = cur->id;
+	}
+
+	struct evbuffer *b = evbuffer_new();
+	assert(b);
+	const char *run_id = get_run_id() ? get_run_id() : "";
+	put_blob(b, run_id, strlen(run_id));
+	put_u32(b, cur_instance->g_session_id);
+	put_u32(b, cur_instance->remote_go_away);
+	put_u32(b, cur_instance->local_go_away);
+	put_stream(b, &ctl->stream);
+	put_cipher_state(b, &enc);
+	put_cipher_state(b, &dec);
+	put_blob(b, &cur_instance->tmux_hdr, sizeof(cur_instance->tmux_hdr));
+	put_u32(b, cur_instance->stream_len);
+	put_u32(b, cur_kind);
+	put_u32(b, cur_id);
+	put_evbuffer(b, bufferevent_get_input(ctl->connect_bev));
+	put_evbuffer(b, bufferevent_get_output(ctl->connect_bev));
+	int ret = send_record(UPGRADE_INSTANCE, cur_instance->id, bufferevent_getfd(ctl->connect_bev), b);
+	evbuffer_free(b);
+	if (ret < 0)
+		return;
+
+	HASH_ITER(hh, cur_instance->all_pc, pc, tmp) {
+		if (can_hand_over(pc))
+			upgrade_client(pc);
+	}
+
+	// connections belong to new process now, nothing more is read or written here
+	bufferevent_disable(ctl->connect_bev, EV_READ|EV_WRITE);
+	HASH_ITER(hh, cur_instance->all_pc, pc, tmp) {
+		if (pc->local_proxy_bev)
+			bufferevent_disable(pc->local_proxy_bev, EV_READ|EV_WRITE);
+	}
+	debug(LOG_INFO, "instance %d handed over with %d streams", cur_instance->id, nclient);
+}
+
+// run by each loop in its own thread, the loop stops afterwards
+void
+upgrade_loop_instances(struct xfrpc_loop *loop)
+{
+	struct xfrpc_instance *inst;
+	for (inst = loop->instances; inst; inst = inst->loop_next) {
+		set_cur_instance(inst);
+		upgrade_instance();
+	}
+	event_base_loopbreak(loop->base);
+}
+
+// all loops stopped, send listeners and let new process go
+void
+finish_upgrade()
+{
+	if (!is_upgrading())
+		return;
+
+	struct upgrade_listener *l;
+	for (l = local_listeners; l && upgrade_compatible; l = l->next)
+		send_record(UPGRADE_LISTENER, l->port, l->fd, NULL);
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	debug(LOG_INFO, "upgrade done, exit");
+}
+
+// new process: receive everything old process hands over before loops start
+void
+load_upgrade_state()
+{
+	const char *env = getenv(UPGRADE_FD_ENV);
+	if (!env)
+		return;
+
+	int sock = atoi(env);
+	unsetenv(UPGRADE_FD_ENV);
+	uint32_t version = UPGRADE_VERSION;
+	if (write_full(sock, (uint8_t *)&version, sizeof(version)) < 0) {
+		close(sock);
+		return;
+	}
+
+	int count = 0;
+	struct upgrade_record *rec, **last = &records;
+	while ((rec = recv_record(sock))) {
+		count++;
+		if (rec->type == UPGRADE_LISTENER) {
+			struct upgrade_listener *l = calloc(1, sizeof(struct upgrade_listener));
+			assert(l);
+			l->port = rec->id;
+			l->fd = rec->fd;
+			l->next = inherited_listeners;
+			inherited_listeners = l;
+			free(rec->data);
+			free(rec);
+			continue;
+		}
+		*last = rec;
+		last = &rec->next;
+	}
+	close(sock);
+	debug(LOG_INFO, "%d connections handed over by old xfrpc", count);
+}
+
+static void
+free_record(struct upgrade_record *rec)
+{
+	if (rec->fd >= 0)
+		close(rec->fd);
+	free(rec->data);
+	rec->data = NULL;
+	rec->fd = -1;
+}
+
+static void
+adopt_client(struct upgrade_record *rec)
+{
+	struct upgrade_reader r = {rec->data, rec->len, 0};
+	uint32_t len;
+	const uint8_t *name = get_blob(&r, &len);
+	char proxy_name[256] = {0};
+	if (name && len < sizeof(proxy_name))
+		memcpy(proxy_name, name, len);
+
+	struct proxy_service *ps = get_proxy_service(proxy_name);
+	struct bufferevent *bout = get_main_control()->connect_bev;
+	if (r.err || !ps) {
+		// proxy is gone from new config, peek stream id to reset it
+		struct upgrade_reader sr = r;
+		uint32_t id = get_u32(&sr);
+		if (!sr.err)
+			tcp_mux_send_win_update_rst(bout, id);
+		free_record(rec);
+		return;
+	}
+
+	struct bufferevent *local = bufferevent_socket_new(get_main_control()->connect_base,
+								rec->fd, BEV_OPT_CLOSE_ON_FREE);
+	assert(local);
+	rec->fd = -1;
+
+	struct upgrade_reader sr = r;
+	uint32_t id = get_u32(&sr);
+	struct proxy_client *pc = adopt_proxy_client(id, ps, local);
+	get_stream(&r, &pc->stream);
+	pc->ftp_in_line = get_u32(&r);
+	const uint8_t *in = get_blob(&r, &len);
+	if (len)
+		evbuffer_add(bufferevent_get_input(local), in, len);
+	const uint8_t *out = get_blob(&r, &len);
+	if (len)
+		bufferevent_write(local, out, len);
+	free_record(rec);
+
+	// data read from local service before upgrade
+	if (evbuffer_get_length(bufferevent_get_input(local)) > 0)
+		bufferevent_trigger(local, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+// new process: take over control connection and streams of current instance,
+// return 0 if the instance has to connect frps itself
+int
+adopt_upgrade_state()
+{
+	struct upgrade_record *rec, *inst_rec = NULL;
+	for (rec = records; rec; rec = rec->next) {
+		if (rec->type == UPGRADE_INSTANCE && rec->id == cur_instance->id && rec->data)
+			inst_rec = rec;
+	}
+	if (!inst_rec)
+		return 0;
+
+	struct upgrade_reader r = {inst_rec->data, inst_rec->len, 0};
+	struct control *ctl = get_main_control();
+	uint32_t len;
+
+	const uint8_t *run_id = get_blob(&r, &len);
+	struct login *lg = cur_instance->c_login;
+	SAFE_FREE(lg->run_id);
+	lg->run_id = strndup(run_id ? (const char *)run_id : "", len);
+	assert(lg->run_id);
+	lg->logged = 1;
+
+	uint32_t session_id = get_u32(&r);
+	cur_instance->remote_go_away = get_u32(&r);
+	cur_instance->local_go_away = get_u32(&r);
+	get_stream(&r, &ctl->stream);
+	cur_instance->g_session_id = session_id;
+
+	struct cipher_state enc, dec;
+	get_cipher_state(&r, &enc);
+	get_cipher_state(&r, &dec);
+	get_fixed(&r, &cur_instance->tmux_hdr, sizeof(cur_instance->tmux_hdr));
+	cur_instance->stream_len = get_u32(&r);
+	uint32_t cur_kind = get_u32(&r);
+	uint32_t cur_id = get_u32(&r);
+	const uint8_t *in = get_blob(&r, &len);
+	uint32_t in_len = len;
+	const uint8_t *out = get_blob(&r, &len);
+	uint32_t out_len = len;
+
+	if (r.err) {
+		debug(LOG_ERR, "instance %d upgrade state is broken, reconnect", cur_instance->id);
+		free_record(inst_rec);
+		init_tmux_stream(&ctl->stream, get_next_session_id(), INIT);
+		return 0;
+	}
+
+	load_main_cipher_state(&enc, &dec);
+	struct bufferevent *bev = bufferevent_socket_new(ctl->connect_base, inst_rec->fd, BEV_OPT_CLOSE_ON_FREE);
+	assert(bev);
+	inst_rec->fd = -1;
+	if (out_len)
+		bufferevent_write(bev, out, out_len);
+	if (in_len)
+		evbuffer_add(bufferevent_get_input(bev), in, in_len);
+	adopt_main_control(bev);
+
+	int nclient = 0;
+	for (rec = records; rec; rec = rec->next) {
+		if (rec->type == UPGRADE_CLIENT && rec->id == cur_instance->id && rec->data) {
+			adopt_client(rec);
+			nclient++;
+		}
+	}
+
+	// frame being read when old process stopped
+	if (cur_kind == 1)
+		set_cur_stream(&cur_instance->abandon_stream);
+	else if (cur_kind == 2)
+		set_cur_stream(get_stream_by_id(cur_id) ? get_stream_by_id(cur_id) : &cur_instance->abandon_stream);
+	free_record(inst_rec);
+
+	if (evbuffer_get_length(bufferevent_get_input(bev)) > 0)
+		bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+
+	debug(LOG_INFO, "instance %d took over frps connection with %d streams", cur_instance->id, nclient);
+	return 1;
+}
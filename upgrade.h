@@ -0,0 +1,55 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file upgrade.h
+    @brief hand connections over to a new xfrpc binary without reconnecting
+    @author Copyright (C) 2016 Dengfeng Liu <liu_df@qq.com>
+*/
+
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+struct xfrpc_loop;
+struct event_base;
+
+// old process side
+
+void set_upgrade_argv(char **argv);
+
+int spawn_upgrade(struct event_base *base, void (*ready)());
+
+int is_upgrading();
+
+void upgrade_loop_instances(struct xfrpc_loop *loop);
+
+void finish_upgrade();
+
+void register_upgrade_listener(int port, int fd);
+
+// new process side
+
+void load_upgrade_state();
+
+int adopt_upgrade_state();
+
+int take_upgrade_listener(int port);
+
+#endif //_UPGRADE_H_
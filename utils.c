@@ -18,6 +18,7 @@
 #include <linux/if_link.h>
 
 #include "utils.h"
+#include "commandline.h"
 
 // s_sleep using select instead of sleep
 // s: second, u: usec 10^6usec = 1s
@@ -207,4 +208,23 @@ int dns_unified(const char *dname, char *udname_buf, int udname_buf_len)
 		return 1;
 
 	return 0;
-}
\ No newline at end of file
+}
+
+FILE *
+open_dump_file(const char *name, char *path, size_t path_len)
+{
+	int n = snprintf(path, path_len, "%s/%s", get_dump_dir(), name);
+	if (n < 0 || (size_t)n >= path_len) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	FILE *fp = fdopen(fd, "w");
+	if (!fp)
+		close(fd);
+	return fp;
+}
@@ -1,6 +1,8 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <stdio.h>
+
 struct mycurl_string {
 	char 	*ptr;
 	size_t 	len;
@@ -16,4 +18,8 @@ int get_net_ifname(char *if_buf, int blen);
 int get_net_mac(char *net_if_name, char *mac, int mac_len);
 int dns_unified(const char *dname, char *udname_buf, int udname_buf_len);
 
+// open_dump_file: create name in the dump directory, never an existing file
+// or a symlink, readable only by our user. path gets the full name
+FILE *open_dump_file(const char *name, char *path, size_t path_len);
+
 #endif //_UTILS_H_
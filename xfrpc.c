@@ -32,9 +32,14 @@
 #include <errno.h>
 
 #include <syslog.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <event2/event.h>
+#include <event2/dns.h>
 
+#include "common.h"
 #include "commandline.h"
 #include "client.h"
 #include "config.h"
@@ -47,6 +52,17 @@
 #include "utils.h"
 #include "tcp_redir.h"
 #include "config.h"
+#include "instance.h"
+#include "upgrade.h"
+#include "latency.h"
+#include "flight.h"
+#include "tcpinfo.h"
+#include "alloc.h"
+#include "admin.h"
+#include "mempressure.h"
+
+static struct xfrpc_loop *all_loops = NULL;
+static int loop_count = 0;
 
 static void start_xfrpc_local_service()
 {
@@ -55,17 +71,230 @@ static void start_xfrpc_local_service()
 	struct proxy_service *ps, *ps_tmp;
 	struct proxy_service *all_ps = get_all_proxy_services();
 	HASH_ITER(hh, all_ps, ps, ps_tmp) {
-		if (ps->proxy_type && strcmp(ps->proxy_type, "mstsc") == 0) {
+		if (ps->type == PROXY_TYPE_MSTSC) {
 			// start tcp_redir for it
 			start_tcp_redir_service(ps);
 		}
 	}
 }
 
+// 'r' reloads config of every instance of the loop, 'd' dumps their stats,
+// 'f' only their flight recorders, 'u' hands them over to the upgraded
+// process and stops the loop
+static void
+loop_notify_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct xfrpc_loop *loop = arg;
+	char c;
+	if (read(fd, &c, 1) <= 0)
+		return;
+
+	if (c == 'u') {
+		upgrade_loop_instances(loop);
+		return;
+	}
+
+	struct xfrpc_instance *inst;
+	for (inst = loop->instances; inst; inst = inst->loop_next) {
+		set_cur_instance(inst);
+		if (c == 'd') {
+			dump_setup_stats();
+			dump_flight_recorder();
+			dump_tcp_paths();
+		} else if (c == 'f')
+			dump_flight_recorder();
+		else
+			reload_proxy_config();
+	}
+}
+
+// signal is handled by loop 0, which forwards it to every loop
+static void
+reload_signal_cb(evutil_socket_t sig, short events, void *arg)
+{
+	debug(LOG_INFO, "receive SIGHUP, reload config");
+	int i;
+	for (i = 0; i < loop_count; i++) {
+		if (write(all_loops[i].notify[1], "r", 1) != 1)
+			debug(LOG_ERR, "error: notify loop %d to reload failed: %s", i, strerror(errno));
+	}
+}
+
+static void
+dump_signal_cb(evutil_socket_t sig, short events, void *arg)
+{
+	debug(LOG_INFO, "receive SIGUSR1, dump stats");
+	dump_alloc_stats();
+	int i;
+	for (i = 0; i < loop_count; i++) {
+		if (write(all_loops[i].notify[1], "d", 1) != 1)
+			debug(LOG_ERR, "error: notify loop %d to dump failed: %s", i, strerror(errno));
+	}
+}
+
+// flight rings belong to the loop of each instance, let the loops write them
+void
+dump_flight_recorders()
+{
+	int i;
+	for (i = 0; i < loop_count; i++) {
+		if (write(all_loops[i].notify[1], "f", 1) != 1)
+			debug(LOG_ERR, "error: notify loop %d to dump flight recorder failed: %s", i, strerror(errno));
+	}
+}
+
+// new process is ready, every loop hands its instances over
+static void
+upgrade_ready()
+{
+	int i;
+	for (i = 0; i < loop_count; i++) {
+		if (write(all_loops[i].notify[1], "u", 1) != 1)
+			debug(LOG_ERR, "error: notify loop %d to upgrade failed: %s", i, strerror(errno));
+	}
+}
+
+static void
+upgrade_signal_cb(evutil_socket_t sig, short events, void *arg)
+{
+	debug(LOG_INFO, "receive SIGUSR2, upgrade xfrpc");
+	spawn_upgrade(all_loops[0].base, upgrade_ready);
+}
+
+static void
+init_xfrpc_loop(struct xfrpc_loop *loop, int id)
+{
+	loop->id = id;
+	loop->base = event_base_new();
+	if (! loop->base) {
+		debug(LOG_ERR, "error: event base init failed!");
+		exit(0);
+	}
+
+	if (pipe(loop->notify) < 0) {
+		debug(LOG_ERR, "error: loop notify pipe init failed!");
+		exit(0);
+	}
+	evutil_make_socket_nonblocking(loop->notify[0]);
+	loop->notify_event = event_new(loop->base, loop->notify[0], EV_READ|EV_PERSIST, 
+									loop_notify_cb, loop);
+	if (! loop->notify_event || event_add(loop->notify_event, NULL) < 0) {
+		debug(LOG_ERR, "error: loop notify event init failed!");
+		exit(0);
+	}
+
+	start_mem_pressure(loop);
+
+	if (id != 0)
+		return;
+
+	// libevent delivers signals to one event base only
+	loop->reload_event = evsignal_new(loop->base, SIGHUP, reload_signal_cb, NULL);
+	if (! loop->reload_event || evsignal_add(loop->reload_event, NULL) < 0) {
+		debug(LOG_ERR, "error: config reload signal init failed!");
+		exit(0);
+	}
+
+	loop->dump_event = evsignal_new(loop->base, SIGUSR1, dump_signal_cb, NULL);
+	if (! loop->dump_event || evsignal_add(loop->dump_event, NULL) < 0) {
+		debug(LOG_ERR, "error: dump signal init failed!");
+		exit(0);
+	}
+
+	loop->upgrade_event = evsignal_new(loop->base, SIGUSR2, upgrade_signal_cb, NULL);
+	if (! loop->upgrade_event || evsignal_add(loop->upgrade_event, NULL) < 0) {
+		debug(LOG_ERR, "error: upgrade signal init failed!");
+		exit(0);
+	}
+
+	if (get_admin_socket())
+		start_admin_socket(loop->base, get_admin_socket());
+}
+
+static void *
+run_xfrpc_loop(void *arg)
+{
+	struct xfrpc_loop *loop = arg;
+	struct xfrpc_instance *inst;
+
+	for (inst = loop->instances; inst; inst = inst->loop_next) {
+		set_cur_instance(inst);
+		start_xfrpc_local_service();
+		init_main_control();
+		if (! adopt_upgrade_state())
+			run_control();
+	}
+
+	event_base_dispatch(loop->base);
+
+	for (inst = loop->instances; inst; inst = inst->loop_next) {
+		set_cur_instance(inst);
+		close_main_control();
+	}
+
+	if (loop->id == 0)
+		close_admin_socket();
+	stop_mem_pressure(loop);
+	if (loop->reload_event) event_free(loop->reload_event);
+	if (loop->upgrade_event) event_free(loop->upgrade_event);
+	if (loop->dump_event) event_free(loop->dump_event);
+	event_free(loop->notify_event);
+	close(loop->notify[0]);
+	close(loop->notify[1]);
+	if (loop->dnsbase) evdns_base_free(loop->dnsbase, 0);
+	event_base_free(loop->base);
+	return NULL;
+}
+
+// instances are spread over loop threads, loop 0 runs in main thread
 void xfrpc_loop()
 {
-	start_xfrpc_local_service();
-	init_main_control();
-	run_control();
-	close_main_control();
+	int ninst = get_instance_count();
+	loop_count = get_loop_threads();
+	if (loop_count > ninst)
+		loop_count = ninst;
+	if (loop_count < 1)
+		loop_count = 1;
+
+	// connections handed over by the process being upgraded
+	load_upgrade_state();
+
+	all_loops = calloc(loop_count, sizeof(struct xfrpc_loop));
+	assert(all_loops);
+
+	int i;
+	for (i = 0; i < loop_count; i++)
+		init_xfrpc_loop(&all_loops[i], i);
+
+	struct xfrpc_instance *inst, *last[loop_count];
+	memset(last, 0, sizeof(last));
+	for (i = 0, inst = get_all_instances(); inst; inst = inst->next, i++) {
+		struct xfrpc_loop *loop = &all_loops[i % loop_count];
+		inst->loop = loop;
+		if (last[loop->id])
+			last[loop->id]->loop_next = inst;
+		else
+			loop->instances = inst;
+		last[loop->id] = inst;
+	}
+
+	debug(LOG_INFO, "%d instances run in %d event loops", ninst, loop_count);
+
+	for (i = 1; i < loop_count; i++) {
+		if (pthread_create(&all_loops[i].tid, NULL, run_xfrpc_loop, &all_loops[i]) != 0) {
+			debug(LOG_ERR, "error: create event loop thread %d failed!", i);
+			exit(0);
+		}
+	}
+
+	all_loops[0].tid = pthread_self();
+	run_xfrpc_loop(&all_loops[0]);
+
+	for (i = 1; i < loop_count; i++)
+		pthread_join(all_loops[i].tid, NULL);
+
+	finish_upgrade();
+
+	SAFE_FREE(all_loops);
+	loop_count = 0;
 }
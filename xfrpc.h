@@ -27,6 +27,32 @@
 #ifndef _XFRPC_H_
 #define _XFRPC_H_
 
+#include <pthread.h>
+
+struct event_base;
+struct evdns_base;
+struct event;
+struct xfrpc_instance;
+
+// event loop thread, instances of the loop share its event base and dns base
+struct xfrpc_loop {
+	int 	id;
+	pthread_t 	tid;
+	struct event_base 	*base;
+	struct evdns_base 	*dnsbase;	// created when first needed
+	int 	notify[2];				// wake up loop to reload its instances
+	struct event 	*notify_event;
+	struct event 	*reload_event;	// SIGHUP, only on loop 0
+	struct event 	*upgrade_event;	// SIGUSR2, only on loop 0
+	struct event 	*dump_event;	// SIGUSR1, only on loop 0
+	struct event 	*mem_event;		// memory pressure check
+	int 	mem_level;				// level seen by last check
+	struct xfrpc_instance *instances;
+};
+
 void xfrpc_loop();
 
+// ask every loop to dump flight recorders of its instances
+void dump_flight_recorders();
+
 #endif //_XFRPC_H_